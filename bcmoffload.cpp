@@ -0,0 +1,337 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "bcmoffload.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/can/bcm.h>
+
+using namespace cannelloni;
+
+/* Payload, length and flags of two frames are the same */
+static bool samePayload(const canfd_frame &a, const canfd_frame &b) {
+  return a.can_id == b.can_id && a.len == b.len && a.flags == b.flags &&
+         memcmp(a.data, b.data, std::min<uint8_t>(canfd_len(&a), CANFD_MAX_DLEN)) == 0;
+}
+
+CycleDetector::CycleDetector()
+  : m_suppressedCount(0)
+  , m_detectedCount(0)
+{}
+
+void CycleDetector::setup(const IdSet &ids) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_ids = ids;
+  m_entries.clear();
+}
+
+bool CycleDetector::isEnabled() {
+  return !m_ids.empty();
+}
+
+void CycleDetector::reset() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (auto &entry : m_entries) {
+    if (entry.second.state == CYCLE_ANNOUNCED) {
+      entry.second.state = CYCLE_DETECTED;
+    } else if (entry.second.state == CYCLE_STOPPING) {
+      entry.second.state = CYCLE_IDLE;
+    }
+  }
+}
+
+bool CycleDetector::track(const canfd_frame *frame, std::chrono::steady_clock::time_point now) {
+  if (!m_ids.contains(frame->can_id))
+    return true;
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto result = m_entries.try_emplace(canfd_id(frame));
+  Entry &entry = result.first->second;
+  if (result.second) {
+    entry.frame = *frame;
+    entry.arrival = now;
+    entry.period = 0;
+    entry.matched = 0;
+    entry.missed = 0;
+    entry.state = CYCLE_IDLE;
+    return true;
+  }
+  int64_t interval = std::chrono::duration_cast<std::chrono::microseconds>(now - entry.arrival).count();
+  entry.arrival = now;
+  if (entry.period > 0 && std::llabs(interval - entry.period) <= entry.period / CYCLE_TOLERANCE_DIVISOR) {
+    entry.matched++;
+    entry.missed = 0;
+    /* Average out the jitter of the arrival times */
+    entry.period += (interval - entry.period) / 8;
+  } else if (entry.state == CYCLE_ANNOUNCED && ++entry.missed < CYCLE_STOP_COUNT) {
+    /* A single late frame is followed by an early one, keep the cycle */
+  } else {
+    entry.matched = 0;
+    entry.missed = 0;
+    entry.period = interval;
+    if (entry.state == CYCLE_ANNOUNCED)
+      entry.state = CYCLE_STOPPING;
+    else if (entry.state == CYCLE_DETECTED)
+      entry.state = CYCLE_IDLE;
+  }
+  if (entry.state == CYCLE_IDLE && entry.matched >= CYCLE_DETECT_COUNT && entry.period > 0) {
+    entry.state = CYCLE_DETECTED;
+    m_detectedCount++;
+  }
+  if (entry.state == CYCLE_ANNOUNCED && samePayload(entry.frame, *frame)) {
+    m_suppressedCount++;
+    return false;
+  }
+  entry.frame = *frame;
+  return true;
+}
+
+void CycleDetector::announcements(std::chrono::steady_clock::time_point now,
+                                  std::vector<CycleAnnouncement> &out) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (auto &it : m_entries) {
+    Entry &entry = it.second;
+    switch (entry.state) {
+      case CYCLE_DETECTED:
+        out.push_back({entry.frame, static_cast<uint32_t>(entry.period)});
+        entry.state = CYCLE_ANNOUNCED;
+        entry.announced = now;
+        break;
+      case CYCLE_ANNOUNCED:
+        if (now - entry.arrival > std::chrono::microseconds(CYCLE_STOP_COUNT * entry.period)) {
+          /* The frames stopped */
+          out.push_back({entry.frame, 0});
+          entry.state = CYCLE_IDLE;
+          entry.matched = 0;
+        } else if (now - entry.announced >= std::chrono::microseconds(CYCLE_ANNOUNCE_INTERVAL)) {
+          out.push_back({entry.frame, static_cast<uint32_t>(entry.period)});
+          entry.announced = now;
+        }
+        break;
+      case CYCLE_STOPPING:
+        out.push_back({entry.frame, 0});
+        entry.state = CYCLE_IDLE;
+        break;
+      case CYCLE_IDLE:
+        break;
+    }
+  }
+}
+
+uint64_t CycleDetector::getSuppressedCount() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_suppressedCount;
+}
+
+uint64_t CycleDetector::getDetectedCount() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_detectedCount;
+}
+
+BcmScheduler::BcmScheduler()
+  : m_socket(-1)
+  , m_setupCount(0)
+  , m_updateCount(0)
+  , m_deleteCount(0)
+{}
+
+BcmScheduler::~BcmScheduler() {
+  close();
+}
+
+bool BcmScheduler::open(const std::string &interfaceName) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_socket = socket(PF_CAN, SOCK_DGRAM, CAN_BCM);
+  if (m_socket < 0)
+    return false;
+  struct ifreq canInterface;
+  strncpy(canInterface.ifr_name, interfaceName.c_str(), IFNAMSIZ-1);
+  canInterface.ifr_name[IFNAMSIZ-1] = '\0';
+  if (ioctl(m_socket, SIOCGIFINDEX, &canInterface) < 0) {
+    ::close(m_socket);
+    m_socket = -1;
+    return false;
+  }
+  struct sockaddr_can addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = canInterface.ifr_ifindex;
+  if (connect(m_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    ::close(m_socket);
+    m_socket = -1;
+    return false;
+  }
+  return true;
+}
+
+bool BcmScheduler::isOpen() {
+  return m_socket >= 0;
+}
+
+void BcmScheduler::close() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_socket < 0)
+    return;
+  /* The kernel deletes all jobs of the socket */
+  ::close(m_socket);
+  m_socket = -1;
+  m_jobs.clear();
+}
+
+void BcmScheduler::schedule(const canfd_frame &frame, uint32_t interval,
+                            std::chrono::steady_clock::time_point now) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_socket < 0)
+    return;
+  expireLocked(now);
+  canid_t id = canfd_id(&frame);
+  bool canfd = frame.len & CANFD_FRAME;
+  auto it = m_jobs.find(id);
+  if (interval == 0) {
+    if (it != m_jobs.end()) {
+      remove(it->second.canId, it->second.canfd);
+      m_jobs.erase(it);
+    }
+    return;
+  }
+  if (it != m_jobs.end() && (it->second.canfd != canfd || it->second.canId != frame.can_id)) {
+    remove(it->second.canId, it->second.canfd);
+    m_jobs.erase(it);
+    it = m_jobs.end();
+  }
+  /* Small changes of the measured cycle time would only shift the phase */
+  bool timer = it == m_jobs.end() ||
+               std::abs(static_cast<int64_t>(interval) - it->second.interval) > it->second.interval / 100;
+  /* Without SETTIMER, only the data of a running job is replaced */
+  if (!setup(frame, canfd, interval, timer ? SETTIMER | STARTTIMER : 0))
+    return;
+  if (timer)
+    m_setupCount++;
+  Job &job = m_jobs[id];
+  if (timer)
+    job.interval = interval;
+  job.canId = frame.can_id;
+  job.canfd = canfd;
+  job.announced = now;
+}
+
+bool BcmScheduler::update(const canfd_frame &frame) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto it = m_jobs.find(canfd_id(&frame));
+  if (it == m_jobs.end() || it->second.canId != frame.can_id ||
+      it->second.canfd != static_cast<bool>(frame.len & CANFD_FRAME))
+    return false;
+  /* Send the new payload right away instead of with the next cycle */
+  if (!setup(frame, it->second.canfd, it->second.interval, TX_ANNOUNCE))
+    return false;
+  m_updateCount++;
+  return true;
+}
+
+bool BcmScheduler::isScheduled(const canfd_frame &frame) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto it = m_jobs.find(canfd_id(&frame));
+  return it != m_jobs.end() && it->second.canId == frame.can_id;
+}
+
+bool BcmScheduler::setup(const canfd_frame &frame, bool canfd, uint32_t interval, uint32_t flags) {
+  /* bcm_msg_head ends with the frames */
+  uint8_t msg[sizeof(struct bcm_msg_head) + sizeof(struct canfd_frame)];
+  struct bcm_msg_head head;
+  memset(&head, 0, sizeof(head));
+  head.opcode = TX_SETUP;
+  head.flags = flags;
+  if (canfd)
+    head.flags |= CAN_FD_FRAME;
+  head.ival2.tv_sec = interval / 1000000;
+  head.ival2.tv_usec = interval % 1000000;
+  head.can_id = frame.can_id;
+  head.nframes = 1;
+  canfd_frame payload = frame;
+  payload.len &= ~(CANFD_FRAME);
+  if (!canfd)
+    payload.flags = 0;
+  memcpy(msg, &head, sizeof(head));
+  memcpy(msg + sizeof(head), &payload, sizeof(payload));
+  size_t size = sizeof(head) + (canfd ? sizeof(struct canfd_frame) : sizeof(struct can_frame));
+  return write(m_socket, msg, size) == static_cast<ssize_t>(size);
+}
+
+void BcmScheduler::remove(canid_t canId, bool canfd) {
+  struct bcm_msg_head head;
+  memset(&head, 0, sizeof(head));
+  head.opcode = TX_DELETE;
+  head.flags = canfd ? CAN_FD_FRAME : 0;
+  head.can_id = canId;
+  if (write(m_socket, &head, sizeof(head)) == sizeof(head))
+    m_deleteCount++;
+}
+
+void BcmScheduler::expire(std::chrono::steady_clock::time_point now) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_socket >= 0)
+    expireLocked(now);
+}
+
+void BcmScheduler::clear() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_socket < 0)
+    return;
+  for (const auto &job : m_jobs)
+    remove(job.second.canId, job.second.canfd);
+  m_jobs.clear();
+}
+
+void BcmScheduler::expireLocked(std::chrono::steady_clock::time_point now) {
+  /* Announcements arrive for each job every CYCLE_ANNOUNCE_INTERVAL, don't check each time */
+  if (now - m_lastExpiry < std::chrono::microseconds(CYCLE_CHECK_INTERVAL))
+    return;
+  m_lastExpiry = now;
+  for (auto it = m_jobs.begin(); it != m_jobs.end();) {
+    if (now - it->second.announced > std::chrono::microseconds(CYCLE_JOB_TIMEOUT)) {
+      remove(it->second.canId, it->second.canfd);
+      it = m_jobs.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
+
+uint64_t BcmScheduler::getSetupCount() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_setupCount;
+}
+
+uint64_t BcmScheduler::getUpdateCount() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_updateCount;
+}
+
+uint64_t BcmScheduler::getDeleteCount() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_deleteCount;
+}
@@ -0,0 +1,177 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cannelloni.h"
+#include "idset.h"
+
+namespace cannelloni {
+
+/* Intervals in a row that have to match before an ID counts as cyclic */
+#define CYCLE_DETECT_COUNT 8
+/* Deviation of an interval from the cycle time that is still tolerated, in 1/n */
+#define CYCLE_TOLERANCE_DIVISOR 4
+/* A cycle counts as stopped after this many cycle times without a frame or intervals that don't match */
+#define CYCLE_STOP_COUNT 3
+/* Interval of the checks for stopped cycles in us */
+#define CYCLE_CHECK_INTERVAL 100000
+/* The parameters of a running cycle are sent again after this time in us */
+#define CYCLE_ANNOUNCE_INTERVAL 1000000
+/* The receiver deletes a cycle that has not been announced for this time in us */
+#define CYCLE_JOB_TIMEOUT (3 * CYCLE_ANNOUNCE_INTERVAL + CYCLE_CHECK_INTERVAL)
+
+/* Design Notes:
+ *
+ * The sender uses a CycleDetector to find IDs that are sent with a
+ * fixed cycle time. Once the last CYCLE_DETECT_COUNT intervals of an ID
+ * matched, the network thread announces the cycle time and the current
+ * frame to the remote with a CYCLE packet, and from then on only frames
+ * with a new payload are sent. The announcement is repeated every
+ * CYCLE_ANNOUNCE_INTERVAL, so a lost CYCLE packet or a restart of the
+ * remote only delays the offload. A cycle that misses a frame for
+ * CYCLE_STOP_COUNT cycle times or whose last CYCLE_STOP_COUNT intervals
+ * didn't match is stopped with an announcement with a cycle time of 0.
+ *
+ * The receiver hands the cycles to a BcmScheduler, which programs a
+ * TX_SETUP job on a CAN_BCM socket, so the kernel sends the frames with
+ * a precise timing that doesn't depend on the network. Frames with a
+ * new payload update the data of the job and are sent right away, the
+ * kernel keeps the cycle. Jobs that are not announced again within CYCLE_JOB_TIMEOUT
+ * are deleted, so the CAN thread calls expire periodically, also when no
+ * CYCLE packets arrive anymore. All jobs are deleted when the remote
+ * restarted, and by the kernel once the socket is closed.
+ */
+
+struct CycleAnnouncement {
+  canfd_frame frame;
+  /* Cycle time in us, 0 stops the cycle */
+  uint32_t interval;
+};
+
+class CycleDetector {
+  public:
+    CycleDetector();
+
+    void setup(const IdSet &ids);
+    bool isEnabled();
+    /* Forgets announced cycles, e.g. when the remote lost them */
+    void reset();
+
+    /* Called for each frame read from the bus, returns false if frame has to be dropped */
+    bool track(const canfd_frame *frame, std::chrono::steady_clock::time_point now);
+    /* Appends the announcements that are due, must only be called if they can be sent */
+    void announcements(std::chrono::steady_clock::time_point now, std::vector<CycleAnnouncement> &out);
+
+    uint64_t getSuppressedCount();
+    uint64_t getDetectedCount();
+
+  private:
+    enum State {
+      CYCLE_IDLE,
+      /* Cyclic, but the remote doesn't know about it yet */
+      CYCLE_DETECTED,
+      CYCLE_ANNOUNCED,
+      /* The remote has to stop the cycle */
+      CYCLE_STOPPING
+    };
+
+    struct Entry {
+      canfd_frame frame;
+      std::chrono::steady_clock::time_point arrival;
+      std::chrono::steady_clock::time_point announced;
+      /* Cycle time in us, 0 until the second frame */
+      int64_t period;
+      uint32_t matched;
+      /* Intervals in a row that didn't match an announced cycle */
+      uint32_t missed;
+      State state;
+    };
+
+  private:
+    std::mutex m_mutex;
+    IdSet m_ids;
+    std::unordered_map<canid_t, Entry> m_entries;
+
+    /* Performance Counters */
+    uint64_t m_suppressedCount;
+    uint64_t m_detectedCount;
+};
+
+class BcmScheduler {
+  public:
+    BcmScheduler();
+    ~BcmScheduler();
+
+    /* Opens a CAN_BCM socket on interfaceName, returns false on error */
+    bool open(const std::string &interfaceName);
+    bool isOpen();
+    void close();
+
+    /* Starts or updates the cycle of frame, an interval of 0 deletes it */
+    void schedule(const canfd_frame &frame, uint32_t interval, std::chrono::steady_clock::time_point now);
+    /* Updates the payload of a running cycle, returns false if there is none for frame */
+    bool update(const canfd_frame &frame);
+    /* A job sends frames like frame, e.g. to recognize them when they are read back */
+    bool isScheduled(const canfd_frame &frame);
+    /* Deletes jobs that have not been announced within CYCLE_JOB_TIMEOUT */
+    void expire(std::chrono::steady_clock::time_point now);
+    /* Deletes all jobs, e.g. after the remote restarted */
+    void clear();
+
+    uint64_t getSetupCount();
+    uint64_t getUpdateCount();
+    uint64_t getDeleteCount();
+
+  private:
+    struct Job {
+      /* ID with the flags the job was set up with */
+      canid_t canId;
+      uint32_t interval;
+      bool canfd;
+      std::chrono::steady_clock::time_point announced;
+    };
+
+    /* Writes a TX_SETUP for frame with the bcm_msg_head flags */
+    bool setup(const canfd_frame &frame, bool canfd, uint32_t interval, uint32_t flags);
+    void remove(canid_t canId, bool canfd);
+    /* expire with m_mutex held */
+    void expireLocked(std::chrono::steady_clock::time_point now);
+
+  private:
+    std::mutex m_mutex;
+    int m_socket;
+    std::unordered_map<canid_t, Job> m_jobs;
+    std::chrono::steady_clock::time_point m_lastExpiry;
+
+    /* Performance Counters */
+    uint64_t m_setupCount;
+    uint64_t m_updateCount;
+    uint64_t m_deleteCount;
+};
+
+}
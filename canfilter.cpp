@@ -0,0 +1,148 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "canfilter.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include <sys/socket.h>
+
+#include <linux/can/raw.h>
+
+using namespace cannelloni;
+
+static bool parseHex(const std::string &str, uint32_t &value) {
+  if (str.empty() || str.size() > 8)
+    return false;
+  char *end;
+  value = strtoul(str.c_str(), &end, 16);
+  return *end == '\0';
+}
+
+bool cannelloni::parseCANFilter(const std::string &list, CANFilterConfig &config) {
+  CANFilterConfig result = config;
+  std::istringstream ss(list);
+  std::string rule;
+  while (getline(ss, rule, ',')) {
+    if (!rule.empty() && rule[0] == '#') {
+      uint32_t mask;
+      if (!parseHex(rule.substr(1), mask))
+        return false;
+      result.errorMask |= mask & CAN_ERR_MASK;
+      continue;
+    }
+    std::size_t pos = rule.find_first_of(":~");
+    struct can_filter filter;
+    if (pos == std::string::npos ||
+        !parseHex(rule.substr(0, pos), filter.can_id) ||
+        !parseHex(rule.substr(pos+1), filter.can_mask))
+      return false;
+    if (pos == 8)
+      filter.can_id |= CAN_EFF_FLAG;
+    /* Error frames are selected by the error mask */
+    filter.can_mask &= ~CAN_ERR_FLAG;
+    if (rule[pos] == ':')
+      result.allow.push_back(filter);
+    else
+      result.deny.push_back(filter);
+  }
+  if (result.allow.size() == config.allow.size() && result.deny.size() == config.deny.size() &&
+      result.errorMask == config.errorMask)
+    return false;
+  config = result;
+  return true;
+}
+
+CANFilter::CANFilter()
+  : m_userDeny(false)
+  , m_interfaceStart(0)
+  , m_deniedCount(0)
+{
+  m_config.errorMask = 0;
+}
+
+void CANFilter::setup(const CANFilterConfig &config) {
+  m_config = config;
+}
+
+bool CANFilter::isEnabled() {
+  return !m_config.allow.empty() || !m_config.deny.empty() || m_config.errorMask;
+}
+
+bool CANFilter::apply(int socket, const std::string &interfaceName) {
+  m_interfaceName = interfaceName;
+  m_interfaceStart = readInterfaceCount();
+  if (m_config.errorMask &&
+      setsockopt(socket, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &m_config.errorMask, sizeof(m_config.errorMask)) < 0)
+    return false;
+  std::vector<struct can_filter> filters = m_config.allow;
+  m_userDeny = false;
+  if (!m_config.deny.empty()) {
+    int join = 1;
+    if (m_config.allow.size() <= 1 && m_config.errorMask == 0 &&
+        setsockopt(socket, SOL_CAN_RAW, CAN_RAW_JOIN_FILTERS, &join, sizeof(join)) == 0) {
+      for (struct can_filter filter : m_config.deny) {
+        filter.can_id |= CAN_INV_FILTER;
+        filters.push_back(filter);
+      }
+    } else {
+      m_userDeny = true;
+    }
+  }
+  /* Without a filter, the default one that reads all frames stays */
+  if (filters.empty())
+    return true;
+  return setsockopt(socket, SOL_CAN_RAW, CAN_RAW_FILTER, filters.data(),
+                    filters.size() * sizeof(struct can_filter)) == 0;
+}
+
+bool CANFilter::pass(const canfd_frame *frame) {
+  if (!m_userDeny || (frame->can_id & CAN_ERR_FLAG))
+    return true;
+  for (const struct can_filter &filter : m_config.deny) {
+    if ((frame->can_id & filter.can_mask) == (filter.can_id & filter.can_mask)) {
+      m_deniedCount++;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool CANFilter::isKernelOnly() {
+  return !m_userDeny;
+}
+
+uint64_t CANFilter::getDeniedCount() {
+  return m_deniedCount;
+}
+
+uint64_t CANFilter::getInterfaceCount() {
+  uint64_t count = readInterfaceCount();
+  return count > m_interfaceStart ? count - m_interfaceStart : 0;
+}
+
+uint64_t CANFilter::readInterfaceCount() {
+  std::ifstream file("/sys/class/net/" + m_interfaceName + "/statistics/rx_packets");
+  uint64_t count = 0;
+  file >> count;
+  return count;
+}
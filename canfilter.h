@@ -0,0 +1,95 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <linux/can.h>
+
+namespace cannelloni {
+
+struct CANFilterConfig {
+  /* A frame is read if it matches one of them, all are read if there is none */
+  std::vector<struct can_filter> allow;
+  /* A frame is not read if it matches one of them */
+  std::vector<struct can_filter> deny;
+  /* Classes of error frames that are read, see linux/can/error.h */
+  can_err_mask_t errorMask;
+};
+
+/*
+ * Adds the comma separated rules of list to config, returns false on a
+ * syntax error. The rules use the syntax of candump: ID:MASK reads
+ * frames with (can_id & MASK) == (ID & MASK), ID~MASK skips them and
+ * #MASK reads the error frames of these classes. IDs with eight hex
+ * digits are extended IDs.
+ */
+bool parseCANFilter(const std::string &list, CANFilterConfig &config);
+
+/* Design Notes:
+ *
+ * CANFilter compiles the rules into CAN_RAW_FILTER and CAN_RAW_ERR_FILTER,
+ * so the kernel drops frames nobody asked for before they are copied to
+ * user space. The kernel passes a frame if any of the filters matches,
+ * a deny rule is an inverted filter and only works if all filters have
+ * to match (CAN_RAW_JOIN_FILTERS). That is possible with at most one
+ * allow rule and no error frames, which are dropped by joined filters.
+ * Otherwise, and on kernels without CAN_RAW_JOIN_FILTERS, the kernel only
+ * applies the allow rules and pass() checks the deny rules.
+ *
+ * The kernel doesn't count the frames it dropped, they are estimated from
+ * the frames the interface received while the socket was open.
+ */
+
+class CANFilter {
+  public:
+    CANFilter();
+
+    void setup(const CANFilterConfig &config);
+    bool isEnabled();
+    /* Installs the rules on a CAN_RAW socket bound to interfaceName, returns false on error */
+    bool apply(int socket, const std::string &interfaceName);
+    /* Returns false if frame matches a deny rule the kernel couldn't apply */
+    bool pass(const canfd_frame *frame);
+    /* The kernel applies all rules */
+    bool isKernelOnly();
+
+    uint64_t getDeniedCount();
+    /* Frames received by the interface since apply */
+    uint64_t getInterfaceCount();
+
+  private:
+    /* rx_packets of the interface, 0 if unknown */
+    uint64_t readInterfaceCount();
+
+  private:
+    CANFilterConfig m_config;
+    std::string m_interfaceName;
+    bool m_userDeny;
+    uint64_t m_interfaceStart;
+
+    /* Performance Counters */
+    uint64_t m_deniedCount;
+};
+
+}
@@ -18,16 +18,24 @@
  *
  */
 
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdio>
 #include <cstdlib>
 #include <fcntl.h>
 #include <fstream>
+#include <getopt.h>
 #include <iostream>
+#include <map>
 #include <signal.h>
+#include <sstream>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <vector>
 
 #include <iomanip>
 
@@ -50,17 +58,118 @@
 
 #include "canthread.h"
 #include "csvmapparser.h"
+#include "flightrecorder.h"
 #include "framebuffer.h"
 #include "logging.h"
 #include "make_unique.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "replay.h"
+#include "statsegment.h"
+#include "spillqueue.h"
 #include <memory>
 
 #define MIN_LINK_MTU_SIZE 100
 
+/* Initial and maximum number of frames in each FrameBuffer pool */
+#define FRAME_BUFFER_INITIAL_SIZE 1000
+#define FRAME_BUFFER_MAX_SIZE 16000
+
+/* Options without a short equivalent */
+enum LongOptions {
+  OPT_STORE_FORWARD = 256,
+  OPT_STORE_FORWARD_AGE,
+  OPT_STORE_FORWARD_DROP,
+  OPT_SPILL_DIR,
+  OPT_SPILL_SEGMENT_SIZE,
+  OPT_SPILL_BUDGET,
+  OPT_SPILL_RATE,
+  OPT_TCP_MAX_CLIENTS,
+  OPT_TCP_CLIENT_QUEUE,
+  OPT_TCP_SLOW_CLIENT,
+  OPT_TCP_STANDBY,
+  OPT_TCP_USER_TIMEOUT,
+  OPT_TCP_KEEPALIVE,
+  OPT_TCP_HEARTBEAT,
+  OPT_UDP_SEQ,
+  OPT_UDP_REORDER_WINDOW,
+  OPT_UDP_RELIABLE_IDS,
+  OPT_UDP_RELIABLE_TIMEOUT,
+  OPT_UDP_FEC,
+  OPT_UDP_RATE,
+  OPT_UDP_RATE_MIN,
+  OPT_UDP_DELAY_TARGET,
+  OPT_UDP_LANE,
+  OPT_UDP_BCM_OFFLOAD,
+  OPT_EVICT,
+  OPT_COALESCE_IDS,
+  OPT_ON_CHANGE,
+  OPT_ON_CHANGE_REFRESH,
+  OPT_ON_CHANGE_MASK,
+  OPT_REGENERATE,
+  OPT_REGENERATE_TIMEOUT,
+  OPT_CAN_FILTER,
+  OPT_RATE_LIMIT,
+  OPT_LATENCY,
+  OPT_LATENCY_IDS,
+  OPT_CLOCK_SYNC,
+  OPT_STAGE_LATENCY,
+  OPT_METRICS,
+  OPT_STATS,
+  OPT_STATS_NAME,
+  OPT_LOG_RATE,
+  OPT_DEBUG_SAMPLE,
+  OPT_DEBUG_IDS,
+  OPT_FLIGHT_RECORDER,
+  OPT_FLIGHT_RECORDER_FRAMES,
+  OPT_FLIGHT_RECORDER_SECONDS,
+  OPT_RECORD,
+  OPT_RECORD_SEGMENT_SIZE,
+  OPT_REPLAY,
+  OPT_REPLAY_TO,
+  OPT_REPLAY_SPEED,
+  OPT_REPLAY_REPEAT,
+};
+
 #define CANNELLONI_VERSION "1.1.0"
+/* IDs listed in the drop summary */
+#define DROP_SUMMARY_IDS 10
 
 using namespace cannelloni;
 
+/* Prints the IDs with the most dropped frames */
+void printDropSummary(const char *direction, FrameBuffer *frameBuffer) {
+  std::map<canid_t, uint64_t> dropCounts = frameBuffer->getDropCounts();
+  if (dropCounts.empty())
+    return;
+  std::vector<std::pair<canid_t, uint64_t>> sorted(dropCounts.begin(), dropCounts.end());
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const auto &a, const auto &b) { return a.second > b.second; });
+  uint64_t total = 0;
+  for (const auto &entry : sorted)
+    total += entry.second;
+  std::ostringstream ids;
+  for (size_t i = 0; i < sorted.size() && i < DROP_SUMMARY_IDS; i++) {
+    ids << " 0x" << std::hex << (sorted[i].first & CAN_EFF_MASK) << std::dec;
+    if (sorted[i].first & CAN_EFF_FLAG)
+      ids << "x";
+    ids << ": " << sorted[i].second;
+  }
+  linfo << "Drop Summary (" << direction << "): Total: " << total << ids.str() << std::endl;
+}
+
+/* The stage histograms, merged over the threads whenever they are read */
+void registerStageMetrics(MetricsRegistry &registry, const std::vector<const StageRecorder*> &recorders) {
+  for (int stage = 0; stage < STAGE_COUNT; stage++) {
+    registry.add("cannelloni_stage_latency_ns", "Time frames spend in each stage of the pipeline",
+                 std::string("stage=\"") + stageName(static_cast<LatencyStage>(stage)) + "\"",
+                 [recorders, stage](LatencyHistogram &histogram) {
+                   for (const StageRecorder *recorder : recorders)
+                     recorder->mergeInto(static_cast<LatencyStage>(stage), histogram);
+                 });
+  }
+}
+
 void printUsage() {
   std::cout << "cannelloni Release: " << CANNELLONI_VERSION << std::endl;
   std::cout << "Usage: cannelloni OPTIONS" << std::endl;
@@ -94,9 +203,104 @@ void printUsage() {
   std::cout << "\t -4 \t\t\t use IPv4 (default)" << std::endl;
   std::cout << "\t -6 \t\t\t use IPv6" << std::endl;
   std::cout << "\t -m \t\t\t set MTU, default: 1500 bytes" << std::endl;
+  std::cout << "\t\t\t auto : UDP only: discover the path MTU, implies --udp-seq" << std::endl;
   std::cout << "\t -f \t\t\t fork into background / daemon mode" << std::endl;
   std::cout << "\t -P \t\t\t pid file path (only in daemon mode), default: /var/run/cannelloni.pid" << std::endl;
   std::cout << "\t -h \t\t\t display this help text" << std::endl;
+  std::cout << "\t --store-forward FRAMES \t TCP only: keep up to FRAMES frames while disconnected, default: 0 (off)" << std::endl;
+  std::cout << "\t --store-forward-age US \t TCP only: drop stored frames older than US, default: 0 (never)" << std::endl;
+  std::cout << "\t --store-forward-drop [oldest|newest] \t TCP only: frame to drop when the store is full, default: oldest" << std::endl;
+  std::cout << "\t --evict POLICY \t frame to drop when a frame buffer is full or overloaded, default: oldest" << std::endl;
+  std::cout << "\t\t\t oldest : the frame buffered the longest" << std::endl;
+  std::cout << "\t\t\t newest : the frame buffered last" << std::endl;
+  std::cout << "\t\t\t priority : the oldest frame of the ID with the lowest CAN priority" << std::endl;
+  std::cout << "\t\t\t quota:N : the oldest frame of the ID with the most frames, if above N" << std::endl;
+  std::cout << "\t --coalesce-ids LIST \t only send the latest value of these IDs, e.g. 0x100,0x200-0x2ff, default: none" << std::endl;
+  std::cout << "\t --on-change LIST \t only send frames of these IDs when their payload changed, default: none" << std::endl;
+  std::cout << "\t --on-change-refresh MS \t send unchanged frames again after MS, 0 is never, default: 1000" << std::endl;
+  std::cout << "\t --on-change-mask ID:HEX \t only compare the bytes of ID that are set in HEX, e.g. 0x100:ff00ff, may be given multiple times" << std::endl;
+  std::cout << "\t --regenerate MS:LIST \t repeat the last frame of these IDs written to the bus every MS, may be given multiple times" << std::endl;
+  std::cout << "\t --regenerate-timeout MS \t stop repeating an ID after MS without a new frame, default: 3000" << std::endl;
+  std::cout << "\t --can-filter LIST \t only read frames from the bus that match these rules, may be given multiple times" << std::endl;
+  std::cout << "\t\t\t ID:MASK : read frames with (can_id & MASK) == (ID & MASK)" << std::endl;
+  std::cout << "\t\t\t ID~MASK : don't read these frames" << std::endl;
+  std::cout << "\t\t\t #MASK : read error frames of these classes" << std::endl;
+  std::cout << "\t --rate-limit FILE \t limit the frames per second of IDs read from the bus, CSV with ID[-ID],RATE[,BURST[,drop|coalesce]]" << std::endl;
+  std::cout << "\t --spill-dir DIR \t spill frames to DIR once the frame buffer is full, default: off" << std::endl;
+  std::cout << "\t --spill-segment-size MB \t size of one spill segment file, default: 16" << std::endl;
+  std::cout << "\t --spill-budget MB \t maximum disk usage of all spill segments, default: 256" << std::endl;
+  std::cout << "\t --spill-rate FPS \t frames per second moved back from disk, 0 is unlimited, default: 10000" << std::endl;
+  std::cout << "\t --tcp-max-clients N \t TCP server only: accept up to N clients, default: 1" << std::endl;
+  std::cout << "\t --tcp-client-queue KB \t TCP server only: send queue size of each client, default: 1024" << std::endl;
+  std::cout << "\t --tcp-slow-client [drop|disconnect] \t TCP server only: handling of clients with a full queue, default: drop" << std::endl;
+  std::cout << "\t --tcp-standby IP[:PORT] \t TCP client only: standby server, may be given multiple times" << std::endl;
+  std::cout << "\t --tcp-user-timeout MS \t TCP only: close connections with unacknowledged data after MS, default: 0 (kernel)" << std::endl;
+  std::cout << "\t --tcp-keepalive S \t TCP only: send keepalive probes after S idle seconds, default: 0 (off)" << std::endl;
+  std::cout << "\t --tcp-heartbeat MS \t TCP only: exchange heartbeats every MS, needed on both ends, default: 0 (off)" << std::endl;
+  std::cout << "\t --udp-seq \t\t UDP only: extended sequence numbers and loss accounting, needed on both ends" << std::endl;
+  std::cout << "\t --udp-reorder-window US \t UDP only: hold out-of-order packets for up to US, implies --udp-seq, default: 0 (off)" << std::endl;
+  std::cout << "\t --udp-reliable-ids LIST \t UDP only: acknowledge and retransmit frames with these IDs, e.g. 0x100,0x200-0x2ff, implies --udp-seq" << std::endl;
+  std::cout << "\t --udp-reliable-timeout US \t minimum retransmission timeout, default: 20000" << std::endl;
+  std::cout << "\t --udp-fec K,M \t\t UDP only: send M parity packets after every K packets, implies --udp-seq" << std::endl;
+  std::cout << "\t --udp-rate KBIT \t UDP only: pace packets and adapt the rate up to KBIT kbit/s, implies --udp-seq" << std::endl;
+  std::cout << "\t --udp-rate-min KBIT \t lower bound of the adapted rate, default: 64" << std::endl;
+  std::cout << "\t --udp-delay-target US \t reduce the rate above this queuing delay, default: 20000" << std::endl;
+  std::cout << "\t --udp-lane SPEC \t UDP only: separate queue for some IDs, may be given multiple times in order of priority" << std::endl;
+  std::cout << "\t\t\t express:LIST : send frames with these IDs right away" << std::endl;
+  std::cout << "\t\t\t US[,BYTES]:LIST : send them after US in packets of up to BYTES" << std::endl;
+  std::cout << "\t --udp-bcm-offload LIST \t UDP only: let the remote CAN_BCM send cyclic frames with these IDs, needed on both ends, implies --udp-seq" << std::endl;
+  std::cout << "\t --latency \t\t UDP only: measure the delay from the CAN bus of the remote to the local one, needed on both ends, implies --udp-seq" << std::endl;
+  std::cout << "\t --latency-ids LIST \t keep a latency histogram for each of these IDs, implies --latency" << std::endl;
+  std::cout << "\t --clock-sync \t\t estimate the clock offset of the remote and correct latencies with it, needed on both ends" << std::endl;
+  std::cout << "\t --stage-latency \t record the time frames spend in each stage of the pipeline" << std::endl;
+  std::cout << "\t --metrics ADDR \t serve Prometheus metrics at IP:PORT, [IPv6]:PORT or the path of a Unix socket" << std::endl;
+  std::cout << "\t --stats \t\t publish live statistics in " STATS_PATH_PREFIX "<interface> for cannelloni-stat" << std::endl;
+  std::cout << "\t --stats-name NAME \t publish them in " STATS_PATH_PREFIX "NAME instead, implies --stats" << std::endl;
+  std::cout << "\t --log-rate N \t\t messages per second each log statement may write, 0 is unlimited, default: "
+            << LOG_RATE_DEFAULT << std::endl;
+  std::cout << "\t --debug-sample N \t with -d c only log every Nth frame" << std::endl;
+  std::cout << "\t --debug-ids LIST \t with -d c only log frames with these IDs" << std::endl;
+  std::cout << "\t --flight-recorder DIR \t keep the last frames of each thread and dump them to DIR on SIGUSR1" << std::endl;
+  std::cout << "\t --flight-recorder-frames N \t frames kept by each thread, default: " << FLIGHT_DEFAULT_FRAMES << std::endl;
+  std::cout << "\t --flight-recorder-seconds S \t seconds before SIGUSR1 that are dumped, default: "
+            << FLIGHT_DEFAULT_SECONDS << std::endl;
+  std::cout << "\t --record DIR \t\t record all tunneled frames to segment files in DIR, see cannelloni-query" << std::endl;
+  std::cout << "\t --record-segment-size MB \t size of a segment, default: " << (RECORD_DEFAULT_SEGMENT_SIZE >> 20) << std::endl;
+  std::cout << "\t --replay PATH \t\t inject the frames of a candump log or a recording (segment or directory)" << std::endl;
+  std::cout << "\t --replay-to TARGET \t network (default) sends the frames to the remote, can writes them to the bus" << std::endl;
+  std::cout << "\t --replay-speed F \t factor of the recorded timing, 0 is as fast as possible, default: 1" << std::endl;
+  std::cout << "\t --replay-repeat N \t replay the recording N times, 0 is forever, default: 1" << std::endl;
+}
+
+/*
+ * Parses IP, IP:PORT, IPv6 or [IPv6]:PORT,
+ * defaultPort is used if no port is given
+ */
+static bool parseEndpoint(const std::string &endpoint, uint16_t defaultPort,
+                          int addressFamily, struct sockaddr_storage *addr) {
+  std::string host = endpoint;
+  uint16_t port = defaultPort;
+  size_t colon = endpoint.rfind(':');
+  if (!endpoint.empty() && endpoint[0] == '[') {
+    size_t bracket = endpoint.find(']');
+    if (bracket == std::string::npos)
+      return false;
+    host = endpoint.substr(1, bracket-1);
+    if (colon != std::string::npos && colon > bracket)
+      port = strtoul(endpoint.c_str() + colon + 1, NULL, 10);
+  } else if (colon != std::string::npos && endpoint.find(':') == colon) {
+    host = endpoint.substr(0, colon);
+    port = strtoul(endpoint.c_str() + colon + 1, NULL, 10);
+  }
+  memset(addr, 0, sizeof(struct sockaddr_storage));
+  if (!parseAddress(host.c_str(), (struct sockaddr *) addr, addressFamily))
+    return false;
+  if (addressFamily == AF_INET) {
+    ((struct sockaddr_in *) addr)->sin_port = htons(port);
+  } else {
+    ((struct sockaddr_in6 *) addr)->sin6_port = htons(port);
+  }
+  return true;
 }
 
 void daemonize(std::string pidFilePath) {
@@ -134,7 +338,7 @@ void daemonize(std::string pidFilePath) {
   pidFile.close();
 
   // change to root, cannelloni only may read the
-  // timeoutTableFile which has already happend
+  // timeoutTableFile and rateLimitFile which has already happend
   // by the time this function is called
   if (chdir("/") < 0) {
     exit(EXIT_FAILURE);
@@ -169,6 +373,7 @@ int main(int argc, char **argv) {
   bool useIPv6 = false;
   bool forkIntoBackground = false;
   uint16_t linkMtuSize = 1500;
+  bool pathMtuDiscovery = false;
   TCPThreadRole tcpRole = TCP_CLIENT;
 #ifdef SCTP_SUPPORT
   SCTPThreadRole sctpRole = SCTP_CLIENT;
@@ -180,9 +385,43 @@ int main(int argc, char **argv) {
   std::string canInterfaceName = "vcan0";
   uint32_t bufferTimeout = 100000;
   std::string timeoutTableFile;
+  std::string rateLimitFile;
+  std::vector<RateLimitRule> rateLimits;
   std::string pidFilePath = "/var/run/cannelloni.pid";
   /* Key is CAN ID, Value is timeout in us */
   std::map<uint32_t, uint32_t> timeoutTable;
+  StoreForwardConfig storeForwardConfig = { /* maxFrames */ 0, /* maxAge */ 0, SF_DROP_OLDEST };
+  TCPMultiServerConfig multiServerConfig = { /* maxClients */ 1, /* maxQueueBytes */ 1024 << 10,
+                                              SLOW_CLIENT_DROP };
+  TCPLivenessConfig livenessConfig = { /* userTimeout */ 0, /* keepalive */ 0, /* heartbeatInterval */ 0 };
+  std::vector<std::string> standbyServers;
+  UDPSequenceConfig sequenceConfig = { /* enabled */ false, /* reorderWindow */ 0 };
+  UDPReliabilityConfig reliabilityConfig = { /* ids */ IdSet(), /* minTimeout */ 20000 };
+  UDPFecConfig fecConfig = { /* dataPackets */ 0, /* parityPackets */ 0 };
+  UDPRateConfig rateConfig = { /* minRate */ 64 * 125, /* maxRate */ 0, /* delayTarget */ 20000 };
+  std::vector<UDPLaneConfig> laneConfigs;
+  IdSet bcmOffloadIds;
+  LatencyConfig latencyConfig = { /* enabled */ false, /* ids */ IdSet() };
+  bool clockSync = false;
+  bool stageLatency = false;
+  bool metricsEnabled = false;
+  MetricsConfig metricsConfig = { /* path */ "", /* address */ {} };
+  bool statsEnabled = false;
+  std::string statsName;
+  uint32_t logRate = LOG_RATE_DEFAULT;
+  FrameDebugConfig frameDebugConfig = { /* sample */ 1, /* ids */ IdSet() };
+  FlightRecorderConfig flightConfig = { /* directory */ "", /* frames */ FLIGHT_DEFAULT_FRAMES,
+                                        /* seconds */ FLIGHT_DEFAULT_SECONDS };
+  RecorderConfig recorderConfig = { /* directory */ "", /* segmentSize */ RECORD_DEFAULT_SEGMENT_SIZE };
+  ReplayConfig replayConfig = { /* path */ "", /* target */ REPLAY_NETWORK, /* speed */ 1.0, /* repeat */ 1 };
+  EvictionConfig evictionConfig = { /* type */ EVICT_OLDEST, /* quota */ 0 };
+  IdSet coalesceIds;
+  ChangeFilterConfig changeFilterConfig = { /* ids */ IdSet(), /* refreshInterval */ 1000000, /* masks */ {} };
+  std::vector<RegenerateConfig> regenerateConfigs;
+  uint64_t regenerateTimeout = REGENERATE_DEFAULT_TIMEOUT;
+  CANFilterConfig canFilterConfig = { /* allow */ {}, /* deny */ {}, /* errorMask */ 0 };
+  SpillConfig spillConfig = { /* directory */ "", /* segmentSize */ 16 << 20,
+                              /* diskBudget */ 256 << 20, /* drainRate */ 10000 };
 
   struct debugOptions_t debugOptions = { /* can */ 0, /* udp */ 0, /* buffer */ 0, /* timer */ 0 };
 
@@ -193,7 +432,63 @@ int main(int argc, char **argv) {
   ;
 #endif
 
-  while ((opt = getopt(argc, argv, argument_options.c_str())) != -1) {
+  const struct option long_options[] = {
+    {"store-forward", required_argument, NULL, OPT_STORE_FORWARD},
+    {"store-forward-age", required_argument, NULL, OPT_STORE_FORWARD_AGE},
+    {"store-forward-drop", required_argument, NULL, OPT_STORE_FORWARD_DROP},
+    {"evict", required_argument, NULL, OPT_EVICT},
+    {"coalesce-ids", required_argument, NULL, OPT_COALESCE_IDS},
+    {"on-change", required_argument, NULL, OPT_ON_CHANGE},
+    {"on-change-refresh", required_argument, NULL, OPT_ON_CHANGE_REFRESH},
+    {"on-change-mask", required_argument, NULL, OPT_ON_CHANGE_MASK},
+    {"regenerate", required_argument, NULL, OPT_REGENERATE},
+    {"regenerate-timeout", required_argument, NULL, OPT_REGENERATE_TIMEOUT},
+    {"can-filter", required_argument, NULL, OPT_CAN_FILTER},
+    {"rate-limit", required_argument, NULL, OPT_RATE_LIMIT},
+    {"spill-dir", required_argument, NULL, OPT_SPILL_DIR},
+    {"spill-segment-size", required_argument, NULL, OPT_SPILL_SEGMENT_SIZE},
+    {"spill-budget", required_argument, NULL, OPT_SPILL_BUDGET},
+    {"spill-rate", required_argument, NULL, OPT_SPILL_RATE},
+    {"tcp-max-clients", required_argument, NULL, OPT_TCP_MAX_CLIENTS},
+    {"tcp-client-queue", required_argument, NULL, OPT_TCP_CLIENT_QUEUE},
+    {"tcp-slow-client", required_argument, NULL, OPT_TCP_SLOW_CLIENT},
+    {"tcp-standby", required_argument, NULL, OPT_TCP_STANDBY},
+    {"tcp-user-timeout", required_argument, NULL, OPT_TCP_USER_TIMEOUT},
+    {"tcp-keepalive", required_argument, NULL, OPT_TCP_KEEPALIVE},
+    {"tcp-heartbeat", required_argument, NULL, OPT_TCP_HEARTBEAT},
+    {"udp-seq", no_argument, NULL, OPT_UDP_SEQ},
+    {"udp-reorder-window", required_argument, NULL, OPT_UDP_REORDER_WINDOW},
+    {"udp-reliable-ids", required_argument, NULL, OPT_UDP_RELIABLE_IDS},
+    {"udp-reliable-timeout", required_argument, NULL, OPT_UDP_RELIABLE_TIMEOUT},
+    {"udp-fec", required_argument, NULL, OPT_UDP_FEC},
+    {"udp-rate", required_argument, NULL, OPT_UDP_RATE},
+    {"udp-rate-min", required_argument, NULL, OPT_UDP_RATE_MIN},
+    {"udp-delay-target", required_argument, NULL, OPT_UDP_DELAY_TARGET},
+    {"udp-lane", required_argument, NULL, OPT_UDP_LANE},
+    {"udp-bcm-offload", required_argument, NULL, OPT_UDP_BCM_OFFLOAD},
+    {"latency", no_argument, NULL, OPT_LATENCY},
+    {"latency-ids", required_argument, NULL, OPT_LATENCY_IDS},
+    {"clock-sync", no_argument, NULL, OPT_CLOCK_SYNC},
+    {"stage-latency", no_argument, NULL, OPT_STAGE_LATENCY},
+    {"metrics", required_argument, NULL, OPT_METRICS},
+    {"stats", no_argument, NULL, OPT_STATS},
+    {"stats-name", required_argument, NULL, OPT_STATS_NAME},
+    {"log-rate", required_argument, NULL, OPT_LOG_RATE},
+    {"debug-sample", required_argument, NULL, OPT_DEBUG_SAMPLE},
+    {"debug-ids", required_argument, NULL, OPT_DEBUG_IDS},
+    {"flight-recorder", required_argument, NULL, OPT_FLIGHT_RECORDER},
+    {"flight-recorder-frames", required_argument, NULL, OPT_FLIGHT_RECORDER_FRAMES},
+    {"flight-recorder-seconds", required_argument, NULL, OPT_FLIGHT_RECORDER_SECONDS},
+    {"record", required_argument, NULL, OPT_RECORD},
+    {"record-segment-size", required_argument, NULL, OPT_RECORD_SEGMENT_SIZE},
+    {"replay", required_argument, NULL, OPT_REPLAY},
+    {"replay-to", required_argument, NULL, OPT_REPLAY_TO},
+    {"replay-speed", required_argument, NULL, OPT_REPLAY_SPEED},
+    {"replay-repeat", required_argument, NULL, OPT_REPLAY_REPEAT},
+    {NULL, 0, NULL, 0}
+  };
+
+  while ((opt = getopt_long(argc, argv, argument_options.c_str(), long_options, NULL)) != -1) {
     switch(opt) {
       case 'C':
         switch (optarg[0]) {
@@ -294,7 +589,12 @@ int main(int argc, char **argv) {
         useIPv4 = false;
         break;
       case 'm':
-        linkMtuSize = static_cast<uint16_t>(strtol(optarg, NULL, 10));
+        if (strcmp(optarg, "auto") == 0) {
+          pathMtuDiscovery = true;
+          sequenceConfig.enabled = true;
+        } else {
+          linkMtuSize = static_cast<uint16_t>(strtol(optarg, NULL, 10));
+        }
         break;
       case 'f':
         forkIntoBackground = true;
@@ -302,6 +602,362 @@ int main(int argc, char **argv) {
       case 'P':
         pidFilePath = std::string(optarg);
         break;
+      case OPT_STORE_FORWARD:
+        storeForwardConfig.maxFrames = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_STORE_FORWARD_AGE:
+        storeForwardConfig.maxAge = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_STORE_FORWARD_DROP:
+        if (strcmp(optarg, "oldest") == 0) {
+          storeForwardConfig.dropPolicy = SF_DROP_OLDEST;
+        } else if (strcmp(optarg, "newest") == 0) {
+          storeForwardConfig.dropPolicy = SF_DROP_NEWEST;
+        } else {
+          std::cout << "Usage Error: " << std::endl
+                    << "--store-forward-drop only accepts oldest or newest" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_EVICT: {
+        char tail;
+        if (strcmp(optarg, "oldest") == 0) {
+          evictionConfig.type = EVICT_OLDEST;
+        } else if (strcmp(optarg, "newest") == 0) {
+          evictionConfig.type = EVICT_NEWEST;
+        } else if (strcmp(optarg, "priority") == 0) {
+          evictionConfig.type = EVICT_PRIORITY;
+        } else if (sscanf(optarg, "quota:%zu%c", &evictionConfig.quota, &tail) == 1) {
+          evictionConfig.type = EVICT_QUOTA;
+        } else {
+          std::cout << "Usage Error: " << std::endl
+                    << "--evict only accepts oldest, newest, priority or quota:N" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      }
+      case OPT_COALESCE_IDS:
+        if (!coalesceIds.parse(optarg)) {
+          std::cout << "Usage Error: " << std::endl
+                    << "--coalesce-ids expects a list of IDs and ranges, e.g. 0x100,0x200-0x2ff" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_ON_CHANGE:
+        if (!changeFilterConfig.ids.parse(optarg)) {
+          std::cout << "Usage Error: " << std::endl
+                    << "--on-change expects a list of IDs and ranges, e.g. 0x100,0x200-0x2ff" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_ON_CHANGE_REFRESH:
+        changeFilterConfig.refreshInterval = strtoull(optarg, NULL, 10) * 1000;
+        break;
+      case OPT_ON_CHANGE_MASK: {
+        std::array<uint8_t, CANFD_MAX_DLEN> mask;
+        /* Bytes beyond the given ones are compared */
+        mask.fill(0xff);
+        char *end;
+        canid_t id = strtoul(optarg, &end, 0);
+        bool valid = *end == ':';
+        size_t len = valid ? strlen(end + 1) : 0;
+        valid = valid && len > 0 && len % 2 == 0 && len / 2 <= CANFD_MAX_DLEN;
+        for (size_t i = 0; valid && i < len / 2; i++) {
+          char byte[3] = { end[1 + 2 * i], end[2 + 2 * i], '\0' };
+          char *byteEnd;
+          mask[i] = static_cast<uint8_t>(strtoul(byte, &byteEnd, 16));
+          valid = isxdigit(byte[0]) && *byteEnd == '\0';
+        }
+        if (!valid) {
+          std::cout << "Usage Error: " << std::endl
+                    << "--on-change-mask expects ID:HEX, e.g. 0x100:ff00ff" << std::endl;
+          printUsage();
+          return -1;
+        }
+        /* Same key as the filter, extended IDs keep the EFF flag */
+        if (id > CAN_SFF_MASK)
+          id = (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+        changeFilterConfig.masks[id] = mask;
+        break;
+      }
+      case OPT_REGENERATE: {
+        RegenerateConfig regenerate = { /* ids */ IdSet(), /* period */ 0, /* timeout */ 0 };
+        char *end;
+        regenerate.period = strtoull(optarg, &end, 10) * 1000;
+        if (*end != ':' || regenerate.period == 0 || !regenerate.ids.parse(end + 1)) {
+          std::cout << "Usage Error: " << std::endl
+                    << "--regenerate expects MS:LIST with MS > 0, e.g. 100:0x100,0x200-0x2ff" << std::endl;
+          printUsage();
+          return -1;
+        }
+        regenerateConfigs.push_back(regenerate);
+        break;
+      }
+      case OPT_REGENERATE_TIMEOUT: {
+        char *end;
+        regenerateTimeout = strtoull(optarg, &end, 10) * 1000;
+        if (*end != '\0' || regenerateTimeout == 0) {
+          std::cout << "Usage Error: " << std::endl
+                    << "--regenerate-timeout expects MS > 0" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      }
+      case OPT_CAN_FILTER:
+        if (!parseCANFilter(optarg, canFilterConfig)) {
+          std::cout << "Usage Error: " << std::endl
+                    << "--can-filter expects a list of ID:MASK, ID~MASK or #MASK in hex, e.g. 100:7f0,123~7ff" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_RATE_LIMIT:
+        rateLimitFile = std::string(optarg);
+        break;
+      case OPT_SPILL_DIR:
+        spillConfig.directory = std::string(optarg);
+        break;
+      case OPT_SPILL_SEGMENT_SIZE:
+        spillConfig.segmentSize = strtoull(optarg, NULL, 10) << 20;
+        break;
+      case OPT_SPILL_BUDGET:
+        spillConfig.diskBudget = strtoull(optarg, NULL, 10) << 20;
+        break;
+      case OPT_SPILL_RATE:
+        spillConfig.drainRate = static_cast<uint32_t>(strtoul(optarg, NULL, 10));
+        break;
+      case OPT_TCP_MAX_CLIENTS:
+        multiServerConfig.maxClients = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_TCP_CLIENT_QUEUE:
+        multiServerConfig.maxQueueBytes = strtoul(optarg, NULL, 10) << 10;
+        break;
+      case OPT_TCP_SLOW_CLIENT:
+        if (strcmp(optarg, "drop") == 0) {
+          multiServerConfig.slowClientPolicy = SLOW_CLIENT_DROP;
+        } else if (strcmp(optarg, "disconnect") == 0) {
+          multiServerConfig.slowClientPolicy = SLOW_CLIENT_DISCONNECT;
+        } else {
+          std::cout << "Usage Error: " << std::endl
+                    << "--tcp-slow-client only accepts drop or disconnect" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_TCP_STANDBY:
+        standbyServers.push_back(std::string(optarg));
+        break;
+      case OPT_TCP_USER_TIMEOUT:
+        livenessConfig.userTimeout = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_TCP_KEEPALIVE:
+        livenessConfig.keepalive = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_TCP_HEARTBEAT:
+        livenessConfig.heartbeatInterval = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_UDP_SEQ:
+        sequenceConfig.enabled = true;
+        break;
+      case OPT_UDP_REORDER_WINDOW:
+        sequenceConfig.enabled = true;
+        sequenceConfig.reorderWindow = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_UDP_RELIABLE_IDS:
+        sequenceConfig.enabled = true;
+        if (!reliabilityConfig.ids.parse(optarg)) {
+          std::cout << "Usage Error: " << std::endl
+                    << "--udp-reliable-ids expects a list of IDs and ranges, e.g. 0x100,0x200-0x2ff" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_UDP_BCM_OFFLOAD:
+        sequenceConfig.enabled = true;
+        if (!bcmOffloadIds.parse(optarg)) {
+          std::cout << "Usage Error: " << std::endl
+                    << "--udp-bcm-offload expects a list of IDs and ranges, e.g. 0x100,0x200-0x2ff" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_LATENCY:
+        sequenceConfig.enabled = true;
+        latencyConfig.enabled = true;
+        break;
+      case OPT_LATENCY_IDS:
+        sequenceConfig.enabled = true;
+        latencyConfig.enabled = true;
+        if (!latencyConfig.ids.parse(optarg)) {
+          std::cout << "Usage Error: " << std::endl
+                    << "--latency-ids expects a list of IDs and ranges, e.g. 0x100,0x200-0x2ff" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_CLOCK_SYNC:
+        clockSync = true;
+        break;
+      case OPT_STAGE_LATENCY:
+        stageLatency = true;
+        break;
+      case OPT_METRICS:
+        metricsEnabled = true;
+        if (optarg[0] == '/' || optarg[0] == '.') {
+          metricsConfig.path = optarg;
+        } else if (!parseEndpoint(optarg, 0, optarg[0] == '[' ? AF_INET6 : AF_INET, &metricsConfig.address) ||
+                   getSocketAddress(&metricsConfig.address).port == 0) {
+          std::cout << "Usage Error: " << std::endl
+                    << "--metrics expects IP:PORT, [IPv6]:PORT or the path of a Unix socket" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_STATS:
+        statsEnabled = true;
+        break;
+      case OPT_STATS_NAME:
+        statsEnabled = true;
+        statsName = optarg;
+        if (!StatsSegment::isValidInstance(statsName)) {
+          std::cout << "Usage Error: " << std::endl
+                    << "--stats-name expects a name without '/' of less than "
+                    << STATS_INSTANCE_SIZE << " characters" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_LOG_RATE:
+        logRate = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_DEBUG_SAMPLE:
+        frameDebugConfig.sample = strtoul(optarg, NULL, 10);
+        if (frameDebugConfig.sample == 0) {
+          std::cout << "Usage Error: " << std::endl << "--debug-sample expects N > 0" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_DEBUG_IDS:
+        if (!frameDebugConfig.ids.parse(optarg)) {
+          std::cout << "Usage Error: " << std::endl
+                    << "--debug-ids expects a list of IDs and ranges, e.g. 0x100,0x200-0x2ff" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_FLIGHT_RECORDER:
+        flightConfig.directory = optarg;
+        break;
+      case OPT_FLIGHT_RECORDER_FRAMES:
+        flightConfig.frames = strtoull(optarg, NULL, 10);
+        if (flightConfig.frames == 0) {
+          std::cout << "Usage Error: " << std::endl << "--flight-recorder-frames expects N > 0" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_FLIGHT_RECORDER_SECONDS:
+        flightConfig.seconds = strtoull(optarg, NULL, 10);
+        if (flightConfig.seconds == 0) {
+          std::cout << "Usage Error: " << std::endl << "--flight-recorder-seconds expects S > 0" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_RECORD:
+        recorderConfig.directory = optarg;
+        break;
+      case OPT_RECORD_SEGMENT_SIZE:
+        recorderConfig.segmentSize = strtoull(optarg, NULL, 10) << 20;
+        if (recorderConfig.segmentSize == 0) {
+          std::cout << "Usage Error: " << std::endl << "--record-segment-size expects MB > 0" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_REPLAY:
+        replayConfig.path = optarg;
+        break;
+      case OPT_REPLAY_TO:
+        if (strcmp(optarg, "network") == 0) {
+          replayConfig.target = REPLAY_NETWORK;
+        } else if (strcmp(optarg, "can") == 0) {
+          replayConfig.target = REPLAY_CAN;
+        } else {
+          std::cout << "Usage Error: " << std::endl << "--replay-to expects network or can" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case OPT_REPLAY_SPEED: {
+        char *end;
+        replayConfig.speed = strtod(optarg, &end);
+        if (end == optarg || *end != '\0' || replayConfig.speed < 0) {
+          std::cout << "Usage Error: " << std::endl << "--replay-speed expects F >= 0" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      }
+      case OPT_REPLAY_REPEAT:
+        replayConfig.repeat = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_UDP_RELIABLE_TIMEOUT:
+        reliabilityConfig.minTimeout = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_UDP_FEC: {
+        unsigned int k, m;
+        if (sscanf(optarg, "%u,%u", &k, &m) != 2 || k < 1 || k > FEC_MAX_DATA_PACKETS ||
+            m < 1 || m > FEC_MAX_PARITY_PACKETS) {
+          std::cout << "Usage Error: " << std::endl
+                    << "--udp-fec expects K,M with 1 <= K <= " << FEC_MAX_DATA_PACKETS
+                    << " and 1 <= M <= " << FEC_MAX_PARITY_PACKETS << std::endl;
+          printUsage();
+          return -1;
+        }
+        sequenceConfig.enabled = true;
+        fecConfig.dataPackets = k;
+        fecConfig.parityPackets = m;
+        break;
+      }
+      case OPT_UDP_RATE:
+        sequenceConfig.enabled = true;
+        /* kbit/s to bytes/s */
+        rateConfig.maxRate = strtoull(optarg, NULL, 10) * 125;
+        break;
+      case OPT_UDP_RATE_MIN:
+        rateConfig.minRate = strtoull(optarg, NULL, 10) * 125;
+        break;
+      case OPT_UDP_DELAY_TARGET:
+        rateConfig.delayTarget = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_UDP_LANE: {
+        UDPLaneConfig lane = { /* ids */ IdSet(), /* timeout */ 0, /* budget */ 0 };
+        const char *list = strchr(optarg, ':');
+        bool valid = list != NULL && lane.ids.parse(list + 1);
+        if (valid && strncmp(optarg, "express:", 8) != 0) {
+          unsigned int timeout, budget = 0;
+          int fields = sscanf(optarg, "%u,%u", &timeout, &budget);
+          lane.timeout = timeout;
+          lane.budget = budget;
+          valid = fields >= 1 && timeout > 0 && (budget == 0 || budget >= UDP_MIN_LANE_BUDGET);
+        }
+        if (!valid || laneConfigs.size() >= UDP_MAX_LANES) {
+          std::cout << "Usage Error: " << std::endl
+                    << "--udp-lane expects express:LIST or US[,BYTES]:LIST with BYTES >= "
+                    << UDP_MIN_LANE_BUDGET << ", up to " << UDP_MAX_LANES << " times" << std::endl;
+          printUsage();
+          return -1;
+        }
+        laneConfigs.push_back(lane);
+        break;
+      }
       default:
         printUsage();
         return -1;
@@ -344,6 +1000,65 @@ int main(int argc, char **argv) {
     return -1;
   }
 
+  if (storeForwardConfig.maxFrames >= FRAME_BUFFER_MAX_SIZE) {
+    std::cout << "Usage Error: " << std::endl
+              << "--store-forward must be smaller than " << FRAME_BUFFER_MAX_SIZE << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+
+  if (multiServerConfig.maxClients == 0 || multiServerConfig.maxClients >= FD_SETSIZE / 2) {
+    std::cout << "Usage Error: " << std::endl
+              << "--tcp-max-clients must be between 1 and " << FD_SETSIZE / 2 - 1 << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+  if (multiServerConfig.maxClients > 1 && storeForwardConfig.maxFrames > 0) {
+    std::cout << "Usage Error: " << std::endl
+              << "--store-forward can't be used with more than one client" << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+
+  if (sequenceConfig.enabled && (useTCP || useSCTP)) {
+    std::cout << "Usage Error: " << std::endl
+              << "--udp-seq, --udp-reorder-window, --udp-reliable-ids, --udp-fec, --udp-rate, --udp-bcm-offload, --latency and -m auto can only be used with UDP" << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+  if (!laneConfigs.empty() && (useTCP || useSCTP)) {
+    std::cout << "Usage Error: " << std::endl
+              << "--udp-lane can only be used with UDP" << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+  if (rateConfig.maxRate > 0 && (rateConfig.minRate == 0 || rateConfig.minRate > rateConfig.maxRate)) {
+    std::cout << "Usage Error: " << std::endl
+              << "--udp-rate-min has to be between 1 and --udp-rate" << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+  if (!standbyServers.empty() && !(useTCP && tcpRole == TCP_CLIENT)) {
+    std::cout << "Usage Error: " << std::endl
+              << "--tcp-standby requires -C c" << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+  if (!standbyServers.empty() && storeForwardConfig.maxFrames > 0) {
+    std::cout << "Usage Error: " << std::endl
+              << "--store-forward can't be used with standby servers" << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+
   // set default values if no IPs have been provided
   if (strlen(localIP) == 0) {
     if (useIPv4) {
@@ -370,6 +1085,11 @@ int main(int argc, char **argv) {
     timeoutTable = mapParser.read();
   }
 
+  if (!rateLimitFile.empty() && !loadRateLimits(rateLimitFile, rateLimits)) {
+    lerror << "Error while reading " << rateLimitFile << "." << std::endl;
+    return -1;
+  }
+
   if (debugOptions.timer) {
     if (timeoutTable.empty()) {
       linfo << "No custom timeout table specified, using "
@@ -396,6 +1116,8 @@ int main(int argc, char **argv) {
   sigemptyset(&signalMask);
   sigaddset(&signalMask, SIGTERM);
   sigaddset(&signalMask, SIGINT);
+  /* Dumps the flight recorder */
+  sigaddset(&signalMask, SIGUSR1);
   /* Block these signals... */
   if (sigprocmask(SIG_BLOCK, &signalMask, NULL) == -1) {
     lerror << "sigprocmask error" << std::endl;
@@ -435,26 +1157,73 @@ int main(int argc, char **argv) {
     ((struct sockaddr_in6 *) &remoteAddr)->sin6_port = htons(remotePort);
     ((struct sockaddr_in6 *) &localAddr)->sin6_port = htons(localPort);
   }
+
+  std::vector<struct sockaddr_storage> standbyAddrs(standbyServers.size());
+  for (size_t i = 0; i < standbyServers.size(); i++) {
+    if (!parseEndpoint(standbyServers[i], remotePort, addressFamily, &standbyAddrs[i])) {
+      lerror << "Invalid standby address " << standbyServers[i] << std::endl;
+      return -1;
+    }
+  }
   
+  std::unique_ptr<SpillQueue> spillQueue;
+  if (!spillConfig.directory.empty()) {
+    spillQueue = std::make_unique<SpillQueue>();
+    if (!spillQueue->open(spillConfig)) {
+      lerror << "Unable to open spill directory " << spillConfig.directory << "." << std::endl;
+      return -1;
+    }
+  }
+
   if (forkIntoBackground) {
     std::cout << "cannelloni is forking into background." << std::endl;
     daemonize(pidFilePath);
   }
+  /* The log thread has to be started after the fork */
+  Logger::instance().setRate(logRate);
+  Logger::instance().start();
 
   std::unique_ptr<ConnectionThread> netThread;
-  if (useTCP && tcpRole == TCP_SERVER) {
-    netThread = std::make_unique<TCPServerThread>(debugOptions, TCPServerThreadParams {
+  if (useTCP && tcpRole == TCP_SERVER && multiServerConfig.maxClients > 1) {
+    auto tcpThread = std::make_unique<TCPMultiServerThread>(debugOptions, TCPServerThreadParams {
+        .remoteAddr = remoteAddr,
+        .localAddr = localAddr,
+        .addressFamily = addressFamily,
+        .checkPeer = checkPeer
+      }, multiServerConfig);
+    tcpThread.get()->setLiveness(livenessConfig);
+    tcpThread.get()->setClockSync(clockSync);
+    netThread = std::move(tcpThread);
+  } else if (useTCP && tcpRole == TCP_CLIENT && !standbyAddrs.empty()) {
+    auto tcpThread = std::make_unique<TCPFailoverClientThread>(debugOptions, TCPThreadParams {
+        .remoteAddr = remoteAddr,
+        .localAddr = localAddr,
+        .addressFamily = addressFamily,
+    }, standbyAddrs);
+    tcpThread.get()->setLiveness(livenessConfig);
+    tcpThread.get()->setClockSync(clockSync);
+    netThread = std::move(tcpThread);
+  } else if (useTCP && tcpRole == TCP_SERVER) {
+    auto tcpThread = std::make_unique<TCPServerThread>(debugOptions, TCPServerThreadParams {
         .remoteAddr = remoteAddr,
         .localAddr = localAddr,
         .addressFamily = addressFamily,
         .checkPeer = checkPeer
       });
+    tcpThread.get()->setStoreForward(storeForwardConfig);
+    tcpThread.get()->setLiveness(livenessConfig);
+    tcpThread.get()->setClockSync(clockSync);
+    netThread = std::move(tcpThread);
   } else if (useTCP && tcpRole == TCP_CLIENT) {
-    netThread = std::make_unique<TCPClientThread>(debugOptions, TCPThreadParams {
+    auto tcpThread = std::make_unique<TCPClientThread>(debugOptions, TCPThreadParams {
         .remoteAddr = remoteAddr,
         .localAddr = localAddr,
         .addressFamily = addressFamily,
     });
+    tcpThread.get()->setStoreForward(storeForwardConfig);
+    tcpThread.get()->setLiveness(livenessConfig);
+    tcpThread.get()->setClockSync(clockSync);
+    netThread = std::move(tcpThread);
   } else if (useSCTP) {
 #ifdef SCTP_SUPPORT
     auto sctpThread = std::make_unique<SCTPThread>(debugOptions, SCTPThreadParams {
@@ -468,6 +1237,7 @@ int main(int argc, char **argv) {
     });
     sctpThread.get()->setTimeout(bufferTimeout);
     sctpThread.get()->setTimeoutTable(timeoutTable);
+    sctpThread.get()->setClockSync(clockSync);
     netThread = std::move(sctpThread);
 #endif
   } else {
@@ -483,19 +1253,86 @@ int main(int argc, char **argv) {
     
     udpThread.get()->setTimeout(bufferTimeout);
     udpThread.get()->setTimeoutTable(timeoutTable);
+    udpThread.get()->setSequencing(sequenceConfig);
+    udpThread.get()->setReliability(reliabilityConfig);
+    udpThread.get()->setFec(fecConfig);
+    udpThread.get()->setRateControl(rateConfig);
+    udpThread.get()->setPathMtuDiscovery(pathMtuDiscovery);
+    udpThread.get()->setLanes(laneConfigs);
+    udpThread.get()->setCycleOffload(bcmOffloadIds);
+    udpThread.get()->setLatency(latencyConfig);
+    udpThread.get()->setClockSync(clockSync);
     netThread = std::move(udpThread);
   }
   auto canThread = std::make_unique<CANThread>(debugOptions, canInterfaceName);
-  auto netFrameBuffer = std::make_unique<FrameBuffer>(1000,16000);
-  auto canFrameBuffer = std::make_unique<FrameBuffer>(1000,16000);
+  auto netFrameBuffer = std::make_unique<FrameBuffer>(FRAME_BUFFER_INITIAL_SIZE, FRAME_BUFFER_MAX_SIZE);
+  auto canFrameBuffer = std::make_unique<FrameBuffer>(FRAME_BUFFER_INITIAL_SIZE, FRAME_BUFFER_MAX_SIZE);
+  netFrameBuffer->setSpillQueue(spillQueue.get());
+  netFrameBuffer->setEvictionPolicy(evictionConfig);
+  netFrameBuffer->setCoalesceIds(coalesceIds);
+  canThread->setChangeFilter(changeFilterConfig);
+  for (RegenerateConfig &regenerate : regenerateConfigs)
+    regenerate.timeout = regenerateTimeout;
+  canThread->setRegeneration(regenerateConfigs);
+  canThread->setFilter(canFilterConfig);
+  canThread->setRateLimits(rateLimits);
+  canThread->setBcmOffload(!bcmOffloadIds.empty());
+  canThread->setLatency(latencyConfig);
+  canThread->setStageLatency(stageLatency);
+  canThread->setFrameDebug(frameDebugConfig);
+  netThread->setFrameDebug(frameDebugConfig);
+  std::unique_ptr<FlightRecorder> flightRecorder;
+  if (!flightConfig.directory.empty()) {
+    canThread->setFlightRecorder(flightConfig.frames);
+    netThread->setFlightRecorder(flightConfig.frames);
+    flightRecorder = std::make_unique<FlightRecorder>(flightConfig,
+                                                      statsName.empty() ? canInterfaceName : statsName);
+    flightRecorder->addRing(&canThread->getFlightRing());
+    flightRecorder->addRing(&netThread->getFlightRing());
+  }
+  std::unique_ptr<Recorder> recorder;
+  if (!recorderConfig.directory.empty()) {
+    recorder = std::make_unique<Recorder>(recorderConfig, statsName.empty() ? canInterfaceName : statsName);
+    canThread->setRecorder(recorder->addQueue());
+    if (recorder->start() != 0) {
+      lerror << "Unable to record to " << recorderConfig.directory << "." << std::endl;
+      Logger::instance().stop();
+      Logger::instance().join();
+      return -1;
+    }
+  }
+  canThread->setReplay(replayConfig);
+  netThread->setStageLatency(stageLatency);
+  canFrameBuffer->setEvictionPolicy(evictionConfig);
   netThread->setPeerThread(canThread.get());
   netThread->setFrameBuffer(netFrameBuffer.get());
   canThread->setPeerThread(netThread.get());
   canThread->setFrameBuffer(canFrameBuffer.get());
+  MetricsRegistry metricsRegistry;
+  canThread->registerMetrics(metricsRegistry);
+  netThread->registerMetrics(metricsRegistry);
+  netFrameBuffer->registerMetrics(metricsRegistry, "buffer=\"can_to_network\"");
+  canFrameBuffer->registerMetrics(metricsRegistry, "buffer=\"network_to_can\"");
+  if (stageLatency)
+    registerStageMetrics(metricsRegistry, { &canThread->getStageRecorder(), &netThread->getStageRecorder() });
+  std::unique_ptr<MetricsServer> metricsServer;
+  if (metricsEnabled)
+    metricsServer = std::make_unique<MetricsServer>(metricsConfig, metricsRegistry);
+
   int netStartReturn = netThread->start();
   int canStartReturn = canThread->start();
+  if (metricsServer && netStartReturn == 0 && canStartReturn == 0 && metricsServer->start() != 0)
+    metricsServer.reset();
+  /* Two instances on the same bus need different names */
+  StatsSegment statsSegment;
+  if (statsEnabled && netStartReturn == 0 && canStartReturn == 0 &&
+      !statsSegment.open(statsName.empty() ? canInterfaceName : statsName))
+    lwarn << "Live statistics are not published" << std::endl;
 
   while (netStartReturn == 0 && canStartReturn == 0) {
+    /* Once a second, readers compute rates from the update time */
+    statsSegment.publish(metricsRegistry);
+
     struct timeval timeout;
     fd_set set;
     FD_ZERO(&set);
@@ -518,6 +1355,16 @@ int main(int argc, char **argv) {
         lerror << "signalfd read error" << std::endl;
         break;
       }
+      if (signalFdInfo.ssi_signo == SIGUSR1) {
+        if (!flightRecorder) {
+          lwarn << "Received SIGUSR1 but the flight recorder is not enabled" << std::endl;
+        } else {
+          std::string path = flightRecorder->dump();
+          if (!path.empty())
+            linfo << "Flight recorder dumped to " << path << std::endl;
+        }
+        continue;
+      }
       /* Currently we only receive SIGTERM and SIGINT but we check nonetheless */
       if (signalFdInfo.ssi_signo == SIGTERM || signalFdInfo.ssi_signo == SIGINT) {
         linfo << "Received signal " << signalFdInfo.ssi_signo << ": Exiting" << std::endl;
@@ -526,15 +1373,49 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (metricsServer) {
+    metricsServer->stop();
+    metricsServer->join();
+  }
   netThread->stop();
   netThread->join();
   canThread->stop();
   canThread->join();
+  statsSegment.close();
+  if (recorder) {
+    recorder->stop();
+    recorder->join();
+    linfo << "Record Summary: Recorded: " << recorder->getRecordedCount()
+          << " Dropped: " << recorder->getDroppedCount()
+          << " Segments: " << recorder->getSegmentCount() << std::endl;
+  }
+
+  if (spillQueue) {
+    if (debugOptions.buffer)
+      spillQueue->debug();
+    linfo << "Spill Summary: Spilled: " << spillQueue->getSpilledCount()
+          << " Drained: " << spillQueue->getDrainedCount()
+          << " Dropped: " << spillQueue->getDroppedCount()
+          << " Pending: " << spillQueue->depth() << std::endl;
+    /* Pending frames stay on disk and are sent after the next start */
+    spillQueue->close();
+  }
+
+  if (!coalesceIds.empty())
+    linfo << "Coalesce Summary: Coalesced: " << netFrameBuffer->getCoalescedCount() << std::endl;
+  printDropSummary("CAN to network", netFrameBuffer.get());
+  printDropSummary("Network to CAN", canFrameBuffer.get());
+  if (stageLatency) {
+    for (const auto &line : stageSummaries({ &canThread->getStageRecorder(), &netThread->getStageRecorder() }))
+      linfo << "Stage Summary: " << line << std::endl;
+  }
 
   /* Clear/free pools once all threads are joined */
   netFrameBuffer->clearPool();
   canFrameBuffer->clearPool();
 
   close(signalFD);
+  Logger::instance().stop();
+  Logger::instance().join();
   return 0;
 }
@@ -33,7 +33,11 @@ namespace cannelloni {
 #define CANNELLONI_FRAME_VERSION 2
 #define CANFD_FRAME              0x80
 
-enum op_codes {DATA, ACK, NACK};
+/*
+ * DATA, ACK and NACK are used in the op_code field of a v2 packet,
+ * all of them are also used as type of an extension header.
+ */
+enum op_codes {DATA, ACK, NACK, HELLO, PARITY, FEEDBACK, PROBE, PROBE_ACK, CYCLE, CLOCK, CLOCK_ACK};
 
 struct __attribute__((__packed__)) CannelloniDataPacket {
   /* Version */
@@ -46,6 +50,129 @@ struct __attribute__((__packed__)) CannelloniDataPacket {
   uint16_t count;
 };
 
+/*
+ * Optional extension header in front of a regular packet, in either
+ * packet format. It is only sent after both ends announced support with
+ * a HELLO packet. The magic byte has the reserved bits of a DTU frame info
+ * byte set and is never a valid v2 version, so extension packets are
+ * easy to tell apart from plain packets.
+ */
+#define CANNELLONI_EXT_MAGIC 0xB0
+/* HELLO: The sender has already received a HELLO from the receiver */
+#define CANNELLONI_EXT_FLAG_PEER_SEEN 0x01
+/* DATA: The receiver has to acknowledge the packet with an ACK */
+#define CANNELLONI_EXT_FLAG_RELIABLE 0x02
+/* DATA: The header is a CannelloniExtTimestamp */
+#define CANNELLONI_EXT_FLAG_TIMESTAMP 0x04
+/* DATA: The sender wants FEEDBACK packets */
+#define CANNELLONI_EXT_FLAG_FEEDBACK 0x08
+/* HELLO: The sender accepts CYCLE packets */
+#define CANNELLONI_EXT_FLAG_CYCLES 0x10
+/* DATA: The payload ends with the receive times of the frames, see CannelloniExtFrameTimes */
+#define CANNELLONI_EXT_FLAG_FRAME_TIMES 0x20
+/* HELLO: The sender sends PARITY packets */
+#define CANNELLONI_EXT_FLAG_FEC 0x40
+/* Time of a frame in CannelloniExtFrameTimes that is not known */
+#define CANNELLONI_FRAME_TIME_UNKNOWN 0xFFFFFFFF
+
+struct __attribute__((__packed__)) CannelloniExtHeader {
+  /* CANNELLONI_EXT_MAGIC */
+  uint8_t magic;
+  /* op_codes */
+  uint8_t type;
+  uint8_t flags;
+  /* Size of the header, the packet starts right after it */
+  uint8_t length;
+  /* Extended sequence number, counts DATA packets */
+  uint32_t seq;
+};
+
+/*
+ * An ACK consists of the extension header only, seq is the acknowledged
+ * packet. A NACK reports count packets starting at seq as missing.
+ */
+struct __attribute__((__packed__)) CannelloniExtNack {
+  struct CannelloniExtHeader header;
+  uint16_t count;
+};
+
+/* Send time of a DATA packet in us, taken from a clock local to the sender */
+struct __attribute__((__packed__)) CannelloniExtTimestamp {
+  struct CannelloniExtHeader header;
+  uint32_t timestamp;
+};
+
+/*
+ * End of a DATA packet with CANNELLONI_EXT_FLAG_FRAME_TIMES. It follows
+ * one uint32_t per frame in the order of the frames, with the receive
+ * time of the frame in us after base.
+ */
+struct __attribute__((__packed__)) CannelloniExtFrameTimes {
+  /* Receive time of the earliest frame in ns since the epoch */
+  uint64_t base;
+  uint16_t count;
+};
+
+/*
+ * Receiver report for the rate control of the sender, sent every
+ * RATE_FEEDBACK_INTERVAL. Counts refer to the DATA packets since the
+ * previous report, delay is the average queuing delay in us.
+ */
+struct __attribute__((__packed__)) CannelloniExtFeedback {
+  struct CannelloniExtHeader header;
+  uint32_t received;
+  uint32_t lost;
+  uint32_t delay;
+};
+
+/*
+ * A PROBE is padded to size bytes (the whole UDP payload) to check
+ * whether packets of that size make it to the receiver. It is answered
+ * with a PROBE_ACK without padding, if it was received completely.
+ */
+struct __attribute__((__packed__)) CannelloniExtProbe {
+  struct CannelloniExtHeader header;
+  uint16_t size;
+};
+
+/*
+ * A CYCLE packet asks the receiver to send frame every interval us
+ * until further notice, an interval of 0 stops it. See bcmoffload.h
+ */
+struct __attribute__((__packed__)) CannelloniExtCycle {
+  struct CannelloniExtHeader header;
+  uint32_t interval;
+  uint32_t can_id;
+  /* Length including the CANFD_FRAME flag */
+  uint8_t len;
+  uint8_t flags;
+  uint8_t data[CANFD_MAX_DLEN];
+};
+
+/*
+ * A CLOCK packet carries the send time of the requester, the CLOCK_ACK
+ * echoes it and adds the times the remote received the CLOCK and sent the
+ * CLOCK_ACK. All times are in ns since the epoch. See clocksync.h
+ */
+struct __attribute__((__packed__)) CannelloniExtClock {
+  struct CannelloniExtHeader header;
+  uint64_t originate;
+  uint64_t receive;
+  uint64_t transmit;
+};
+
+/*
+ * A PARITY packet protects the count DATA packets starting at seq, it
+ * is followed by parity block index of parityCount. See fec.h
+ */
+struct __attribute__((__packed__)) CannelloniExtParity {
+  struct CannelloniExtHeader header;
+  uint8_t count;
+  uint8_t parityCount;
+  uint8_t index;
+  uint8_t reserved;
+};
+
 /*
  * Since we are buffering CAN Frames, it is a good idea
  * to order them by their identifier to mimic a CAN bus
@@ -75,4 +202,11 @@ inline uint8_t canfd_len(const struct canfd_frame *f) {
   return f->len & ~(CANFD_FRAME);
 }
 
+/* Helper function to get the ID of a frame including the EFF flag */
+inline canid_t canfd_id(const struct canfd_frame *f) {
+  if (f->can_id & CAN_EFF_FLAG)
+    return f->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+  return f->can_id & CAN_SFF_MASK;
+}
+
 }
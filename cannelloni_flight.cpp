@@ -0,0 +1,154 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <signal.h>
+#include <string>
+#include <vector>
+
+#include "flightrecorder.h"
+#include "statsegment.h"
+
+/* Triggers and decodes dumps of the flight recorder, see --flight-recorder */
+
+using namespace cannelloni;
+
+void printUsage() {
+  std::cout << "Usage: cannelloni-flight [OPTIONS] [FILE...]" << std::endl;
+  std::cout << "Prints the records of flight recorder dumps." << std::endl;
+  std::cout << "Available options:" << std::endl;
+  std::cout << "\t -c \t\t\t print the frames of the bus in candump log format" << std::endl;
+  std::cout << "\t -t PID|INSTANCE \t let cannelloni write a dump, an INSTANCE needs --stats" << std::endl;
+  std::cout << "\t -h \t\t\t display this help text" << std::endl;
+}
+
+/* The pid of a number or of the instance that publishes statistics under name */
+pid_t findProcess(const std::string &name) {
+  if (!name.empty() && std::all_of(name.begin(), name.end(), ::isdigit))
+    return atoi(name.c_str());
+  auto header = std::make_unique<StatsHeader>();
+  if (!StatsSegment::isValidInstance(name) || !StatsSegment::read(STATS_PATH_PREFIX + name, *header))
+    return 0;
+  return header->pid;
+}
+
+void printRecord(const FlightDumpHeader &header, const FlightRecord &record, bool candump) {
+  uint64_t time = record.time + header.realtimeOffset;
+  printf("(%llu.%06llu) ", static_cast<unsigned long long>(time / 1000000000),
+         static_cast<unsigned long long>(time % 1000000000 / 1000));
+  if (candump)
+    printf("%s ", header.interface);
+  else
+    printf("%-8s ", flightEventName(record.event));
+  if (record.can_id & CAN_EFF_FLAG)
+    printf("%08X", record.can_id & CAN_EFF_MASK);
+  else if (record.can_id & CAN_ERR_FLAG)
+    printf("%08X", record.can_id & (CAN_ERR_MASK | CAN_ERR_FLAG));
+  else
+    printf("%03X", record.can_id & CAN_SFF_MASK);
+
+  bool fd = record.len & CANFD_FRAME;
+  uint8_t len = record.len & ~CANFD_FRAME;
+  uint8_t kept = std::min<uint8_t>(len, FLIGHT_RECORD_DATA);
+  if (candump) {
+    if (fd)
+      printf("##%X", record.flags & 0xf);
+    else
+      printf("#");
+    if (record.can_id & CAN_RTR_FLAG) {
+      printf("R");
+    } else {
+      for (uint8_t i = 0; i < kept; i++)
+        printf("%02X", record.data[i]);
+    }
+  } else {
+    printf("%s [%u] ", fd ? " FD" : "   ", len);
+    if (record.can_id & CAN_RTR_FLAG) {
+      printf(" REMOTE");
+    } else {
+      for (uint8_t i = 0; i < kept; i++)
+        printf(" %02X", record.data[i]);
+      if (kept < len)
+        printf(" ...");
+    }
+    printf("  seq %u", record.seq);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  bool candump = false;
+  std::string trigger;
+
+  while ((opt = getopt(argc, argv, "ct:h")) != -1) {
+    switch (opt) {
+      case 'c':
+        candump = true;
+        break;
+      case 't':
+        trigger = optarg;
+        break;
+      case 'h':
+        printUsage();
+        return 0;
+      default:
+        printUsage();
+        return -1;
+    }
+  }
+  if (trigger.empty() && optind >= argc) {
+    printUsage();
+    return -1;
+  }
+
+  if (!trigger.empty()) {
+    pid_t pid = findProcess(trigger);
+    if (pid <= 0 || kill(pid, SIGUSR1) != 0) {
+      std::cerr << "Could not signal " << trigger << std::endl;
+      return 1;
+    }
+    std::cout << "Asked process " << pid << " for a dump" << std::endl;
+  }
+
+  int result = 0;
+  for (int i = optind; i < argc; i++) {
+    FlightDumpHeader header;
+    std::vector<FlightRecord> records;
+    if (!FlightRecorder::read(argv[i], header, records)) {
+      std::cerr << "Could not read flight recorder dump " << argv[i] << std::endl;
+      result = 1;
+      continue;
+    }
+    for (const FlightRecord &record : records) {
+      /* A candump log only has the frames of the bus */
+      if (candump && record.event != FLIGHT_CAN_RX && record.event != FLIGHT_CAN_TX)
+        continue;
+      printRecord(header, record, candump);
+    }
+  }
+  return result;
+}
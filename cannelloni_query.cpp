@@ -0,0 +1,202 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "recorder.h"
+
+/* Extracts frames from the segments written with --record */
+
+using namespace cannelloni;
+
+void printUsage() {
+  std::cout << "Usage: cannelloni-query [OPTIONS] PATH..." << std::endl;
+  std::cout << "PATH is a segment or a directory with segments." << std::endl;
+  std::cout << "Available options:" << std::endl;
+  std::cout << "\t -f TIME \t only frames at or after TIME (seconds since the epoch, e.g. 1700000000.25)" << std::endl;
+  std::cout << "\t -t TIME \t only frames at or before TIME" << std::endl;
+  std::cout << "\t -i LIST \t only frames with these IDs, e.g. 0x100,0x200-0x2ff" << std::endl;
+  std::cout << "\t -c \t\t print the frames in candump log format" << std::endl;
+  std::cout << "\t -s \t\t print a summary of each segment instead of the frames" << std::endl;
+  std::cout << "\t -v \t\t print the number of frames and the time the query took" << std::endl;
+  std::cout << "\t -h \t\t display this help text" << std::endl;
+}
+
+bool parseTime(const char *text, uint64_t &time) {
+  char *end;
+  long double seconds = strtold(text, &end);
+  if (end == text || *end != '\0' || seconds < 0)
+    return false;
+  time = static_cast<uint64_t>(seconds * 1000000000.0L);
+  return true;
+}
+
+void printTime(uint64_t time) {
+  printf("(%llu.%06llu)", static_cast<unsigned long long>(time / 1000000000),
+         static_cast<unsigned long long>(time % 1000000000 / 1000));
+}
+
+void printFrame(const RecordingHeader &header, const RecordedFrame &frame, bool candump) {
+  printTime(frame.time);
+  if (candump)
+    printf(" %s ", header.instance);
+  else
+    printf(" %-14s ", recordSourceName(frame.source));
+  if (frame.can_id & CAN_EFF_FLAG)
+    printf("%08X", frame.can_id & CAN_EFF_MASK);
+  else if (frame.can_id & CAN_ERR_FLAG)
+    printf("%08X", frame.can_id & (CAN_ERR_MASK | CAN_ERR_FLAG));
+  else
+    printf("%03X", frame.can_id & CAN_SFF_MASK);
+
+  bool fd = frame.len & CANFD_FRAME;
+  uint8_t len = std::min<uint8_t>(frame.len & ~CANFD_FRAME, CANFD_MAX_DLEN);
+  if (candump) {
+    if (fd)
+      printf("##%X", frame.flags & 0xf);
+    else
+      printf("#");
+    if (frame.can_id & CAN_RTR_FLAG) {
+      printf("R");
+    } else {
+      for (uint8_t i = 0; i < len; i++)
+        printf("%02X", frame.data[i]);
+    }
+  } else {
+    printf("%s [%u]", fd ? " FD" : "   ", len);
+    if (frame.can_id & CAN_RTR_FLAG) {
+      printf(" REMOTE");
+    } else {
+      for (uint8_t i = 0; i < len; i++)
+        printf(" %02X", frame.data[i]);
+    }
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  uint64_t from = 0;
+  uint64_t to = UINT64_MAX;
+  IdSet ids;
+  bool candump = false;
+  bool summary = false;
+  bool verbose = false;
+
+  while ((opt = getopt(argc, argv, "f:t:i:csvh")) != -1) {
+    switch (opt) {
+      case 'f':
+      case 't':
+        if (!parseTime(optarg, opt == 'f' ? from : to)) {
+          std::cout << "Usage Error: " << std::endl << "-" << static_cast<char>(opt)
+                    << " expects seconds since the epoch" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case 'i':
+        if (!ids.parse(optarg)) {
+          std::cout << "Usage Error: " << std::endl
+                    << "-i expects a list of IDs and ranges, e.g. 0x100,0x200-0x2ff" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case 'c':
+        candump = true;
+        break;
+      case 's':
+        summary = true;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      case 'h':
+        printUsage();
+        return 0;
+      default:
+        printUsage();
+        return -1;
+    }
+  }
+  if (optind >= argc) {
+    printUsage();
+    return -1;
+  }
+
+  std::vector<std::string> paths;
+  for (int i = optind; i < argc; i++) {
+    struct stat st;
+    if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+      std::vector<std::string> segments = listRecordings(argv[i]);
+      paths.insert(paths.end(), segments.begin(), segments.end());
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  int result = 0;
+  uint64_t matches = 0;
+  for (const std::string &path : paths) {
+    RecordingReader reader;
+    if (!reader.open(path)) {
+      std::cerr << "Could not read recording segment " << path << std::endl;
+      result = 1;
+      continue;
+    }
+    const RecordingHeader &header = reader.header();
+    if (summary) {
+      uint64_t count = header.count.load(std::memory_order_acquire);
+      printf("%s %s frames: %llu ", path.c_str(), header.instance, static_cast<unsigned long long>(count));
+      if (count) {
+        printTime(header.firstTime);
+        printf(" - ");
+        printTime(header.lastTime);
+      }
+      printf("%s\n", header.complete.load(std::memory_order_acquire) ? "" : " (being written)");
+      continue;
+    }
+    /* Segments only hold frames from their first to their last time */
+    uint64_t count = header.count.load(std::memory_order_acquire);
+    if (count && header.complete.load(std::memory_order_acquire) &&
+        (header.lastTime < from || header.firstTime > to))
+      continue;
+    matches += reader.query(from, to, ids, [&header, candump](const RecordedFrame &frame) {
+      printFrame(header, frame, candump);
+    });
+  }
+  fflush(stdout);
+  if (verbose) {
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    std::cerr << matches << " frames from " << paths.size() << " segments in "
+              << elapsed.count() / 1000.0 << " ms" << std::endl;
+  }
+  return result;
+}
@@ -0,0 +1,175 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <dirent.h>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <signal.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "statsegment.h"
+
+/* Prints the live statistics of a cannelloni instance, see --stats */
+
+using namespace cannelloni;
+
+void printUsage() {
+  std::cout << "Usage: cannelloni-stat [OPTIONS] [INSTANCE]" << std::endl;
+  std::cout << "Without INSTANCE the running instances are listed." << std::endl;
+  std::cout << "Available options:" << std::endl;
+  std::cout << "\t -i MS \t\t refresh interval in ms, default: 1000" << std::endl;
+  std::cout << "\t -n COUNT \t exit after COUNT refreshes, default: run until interrupted" << std::endl;
+  std::cout << "\t -z \t\t hide samples that are zero" << std::endl;
+  std::cout << "\t -h \t\t display this help text" << std::endl;
+}
+
+/* The instance names of all segments in /dev/shm */
+std::vector<std::string> listInstances() {
+  std::vector<std::string> instances;
+  std::string prefix = STATS_PATH_PREFIX;
+  std::string directory = prefix.substr(0, prefix.find_last_of('/') + 1);
+  std::string filePrefix = prefix.substr(directory.size());
+  DIR *dir = opendir(directory.c_str());
+  if (!dir)
+    return instances;
+  while (struct dirent *entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name.compare(0, filePrefix.size(), filePrefix) == 0 && name.size() > filePrefix.size())
+      instances.push_back(name.substr(filePrefix.size()));
+  }
+  closedir(dir);
+  std::sort(instances.begin(), instances.end());
+  return instances;
+}
+
+bool isAlive(const StatsHeader &header) {
+  return kill(header.pid, 0) == 0;
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  uint64_t interval = 1000;
+  uint64_t refreshes = 0;
+  bool hideZero = false;
+
+  while ((opt = getopt(argc, argv, "i:n:zh")) != -1) {
+    switch (opt) {
+      case 'i':
+        interval = strtoull(optarg, NULL, 10);
+        if (interval == 0) {
+          std::cout << "Usage Error: " << std::endl << "-i expects an interval > 0" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case 'n':
+        refreshes = strtoull(optarg, NULL, 10);
+        break;
+      case 'z':
+        hideZero = true;
+        break;
+      case 'h':
+        printUsage();
+        return 0;
+      default:
+        printUsage();
+        return -1;
+    }
+  }
+
+  auto snapshot = std::make_unique<StatsHeader>();
+  if (optind >= argc) {
+    std::vector<std::string> instances = listInstances();
+    if (instances.empty()) {
+      std::cout << "No instance publishes statistics, start cannelloni with --stats" << std::endl;
+      return 1;
+    }
+    for (const std::string &instance : instances) {
+      std::cout << std::left << std::setw(24) << instance << std::right;
+      if (StatsSegment::read(STATS_PATH_PREFIX + instance, *snapshot))
+        std::cout << " pid " << snapshot->pid << (isAlive(*snapshot) ? "" : " (exited)");
+      else
+        std::cout << " (unreadable)";
+      std::cout << std::endl;
+    }
+    return 0;
+  }
+
+  std::string path = STATS_PATH_PREFIX + std::string(argv[optind]);
+  bool clearScreen = isatty(STDOUT_FILENO);
+  /* The counters of the previous refresh, for rates */
+  std::map<std::string, uint64_t> previous;
+  std::map<std::string, double> rates;
+  uint64_t previousUpdate = 0;
+
+  for (uint64_t refresh = 0; refreshes == 0 || refresh < refreshes; refresh++) {
+    if (refresh > 0)
+      usleep(interval * 1000);
+    if (!StatsSegment::read(path, *snapshot)) {
+      std::cerr << "Could not read " << path << std::endl;
+      return 1;
+    }
+    /* Rates are computed per update of the writer, not per refresh */
+    if (snapshot->updated != previousUpdate) {
+      double elapsed = (snapshot->updated - previousUpdate) / 1e9;
+      rates.clear();
+      for (uint32_t i = 0; i < snapshot->count; i++) {
+        const StatsEntry &entry = snapshot->entries[i];
+        auto last = previous.find(entry.name);
+        if (entry.type == METRIC_COUNTER && previousUpdate != 0 && last != previous.end() &&
+            entry.value >= last->second)
+          rates[entry.name] = (entry.value - last->second) / elapsed;
+      }
+      previous.clear();
+      for (uint32_t i = 0; i < snapshot->count; i++)
+        previous[snapshot->entries[i].name] = snapshot->entries[i].value;
+      previousUpdate = snapshot->updated;
+    }
+
+    if (clearScreen)
+      std::cout << "\033[H\033[2J";
+    std::cout << "cannelloni " << snapshot->instance << " pid " << snapshot->pid
+              << (isAlive(*snapshot) ? "" : " (exited)") << " up "
+              << (snapshot->updated - snapshot->started) / 1000000000 << "s" << std::endl
+              << std::endl;
+    std::cout << std::setw(16) << "VALUE" << std::setw(14) << "RATE/s" << "  NAME" << std::endl;
+    for (uint32_t i = 0; i < snapshot->count; i++) {
+      const StatsEntry &entry = snapshot->entries[i];
+      if (hideZero && entry.value == 0)
+        continue;
+      std::cout << std::setw(16) << entry.value << std::setw(14);
+      auto rate = rates.find(entry.name);
+      if (rate != rates.end())
+        std::cout << std::fixed << std::setprecision(1) << rate->second;
+      else
+        std::cout << "";
+      std::cout << "  " << entry.name << std::endl;
+    }
+    std::cout << std::flush;
+  }
+  return 0;
+}
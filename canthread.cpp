@@ -18,7 +18,10 @@
  *
  */
 
+#include <algorithm>
+#include <chrono>
 #include <string.h>
+#include <vector>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -27,6 +30,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 
 #include <linux/can/raw.h>
 #include <net/if.h>
@@ -42,9 +46,11 @@ CANThread::CANThread(const struct debugOptions_t &debugOptions, const std::strin
   : ConnectionThread()
   , m_canSocket(0)
   , m_canfd(false)
+  , m_bcmOffload(false)
+  , m_recordQueue(NULL)
+  , m_latencyConfig{ /* enabled */ false, /* ids */ IdSet() }
   , m_canInterfaceName(canInterfaceName)
-  , m_rxCount(0)
-  , m_txCount(0)
+  , m_echoCount(0)
 {
   memcpy(&m_debugOptions, &debugOptions, sizeof(struct debugOptions_t));
 }
@@ -88,11 +94,48 @@ int CANThread::start() {
     lerror << "CAN_FD is not supported on >" << m_canInterfaceName << "<" << std::endl;
   }
 
+  /*
+   * Frames we write must not be read back and sent to the remote again,
+   * but other programs on this host should see them
+   */
+  int recvOwnMsgs = 0;
+  int loopback = 1;
+  if (setsockopt(m_canSocket, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &recvOwnMsgs, sizeof(recvOwnMsgs)) < 0 ||
+      setsockopt(m_canSocket, SOL_CAN_RAW, CAN_RAW_LOOPBACK, &loopback, sizeof(loopback)) < 0) {
+    lerror << "Could not set up loopback on >" << m_canInterfaceName << "<" << std::endl;
+    return -1;
+  }
+
+  if (m_filter.isEnabled()) {
+    if (!m_filter.apply(m_canSocket, m_canInterfaceName)) {
+      lerror << "Could not set CAN filters on >" << m_canInterfaceName << "<" << std::endl;
+      return -1;
+    }
+    if (!m_filter.isKernelOnly())
+      lwarn << "The kernel can't apply all CAN filters, deny rules are checked by cannelloni" << std::endl;
+  }
+
+  if (m_latencyConfig.enabled) {
+    int timestamps = 1;
+    if (setsockopt(m_canSocket, SOL_SOCKET, SO_TIMESTAMPNS, &timestamps, sizeof(timestamps)) < 0)
+      lwarn << "Could not enable receive timestamps, frames are stamped when they are read" << std::endl;
+  }
+
   if (bind(m_canSocket, (struct sockaddr *)&localAddr, sizeof(localAddr)) < 0) {
     lerror << "Could not bind to interface" << std::endl;
     return -1;
   }
 
+  if (m_bcmOffload && !m_bcm.open(m_canInterfaceName)) {
+    lerror << "Could not open CAN_BCM socket on >" << m_canInterfaceName << "<" << std::endl;
+    return -1;
+  }
+
+  if (m_replay.isEnabled() && !m_replay.open()) {
+    lerror << "Could not open the recording to replay" << std::endl;
+    return -1;
+  }
+
   return Thread::start();
 }
 
@@ -108,14 +151,30 @@ void CANThread::run() {
   linfo << "CANThread up and running" << std::endl;
 
   m_timer.adjust(CAN_TIMEOUT, CAN_TIMEOUT);
+  m_regenerateTimer.disable();
+  m_rateLimitTimer.disable();
+  if (m_bcm.isOpen())
+    m_bcmTimer.adjust(CYCLE_CHECK_INTERVAL, CYCLE_CHECK_INTERVAL);
+  else
+    m_bcmTimer.disable();
+  if (m_replay.isEnabled())
+    m_replayTimer.adjust(REPLAY_RETRY_INTERVAL, 1);
+  else
+    m_replayTimer.disable();
 
   while (m_started) {
     /* Prepare readfds */
     FD_ZERO(&readfds);
     FD_SET(m_canSocket, &readfds);
     FD_SET(m_timer.getFd(), &readfds);
+    FD_SET(m_regenerateTimer.getFd(), &readfds);
+    FD_SET(m_rateLimitTimer.getFd(), &readfds);
+    FD_SET(m_replayTimer.getFd(), &readfds);
+    FD_SET(m_bcmTimer.getFd(), &readfds);
 
-    int ret = select(std::max(m_canSocket,m_timer.getFd())+1, &readfds, NULL, NULL, NULL);
+    int ret = select(std::max({m_canSocket, m_timer.getFd(), m_regenerateTimer.getFd(),
+                               m_rateLimitTimer.getFd(), m_replayTimer.getFd(), m_bcmTimer.getFd()})+1,
+                     &readfds, NULL, NULL, NULL);
     if (ret < 0) {
       lerror << "select error" << std::endl;
       break;
@@ -125,38 +184,114 @@ void CANThread::run() {
         /* We transmit our buffer */
         if (m_frameBuffer->getFrameBufferSize())
           transmitBuffer();
+        /* Frames written from the network start a new period */
+        if (m_regenerator.isEnabled())
+          scheduleRegeneration();
       }
     }
+    if (FD_ISSET(m_regenerateTimer.getFd(), &readfds)) {
+      m_regenerateTimer.read();
+      regenerateFrames();
+    }
+    if (FD_ISSET(m_rateLimitTimer.getFd(), &readfds)) {
+      m_rateLimitTimer.read();
+      releaseRateLimited();
+    }
+    if (FD_ISSET(m_replayTimer.getFd(), &readfds)) {
+      m_replayTimer.read();
+      replayFrames();
+    }
+    if (FD_ISSET(m_bcmTimer.getFd(), &readfds)) {
+      m_bcmTimer.read();
+      m_bcm.expire(std::chrono::steady_clock::now());
+    }
     if (FD_ISSET(m_canSocket, &readfds)) {
-      /* Request frame from frameBuffer */
-      struct canfd_frame *frame = m_peerThread->getFrameBuffer()->requestFrame(true, m_debugOptions.buffer);
-      if (frame == NULL) {
-        continue;
-      }
-      receivedBytes = recv(m_canSocket, frame, sizeof(struct canfd_frame), 0);
+      /*
+       * The frame is read and filtered on the stack, only a frame that is
+       * forwarded takes one of the pool, which may evict a buffered frame
+       */
+      BufferedFrame received;
+      struct canfd_frame *frame = &received.frame;
+      clearFrameMetadata(frame);
+      receivedBytes = readFrame(frame);
       if (receivedBytes < 0) {
         if (errno == EWOULDBLOCK || errno == EAGAIN) {
           /* Timeout occurred */
-          m_peerThread->getFrameBuffer()->insertFramePool(frame);
           continue;
         } else {
-          m_peerThread->getFrameBuffer()->insertFramePool(frame);
+          m_readErrors.add();
           lerror << "CAN read error" << std::endl;
           break;
         }
       } else if (receivedBytes == CAN_MTU || receivedBytes == CANFD_MTU) {
-        m_rxCount++;
+        m_rxCount.add();
+        m_rxBytes.add(canfd_len(frame));
+        if (m_stages.isEnabled())
+          frameStageTime(frame) = monotonicNow();
         /* If it is a CAN FD frame, encode this in len */
         if (receivedBytes == CANFD_MTU) {
           frame->len |= CANFD_FRAME;
         } else {
           frame->len &= ~(CANFD_FRAME);
         }
+        if (m_flight.isEnabled())
+          m_flight.record(FLIGHT_CAN_RX, frame, m_rxCount.get());
+        if (!m_filter.pass(frame)) {
+          if (m_flight.isEnabled())
+            m_flight.record(FLIGHT_FILTERED, frame, m_rxCount.get());
+          continue;
+        }
+        /* The remote sends these frames, see bcmoffload.h */
+        if (m_bcm.isOpen() && m_bcm.isScheduled(*frame)) {
+          m_echoCount++;
+          continue;
+        }
+        if (m_changeFilter.isEnabled() &&
+            !m_changeFilter.pass(frame, std::chrono::steady_clock::now())) {
+          if (m_flight.isEnabled())
+            m_flight.record(FLIGHT_FILTERED, frame, m_rxCount.get());
+          continue;
+        }
+        if (m_rateLimiter.isEnabled()) {
+          RateLimiter::Result result = m_rateLimiter.admit(frame, std::chrono::steady_clock::now());
+          if (result != RateLimiter::RATE_PASS) {
+            if (m_flight.isEnabled())
+              m_flight.record(FLIGHT_FILTERED, frame, m_rxCount.get());
+            /* A held frame is sent later, a newer one has to be compared against it */
+            if (result == RateLimiter::RATE_HOLD && m_changeFilter.isEnabled())
+              m_changeFilter.commit(frame, std::chrono::steady_clock::now());
+            if (result == RateLimiter::RATE_HOLD && !m_rateLimitTimer.isEnabled())
+              releaseRateLimited();
+            continue;
+          }
+        }
+        if (m_stages.isEnabled()) {
+          uint64_t now = monotonicNow();
+          m_stages.add(STAGE_FILTER, frameStageTime(frame), now);
+          frameStageTime(frame) = now;
+        }
+        struct canfd_frame *pooled = m_peerThread->getFrameBuffer()->requestFrame(true, m_debugOptions.buffer);
+        if (pooled == NULL) {
+          /* All frames are on their way to the remote */
+          continue;
+        }
+        *reinterpret_cast<BufferedFrame*>(pooled) = received;
+        frame = pooled;
+        if (m_stages.isEnabled()) {
+          uint64_t now = monotonicNow();
+          m_stages.add(STAGE_POOL, frameStageTime(frame), now);
+          frameStageTime(frame) = now;
+        }
+        /* Only a frame that is sent counts as the last one of its ID, see changefilter.h */
+        if (m_changeFilter.isEnabled())
+          m_changeFilter.commit(frame, std::chrono::steady_clock::now());
+        if (m_recordQueue)
+          m_recordQueue->push(frame, RECORD_CAN_TO_NETWORK);
         if (m_peerThread != NULL) {
           m_peerThread->transmitFrame(frame);
         }
         if (m_debugOptions.can) {
-          printCANInfo(frame);
+          m_frameDebug.log(frame);
         }
       } else {
         lwarn << "Incomplete/Invalid CAN frame" << std::endl;
@@ -166,7 +301,42 @@ void CANThread::run() {
   if (m_debugOptions.buffer) {
     m_frameBuffer->debug();
   }
-  linfo << "Shutting down. CAN Transmission Summary: TX: " << m_txCount << " RX: " << m_rxCount << std::endl;
+  linfo << "Shutting down. CAN Transmission Summary: TX: " << m_txCount.get() << " RX: " << m_rxCount.get() << std::endl;
+  if (m_filter.isEnabled()) {
+    uint64_t interfaceCount = m_filter.getInterfaceCount();
+    linfo << "Filter Summary: Interface RX: " << interfaceCount
+          << " Read: " << m_rxCount.get()
+          << " Dropped by kernel: " << (interfaceCount > m_rxCount.get() ? interfaceCount - m_rxCount.get() : 0)
+          << " Denied: " << m_filter.getDeniedCount() << std::endl;
+  }
+  if (m_changeFilter.isEnabled()) {
+    linfo << "On-change Summary: Passed: " << m_changeFilter.getPassedCount()
+          << " Suppressed: " << m_changeFilter.getSuppressedCount() << " "
+          << m_changeFilter.summary(CHANGE_SUMMARY_IDS) << std::endl;
+  }
+  if (m_rateLimiter.isEnabled())
+    linfo << "Rate Limit Summary: " << m_rateLimiter.summary(std::chrono::steady_clock::now()) << std::endl;
+  if (m_regenerator.isEnabled())
+    linfo << "Regenerate Summary: Regenerated: " << m_regenerator.getRegeneratedCount()
+          << " Timed out: " << m_regenerator.getExpiredCount() << std::endl;
+  /* A finished replay was summarized already */
+  if (m_replay.isEnabled() && !m_replay.isDone())
+    linfo << "Replay Summary: " << m_replay.summary(monotonicNow()) << std::endl;
+  if (m_inboundLatency.getTotal().getCount() > 0) {
+    linfo << "Latency Summary: Remote CAN RX to CAN TX: " << m_inboundLatency.getTotal().summary() << std::endl;
+    for (const auto &line : m_inboundLatency.idSummaries())
+      linfo << "Latency Summary: " << line << std::endl;
+    if (m_inboundLatency.getNegativeCount() > 0)
+      lwarn << "Latency Summary: " << m_inboundLatency.getNegativeCount()
+            << " frames were received before they were sent, the clocks are not synchronized" << std::endl;
+  }
+  if (m_bcm.isOpen()) {
+    linfo << "BCM Summary: Setups: " << m_bcm.getSetupCount()
+          << " Updates: " << m_bcm.getUpdateCount()
+          << " Deletes: " << m_bcm.getDeleteCount()
+          << " Echoes: " << m_echoCount << std::endl;
+    m_bcm.close();
+  }
   shutdown(m_canSocket, SHUT_RDWR);
   close(m_canSocket);
 }
@@ -176,6 +346,93 @@ void CANThread::transmitFrame(canfd_frame* frame) {
   fireTimer();
 }
 
+void CANThread::registerMetrics(MetricsRegistry &registry) {
+  registry.add("cannelloni_can_frames_total", "Frames read from and written to the bus", METRIC_COUNTER,
+               "direction=\"rx\"", m_rxCount);
+  registry.add("cannelloni_can_frames_total", "Frames read from and written to the bus", METRIC_COUNTER,
+               "direction=\"tx\"", m_txCount);
+  registry.add("cannelloni_can_bytes_total", "Payload bytes read from and written to the bus", METRIC_COUNTER,
+               "direction=\"rx\"", m_rxBytes);
+  registry.add("cannelloni_can_bytes_total", "Payload bytes read from and written to the bus", METRIC_COUNTER,
+               "direction=\"tx\"", m_txBytes);
+  registry.add("cannelloni_socket_errors_total", "Failed socket operations", METRIC_COUNTER,
+               "socket=\"can\",op=\"read\"", m_readErrors);
+  registry.add("cannelloni_socket_errors_total", "Failed socket operations", METRIC_COUNTER,
+               "socket=\"can\",op=\"write\"", m_writeErrors);
+}
+
+void CANThread::transmitCycle(const canfd_frame &frame, uint32_t interval) {
+  if (m_canfd || !(frame.len & CANFD_FRAME))
+    m_bcm.schedule(frame, interval, std::chrono::steady_clock::now());
+}
+
+void CANThread::resetCycles() {
+  m_bcm.clear();
+}
+
+void CANThread::setChangeFilter(const ChangeFilterConfig &config) {
+  m_changeFilter.setup(config);
+}
+
+void CANThread::setRegeneration(const std::vector<RegenerateConfig> &config) {
+  m_regenerator.setup(config);
+}
+
+void CANThread::setFilter(const CANFilterConfig &config) {
+  m_filter.setup(config);
+}
+
+void CANThread::setRateLimits(const std::vector<RateLimitRule> &rules) {
+  m_rateLimiter.setup(rules, std::chrono::steady_clock::now());
+}
+
+void CANThread::setBcmOffload(bool enabled) {
+  m_bcmOffload = enabled;
+}
+
+void CANThread::setLatency(const LatencyConfig &config) {
+  m_latencyConfig = config;
+  m_inboundLatency.setIds(config.ids);
+}
+
+void CANThread::setRecorder(RecordQueue *queue) {
+  m_recordQueue = queue;
+}
+
+void CANThread::setReplay(const ReplayConfig &config) {
+  m_replay.setup(config);
+}
+
+ssize_t CANThread::readFrame(canfd_frame *frame) {
+  if (!m_latencyConfig.enabled)
+    return recv(m_canSocket, frame, sizeof(struct canfd_frame), 0);
+  struct iovec iov;
+  iov.iov_base = frame;
+  iov.iov_len = sizeof(struct canfd_frame);
+  uint8_t control[CMSG_SPACE(sizeof(struct timespec))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t receivedBytes = recvmsg(m_canSocket, &msg, 0);
+  if (receivedBytes < 0)
+    return receivedBytes;
+  uint64_t timestamp = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPNS) {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      timestamp = static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+  }
+  if (timestamp && m_stages.isEnabled())
+    m_stages.add(STAGE_CAN_READ, timestamp, realtimeNow());
+  frameTimestamp(frame) = timestamp ? timestamp : realtimeNow();
+  return receivedBytes;
+}
+
 void CANThread::transmitBuffer() {
   ssize_t transmittedBytes = 0;
   /* Loop here until buffer is empty or we cannot write anymore */
@@ -184,6 +441,12 @@ void CANThread::transmitBuffer() {
     bool frameIsCANFD = false;
     if (frame == NULL)
       break;
+    /* The frame replaces the payload of a running cycle, see bcmoffload.h */
+    if (m_bcm.isOpen() && m_bcm.update(*frame)) {
+      m_frameBuffer->insertFramePool(frame);
+      continue;
+    }
+    uint64_t attempt = m_stages.isEnabled() ? monotonicNow() : 0;
     /* Check whether we are operating on a CAN FD socket */
     if (m_canfd) {
       if (frame->len & CANFD_FRAME) {
@@ -209,14 +472,47 @@ void CANThread::transmitBuffer() {
       }
     }
     if (transmittedBytes == CANFD_MTU || transmittedBytes == CAN_MTU) {
+      if (m_regenerator.isEnabled()) {
+        canfd_frame written = *frame;
+        if (frameIsCANFD)
+          written.len |= CANFD_FRAME;
+        m_regenerator.update(&written, std::chrono::steady_clock::now());
+      }
+      uint64_t received = frameTimestamp(frame);
+      if (m_latencyConfig.enabled && received)
+        m_inboundLatency.add(frame, static_cast<int64_t>(realtimeNow() - received) / 1000);
+      if (attempt) {
+        uint64_t now = monotonicNow();
+        if (frameWriteRetried(frame)) {
+          m_stages.add(STAGE_CAN_WRITE, frameStageTime(frame), now);
+        } else {
+          m_stages.add(STAGE_CAN_QUEUE, frameStageTime(frame), attempt);
+          m_stages.add(STAGE_CAN_WRITE, attempt, now);
+        }
+      }
+      m_txBytes.add(canfd_len(frame));
+      /* The frame goes back to the pool, keep CAN FD in len for the records */
+      if (frameIsCANFD)
+        frame->len |= CANFD_FRAME;
+      if (m_flight.isEnabled())
+        m_flight.record(FLIGHT_CAN_TX, frame, m_txCount.get());
+      if (m_recordQueue)
+        m_recordQueue->push(frame, RECORD_NETWORK_TO_CAN);
       /* Put frame back into pool */
       m_frameBuffer->insertFramePool(frame);
-      m_txCount++;
+      m_txCount.add();
     } else {
       /* If it was a CAN FD frame, encode this in len again before putting it back into buffer */
       if (frameIsCANFD) {
         frame->len |= CANFD_FRAME;
       }
+      /* The write stage of a retried frame starts with the first attempt */
+      if (attempt && !frameWriteRetried(frame)) {
+        m_stages.add(STAGE_CAN_QUEUE, frameStageTime(frame), attempt);
+        frameStageTime(frame) = attempt;
+        frameWriteRetried(frame) = true;
+      }
+      m_writeErrors.add();
       /* Put frame back into buffer */
       m_frameBuffer->returnFrame(frame);
       /* Revisit this function after 25 us */
@@ -228,7 +524,107 @@ void CANThread::transmitBuffer() {
   }
 }
 
+void CANThread::regenerateFrames() {
+  std::vector<canfd_frame> frames;
+  m_regenerator.due(std::chrono::steady_clock::now(), frames);
+  for (canfd_frame &frame : frames) {
+    size_t mtu = (frame.len & CANFD_FRAME) ? CANFD_MTU : CAN_MTU;
+    if (mtu == CANFD_MTU && !m_canfd)
+      continue;
+    frame.len &= ~(CANFD_FRAME);
+    /* A frame that can't be written now is left out, the next one follows a period later */
+    if (write(m_canSocket, &frame, mtu) == static_cast<ssize_t>(mtu)) {
+      m_txCount.add();
+      m_txBytes.add(canfd_len(&frame));
+    }
+  }
+  scheduleRegeneration();
+}
+
+void CANThread::scheduleRegeneration() {
+  uint64_t timeout = m_regenerator.nextTimeout(std::chrono::steady_clock::now());
+  if (timeout > 0) {
+    m_regenerateTimer.adjust(timeout, timeout);
+  } else {
+    m_regenerateTimer.disable();
+  }
+}
+
 void CANThread::fireTimer() {
   /* Instant expiry (so 1us) */
   m_timer.adjust(CAN_TIMEOUT, 1);
 }
+
+void CANThread::releaseRateLimited() {
+  auto now = std::chrono::steady_clock::now();
+  std::vector<canfd_frame> frames;
+  m_rateLimiter.due(now, frames);
+  for (const canfd_frame &held : frames) {
+    canfd_frame *frame = m_peerThread->getFrameBuffer()->requestFrame(true, m_debugOptions.buffer);
+    if (frame == NULL)
+      break;
+    *frame = held;
+    if (m_stages.isEnabled())
+      frameStageTime(frame) = monotonicNow();
+    if (m_recordQueue)
+      m_recordQueue->push(frame, RECORD_CAN_TO_NETWORK);
+    m_peerThread->transmitFrame(frame);
+  }
+  uint64_t timeout = m_rateLimiter.nextTimeout(now);
+  if (timeout) {
+    m_rateLimitTimer.adjust(timeout, timeout);
+  } else {
+    m_rateLimitTimer.disable();
+  }
+}
+
+void CANThread::replayFrames() {
+  bool toNetwork = m_replay.getTarget() == REPLAY_NETWORK;
+  FrameBuffer *buffer = toNetwork ? m_peerThread->getFrameBuffer() : m_frameBuffer;
+  Replayer::Result result = Replayer::REPLAY_DONE;
+  uint64_t wait = 0;
+  for (int i = 0; i < REPLAY_BATCH; i++) {
+    uint64_t now = monotonicNow();
+    result = m_replay.poll(now, wait);
+    if (result != Replayer::REPLAY_DUE)
+      break;
+    /* Leave room for the frames of the bus and the remote */
+    canfd_frame *frame = NULL;
+    if (buffer->availableFrames() > SPILL_POOL_RESERVE)
+      frame = buffer->requestFrame(false, m_debugOptions.buffer);
+    if (frame == NULL) {
+      m_replay.stalled();
+      wait = REPLAY_RETRY_INTERVAL;
+      break;
+    }
+    const RecordedFrame &recorded = m_replay.pending();
+    frame->can_id = recorded.can_id;
+    frame->len = recorded.len;
+    frame->flags = recorded.flags;
+    memcpy(frame->data, recorded.data, sizeof(frame->data));
+    m_replay.injected(now);
+    if (toNetwork) {
+      /* The frames take the path of frames read from the bus, past the filters */
+      frameTimestamp(frame) = realtimeNow();
+      if (m_stages.isEnabled())
+        frameStageTime(frame) = monotonicNow();
+      if (m_recordQueue)
+        m_recordQueue->push(frame, RECORD_CAN_TO_NETWORK);
+      m_peerThread->transmitFrame(frame);
+    } else {
+      m_frameBuffer->insertFrame(frame);
+    }
+  }
+  if (!toNetwork && m_frameBuffer->getFrameBufferSize())
+    transmitBuffer();
+
+  if (result == Replayer::REPLAY_DONE) {
+    m_replayTimer.disable();
+    linfo << "Replay Summary: " << m_replay.summary(monotonicNow()) << std::endl;
+    return;
+  }
+  /* The batch is full, continue right after the bus was served */
+  if (wait == 0)
+    wait = 1;
+  m_replayTimer.adjust(wait, wait);
+}
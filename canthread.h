@@ -23,12 +23,21 @@
 #include <string>
 #include <stdint.h>
 
+#include "bcmoffload.h"
+#include "canfilter.h"
+#include "changefilter.h"
 #include "connection.h"
+#include "latency.h"
+#include "ratelimit.h"
+#include "recorder.h"
+#include "replay.h"
 #include "timer.h"
 
 namespace cannelloni {
 
 #define CAN_TIMEOUT 2000000 /* 2 sec in us */
+/* IDs listed in the on-change summary */
+#define CHANGE_SUMMARY_IDS 10
 
 class CANThread : public ConnectionThread {
   public:
@@ -40,22 +49,75 @@ class CANThread : public ConnectionThread {
     virtual void run();
 
     virtual void transmitFrame(canfd_frame *frame);
+    virtual void transmitCycle(const canfd_frame &frame, uint32_t interval);
+    virtual void resetCycles();
+    virtual void registerMetrics(MetricsRegistry &registry);
+
+    /* Drops unchanged frames read from the bus, must be called before start() */
+    void setChangeFilter(const ChangeFilterConfig &config);
+    /* Repeats frames written to the bus, must be called before start() */
+    void setRegeneration(const std::vector<RegenerateConfig> &config);
+    /* Rules for the frames read from the bus, must be called before start() */
+    void setFilter(const CANFilterConfig &config);
+    /* Limits the rate of frames read from the bus, must be called before start() */
+    void setRateLimits(const std::vector<RateLimitRule> &rules);
+    /* Sends cycles of the remote with CAN_BCM, must be called before start() */
+    void setBcmOffload(bool enabled);
+    /* Keeps the receive time of the frames and records their delay, must be called before start() */
+    void setLatency(const LatencyConfig &config);
+    /* Records the frames of both directions, must be called before start() */
+    void setRecorder(RecordQueue *queue);
+    /* Injects the frames of a recording, must be called before start() */
+    void setReplay(const ReplayConfig &config);
 
   private:
     void transmitBuffer();
+    /* Reads a frame and its receive time from the bus */
+    ssize_t readFrame(canfd_frame *frame);
     void fireTimer();
+    /* Writes the frames that are due and rearms m_regenerateTimer */
+    void regenerateFrames();
+    void scheduleRegeneration();
+    /* Hands held frames to the network thread and rearms m_rateLimitTimer */
+    void releaseRateLimited();
+    /* Injects the frames that are due and rearms m_replayTimer */
+    void replayFrames();
 
   private:
     struct debugOptions_t m_debugOptions;
     int m_canSocket;
     bool m_canfd;
     Timer m_timer;
+    Timer m_regenerateTimer;
+    CANFilter m_filter;
+    ChangeFilter m_changeFilter;
+    CyclicRegenerator m_regenerator;
+    Timer m_rateLimitTimer;
+    RateLimiter m_rateLimiter;
+    bool m_bcmOffload;
+    BcmScheduler m_bcm;
+    /* Deletes the CAN_BCM jobs of a remote that went silent */
+    Timer m_bcmTimer;
+    RecordQueue *m_recordQueue;
+    Timer m_replayTimer;
+    Replayer m_replay;
+    LatencyConfig m_latencyConfig;
+    /* Time from the CAN receive on the remote to the CAN send */
+    LatencyTracker m_inboundLatency;
 
     std::string m_canInterfaceName;
 
     /* Performance Counters */
-    uint64_t m_rxCount;
-    uint64_t m_txCount;
+    Metric m_rxCount;
+    Metric m_txCount;
+    /* Payload bytes */
+    Metric m_rxBytes;
+    Metric m_txBytes;
+    Metric m_readErrors;
+    /* Writes that failed and are retried, e.g. because the transmit queue is full */
+    Metric m_writeErrors;
+    /* Frames of CAN_BCM jobs read back from the bus */
+    uint64_t m_echoCount;
 };
 
 }
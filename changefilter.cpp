@@ -0,0 +1,211 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "changefilter.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+using namespace cannelloni;
+
+static inline uint64_t loadWord(const uint8_t *data) {
+  uint64_t word;
+  memcpy(&word, data, sizeof(word));
+  return word;
+}
+
+ChangeFilter::ChangeFilter()
+  : m_passedCount(0)
+  , m_suppressedCount(0)
+{
+  m_config.refreshInterval = 0;
+}
+
+void ChangeFilter::setup(const ChangeFilterConfig &config) {
+  m_config = config;
+  m_entries.clear();
+}
+
+bool ChangeFilter::isEnabled() {
+  return !m_config.ids.empty();
+}
+
+bool ChangeFilter::pass(const canfd_frame *frame, std::chrono::steady_clock::time_point now) {
+  if (!m_config.ids.contains(frame->can_id))
+    return true;
+  auto it = m_entries.find(canfd_id(frame));
+  if (it == m_entries.end())
+    return true;
+  Entry &entry = it->second;
+  if (frame->can_id == entry.canId && frame->len == entry.len &&
+      frame->flags == entry.flags &&
+      (m_config.refreshInterval == 0 ||
+       now - entry.sent < std::chrono::microseconds(m_config.refreshInterval))) {
+    uint64_t diff;
+    if (canfd_len(frame) <= CAN_MAX_DLEN) {
+      diff = (loadWord(frame->data) ^ entry.payload[0]) & entry.mask[0];
+    } else {
+      diff = 0;
+      for (size_t i = 0; i < CHANGE_FILTER_WORDS; i++)
+        diff |= (loadWord(frame->data + 8 * i) ^ entry.payload[i]) & entry.mask[i];
+    }
+    if (diff == 0) {
+      entry.suppressed++;
+      m_suppressedCount++;
+      return false;
+    }
+  }
+  return true;
+}
+
+void ChangeFilter::commit(const canfd_frame *frame, std::chrono::steady_clock::time_point now) {
+  if (!m_config.ids.contains(frame->can_id))
+    return;
+  Entry &entry = m_entries[canfd_id(frame)];
+  store(entry, frame);
+  entry.sent = now;
+  entry.passed++;
+  m_passedCount++;
+}
+
+void ChangeFilter::store(Entry &entry, const canfd_frame *frame) {
+  if (frame->len != entry.len || frame->can_id != entry.canId) {
+    /* Only bytes within the frame are compared */
+    uint8_t mask[CANFD_MAX_DLEN];
+    auto configured = m_config.masks.find(canfd_id(frame));
+    if (configured != m_config.masks.end()) {
+      memcpy(mask, configured->second.data(), sizeof(mask));
+    } else {
+      memset(mask, 0xff, sizeof(mask));
+    }
+    uint8_t len = std::min<uint8_t>(canfd_len(frame), CANFD_MAX_DLEN);
+    memset(mask + len, 0, sizeof(mask) - len);
+    for (size_t i = 0; i < CHANGE_FILTER_WORDS; i++)
+      entry.mask[i] = loadWord(mask + 8 * i);
+  }
+  for (size_t i = 0; i < CHANGE_FILTER_WORDS; i++)
+    entry.payload[i] = loadWord(frame->data + 8 * i) & entry.mask[i];
+  entry.canId = frame->can_id;
+  entry.len = frame->len;
+  entry.flags = frame->flags;
+}
+
+uint64_t ChangeFilter::getPassedCount() {
+  return m_passedCount;
+}
+
+uint64_t ChangeFilter::getSuppressedCount() {
+  return m_suppressedCount;
+}
+
+std::string ChangeFilter::summary(size_t maxIds) {
+  std::vector<std::pair<canid_t, const Entry*>> sorted;
+  for (const auto &entry : m_entries)
+    sorted.push_back({entry.first, &entry.second});
+  std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+    if (a.second->suppressed != b.second->suppressed)
+      return a.second->suppressed > b.second->suppressed;
+    return a.first < b.first;
+  });
+  std::ostringstream out;
+  for (size_t i = 0; i < sorted.size() && i < maxIds; i++) {
+    const Entry *entry = sorted[i].second;
+    out << (i > 0 ? " " : "") << "0x" << std::hex << (sorted[i].first & CAN_EFF_MASK) << std::dec;
+    if (sorted[i].first & CAN_EFF_FLAG)
+      out << "x";
+    out << ": " << std::fixed << std::setprecision(1)
+        << 100.0 * entry->suppressed / (entry->passed + entry->suppressed) << "%";
+  }
+  return out.str();
+}
+
+CyclicRegenerator::CyclicRegenerator()
+  : m_regeneratedCount(0)
+  , m_expiredCount(0)
+{}
+
+void CyclicRegenerator::setup(const std::vector<RegenerateConfig> &config) {
+  m_config = config;
+  m_entries.clear();
+  m_schedule.clear();
+}
+
+bool CyclicRegenerator::isEnabled() {
+  return !m_config.empty();
+}
+
+void CyclicRegenerator::update(const canfd_frame *frame, std::chrono::steady_clock::time_point now) {
+  canid_t id = canfd_id(frame);
+  auto it = m_entries.find(id);
+  if (it == m_entries.end()) {
+    auto config = std::find_if(m_config.begin(), m_config.end(),
+                               [frame](const RegenerateConfig &c) { return c.ids.contains(frame->can_id); });
+    if (config == m_config.end())
+      return;
+    it = m_entries.emplace(id, Entry{*frame, std::chrono::microseconds(config->period),
+                                     std::chrono::microseconds(config->timeout), now, now}).first;
+  } else {
+    m_schedule.erase({it->second.next, id});
+    it->second.frame = *frame;
+  }
+  it->second.received = now;
+  it->second.next = now + it->second.period;
+  m_schedule.insert({it->second.next, id});
+}
+
+void CyclicRegenerator::due(std::chrono::steady_clock::time_point now, std::vector<canfd_frame> &frames) {
+  while (!m_schedule.empty() && m_schedule.begin()->first <= now) {
+    canid_t id = m_schedule.begin()->second;
+    m_schedule.erase(m_schedule.begin());
+    Entry &entry = m_entries[id];
+    if (now - entry.received >= entry.timeout) {
+      /* A new frame arms it again */
+      m_entries.erase(id);
+      m_expiredCount++;
+      continue;
+    }
+    frames.push_back(entry.frame);
+    m_regeneratedCount++;
+    /* Keep the phase, but don't catch up on missed cycles */
+    entry.next += entry.period;
+    if (entry.next <= now)
+      entry.next = now + entry.period;
+    m_schedule.insert({entry.next, id});
+  }
+}
+
+uint64_t CyclicRegenerator::nextTimeout(std::chrono::steady_clock::time_point now) {
+  if (m_schedule.empty())
+    return 0;
+  auto next = m_schedule.begin()->first;
+  if (next <= now)
+    return 1;
+  return std::chrono::duration_cast<std::chrono::microseconds>(next - now).count() + 1;
+}
+
+uint64_t CyclicRegenerator::getRegeneratedCount() {
+  return m_regeneratedCount;
+}
+
+uint64_t CyclicRegenerator::getExpiredCount() {
+  return m_expiredCount;
+}
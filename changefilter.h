@@ -0,0 +1,165 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "cannelloni.h"
+#include "idset.h"
+
+namespace cannelloni {
+
+/* Payload of a frame in 64 bit words */
+#define CHANGE_FILTER_WORDS (CANFD_MAX_DLEN / 8)
+/* Time in us without a new frame after which an ID is not regenerated anymore */
+#define REGENERATE_DEFAULT_TIMEOUT 3000000
+
+struct ChangeFilterConfig {
+  IdSet ids;
+  /* Unchanged frames are still sent after this time in us, 0 is never */
+  uint64_t refreshInterval;
+  /* Bytes that are compared for an ID, all if there is no mask */
+  std::map<canid_t, std::array<uint8_t, CANFD_MAX_DLEN>> masks;
+};
+
+struct RegenerateConfig {
+  IdSet ids;
+  /* Cycle time in us */
+  uint64_t period;
+  /* Regeneration stops once no frame arrived for this time in us */
+  uint64_t timeout;
+};
+
+/* Design Notes:
+ *
+ * ChangeFilter sits between CANThread and the network thread and drops
+ * frames of the configured IDs whose payload is the same as the one of
+ * the last frame that passed. Bytes outside the mask of an ID, e.g. a
+ * counter or a checksum, are not compared. A frame with another length
+ * or other flags always passes, and so does an unchanged frame once the
+ * last one that passed is older than the refresh interval.
+ *
+ * Later stages like the RateLimiter may still drop a frame that passed,
+ * so the payload is only remembered with commit once the frame is sent
+ * or held for sending. Otherwise the changed value would never arrive.
+ *
+ * The payload is compared as 64 bit words under the mask, which is a
+ * single compare for classic CAN and a loop over all words for CAN FD
+ * that the compiler turns into vector instructions.
+ *
+ * The remote can restore the cyclic stream with a CyclicRegenerator,
+ * which repeats the last frame of an ID that was written to the bus
+ * each period until a new one arrives from the network. If none arrives
+ * within the timeout, the sender or the link is gone and the ID is not
+ * regenerated anymore, so the bus doesn't see a dead ECU as alive. The
+ * timeout has to be longer than the refresh interval of the sender.
+ */
+
+class ChangeFilter {
+  public:
+    ChangeFilter();
+
+    void setup(const ChangeFilterConfig &config);
+    bool isEnabled();
+    /*
+     * Returns false if frame is unchanged and has to be dropped. A frame
+     * that passes is only compared against once it was given to commit.
+     */
+    bool pass(const canfd_frame *frame, std::chrono::steady_clock::time_point now);
+    /* Remembers frame as the last one of its ID, once it is sure to be sent */
+    void commit(const canfd_frame *frame, std::chrono::steady_clock::time_point now);
+
+    uint64_t getPassedCount();
+    uint64_t getSuppressedCount();
+    /* Share of suppressed frames of the IDs with the most suppressed frames */
+    std::string summary(size_t maxIds);
+
+  private:
+    struct Entry {
+      uint64_t payload[CHANGE_FILTER_WORDS];
+      /* Mask of the ID limited to the length of payload */
+      uint64_t mask[CHANGE_FILTER_WORDS];
+      canid_t canId;
+      uint8_t len;
+      uint8_t flags;
+      std::chrono::steady_clock::time_point sent;
+      uint64_t passed;
+      uint64_t suppressed;
+    };
+
+    void store(Entry &entry, const canfd_frame *frame);
+
+  private:
+    ChangeFilterConfig m_config;
+    std::unordered_map<canid_t, Entry> m_entries;
+
+    /* Performance Counters */
+    uint64_t m_passedCount;
+    uint64_t m_suppressedCount;
+};
+
+class CyclicRegenerator {
+  public:
+    CyclicRegenerator();
+
+    void setup(const std::vector<RegenerateConfig> &config);
+    bool isEnabled();
+    /* Remembers frame if its ID is regenerated, frame has been written to the bus */
+    void update(const canfd_frame *frame, std::chrono::steady_clock::time_point now);
+    /* Appends the frames that are due to frames */
+    void due(std::chrono::steady_clock::time_point now, std::vector<canfd_frame> &frames);
+    /* Time in us until due has to be called again, 0 if no frame is known */
+    uint64_t nextTimeout(std::chrono::steady_clock::time_point now);
+
+    uint64_t getRegeneratedCount();
+    /* IDs whose regeneration stopped because no new frame arrived */
+    uint64_t getExpiredCount();
+
+  private:
+    struct Entry {
+      canfd_frame frame;
+      std::chrono::microseconds period;
+      std::chrono::microseconds timeout;
+      std::chrono::steady_clock::time_point next;
+      /* Time the frame was written from the network */
+      std::chrono::steady_clock::time_point received;
+    };
+
+  private:
+    std::vector<RegenerateConfig> m_config;
+    std::unordered_map<canid_t, Entry> m_entries;
+    /* IDs ordered by the time they are due */
+    std::set<std::pair<std::chrono::steady_clock::time_point, canid_t>> m_schedule;
+
+    /* Performance Counters */
+    uint64_t m_regeneratedCount;
+    uint64_t m_expiredCount;
+};
+
+}
@@ -0,0 +1,110 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#include "clocksync.h"
+#include "latency.h"
+
+using namespace cannelloni;
+
+ClockSync::ClockSync()
+  : m_enabled(false)
+  , m_requestCount(0)
+  , m_sampleCount(0)
+{
+  reset();
+}
+
+void ClockSync::setEnabled(bool enabled) {
+  m_enabled = enabled;
+}
+
+bool ClockSync::isEnabled() {
+  return m_enabled;
+}
+
+void ClockSync::reset() {
+  m_pending = 0;
+  m_sampleSize = 0;
+  m_nextSample = 0;
+  m_offset = 0;
+  m_rtt = 0;
+}
+
+uint64_t ClockSync::request() {
+  m_pending = realtimeNow();
+  m_requestCount++;
+  return m_pending;
+}
+
+uint64_t ClockSync::nextInterval() {
+  return m_sampleSize < CLOCK_FILTER_SAMPLES ? CLOCK_SYNC_FAST_INTERVAL : CLOCK_SYNC_INTERVAL;
+}
+
+bool ClockSync::answer(uint64_t originate, uint64_t receive, uint64_t transmit, uint64_t now) {
+  /* Late answers to earlier requests and duplicates are ignored */
+  if (m_pending == 0 || originate != m_pending)
+    return false;
+  m_pending = 0;
+  if (now < originate || transmit < receive)
+    return false;
+  Sample sample;
+  sample.rtt = static_cast<int64_t>(now - originate) - static_cast<int64_t>(transmit - receive);
+  if (sample.rtt < 0)
+    sample.rtt = 0;
+  sample.offset = ((static_cast<int64_t>(receive - originate)) + (static_cast<int64_t>(transmit - now))) / 2;
+  m_samples[m_nextSample] = sample;
+  m_nextSample = (m_nextSample + 1) % CLOCK_FILTER_SAMPLES;
+  if (m_sampleSize < CLOCK_FILTER_SAMPLES)
+    m_sampleSize++;
+  const Sample *best = &m_samples[0];
+  for (size_t i = 1; i < m_sampleSize; i++) {
+    if (m_samples[i].rtt < best->rtt)
+      best = &m_samples[i];
+  }
+  m_offset = best->offset;
+  m_rtt = best->rtt;
+  m_sampleCount++;
+  return true;
+}
+
+bool ClockSync::isValid() {
+  return m_sampleSize > 0;
+}
+
+int64_t ClockSync::getOffset() {
+  return m_offset;
+}
+
+int64_t ClockSync::getRtt() {
+  return m_rtt;
+}
+
+uint64_t ClockSync::toLocal(uint64_t remoteTime) {
+  return remoteTime - m_offset;
+}
+
+uint64_t ClockSync::getRequestCount() {
+  return m_requestCount;
+}
+
+uint64_t ClockSync::getSampleCount() {
+  return m_sampleCount;
+}
@@ -0,0 +1,111 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace cannelloni {
+
+/* Interval of the requests in us once the estimate has settled */
+#define CLOCK_SYNC_INTERVAL 1000000
+/* Interval of the first CLOCK_FILTER_SAMPLES requests in us */
+#define CLOCK_SYNC_FAST_INTERVAL 100000
+/* The estimate is taken from the sample with the smallest RTT of the last n */
+#define CLOCK_FILTER_SAMPLES 8
+
+/* Design Notes:
+ *
+ * ClockSync estimates the offset of the clock of the remote with
+ * NTP-style requests (RFC 5905): The requester sends its time t1, the
+ * remote answers with the time t2 it received the request and the time
+ * t3 it sent the answer, which arrives at t4. Then
+ *
+ *   RTT    = (t4 - t1) - (t3 - t2)
+ *   offset = ((t2 - t1) + (t3 - t4)) / 2
+ *
+ * The offset is exact if both directions took the same time, so queuing
+ * in one direction shows up as an error of up to half the RTT. Like the
+ * clock filter of NTP, the estimate is taken from the sample with the
+ * smallest RTT of the last CLOCK_FILTER_SAMPLES, which had the least
+ * queuing. Old samples drop out, so a drift of the clocks is followed.
+ *
+ * All times are CLOCK_REALTIME in ns, the clock of the frame receive
+ * timestamps (see latency.h). A request is sent every CLOCK_SYNC_INTERVAL,
+ * so the exchange costs less than 100 bytes per second in each direction.
+ */
+
+class ClockSync {
+  public:
+    ClockSync();
+
+    void setEnabled(bool enabled);
+    bool isEnabled();
+    /* Forgets the samples, e.g. after a reconnect */
+    void reset();
+
+    /* Returns t1 for a new request */
+    uint64_t request();
+    /* Time until the next request in us */
+    uint64_t nextInterval();
+    /*
+     * Adds the sample of an answer, returns false if it doesn't belong to
+     * the last request or is invalid
+     */
+    bool answer(uint64_t originate, uint64_t receive, uint64_t transmit, uint64_t now);
+
+    /* There is an estimate */
+    bool isValid();
+    /* Time of the remote minus the local time in ns */
+    int64_t getOffset();
+    /* RTT of the sample the offset was taken from in ns */
+    int64_t getRtt();
+    /* Converts a time of the remote to the local clock */
+    uint64_t toLocal(uint64_t remoteTime);
+
+    uint64_t getRequestCount();
+    uint64_t getSampleCount();
+
+  private:
+    struct Sample {
+      int64_t offset;
+      int64_t rtt;
+    };
+
+  private:
+    bool m_enabled;
+    /* t1 of the last request, 0 once it has been answered */
+    uint64_t m_pending;
+    std::array<Sample, CLOCK_FILTER_SAMPLES> m_samples;
+    /* Valid entries of m_samples */
+    size_t m_sampleSize;
+    size_t m_nextSample;
+    int64_t m_offset;
+    int64_t m_rtt;
+
+    /* Performance Counters */
+    uint64_t m_requestCount;
+    uint64_t m_sampleCount;
+};
+
+}
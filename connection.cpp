@@ -47,3 +47,29 @@ void ConnectionThread::setPeerThread(ConnectionThread *thread) {
 ConnectionThread* ConnectionThread::getPeerThread() {
   return m_peerThread;
 }
+
+void ConnectionThread::setStageLatency(bool enabled) {
+  m_stages.setEnabled(enabled);
+}
+
+const StageRecorder& ConnectionThread::getStageRecorder() const {
+  return m_stages;
+}
+
+void ConnectionThread::setFrameDebug(const FrameDebugConfig &config) {
+  m_frameDebug.setup(config);
+}
+
+void ConnectionThread::setFlightRecorder(size_t frames) {
+  m_flight.setup(frames);
+}
+
+const FlightRing& ConnectionThread::getFlightRing() const {
+  return m_flight;
+}
+
+void ConnectionThread::transmitCycle(const canfd_frame&, uint32_t) {}
+
+void ConnectionThread::resetCycles() {}
+
+void ConnectionThread::registerMetrics(MetricsRegistry&) {}
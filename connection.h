@@ -24,7 +24,10 @@
 #include <stdint.h>
 
 #include "thread.h"
+#include "flightrecorder.h"
 #include "framebuffer.h"
+#include "latency.h"
+#include "logging.h"
 
 namespace cannelloni {
 
@@ -41,15 +44,33 @@ class ConnectionThread : public Thread {
     virtual ~ConnectionThread();
 
     virtual void transmitFrame(canfd_frame *frame) = 0;
+    /* Sends frame every interval us, 0 stops it, see bcmoffload.h. Ignored by default */
+    virtual void transmitCycle(const canfd_frame &frame, uint32_t interval);
+    /* Stops all cycles of transmitCycle, e.g. after the remote restarted. Ignored by default */
+    virtual void resetCycles();
+    /* Adds the metrics of this thread to registry, must be called before start() */
+    virtual void registerMetrics(MetricsRegistry &registry);
     void setFrameBuffer(FrameBuffer *buffer);
     FrameBuffer *getFrameBuffer();
 
     void setPeerThread(ConnectionThread *thread);
     ConnectionThread* getPeerThread();
 
+    /* Records the stage latencies of the frames this thread handles, see latency.h */
+    void setStageLatency(bool enabled);
+    const StageRecorder& getStageRecorder() const;
+    /* Sampling and IDs of the frames logged with -d c */
+    void setFrameDebug(const FrameDebugConfig &config);
+    /* Keeps the last frames this thread handled, see flightrecorder.h */
+    void setFlightRecorder(size_t frames);
+    const FlightRing& getFlightRing() const;
+
   protected:
     FrameBuffer *m_frameBuffer;
     ConnectionThread *m_peerThread;
+    StageRecorder m_stages;
+    FrameDebugger m_frameDebug;
+    FlightRing m_flight;
 };
 
 }
@@ -18,6 +18,7 @@
  *
  */
 
+#include <algorithm>
 #include <cstring>
 #include <netinet/in.h>
 #include "decoder.h"
@@ -30,6 +31,7 @@
 
 using namespace cannelloni;
 
+#ifndef USE_GENERIC_FORMAT
 ssize_t decodeFrame(uint8_t *data, size_t len, canfd_frame *frame, DecodeState *state) {
   switch (*state) {
   case STATE_INIT:
@@ -92,3 +94,50 @@ ssize_t decodeFrame(uint8_t *data, size_t len, canfd_frame *frame, DecodeState *
   }
   return -1;
 }
+#else
+/*
+ * The DTU format that encodeFrame of parser.cpp writes:
+ * | info | 32 bit ID | data, padded to 8 bytes |
+ * info holds the length in bits 0-3, RTR in bit 6 and FF in bit 7
+ */
+#define DTU_HEADER_SIZE_BYTES 5
+#define DTU_MIN_DATA_SIZE_BYTES 8
+#define DTU_INFO_LEN_MASK 0x0F
+#define DTU_INFO_RTR 0x40
+#define DTU_INFO_FF 0x80
+
+ssize_t decodeFrame(uint8_t *data, size_t len, canfd_frame *frame, DecodeState *state) {
+  switch (*state) {
+  case STATE_INIT:
+    *state = STATE_CAN_ID;
+    return DTU_HEADER_SIZE_BYTES;
+  case STATE_CAN_ID: {
+    if (len != DTU_HEADER_SIZE_BYTES) {
+      return -1;
+    }
+    canid_t tmp;
+    memcpy(&tmp, data + 1, sizeof(canid_t));
+    frame->can_id = ntohl(tmp);
+    if (data[0] & DTU_INFO_FF)
+      frame->can_id |= CAN_EFF_FLAG;
+    if (data[0] & DTU_INFO_RTR)
+      frame->can_id |= CAN_RTR_FLAG;
+    frame->len = data[0] & DTU_INFO_LEN_MASK;
+    frame->flags = 0;
+    *state = STATE_DATA;
+    /* The data is sent even for RTR frames */
+    return std::max<size_t>(frame->len, DTU_MIN_DATA_SIZE_BYTES);
+  }
+  case STATE_DATA:
+    if (len != std::max<size_t>(frame->len, DTU_MIN_DATA_SIZE_BYTES)) {
+      return -1;
+    }
+    memcpy(frame->data, data, frame->len);
+    *state = STATE_INIT;
+    return 0;
+  default:
+    break;
+  }
+  return -1;
+}
+#endif
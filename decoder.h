@@ -51,7 +51,8 @@ struct Decoder {
 };
 
 /**
- * Decodes a CAN frame from input data.
+ * Decodes a CAN frame from input data in the format encodeFrame writes,
+ * the DTU format if USE_GENERIC_FORMAT is defined.
  *
  * @param data Pointer to the input data to be decoded.
  * @param len The length of the input data in bytes.
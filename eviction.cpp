@@ -0,0 +1,184 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "eviction.h"
+
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <utility>
+
+using namespace cannelloni;
+
+/* Larger keys lose the arbitration */
+static uint32_t arbitrationKey(const canfd_frame *frame) {
+  if (frame->can_id & CAN_EFF_FLAG) {
+    uint32_t id = frame->can_id & CAN_EFF_MASK;
+    /* Base ID, then the IDE bit, then the ID extension */
+    return (id >> 18) << 19 | 1 << 18 | (id & 0x3ffff);
+  }
+  return (frame->can_id & CAN_SFF_MASK) << 19;
+}
+
+namespace {
+
+class OldestEviction : public EvictionPolicy {
+  public:
+    FrameIterator victim(std::list<canfd_frame*> &buffer) override {
+      return buffer.begin();
+    }
+};
+
+class NewestEviction : public EvictionPolicy {
+  public:
+    FrameIterator victim(std::list<canfd_frame*> &buffer) override {
+      return std::prev(buffer.end());
+    }
+};
+
+/*
+ * Frames by key, frames with the same key are in the order of
+ * the buffer, so the oldest one comes first
+ */
+class FrameIndex {
+  public:
+    void insert(uint32_t key, EvictionPolicy::FrameIterator it, bool front) {
+      m_index.insert(front ? m_index.lower_bound(key) : m_index.upper_bound(key), {key, it});
+    }
+
+    void remove(uint32_t key, EvictionPolicy::FrameIterator it) {
+      auto range = m_index.equal_range(key);
+      /* Frames leave at the front or the back almost always */
+      if (range.first->second == it) {
+        m_index.erase(range.first);
+        return;
+      }
+      for (auto entry = std::prev(range.second); entry != range.first; entry--) {
+        if (entry->second == it) {
+          m_index.erase(entry);
+          return;
+        }
+      }
+    }
+
+    void clear() {
+      m_index.clear();
+    }
+
+    /* Oldest frame with key */
+    EvictionPolicy::FrameIterator oldest(uint32_t key) {
+      return m_index.lower_bound(key)->second;
+    }
+
+    uint32_t largestKey() {
+      return std::prev(m_index.end())->first;
+    }
+
+  private:
+    std::multimap<uint32_t, EvictionPolicy::FrameIterator> m_index;
+};
+
+class PriorityEviction : public EvictionPolicy {
+  public:
+    void inserted(FrameIterator it, bool front) override {
+      m_index.insert(arbitrationKey(*it), it, front);
+    }
+
+    void removed(FrameIterator it) override {
+      m_index.remove(arbitrationKey(*it), it);
+    }
+
+    void cleared() override {
+      m_index.clear();
+    }
+
+    FrameIterator victim(std::list<canfd_frame*> &) override {
+      return m_index.oldest(m_index.largestKey());
+    }
+
+  private:
+    FrameIndex m_index;
+};
+
+class QuotaEviction : public EvictionPolicy {
+  public:
+    QuotaEviction(size_t quota) : m_quota(quota) {}
+
+    void inserted(FrameIterator it, bool front) override {
+      canid_t id = canfd_id(*it);
+      m_index.insert(id, it, front);
+      updateCount(id, 1);
+    }
+
+    void removed(FrameIterator it) override {
+      canid_t id = canfd_id(*it);
+      m_index.remove(id, it);
+      updateCount(id, -1);
+    }
+
+    void cleared() override {
+      m_index.clear();
+      m_counts.clear();
+      m_byCount.clear();
+    }
+
+    FrameIterator victim(std::list<canfd_frame*> &buffer) override {
+      const std::pair<size_t, canid_t> &largest = *m_byCount.rbegin();
+      if (largest.first <= m_quota)
+        return buffer.begin();
+      return m_index.oldest(largest.second);
+    }
+
+  private:
+    void updateCount(canid_t id, int change) {
+      size_t &count = m_counts[id];
+      if (count > 0)
+        m_byCount.erase({count, id});
+      count += change;
+      if (count > 0) {
+        m_byCount.insert({count, id});
+      } else {
+        m_counts.erase(id);
+      }
+    }
+
+  private:
+    size_t m_quota;
+    FrameIndex m_index;
+    std::unordered_map<canid_t, size_t> m_counts;
+    /* Ordered by the number of buffered frames */
+    std::set<std::pair<size_t, canid_t>> m_byCount;
+};
+
+}
+
+std::unique_ptr<EvictionPolicy> cannelloni::createEvictionPolicy(const EvictionConfig &config) {
+  switch (config.type) {
+    case EVICT_NEWEST:
+      return std::unique_ptr<EvictionPolicy>(new NewestEviction());
+    case EVICT_PRIORITY:
+      return std::unique_ptr<EvictionPolicy>(new PriorityEviction());
+    case EVICT_QUOTA:
+      return std::unique_ptr<EvictionPolicy>(new QuotaEviction(config.quota));
+    case EVICT_OLDEST:
+    default:
+      return std::unique_ptr<EvictionPolicy>(new OldestEviction());
+  }
+}
@@ -0,0 +1,79 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <memory>
+
+#include "cannelloni.h"
+
+namespace cannelloni {
+
+enum EvictionType {
+  /* The frame that has been buffered the longest */
+  EVICT_OLDEST,
+  /* The frame that has been buffered last */
+  EVICT_NEWEST,
+  /* The oldest frame of the ID that loses the arbitration on the bus */
+  EVICT_PRIORITY,
+  /* The oldest frame of the ID with the most buffered frames above the quota */
+  EVICT_QUOTA
+};
+
+struct EvictionConfig {
+  EvictionType type;
+  /* Frames per ID that are safe as long as another ID has more, EVICT_QUOTA only */
+  size_t quota;
+};
+
+/* Design Notes:
+ *
+ * An EvictionPolicy picks the frame that is dropped from a buffer once
+ * the FrameBuffer runs out of frames or exceeds its overload limit. The
+ * FrameBuffer reports every change of the buffer, so a policy can keep
+ * an index next to it. Frames are only added and removed at the front
+ * and the back or picked by the policy, which keeps the index updates
+ * and the choice of a victim at O(log n).
+ *
+ * CAN IDs are compared like in the arbitration on the bus: a standard
+ * frame wins against an extended frame with the same 11 bit base ID.
+ */
+
+class EvictionPolicy {
+  public:
+    typedef std::list<canfd_frame*>::iterator FrameIterator;
+
+    virtual ~EvictionPolicy() {}
+
+    /* it has been added at the front or the back of the buffer */
+    virtual void inserted(FrameIterator, bool) {}
+    /* it is about to be removed from the buffer */
+    virtual void removed(FrameIterator) {}
+    /* All frames have been removed from the buffer */
+    virtual void cleared() {}
+    /* The frame to drop from buffer, which is not empty */
+    virtual FrameIterator victim(std::list<canfd_frame*> &buffer) = 0;
+};
+
+std::unique_ptr<EvictionPolicy> createEvictionPolicy(const EvictionConfig &config);
+
+}
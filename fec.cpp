@@ -0,0 +1,307 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "fec.h"
+
+#include <algorithm>
+
+using namespace cannelloni;
+
+namespace {
+
+/* GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 */
+class GaloisField {
+  public:
+    GaloisField() {
+      uint16_t x = 1;
+      for (int i = 0; i < 255; i++) {
+        m_exp[i] = x;
+        m_exp[i + 255] = x;
+        m_log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+          x ^= 0x11d;
+      }
+      m_log[0] = 0;
+      for (int j = 0; j < FEC_MAX_PARITY_PACKETS; j++) {
+        for (int i = 0; i < FEC_MAX_DATA_PACKETS; i++) {
+          /* Cauchy matrix 1/(x_j + y_i), column i scaled by y_i = 1/(x_0 + y_i) */
+          uint8_t y = FEC_MAX_PARITY_PACKETS + i;
+          m_coefficients[j][i] = mul(inv(j ^ y), y);
+        }
+      }
+    }
+
+    uint8_t mul(uint8_t a, uint8_t b) const {
+      if (a == 0 || b == 0)
+        return 0;
+      return m_exp[m_log[a] + m_log[b]];
+    }
+
+    uint8_t inv(uint8_t a) const {
+      return m_exp[255 - m_log[a]];
+    }
+
+    uint8_t coefficient(uint8_t parity, uint8_t data) const {
+      return m_coefficients[parity][data];
+    }
+
+    /* dst += c * src, src may be shorter than dst */
+    void mulAdd(std::vector<uint8_t> &dst, const std::vector<uint8_t> &src, uint8_t c) const {
+      size_t len = std::min(dst.size(), src.size());
+      if (c == 0)
+        return;
+      if (c == 1) {
+        for (size_t n = 0; n < len; n++)
+          dst[n] ^= src[n];
+        return;
+      }
+      uint8_t row[256];
+      for (int v = 0; v < 256; v++)
+        row[v] = mul(c, v);
+      for (size_t n = 0; n < len; n++)
+        dst[n] ^= row[src[n]];
+    }
+
+  private:
+    uint8_t m_exp[510];
+    uint8_t m_log[256];
+    uint8_t m_coefficients[FEC_MAX_PARITY_PACKETS][FEC_MAX_DATA_PACKETS];
+};
+
+const GaloisField gf;
+
+std::vector<uint8_t> makeBlock(uint8_t flags, const uint8_t *data, uint16_t len) {
+  std::vector<uint8_t> block(FEC_BLOCK_HEADER_SIZE + len);
+  block[0] = flags;
+  block[1] = len >> 8;
+  block[2] = len & 0xff;
+  std::copy(data, data + len, block.begin() + FEC_BLOCK_HEADER_SIZE);
+  return block;
+}
+
+}
+
+FecEncoder::FecEncoder()
+  : m_k(0)
+  , m_m(0)
+  , m_base(0)
+{
+}
+
+void FecEncoder::setup(uint8_t k, uint8_t m) {
+  m_k = std::min<uint8_t>(k, FEC_MAX_DATA_PACKETS);
+  m_m = std::min<uint8_t>(m, FEC_MAX_PARITY_PACKETS);
+  reset();
+}
+
+bool FecEncoder::isEnabled() {
+  return m_k > 0 && m_m > 0;
+}
+
+void FecEncoder::reset() {
+  m_blocks.clear();
+}
+
+bool FecEncoder::add(uint32_t seq, uint8_t flags, const uint8_t *data, uint16_t len) {
+  /* Groups only consist of consecutive packets, also across the wrap of seq */
+  if (m_blocks.empty() || seq != static_cast<uint32_t>(m_base + m_blocks.size())) {
+    m_blocks.clear();
+    m_base = seq;
+  }
+  m_blocks.push_back(makeBlock(flags, data, len));
+  return m_blocks.size() >= m_k;
+}
+
+uint8_t FecEncoder::pending() {
+  return m_blocks.size();
+}
+
+uint32_t FecEncoder::groupBase() {
+  return m_base;
+}
+
+void FecEncoder::finish(std::vector<std::vector<uint8_t>> &parity) {
+  size_t blockLen = 0;
+  for (const std::vector<uint8_t> &block : m_blocks)
+    blockLen = std::max(blockLen, block.size());
+  parity.assign(m_m, std::vector<uint8_t>(blockLen, 0));
+  for (uint8_t j = 0; j < m_m; j++) {
+    for (size_t i = 0; i < m_blocks.size(); i++)
+      gf.mulAdd(parity[j], m_blocks[i], gf.coefficient(j, i));
+  }
+  m_blocks.clear();
+}
+
+FecDecoder::FecDecoder()
+  : m_recoveredCount(0)
+  , m_unrecoverableCount(0)
+{
+}
+
+void FecDecoder::reset() {
+  m_history.clear();
+  m_groups.clear();
+}
+
+void FecDecoder::addData(uint32_t seq, uint8_t flags, const uint8_t *data, uint16_t len) {
+  remember(seq, makeBlock(flags, data, len));
+}
+
+void FecDecoder::addParity(uint32_t base, uint8_t k, uint8_t m, uint8_t index,
+                           const uint8_t *data, uint16_t len, std::vector<FecRecoveredPacket> &recovered) {
+  if (k == 0 || k > FEC_MAX_DATA_PACKETS || m == 0 || m > FEC_MAX_PARITY_PACKETS ||
+      index >= m || len < FEC_BLOCK_HEADER_SIZE)
+    return;
+  auto it = std::find_if(m_groups.begin(), m_groups.end(),
+                         [base, k](const Group &group) { return group.base == base && group.k == k; });
+  if (it == m_groups.end()) {
+    if (m_groups.size() >= FEC_MAX_GROUPS) {
+      giveUp(m_groups.front());
+      m_groups.pop_front();
+    }
+    m_groups.push_back(Group{base, k, m, std::vector<std::vector<uint8_t>>(m)});
+    it = std::prev(m_groups.end());
+  }
+  if (index >= it->m || !it->parity[index].empty())
+    return;
+  it->parity[index].assign(data, data + len);
+  if (decode(*it, recovered)) {
+    m_groups.erase(it);
+    return;
+  }
+  bool complete = std::all_of(it->parity.begin(), it->parity.end(),
+                              [](const std::vector<uint8_t> &parity) { return !parity.empty(); });
+  if (complete) {
+    /* More packets are missing than there are parity packets */
+    giveUp(*it);
+    m_groups.erase(it);
+  }
+}
+
+const std::vector<uint8_t>* FecDecoder::findBlock(uint32_t seq) {
+  for (auto it = m_history.rbegin(); it != m_history.rend(); it++) {
+    if (it->seq == seq)
+      return &it->data;
+  }
+  return NULL;
+}
+
+void FecDecoder::remember(uint32_t seq, std::vector<uint8_t> &&block) {
+  m_history.push_back(Block{seq, std::move(block)});
+  if (m_history.size() > FEC_HISTORY_PACKETS)
+    m_history.pop_front();
+}
+
+bool FecDecoder::decode(Group &group, std::vector<FecRecoveredPacket> &recovered) {
+  std::vector<uint8_t> missing;
+  for (uint8_t i = 0; i < group.k; i++) {
+    if (findBlock(group.base + i) == NULL)
+      missing.push_back(i);
+  }
+  if (missing.empty())
+    return true;
+  std::vector<uint8_t> rows;
+  for (uint8_t j = 0; j < group.m && rows.size() < missing.size(); j++) {
+    if (!group.parity[j].empty())
+      rows.push_back(j);
+  }
+  if (rows.size() < missing.size())
+    return false;
+
+  size_t e = missing.size();
+  size_t blockLen = group.parity[rows[0]].size();
+  /* Remove the known blocks from the parity blocks */
+  std::vector<std::vector<uint8_t>> syndromes(e);
+  for (size_t r = 0; r < e; r++) {
+    syndromes[r] = group.parity[rows[r]];
+    syndromes[r].resize(blockLen, 0);
+    for (uint8_t i = 0; i < group.k; i++) {
+      const std::vector<uint8_t> *block = findBlock(group.base + i);
+      if (block)
+        gf.mulAdd(syndromes[r], *block, gf.coefficient(rows[r], i));
+    }
+  }
+  /* Invert the e x e submatrix of the missing blocks with Gauss-Jordan elimination */
+  std::vector<std::vector<uint8_t>> a(e, std::vector<uint8_t>(e));
+  std::vector<std::vector<uint8_t>> inv(e, std::vector<uint8_t>(e, 0));
+  for (size_t r = 0; r < e; r++) {
+    for (size_t c = 0; c < e; c++)
+      a[r][c] = gf.coefficient(rows[r], missing[c]);
+    inv[r][r] = 1;
+  }
+  for (size_t c = 0; c < e; c++) {
+    size_t pivot = c;
+    while (pivot < e && a[pivot][c] == 0)
+      pivot++;
+    if (pivot == e)
+      return false;
+    std::swap(a[c], a[pivot]);
+    std::swap(inv[c], inv[pivot]);
+    uint8_t scale = gf.inv(a[c][c]);
+    for (size_t n = 0; n < e; n++) {
+      a[c][n] = gf.mul(a[c][n], scale);
+      inv[c][n] = gf.mul(inv[c][n], scale);
+    }
+    for (size_t r = 0; r < e; r++) {
+      uint8_t factor = a[r][c];
+      if (r == c || factor == 0)
+        continue;
+      for (size_t n = 0; n < e; n++) {
+        a[r][n] ^= gf.mul(factor, a[c][n]);
+        inv[r][n] ^= gf.mul(factor, inv[c][n]);
+      }
+    }
+  }
+  for (size_t c = 0; c < e; c++) {
+    std::vector<uint8_t> block(blockLen, 0);
+    for (size_t r = 0; r < e; r++)
+      gf.mulAdd(block, syndromes[r], inv[c][r]);
+    uint16_t len = block[1] << 8 | block[2];
+    if (static_cast<size_t>(FEC_BLOCK_HEADER_SIZE + len) > blockLen) {
+      /* Parity blocks of different groups got mixed up */
+      m_unrecoverableCount += e - c;
+      return true;
+    }
+    uint32_t seq = group.base + missing[c];
+    recovered.push_back(FecRecoveredPacket{seq, block[0],
+        std::vector<uint8_t>(block.begin() + FEC_BLOCK_HEADER_SIZE,
+                             block.begin() + FEC_BLOCK_HEADER_SIZE + len)});
+    block.resize(FEC_BLOCK_HEADER_SIZE + len);
+    remember(seq, std::move(block));
+    m_recoveredCount++;
+  }
+  return true;
+}
+
+void FecDecoder::giveUp(Group &group) {
+  for (uint8_t i = 0; i < group.k; i++) {
+    if (findBlock(group.base + i) == NULL)
+      m_unrecoverableCount++;
+  }
+}
+
+uint64_t FecDecoder::getRecoveredCount() {
+  return m_recoveredCount;
+}
+
+uint64_t FecDecoder::getUnrecoverableCount() {
+  return m_unrecoverableCount;
+}
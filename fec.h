@@ -0,0 +1,132 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+namespace cannelloni {
+
+/* Maximum number of data packets (K) protected by one group of parity packets */
+#define FEC_MAX_DATA_PACKETS 64
+/* Maximum number of parity packets (M) per group */
+#define FEC_MAX_PARITY_PACKETS 16
+/* A block is the packet prefixed with its flags and its length */
+#define FEC_BLOCK_HEADER_SIZE 3
+/* Data packets a FecDecoder remembers */
+#define FEC_HISTORY_PACKETS (2 * FEC_MAX_DATA_PACKETS)
+/* Incomplete groups a FecDecoder waits for parity packets of */
+#define FEC_MAX_GROUPS 8
+
+/* Design Notes:
+ *
+ * Forward error correction for groups of up to FEC_MAX_DATA_PACKETS
+ * consecutive data packets, which may differ in length. Every packet is
+ * turned into a block (flags, length and payload), shorter blocks are
+ * padded with zeros. Parity block j is the sum of all data blocks
+ * multiplied with the coefficients c(j,i) over GF(2^8).
+ *
+ * The coefficients are taken from a Cauchy matrix whose columns are
+ * scaled so the first row is all ones, which makes parity block 0 a
+ * plain XOR of the data blocks. Every square submatrix of a Cauchy
+ * matrix is invertible, so any M lost packets of a group can be rebuilt
+ * from M parity packets (Reed-Solomon erasure code). The coefficients
+ * only depend on the position in the group, so K and M may change at
+ * any time without telling the receiver.
+ */
+
+class FecEncoder {
+  public:
+    FecEncoder();
+
+    /* k data packets are followed by m parity packets, k = 0 disables the encoder */
+    void setup(uint8_t k, uint8_t m);
+    bool isEnabled();
+    void reset();
+
+    /* Adds a data packet to the current group, returns true once the group is complete */
+    bool add(uint32_t seq, uint8_t flags, const uint8_t *data, uint16_t len);
+    /* Number of data packets in the current group */
+    uint8_t pending();
+    uint32_t groupBase();
+    /* Computes the parity blocks of the current group and starts a new group */
+    void finish(std::vector<std::vector<uint8_t>> &parity);
+
+  private:
+    uint8_t m_k;
+    uint8_t m_m;
+    uint32_t m_base;
+    std::vector<std::vector<uint8_t>> m_blocks;
+};
+
+struct FecRecoveredPacket {
+  uint32_t seq;
+  uint8_t flags;
+  std::vector<uint8_t> data;
+};
+
+class FecDecoder {
+  public:
+    FecDecoder();
+
+    void reset();
+    /* Remembers a received data packet */
+    void addData(uint32_t seq, uint8_t flags, const uint8_t *data, uint16_t len);
+    /*
+     * Adds parity block index of the group of k data packets starting at base,
+     * packets that can be rebuilt are appended to recovered
+     */
+    void addParity(uint32_t base, uint8_t k, uint8_t m, uint8_t index,
+                   const uint8_t *data, uint16_t len, std::vector<FecRecoveredPacket> &recovered);
+
+    uint64_t getRecoveredCount();
+    uint64_t getUnrecoverableCount();
+
+  private:
+    struct Block {
+      uint32_t seq;
+      std::vector<uint8_t> data;
+    };
+    struct Group {
+      uint32_t base;
+      uint8_t k;
+      uint8_t m;
+      /* Parity blocks by index, empty if not received */
+      std::vector<std::vector<uint8_t>> parity;
+    };
+
+    const std::vector<uint8_t>* findBlock(uint32_t seq);
+    void remember(uint32_t seq, std::vector<uint8_t> &&block);
+    /* Returns true once the group is complete */
+    bool decode(Group &group, std::vector<FecRecoveredPacket> &recovered);
+    void giveUp(Group &group);
+
+  private:
+    std::deque<Block> m_history;
+    std::deque<Group> m_groups;
+
+    /* Performance Counters */
+    uint64_t m_recoveredCount;
+    uint64_t m_unrecoverableCount;
+};
+
+}
@@ -0,0 +1,140 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "flightrecorder.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <fstream>
+
+#include <time.h>
+
+using namespace cannelloni;
+
+const char* cannelloni::flightEventName(uint8_t event) {
+  switch (event) {
+    case FLIGHT_CAN_RX: return "can_rx";
+    case FLIGHT_FILTERED: return "filtered";
+    case FLIGHT_CAN_TX: return "can_tx";
+    case FLIGHT_NET_RX: return "net_rx";
+    case FLIGHT_NET_TX: return "net_tx";
+    default: return "unknown";
+  }
+}
+
+FlightRing::FlightRing()
+  : m_mask(0)
+  , m_head(0)
+{
+}
+
+void FlightRing::setup(size_t frames) {
+  size_t size = 0;
+  if (frames > 0) {
+    size = 1;
+    while (size < frames)
+      size <<= 1;
+  }
+  m_records.assign(size, FlightRecord());
+  m_mask = size ? size - 1 : 0;
+  m_head.store(0, std::memory_order_relaxed);
+}
+
+void FlightRing::collect(uint64_t since, std::vector<FlightRecord> &records) const {
+  if (!isEnabled())
+    return;
+  uint64_t size = m_mask + 1;
+  uint64_t head = m_head.load(std::memory_order_acquire);
+  uint64_t first = head > size ? head - size : 0;
+  std::vector<FlightRecord> copy;
+  copy.reserve(head - first);
+  for (uint64_t i = first; i < head; i++)
+    copy.push_back(m_records[i & m_mask]);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  /* The writer may have overwritten the oldest slots while they were copied */
+  uint64_t written = m_head.load(std::memory_order_relaxed) + 1;
+  uint64_t valid = written > size ? written - size : 0;
+  for (uint64_t i = std::max(first, valid); i < head; i++) {
+    const FlightRecord &record = copy[i - first];
+    if (record.time >= since)
+      records.push_back(record);
+  }
+}
+
+FlightRecorder::FlightRecorder(const FlightRecorderConfig &config, const std::string &interface)
+  : m_config(config)
+  , m_interface(interface)
+{
+}
+
+void FlightRecorder::addRing(const FlightRing *ring) {
+  m_rings.push_back(ring);
+}
+
+std::string FlightRecorder::dump() {
+  uint64_t now = monotonicNow();
+  uint64_t window = m_config.seconds * 1000000000;
+  std::vector<FlightRecord> records;
+  for (const FlightRing *ring : m_rings)
+    ring->collect(now > window ? now - window : 0, records);
+  std::stable_sort(records.begin(), records.end(),
+                   [](const FlightRecord &a, const FlightRecord &b) { return a.time < b.time; });
+
+  FlightDumpHeader header = {};
+  header.magic = FLIGHT_MAGIC;
+  header.version = FLIGHT_VERSION;
+  header.recordSize = sizeof(FlightRecord);
+  header.count = records.size();
+  header.realtimeOffset = static_cast<int64_t>(realtimeNow() - monotonicNow());
+  header.dumped = now;
+  header.window = window;
+  strncpy(header.interface, m_interface.c_str(), FLIGHT_INTERFACE_SIZE - 1);
+
+  time_t wallclock = time(NULL);
+  struct tm local;
+  localtime_r(&wallclock, &local);
+  char stamp[32];
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+  std::string path = m_config.directory + "/cannelloni-" + m_interface + "-" + stamp + ".flight";
+
+  std::ofstream file(path, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(FlightRecord));
+  file.close();
+  if (file.fail()) {
+    lerror << "Could not write flight recorder dump " << path << std::endl;
+    return "";
+  }
+  return path;
+}
+
+bool FlightRecorder::read(const std::string &path, FlightDumpHeader &header,
+                          std::vector<FlightRecord> &records) {
+  std::ifstream file(path, std::ifstream::in | std::ifstream::binary);
+  if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+    return false;
+  if (header.magic != FLIGHT_MAGIC || header.version != FLIGHT_VERSION ||
+      header.recordSize != sizeof(FlightRecord))
+    return false;
+  header.interface[FLIGHT_INTERFACE_SIZE - 1] = '\0';
+  records.resize(header.count);
+  return static_cast<bool>(file.read(reinterpret_cast<char*>(records.data()),
+                                     records.size() * sizeof(FlightRecord)));
+}
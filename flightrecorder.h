@@ -0,0 +1,165 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "cannelloni.h"
+#include "latency.h"
+
+namespace cannelloni {
+
+#define FLIGHT_MAGIC 0x43414e46
+/* Changes whenever the layout of a dump changes */
+#define FLIGHT_VERSION 1
+/* Payload bytes kept of each frame, CAN FD frames are cut */
+#define FLIGHT_RECORD_DATA 8
+/* Records kept by each thread by default, a power of two */
+#define FLIGHT_DEFAULT_FRAMES 65536
+/* Seconds before the trigger that are dumped by default */
+#define FLIGHT_DEFAULT_SECONDS 10
+#define FLIGHT_INTERFACE_SIZE 32
+
+/* Design Notes:
+ *
+ * The flight recorder keeps the last frames each thread handled, so
+ * the seconds before an event can be looked at after it happened. Every
+ * ConnectionThread owns a FlightRing and is its only writer: recording a
+ * frame writes one 32 byte record into the next slot and publishes it
+ * with a release store of the head, there are no locks or RMW
+ * operations. Old records are overwritten.
+ *
+ * On SIGUSR1 the main thread copies the rings and checks afterwards
+ * which slots the threads overwrote meanwhile, those are discarded. The
+ * records of the last seconds are written to a dump file, ordered by
+ * time, with the offset of CLOCK_REALTIME to CLOCK_MONOTONIC so
+ * cannelloni-flight can print wall clock times.
+ */
+
+enum FlightEvent : uint8_t {
+  /* Read from the bus */
+  FLIGHT_CAN_RX,
+  /* Dropped by the filters or the rate limits after being read */
+  FLIGHT_FILTERED,
+  /* Written to the bus */
+  FLIGHT_CAN_TX,
+  /* Received from the remote */
+  FLIGHT_NET_RX,
+  /* Sent to the remote */
+  FLIGHT_NET_TX,
+  FLIGHT_EVENTS
+};
+
+const char* flightEventName(uint8_t event);
+
+struct FlightRecord {
+  /* CLOCK_MONOTONIC in ns */
+  uint64_t time;
+  uint32_t can_id;
+  /* Number of the packet of a network event, of the frame otherwise */
+  uint32_t seq;
+  /* With CANFD_FRAME like in the frame buffer */
+  uint8_t len;
+  uint8_t event;
+  uint8_t flags;
+  uint8_t reserved[5];
+  uint8_t data[FLIGHT_RECORD_DATA];
+};
+
+static_assert(sizeof(FlightRecord) == 32, "flight records are written to dumps as they are");
+
+class FlightRing {
+  public:
+    FlightRing();
+
+    /* Keeps the last frames records, 0 disables the ring */
+    void setup(size_t frames);
+    bool isEnabled() const {
+      return m_mask != 0;
+    }
+
+    /* Only called by the owning thread */
+    void record(FlightEvent event, const canfd_frame *frame, uint32_t seq) {
+      uint64_t head = m_head.load(std::memory_order_relaxed);
+      FlightRecord &record = m_records[head & m_mask];
+      record.time = monotonicNow();
+      record.can_id = frame->can_id;
+      record.seq = seq;
+      record.len = frame->len;
+      record.event = event;
+      record.flags = frame->flags;
+      memcpy(record.data, frame->data, FLIGHT_RECORD_DATA);
+      m_head.store(head + 1, std::memory_order_release);
+    }
+
+    /* Appends the records taken at or after since, may be called by any thread */
+    void collect(uint64_t since, std::vector<FlightRecord> &records) const;
+
+  private:
+    std::vector<FlightRecord> m_records;
+    uint64_t m_mask;
+    std::atomic<uint64_t> m_head;
+};
+
+struct FlightRecorderConfig {
+  /* Dumps are written to this directory, the recorder is off if it is empty */
+  std::string directory;
+  /* Records of each thread */
+  size_t frames;
+  uint64_t seconds;
+};
+
+struct FlightDumpHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t recordSize;
+  uint32_t count;
+  /* CLOCK_REALTIME - CLOCK_MONOTONIC in ns at the time of the dump */
+  int64_t realtimeOffset;
+  /* CLOCK_MONOTONIC in ns of the dump */
+  uint64_t dumped;
+  uint64_t window;
+  char interface[FLIGHT_INTERFACE_SIZE];
+};
+
+class FlightRecorder {
+  public:
+    FlightRecorder(const FlightRecorderConfig &config, const std::string &interface);
+
+    void addRing(const FlightRing *ring);
+    /* Writes the last seconds to a new file in the directory, returns its path or "" */
+    std::string dump();
+
+    /* Reads a dump written by dump() */
+    static bool read(const std::string &path, FlightDumpHeader &header,
+                     std::vector<FlightRecord> &records);
+
+  private:
+    FlightRecorderConfig m_config;
+    std::string m_interface;
+    std::vector<const FlightRing*> m_rings;
+};
+
+}
@@ -18,18 +18,33 @@
  *
  */
 
+#include <cstdint>
 #include <cstring>
+#include <iterator>
 #include "framebuffer.h"
 #include "logging.h"
+#include "spillqueue.h"
 
 using namespace cannelloni;
 
+/* Bytes a frame adds to a packet */
+static size_t frameSize(const canfd_frame *frame) {
+  size_t size = CANNELLONI_FRAME_BASE_SIZE + canfd_len(frame);
+  /* We need one more byte for CAN_FD Frames */
+  if (frame->len & CANFD_FRAME)
+    size++;
+  return size;
+}
+
 FrameBuffer::FrameBuffer(size_t size, size_t max) :
+  m_lanes(1),
   m_totalAllocCount(0),
-  m_bufferSize(0),
-  m_intermediateBufferSize(0),
-  m_maxAllocCount(max)
+  m_maxAllocCount(max),
+  m_spillQueue(NULL),
+  m_overloadLimit(0),
+  m_evictionConfig({EVICT_OLDEST, 0})
 {
+  m_lanes[0].eviction = createEvictionPolicy(m_evictionConfig);
   resizePool(size, false);
 }
 
@@ -67,10 +82,13 @@ canfd_frame* FrameBuffer::requestFrame(bool overwriteLast, bool debug) {
     } else if(!resizePoolResult && overwriteLast) {
       std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
       /*
-       * We did reach the limit but we are returning the last frame in the
-       * buffer. (ringbuffer behaviour)
+       * We did reach the limit but we are returning a frame of the
+       * buffer picked by the EvictionPolicy.
        */
-      return requestBufferBack();
+      canfd_frame *evicted = evictFrame();
+      if (evicted)
+        clearFrameMetadata(evicted);
+      return evicted;
     }
   }
   /* If we reach this point, m_framePool is not depleted */
@@ -81,6 +99,8 @@ canfd_frame* FrameBuffer::requestFrame(bool overwriteLast, bool debug) {
    * it even was 33% slower
    */
   m_framePool.pop_front();
+  updatePoolMetrics();
+  clearFrameMetadata(ret);
   return ret;
 }
 
@@ -88,105 +108,263 @@ void FrameBuffer::insertFramePool(canfd_frame *frame) {
   std::lock_guard<std::recursive_mutex> lock(m_poolMutex);
 
   m_framePool.push_back(frame);
+  updatePoolMetrics();
+}
+
+void FrameBuffer::insertFrame(canfd_frame *frame, bool allowSpill) {
+  /*
+   * Once the pool is exhausted we spill instead of overwriting.
+   * Keep spilling while the SpillQueue is not empty to keep the order.
+   */
+  if (coalesceFrame(frame))
+    return;
+  if (allowSpill && m_spillQueue &&
+      (m_spillQueue->depth() > 0 || availableFrames() == 0)) {
+    if (spillFrame(frame))
+      return;
+  }
+  std::list<canfd_frame*> dropped;
+  {
+    std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
+
+    size_t laneIndex = laneOf(frame);
+    Lane &lane = m_lanes[laneIndex];
+    pushBack(lane, frame);
+
+    size_t limit = m_overloadLimit;
+    while (laneIndex == 0 && limit > 0 && lane.bufferSize > limit && lane.buffer.size() > 1) {
+      dropped.push_back(evictFrame(lane));
+      m_overloadDropCount.add();
+    }
+  }
+  /* m_poolMutex is taken before m_bufferMutex elsewhere */
+  if (!dropped.empty()) {
+    std::lock_guard<std::recursive_mutex> lock(m_poolMutex);
+    m_framePool.splice(m_framePool.end(), dropped);
+    updatePoolMetrics();
+  }
+}
+
+bool FrameBuffer::spillFrame(canfd_frame *frame) {
+  if (m_spillQueue == NULL || !m_spillQueue->append(frame))
+    return false;
+  insertFramePool(frame);
+  return true;
+}
+
+size_t FrameBuffer::drainSpill(size_t maxFrames) {
+  size_t drained = 0;
+  if (m_spillQueue == NULL)
+    return 0;
+  while (drained < maxFrames) {
+    /* Leave room for frames that arrive in the meantime */
+    if (m_maxAllocCount > 0 && availableFrames() <= SPILL_POOL_RESERVE)
+      break;
+    canfd_frame *frame = requestFrame(false);
+    if (frame == NULL)
+      break;
+    if (!m_spillQueue->pop(frame)) {
+      insertFramePool(frame);
+      break;
+    }
+    insertFrame(frame, false);
+    drained++;
+  }
+  return drained;
+}
+
+void FrameBuffer::setLanes(const std::vector<IdSet> &lanes) {
+  std::unique_lock<std::recursive_mutex> lock1(m_bufferMutex, std::defer_lock);
+  std::unique_lock<std::recursive_mutex> lock2(m_intermediateBufferMutex, std::defer_lock);
+  std::lock(lock1, lock2);
+
+  m_lanes.resize(lanes.size() + 1);
+  for (size_t i = 0; i < lanes.size(); i++) {
+    m_lanes[i+1].ids = lanes[i];
+    if (!m_lanes[i+1].eviction)
+      m_lanes[i+1].eviction = createEvictionPolicy(m_evictionConfig);
+  }
+}
+
+size_t FrameBuffer::getLaneCount() {
+  return m_lanes.size();
+}
+
+size_t FrameBuffer::laneOf(const canfd_frame *frame) {
+  for (size_t i = 1; i < m_lanes.size(); i++) {
+    if (m_lanes[i].ids.contains(frame->can_id))
+      return i;
+  }
+  return 0;
+}
+
+void FrameBuffer::setSpillQueue(SpillQueue *spillQueue) {
+  m_spillQueue = spillQueue;
 }
 
-void FrameBuffer::insertFrame(canfd_frame *frame) {
+SpillQueue* FrameBuffer::getSpillQueue() {
+  return m_spillQueue;
+}
+
+void FrameBuffer::setOverloadLimit(size_t limit) {
+  m_overloadLimit = limit;
+}
+
+uint64_t FrameBuffer::getOverloadDropCount() {
+  return m_overloadDropCount.get();
+}
+
+void FrameBuffer::setCoalesceIds(const IdSet &ids) {
   std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
+  m_coalesceIds = ids;
+}
 
-  m_buffer.push_back(frame);
-  m_bufferSize += CANNELLONI_FRAME_BASE_SIZE + canfd_len(frame);
+uint64_t FrameBuffer::getCoalescedCount() {
+  return m_coalescedCount.get();
+}
 
-  /* We need one more byte for CAN_FD Frames */
-  if (frame->len & CANFD_FRAME)
-    m_bufferSize++;
+bool FrameBuffer::coalesceFrame(canfd_frame *frame) {
+  if (m_coalesceIds.empty() || !m_coalesceIds.contains(frame->can_id))
+    return false;
+  {
+    std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
+    Lane &lane = m_lanes[laneOf(frame)];
+    auto entry = lane.unsent.find(canfd_id(frame));
+    if (entry == lane.unsent.end())
+      return false;
+    canfd_frame *buffered = *entry->second;
+    lane.bufferSize -= frameSize(buffered);
+    memcpy(buffered, frame, sizeof(canfd_frame));
+    frameTimestamp(buffered) = frameTimestamp(frame);
+    lane.bufferSize += frameSize(buffered);
+    m_coalescedCount.add();
+  }
+  insertFramePool(frame);
+  return true;
 }
 
-void FrameBuffer::returnFrame(canfd_frame *frame) {
+void FrameBuffer::setEvictionPolicy(const EvictionConfig &config) {
   std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
 
-  m_buffer.push_front(frame);
-  m_bufferSize += CANNELLONI_FRAME_BASE_SIZE + canfd_len(frame);
-  /* We need one more byte for CAN_FD Frames */
-  if (frame->len & CANFD_FRAME)
-    m_bufferSize++;
+  m_evictionConfig = config;
+  for (Lane &lane : m_lanes) {
+    lane.eviction = createEvictionPolicy(config);
+    /* Let the new policy know about frames that are already buffered */
+    for (auto it = lane.buffer.begin(); it != lane.buffer.end(); it++)
+      lane.eviction->inserted(it, false);
+  }
+}
+
+void FrameBuffer::registerMetrics(MetricsRegistry &registry, const std::string &labels) {
+  registry.add("cannelloni_pool_frames", "Frames allocated by the frame pool", METRIC_GAUGE,
+               labels + ",state=\"allocated\"", m_poolAllocated);
+  registry.add("cannelloni_pool_frames", "Frames allocated by the frame pool", METRIC_GAUGE,
+               labels + ",state=\"free\"", m_poolFree);
+  registry.add("cannelloni_pool_frames_in_use_max", "Most frames that were in use at once", METRIC_GAUGE,
+               labels, m_inUseHighWater);
+  registry.add("cannelloni_dropped_frames_total", "Frames that were dropped", METRIC_COUNTER,
+               labels + ",reason=\"overload\"", m_overloadDropCount);
+  registry.add("cannelloni_dropped_frames_total", "Frames that were dropped", METRIC_COUNTER,
+               labels + ",reason=\"pool_exhausted\"", m_poolDropCount);
+  registry.add("cannelloni_coalesced_frames_total", "Frames that overwrote an unsent one of the same ID",
+               METRIC_COUNTER, labels, m_coalescedCount);
+}
+
+std::map<canid_t, uint64_t> FrameBuffer::getDropCounts() {
+  std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
+  return m_dropCounts;
+}
+
+void FrameBuffer::returnFrame(canfd_frame *frame, size_t lane) {
+  std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
+
+  pushFront(m_lanes[lane], frame);
 }
 
-canfd_frame* FrameBuffer::requestBufferFront() {
+canfd_frame* FrameBuffer::requestBufferFront(size_t lane) {
   std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
-  if (m_buffer.empty()) {
+  std::list<canfd_frame*> &buffer = m_lanes[lane].buffer;
+  if (buffer.empty()) {
     return NULL;
   }
   else {
-    canfd_frame *ret = m_buffer.front();
-    m_buffer.pop_front();
-    m_bufferSize -= (CANNELLONI_FRAME_BASE_SIZE + canfd_len(ret));
-    /* We need one more byte for CAN_FD Frames */
-    if (ret->len & CANFD_FRAME)
-      m_bufferSize--;
-    return ret;
+    return removeFrame(m_lanes[lane], buffer.begin());
   }
 }
 
 canfd_frame* FrameBuffer::requestBufferBack() {
   std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
-  if (m_buffer.empty()) {
-    return NULL;
-  }
-  else {
-    canfd_frame *ret = m_buffer.back();
-    m_buffer.pop_back();
-    m_bufferSize -= (CANNELLONI_FRAME_BASE_SIZE + canfd_len(ret));
-    /* We need one more byte for CAN_FD Frames */
-    if (ret->len & CANFD_FRAME)
-      m_bufferSize--;
-    return ret;
+  /* Lane 0 first, then from the lowest to the highest priority */
+  for (size_t i = 0; i < m_lanes.size(); i++) {
+    Lane &lane = m_lanes[i == 0 ? 0 : m_lanes.size() - i];
+    if (lane.buffer.empty())
+      continue;
+    return removeFrame(lane, std::prev(lane.buffer.end()));
   }
+  return NULL;
 }
 
-
-
-void FrameBuffer::swapBuffers() {
+void FrameBuffer::swapBuffers(size_t lane) {
   std::unique_lock<std::recursive_mutex> lock1(m_bufferMutex, std::defer_lock);
   std::unique_lock<std::recursive_mutex> lock2(m_intermediateBufferMutex, std::defer_lock);
   std::lock(lock1, lock2);
 
-  std::swap(m_bufferSize, m_intermediateBufferSize);
-  m_buffer.swap(m_intermediateBuffer);
+  Lane &l = m_lanes[lane];
+  std::swap(l.bufferSize, l.intermediateBufferSize);
+  l.buffer.swap(l.intermediateBuffer);
+  l.eviction->cleared();
+  l.unsent.clear();
+  /* The intermediate buffer is usually empty at this point */
+  for (auto it = l.buffer.begin(); it != l.buffer.end(); it++) {
+    l.eviction->inserted(it, false);
+    if (!m_coalesceIds.empty() && m_coalesceIds.contains((*it)->can_id))
+      l.unsent[canfd_id(*it)] = it;
+  }
 }
 
-void FrameBuffer::sortIntermediateBuffer() {
+void FrameBuffer::sortIntermediateBuffer(size_t lane) {
   std::lock_guard<std::recursive_mutex> lock(m_intermediateBufferMutex);
 
-  m_intermediateBuffer.sort(canfd_frame_comp());
+  m_lanes[lane].intermediateBuffer.sort(canfd_frame_comp());
 }
 
-void FrameBuffer::mergeIntermediateBuffer() {
+void FrameBuffer::mergeIntermediateBuffer(size_t lane) {
   std::unique_lock<std::recursive_mutex> lock1(m_poolMutex, std::defer_lock);
   std::unique_lock<std::recursive_mutex> lock2(m_intermediateBufferMutex, std::defer_lock);
   std::lock(lock1, lock2);
 
-  m_framePool.splice(m_framePool.end(), m_intermediateBuffer);
-  m_intermediateBufferSize = 0;
+  m_framePool.splice(m_framePool.end(), m_lanes[lane].intermediateBuffer);
+  m_lanes[lane].intermediateBufferSize = 0;
+  updatePoolMetrics();
 }
 
-void FrameBuffer::returnIntermediateBuffer(std::list<canfd_frame*>::iterator start) {
+void FrameBuffer::returnIntermediateBuffer(std::list<canfd_frame*>::iterator start, size_t lane) {
   std::unique_lock<std::recursive_mutex> lock1(m_intermediateBufferMutex, std::defer_lock);
   std::unique_lock<std::recursive_mutex> lock2(m_bufferMutex, std::defer_lock);
   std::lock(lock1,lock2);
 
-  /* Don't splice since we need to keep track of the size */
-  for (std::list<canfd_frame*>::iterator it = start;
-                                         it != m_intermediateBuffer.end();) {
+  std::list<canfd_frame*> &intermediateBuffer = m_lanes[lane].intermediateBuffer;
+  /*
+   * Don't splice since we need to keep track of the size.
+   * returnFrame inserts at the front, so walk backwards to keep the order.
+   */
+  if (start == intermediateBuffer.end())
+    return;
+  while (!intermediateBuffer.empty()) {
+    std::list<canfd_frame*>::iterator it = std::prev(intermediateBuffer.end());
     canfd_frame *frame = *it;
-    it = m_intermediateBuffer.erase(it);
-    returnFrame(frame);
+    bool last = (it == start);
+    intermediateBuffer.erase(it);
+    returnFrame(frame, lane);
+    if (last)
+      break;
   }
 }
 
-std::list<canfd_frame*>* FrameBuffer::getIntermediateBuffer() {
+std::list<canfd_frame*>* FrameBuffer::getIntermediateBuffer(size_t lane) {
   /* We need to lock m_intermediateBuffer here */
   m_intermediateBufferMutex.lock();
-  return &m_intermediateBuffer;
+  return &m_lanes[lane].intermediateBuffer;
 }
 
 void FrameBuffer::unlockIntermediateBuffer() {
@@ -195,9 +373,13 @@ void FrameBuffer::unlockIntermediateBuffer() {
 
 void FrameBuffer::debug() {
   linfo << "FramePool: " << m_framePool.size() << std::endl;
-  linfo << "Buffer: " << m_buffer.size() << " (elements) "
-        << m_bufferSize << " (bytes)" <<  std::endl;
-  linfo << "intermediateBuffer: " << m_intermediateBuffer.size() << std::endl;
+  for (size_t i = 0; i < m_lanes.size(); i++) {
+    if (m_lanes.size() > 1)
+      linfo << "Lane " << i << ":" << std::endl;
+    linfo << "Buffer: " << m_lanes[i].buffer.size() << " (elements) "
+          << m_lanes[i].bufferSize << " (bytes)" <<  std::endl;
+    linfo << "intermediateBuffer: " << m_lanes[i].intermediateBuffer.size() << std::endl;
+  }
 }
 
 void FrameBuffer::reset() {
@@ -207,11 +389,15 @@ void FrameBuffer::reset() {
   std::lock(lock1, lock2, lock3);
 
   /* Splice everything back into the pool */
-  m_framePool.splice(m_framePool.end(), m_intermediateBuffer);
-  m_framePool.splice(m_framePool.end(), m_buffer);
-
-  m_intermediateBufferSize = 0;
-  m_bufferSize = 0;
+  for (Lane &lane : m_lanes) {
+    m_framePool.splice(m_framePool.end(), lane.intermediateBuffer);
+    m_framePool.splice(m_framePool.end(), lane.buffer);
+    lane.intermediateBufferSize = 0;
+    lane.bufferSize = 0;
+    lane.eviction->cleared();
+    lane.unsent.clear();
+  }
+  updatePoolMetrics();
 }
 
 void FrameBuffer::clearPool() {
@@ -223,25 +409,89 @@ void FrameBuffer::clearPool() {
   reset();
 
   for (canfd_frame *f : m_framePool) {
-    delete f;
+    delete reinterpret_cast<BufferedFrame*>(f);
   }
   m_framePool.clear();
   m_totalAllocCount = 0;
+  updatePoolMetrics();
 }
 
-size_t FrameBuffer::getFrameBufferSize() {
+size_t FrameBuffer::getFrameBufferSize(size_t lane) {
   std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
-  return m_bufferSize;
+  return m_lanes[lane].bufferSize;
+}
+
+size_t FrameBuffer::availableFrames() {
+  std::lock_guard<std::recursive_mutex> lock(m_poolMutex);
+  if (m_maxAllocCount == 0)
+    return SIZE_MAX;
+  return m_framePool.size() + (m_maxAllocCount - std::min(m_maxAllocCount, m_totalAllocCount));
+}
+
+void FrameBuffer::updatePoolMetrics() {
+  m_poolFree.set(m_framePool.size());
+  m_poolAllocated.set(m_totalAllocCount);
+  m_inUseHighWater.raise(m_totalAllocCount - m_framePool.size());
+}
+
+void FrameBuffer::pushBack(Lane &lane, canfd_frame *frame) {
+  lane.buffer.push_back(frame);
+  lane.bufferSize += frameSize(frame);
+  lane.eviction->inserted(std::prev(lane.buffer.end()), false);
+  if (!m_coalesceIds.empty() && m_coalesceIds.contains(frame->can_id))
+    lane.unsent[canfd_id(frame)] = std::prev(lane.buffer.end());
+}
+
+void FrameBuffer::pushFront(Lane &lane, canfd_frame *frame) {
+  lane.buffer.push_front(frame);
+  lane.bufferSize += frameSize(frame);
+  lane.eviction->inserted(lane.buffer.begin(), true);
+  /* A newer frame of the same ID in the buffer is the one to overwrite */
+  if (!m_coalesceIds.empty() && m_coalesceIds.contains(frame->can_id))
+    lane.unsent.emplace(canfd_id(frame), lane.buffer.begin());
+}
+
+canfd_frame* FrameBuffer::removeFrame(Lane &lane, std::list<canfd_frame*>::iterator it) {
+  canfd_frame *frame = *it;
+  lane.eviction->removed(it);
+  if (!m_coalesceIds.empty()) {
+    auto entry = lane.unsent.find(canfd_id(frame));
+    if (entry != lane.unsent.end() && entry->second == it)
+      lane.unsent.erase(entry);
+  }
+  lane.buffer.erase(it);
+  lane.bufferSize -= frameSize(frame);
+  return frame;
+}
+
+canfd_frame* FrameBuffer::evictFrame(Lane &lane) {
+  canfd_frame *frame = removeFrame(lane, lane.eviction->victim(lane.buffer));
+  m_dropCounts[canfd_id(frame)]++;
+  return frame;
+}
+
+canfd_frame* FrameBuffer::evictFrame() {
+  std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
+  /* Lane 0 first, then from the lowest to the highest priority */
+  for (size_t i = 0; i < m_lanes.size(); i++) {
+    Lane &lane = m_lanes[i == 0 ? 0 : m_lanes.size() - i];
+    if (!lane.buffer.empty()) {
+      m_poolDropCount.add();
+      return evictFrame(lane);
+    }
+  }
+  return NULL;
 }
 
 bool FrameBuffer::resizePool(std::size_t size, bool debug) {
   std::lock_guard<std::recursive_mutex> lock(m_poolMutex);
   for (size_t i=0; i<size; i++) {
-      auto f = new canfd_frame;
+      auto f = new BufferedFrame;
       memset(f, 0, sizeof(*f));
-      m_framePool.push_back(f);
+      m_framePool.push_back(&f->frame);
   }
   m_totalAllocCount += size;
+  updatePoolMetrics();
   if (debug)
     linfo << "New Poolsize:" << m_totalAllocCount << std::endl;
   return true;
@@ -20,12 +20,62 @@
 
 #pragma once
 
+#include <atomic>
 #include <list>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <unordered_map>
+#include <vector>
 #include "cannelloni.h"
+#include "eviction.h"
+#include "idset.h"
+#include "metrics.h"
 
 namespace cannelloni {
 
+class SpillQueue;
+
+/*
+ * Number of frames that drainSpill keeps available in the pool
+ * for frames that arrive while draining
+ */
+#define SPILL_POOL_RESERVE 1000
+
+/*
+ * A frame of the pool, the metadata is kept behind the canfd_frame,
+ * which stays the type the threads pass around
+ */
+struct BufferedFrame {
+  canfd_frame frame;
+  /* Kernel receive time in ns since the epoch, 0 if unknown, see latency.h */
+  uint64_t timestamp;
+  /* Monotonic time in ns of the last stage, 0 if not stamped, see StageRecorder */
+  uint64_t stageTime;
+  /* A write to the bus failed, stageTime is the time of the first one */
+  bool writeRetried;
+};
+
+/* Only valid for frames of a FrameBuffer */
+inline uint64_t& frameTimestamp(canfd_frame *frame) {
+  return reinterpret_cast<BufferedFrame*>(frame)->timestamp;
+}
+
+inline uint64_t& frameStageTime(canfd_frame *frame) {
+  return reinterpret_cast<BufferedFrame*>(frame)->stageTime;
+}
+
+inline bool& frameWriteRetried(canfd_frame *frame) {
+  return reinterpret_cast<BufferedFrame*>(frame)->writeRetried;
+}
+
+inline void clearFrameMetadata(canfd_frame *frame) {
+  BufferedFrame *buffered = reinterpret_cast<BufferedFrame*>(frame);
+  buffered->timestamp = 0;
+  buffered->stageTime = 0;
+  buffered->writeRetried = false;
+}
+
 /* Design Notes:
  *
  * This buffer contains canfd_frames received by CANThread or
@@ -49,6 +99,32 @@ namespace cannelloni {
  *
  * The goal is to have FrameBuffer 100% thread-safe to support further
  * use-cases of cannelloni.
+ *
+ * If a SpillQueue is attached, frames are appended to it instead of
+ * the buffer once the pool is exhausted, and until the SpillQueue
+ * has been drained again (see SpillQueue).
+ *
+ * The consumer may set an overload limit when it knows that it can't
+ * send more than a certain amount in time (see RateController). Frames
+ * are then dropped as soon as the buffer grows beyond the limit instead
+ * of queueing up until the pool is exhausted.
+ *
+ * Which frame gets dropped, either because of the overload limit or
+ * because the pool is exhausted, is up to the EvictionPolicy of the
+ * lane. Every dropped frame is counted by its ID.
+ *
+ * Frames with an ID of the coalesce set only carry the latest value of a
+ * signal. While such a frame waits in the buffer, a newer frame with the
+ * same ID overwrites it in place instead of being appended, so it keeps
+ * the position of the first one. Frames that have been swapped into the
+ * intermediate buffer are on their way and are never touched.
+ *
+ * Frames can be split into lanes by their ID, each lane has a buffer
+ * and an intermediate buffer of its own, so the consumer can flush
+ * them independently. Lane 0 takes all frames without a lane and is
+ * the only one the overload limit applies to. The other lanes are in
+ * the order of their priority, so if the pool is exhausted, frames are
+ * evicted from lane 0 first and from lane 1 last.
  */
 
 class FrameBuffer {
@@ -59,19 +135,54 @@ class FrameBuffer {
      * will grow the buffer if no frame is available
      *
      * will return NULL if no memory is available and overwriteLast is false
-     * will return the last frame in the buffer when overwriteLast is true
+     * will return a frame evicted from the buffer when overwriteLast is true
      *
      */
     canfd_frame* requestFrame(bool overwriteLast, bool debug = false);
+    /* Number of frames that can still be requested without overwriting */
+    size_t availableFrames();
 
     /* If a read fails we need to give the frame back */
     void insertFramePool(canfd_frame *frame);
 
-    /* Inserts a frame into the frameBuffer (back) */
-    void insertFrame(canfd_frame *frame);
+    /* Inserts a frame into the frameBuffer (back) of its lane
+     * or spills it if allowSpill is true and spilling is needed */
+    void insertFrame(canfd_frame *frame, bool allowSpill = true);
+
+    /* Frames with an ID of lanes[i] go to lane i+1, must be called before frames are inserted */
+    void setLanes(const std::vector<IdSet> &lanes);
+    size_t getLaneCount();
+    size_t laneOf(const canfd_frame *frame);
+
+    /* Appends a frame to the SpillQueue and returns it to the pool.
+     * Returns false if the frame could not be spilled. */
+    bool spillFrame(canfd_frame *frame);
+
+    /* Moves up to maxFrames from the SpillQueue into the buffer (back)
+     * and returns the number of frames moved */
+    size_t drainSpill(size_t maxFrames);
+
+    void setSpillQueue(SpillQueue *spillQueue);
+    SpillQueue* getSpillQueue();
+
+    /* Maximum size of lane 0 in bytes before frames are dropped, 0 is unlimited */
+    void setOverloadLimit(size_t limit);
+    uint64_t getOverloadDropCount();
+
+    /* Only the latest unsent frame of these IDs is kept, must be called before frames are inserted */
+    void setCoalesceIds(const IdSet &ids);
+    uint64_t getCoalescedCount();
+
+    /* Pool occupancy and drops, labels tell the buffers apart */
+    void registerMetrics(MetricsRegistry &registry, const std::string &labels);
+
+    /* Must be called before frames are inserted, the default is EVICT_OLDEST */
+    void setEvictionPolicy(const EvictionConfig &config);
+    /* Frames dropped by the overload limit or because the pool was exhausted, by ID */
+    std::map<canid_t, uint64_t> getDropCounts();
 
     /* Inserts a frame into the frameBuffer (front) */
-    void returnFrame(canfd_frame *frame);
+    void returnFrame(canfd_frame *frame, size_t lane = 0);
 
     /* Instead of operating on the intermediateBuffer, we can
      * also request a frame from the buffer and put it back
@@ -79,28 +190,29 @@ class FrameBuffer {
      * This is useful when the consumer is a lot slower than
      * the producer (see Design Notes)
      */
-    canfd_frame* requestBufferFront();
+    canfd_frame* requestBufferFront(size_t lane = 0);
 
+    /* Takes the last frame of the lane with the lowest priority */
     canfd_frame* requestBufferBack();
 
     /* Swaps m_Buffer with m_intermediateBuffer */
-    void swapBuffers();
+    void swapBuffers(size_t lane = 0);
 
     /* Sorts m_intermediateBuffer by canfd_frame->id */
-    void sortIntermediateBuffer();
+    void sortIntermediateBuffer(size_t lane = 0);
 
     /* merges m_intermediateBuffer back into m_poolMutex */
-    void mergeIntermediateBuffer();
+    void mergeIntermediateBuffer(size_t lane = 0);
 
     /* merges parts of m_intermediateBuffer back into m_buffer */
-    void returnIntermediateBuffer(std::list<canfd_frame*>::iterator start);
+    void returnIntermediateBuffer(std::list<canfd_frame*>::iterator start, size_t lane = 0);
 
     /* This will return a pointer to the current intermediateBuffer.
      * Once the operation is done the caller MUST call
      * unlockIntermediateBuffer to unlock the mutex in order to
      * prevent a deadlock!
      */
-    std::list<canfd_frame*>* getIntermediateBuffer();
+    std::list<canfd_frame*>* getIntermediateBuffer(size_t lane = 0);
 
     void unlockIntermediateBuffer();
 
@@ -111,24 +223,45 @@ class FrameBuffer {
 
     void clearPool();
 
-    size_t getFrameBufferSize();
+    size_t getFrameBufferSize(size_t lane = 0);
 
   private:
+    struct Lane {
+      IdSet ids;
+      std::list<canfd_frame*> buffer;
+      std::list<canfd_frame*> intermediateBuffer;
+      /* Track current frame buffer size */
+      size_t bufferSize = 0;
+      size_t intermediateBufferSize = 0;
+      std::unique_ptr<EvictionPolicy> eviction;
+      /* Frame in buffer of each ID of the coalesce set */
+      std::unordered_map<canid_t, std::list<canfd_frame*>::iterator> unsent;
+    };
+
     bool resizePool(std::size_t size, bool debug = false);
+    /* Changes of a lane's buffer, these keep the size and the EvictionPolicy up to date */
+    void pushBack(Lane &lane, canfd_frame *frame);
+    void pushFront(Lane &lane, canfd_frame *frame);
+    canfd_frame* removeFrame(Lane &lane, std::list<canfd_frame*>::iterator it);
+    /* Replaces the buffered frame with the ID of frame, returns false if there is none */
+    bool coalesceFrame(canfd_frame *frame);
+    /* Drops the frame picked by the EvictionPolicy of lane, which is not empty */
+    canfd_frame* evictFrame(Lane &lane);
+    /* Evicts from the lane with the lowest priority that is not empty */
+    canfd_frame* evictFrame();
+    /* Must be called with m_poolMutex held after the pool changed */
+    void updatePoolMetrics();
 
   private:
     std::list<canfd_frame*> m_framePool;
-    std::list<canfd_frame*> m_buffer;
-    std::list<canfd_frame*> m_intermediateBuffer;
+    /* Lane 0 is the default lane */
+    std::vector<Lane> m_lanes;
 
     uint64_t m_totalAllocCount;
     /* When filling/swapping the buffers we currently need a mutex */
     std::recursive_mutex m_bufferMutex;
     std::recursive_mutex m_intermediateBufferMutex;
     std::recursive_mutex m_poolMutex;
-    /* Track current frame buffer size */
-    size_t m_bufferSize;
-    size_t m_intermediateBufferSize;
     /*
      * This is the maximum of frames that will be
      * allocated. This guarantees that cannelloni stays
@@ -138,6 +271,20 @@ class FrameBuffer {
      * unlimited
      */
     size_t m_maxAllocCount;
+
+    SpillQueue *m_spillQueue;
+    std::atomic<size_t> m_overloadLimit;
+    Metric m_overloadDropCount;
+    /* Frames evicted because the pool was exhausted */
+    Metric m_poolDropCount;
+    EvictionConfig m_evictionConfig;
+    std::map<canid_t, uint64_t> m_dropCounts;
+    IdSet m_coalesceIds;
+    Metric m_coalescedCount;
+    Metric m_poolFree;
+    Metric m_poolAllocated;
+    /* Most frames that were out of the pool at once */
+    Metric m_inUseHighWater;
 };
 
 }
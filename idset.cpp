@@ -0,0 +1,92 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "idset.h"
+
+#include <cstdlib>
+#include <sstream>
+
+using namespace cannelloni;
+
+static bool parseId(const std::string &str, uint32_t &id) {
+  if (str.empty())
+    return false;
+  char *end;
+  unsigned long value = strtoul(str.c_str(), &end, 0);
+  if (*end != '\0' || value > CAN_EFF_MASK)
+    return false;
+  id = value;
+  return true;
+}
+
+bool IdSet::parse(const std::string &list) {
+  std::vector<Range> ranges;
+  std::istringstream ss(list);
+  std::string item;
+  while (getline(ss, item, ',')) {
+    Range range;
+    std::size_t pos = item.find('-');
+    if (pos == std::string::npos) {
+      if (!parseId(item, range.low))
+        return false;
+      range.high = range.low;
+    } else {
+      if (!parseId(item.substr(0, pos), range.low) ||
+          !parseId(item.substr(pos+1), range.high) ||
+          range.low > range.high)
+        return false;
+    }
+    ranges.push_back(range);
+  }
+  if (ranges.empty())
+    return false;
+  m_ranges.swap(ranges);
+  return true;
+}
+
+bool IdSet::contains(canid_t can_id) const {
+  uint32_t id;
+  if (can_id & CAN_EFF_FLAG)
+    id = can_id & CAN_EFF_MASK;
+  else
+    id = can_id & CAN_SFF_MASK;
+  for (const Range &range : m_ranges) {
+    if (id >= range.low && id <= range.high)
+      return true;
+  }
+  return false;
+}
+
+bool IdSet::empty() const {
+  return m_ranges.empty();
+}
+
+std::string IdSet::toString() const {
+  std::ostringstream ss;
+  ss << std::hex << std::showbase;
+  for (std::size_t i = 0; i < m_ranges.size(); i++) {
+    if (i > 0)
+      ss << ",";
+    ss << m_ranges[i].low;
+    if (m_ranges[i].high != m_ranges[i].low)
+      ss << "-" << m_ranges[i].high;
+  }
+  return ss.str();
+}
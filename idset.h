@@ -0,0 +1,53 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <linux/can.h>
+
+namespace cannelloni {
+
+/*
+ * A set of CAN IDs, given as a comma separated list of IDs and
+ * ranges, e.g. "0x100,0x200-0x2ff,1234". IDs are compared without
+ * flags, so standard and extended frames with the same numeric
+ * ID are both in the set.
+ */
+class IdSet {
+  public:
+    /* Replaces the content of the set, returns false on a syntax error */
+    bool parse(const std::string &list);
+    bool contains(canid_t can_id) const;
+    bool empty() const;
+    std::string toString() const;
+
+  private:
+    struct Range {
+      uint32_t low;
+      uint32_t high;
+    };
+    std::vector<Range> m_ranges;
+};
+
+}
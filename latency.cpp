@@ -0,0 +1,214 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "latency.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include <time.h>
+
+using namespace cannelloni;
+
+uint64_t cannelloni::realtimeNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t cannelloni::monotonicNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+LatencyHistogram::LatencyHistogram()
+  : m_count(0)
+  , m_max(0)
+{
+  m_buckets.fill(0);
+}
+
+size_t LatencyHistogram::bucketOf(uint64_t delay) {
+  if (delay < LATENCY_SUB_BUCKETS)
+    return delay;
+  unsigned int exponent = 63 - __builtin_clzll(delay);
+  if (exponent >= LATENCY_MAX_BITS)
+    return LATENCY_BUCKETS - 1;
+  size_t sub = (delay >> (exponent - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+  return (exponent - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS + sub;
+}
+
+uint64_t LatencyHistogram::bucketValue(size_t bucket) {
+  if (bucket < LATENCY_SUB_BUCKETS)
+    return bucket;
+  unsigned int exponent = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+  uint64_t sub = bucket % LATENCY_SUB_BUCKETS;
+  uint64_t width = 1ULL << (exponent - LATENCY_SUB_BUCKET_BITS);
+  return ((LATENCY_SUB_BUCKETS + sub) << (exponent - LATENCY_SUB_BUCKET_BITS)) + width - 1;
+}
+
+void LatencyHistogram::add(uint64_t delay) {
+  m_buckets[bucketOf(delay)]++;
+  m_count++;
+  m_max = std::max(m_max, delay);
+}
+
+uint64_t LatencyHistogram::getCount() const {
+  return m_count;
+}
+
+uint64_t LatencyHistogram::getMax() const {
+  return m_max;
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const {
+  if (m_count == 0)
+    return 0;
+  uint64_t rank = std::max<uint64_t>(1, std::ceil(fraction * m_count));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += m_buckets[i];
+    if (seen >= rank)
+      return std::min(bucketValue(i), m_max);
+  }
+  return m_max;
+}
+
+std::string LatencyHistogram::summary(const char *unit) const {
+  std::ostringstream out;
+  out << "p50: " << percentile(0.5) << " p99: " << percentile(0.99)
+      << " p99.9: " << percentile(0.999) << " max: " << m_max << " " << unit
+      << " (" << m_count << " frames)";
+  return out.str();
+}
+
+LatencyTracker::LatencyTracker()
+  : m_negativeCount(0)
+{}
+
+void LatencyTracker::setIds(const IdSet &ids) {
+  m_ids = ids;
+}
+
+void LatencyTracker::add(const canfd_frame *frame, int64_t delay) {
+  if (delay < 0) {
+    m_negativeCount++;
+    delay = 0;
+  }
+  m_total.add(delay);
+  if (!m_ids.empty() && m_ids.contains(frame->can_id))
+    m_perId[canfd_id(frame)].add(delay);
+}
+
+const LatencyHistogram& LatencyTracker::getTotal() const {
+  return m_total;
+}
+
+uint64_t LatencyTracker::getNegativeCount() const {
+  return m_negativeCount;
+}
+
+std::vector<std::string> LatencyTracker::idSummaries() const {
+  std::vector<std::string> lines;
+  for (const auto &entry : m_perId) {
+    std::ostringstream out;
+    out << "0x" << std::hex << (entry.first & CAN_EFF_MASK) << std::dec
+        << ((entry.first & CAN_EFF_FLAG) ? "x" : "") << ": " << entry.second.summary();
+    lines.push_back(out.str());
+  }
+  return lines;
+}
+
+const char* cannelloni::stageName(LatencyStage stage) {
+  switch (stage) {
+    case STAGE_CAN_READ: return "CAN read";
+    case STAGE_FILTER: return "Filter";
+    case STAGE_POOL: return "Pool";
+    case STAGE_QUEUE: return "Queue";
+    case STAGE_ENCODE: return "Encode";
+    case STAGE_SEND: return "Send";
+    case STAGE_DECODE: return "Decode";
+    case STAGE_CAN_QUEUE: return "CAN queue";
+    case STAGE_CAN_WRITE: return "CAN write";
+    default: return "Unknown";
+  }
+}
+
+AtomicHistogram::AtomicHistogram()
+  : m_max(0)
+{
+  for (auto &bucket : m_buckets)
+    bucket.store(0, std::memory_order_relaxed);
+}
+
+void AtomicHistogram::add(uint64_t delay) {
+  /* There is only one writer, so load and store suffice */
+  std::atomic<uint64_t> &bucket = m_buckets[LatencyHistogram::bucketOf(delay)];
+  bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  if (delay > m_max.load(std::memory_order_relaxed))
+    m_max.store(delay, std::memory_order_relaxed);
+}
+
+void AtomicHistogram::mergeInto(LatencyHistogram &histogram) const {
+  for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+    uint64_t count = m_buckets[i].load(std::memory_order_relaxed);
+    histogram.m_buckets[i] += count;
+    histogram.m_count += count;
+  }
+  histogram.m_max = std::max(histogram.m_max, m_max.load(std::memory_order_relaxed));
+}
+
+StageRecorder::StageRecorder()
+  : m_enabled(false)
+{}
+
+void StageRecorder::setEnabled(bool enabled) {
+  m_enabled = enabled;
+}
+
+bool StageRecorder::isEnabled() const {
+  return m_enabled;
+}
+
+void StageRecorder::add(LatencyStage stage, uint64_t since, uint64_t now) {
+  if (since == 0)
+    return;
+  m_stages[stage].add(now > since ? now - since : 0);
+}
+
+void StageRecorder::mergeInto(LatencyStage stage, LatencyHistogram &histogram) const {
+  m_stages[stage].mergeInto(histogram);
+}
+
+std::vector<std::string> cannelloni::stageSummaries(const std::vector<const StageRecorder*> &recorders) {
+  std::vector<std::string> lines;
+  for (int stage = 0; stage < STAGE_COUNT; stage++) {
+    LatencyHistogram histogram;
+    for (const StageRecorder *recorder : recorders)
+      recorder->mergeInto(static_cast<LatencyStage>(stage), histogram);
+    if (histogram.getCount() == 0)
+      continue;
+    lines.push_back(std::string(stageName(static_cast<LatencyStage>(stage))) + ": " +
+                    histogram.summary("ns"));
+  }
+  return lines;
+}
@@ -0,0 +1,188 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cannelloni.h"
+#include "idset.h"
+
+namespace cannelloni {
+
+/* Each power of two is split into 2^n buckets, which limits the error to 1/2^n */
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+/* Delays up to 2^n units are recorded, larger ones count as the largest bucket */
+#define LATENCY_MAX_BITS 36
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+/* Current CLOCK_REALTIME in ns, the clock of the kernel receive timestamps */
+uint64_t realtimeNow();
+/* Current CLOCK_MONOTONIC in ns, the clock of the stage stamps */
+uint64_t monotonicNow();
+
+/* Design Notes:
+ *
+ * Each frame read from the bus keeps the kernel receive timestamp
+ * (SO_TIMESTAMPNS) in its BufferedFrame. The UDP sender records the
+ * time the frame waited until it was sent, and appends the timestamps to
+ * the DATA packet (see CannelloniExtFrameTimes). The receiver restores
+ * them and records the delay from the receive on the remote bus to the
+ * write on the local bus once the frame was written. That delay is only
+ * as good as the synchronization of the clocks of both hosts.
+ *
+ * The delays go into log-linear histograms with a relative error below
+ * 1/LATENCY_SUB_BUCKETS, so percentiles can be kept for a long time in
+ * constant memory.
+ */
+
+class LatencyHistogram {
+  friend class AtomicHistogram;
+
+  public:
+    LatencyHistogram();
+
+    /* Records a delay in us (ns for the stages) */
+    void add(uint64_t delay);
+    uint64_t getCount() const;
+    uint64_t getMax() const;
+    /* Delay below which fraction (0..1) of the recorded delays are */
+    uint64_t percentile(double fraction) const;
+    /* p50, p99, p99.9 and max */
+    std::string summary(const char *unit = "us") const;
+
+  private:
+    static size_t bucketOf(uint64_t delay);
+    /* Largest delay that falls into bucket */
+    static uint64_t bucketValue(size_t bucket);
+
+  private:
+    std::array<uint64_t, LATENCY_BUCKETS> m_buckets;
+    uint64_t m_count;
+    uint64_t m_max;
+};
+
+struct LatencyConfig {
+  bool enabled;
+  /* IDs that get a histogram of their own */
+  IdSet ids;
+};
+
+/* A histogram of all frames and one for each of some IDs */
+class LatencyTracker {
+  public:
+    LatencyTracker();
+
+    void setIds(const IdSet &ids);
+    /* Records a delay in us, negative delays count as 0 */
+    void add(const canfd_frame *frame, int64_t delay);
+    const LatencyHistogram& getTotal() const;
+    /* Delays below 0, a sign of clocks that are not synchronized */
+    uint64_t getNegativeCount() const;
+    /* The summary of each ID */
+    std::vector<std::string> idSummaries() const;
+
+  private:
+    IdSet m_ids;
+    LatencyHistogram m_total;
+    std::map<canid_t, LatencyHistogram> m_perId;
+    uint64_t m_negativeCount;
+};
+
+/* Design Notes:
+ *
+ * With stage latencies enabled, each BufferedFrame carries the monotonic
+ * time of the last stage it passed. Every following stage records the
+ * time since then and stamps the frame again, so a frame costs one
+ * clock_gettime() per stage and no extra memory per stage.
+ *
+ * The thread that handles a stage records it into its own StageRecorder.
+ * Each histogram has exactly one writer, which updates the buckets with
+ * relaxed loads and stores instead of read-modify-write operations. Other
+ * threads can merge the histograms at any time without locking, they may
+ * just miss the frames that are recorded meanwhile.
+ */
+
+/* The stages of the pipeline, each is the time since the previous one */
+enum LatencyStage {
+  /* Kernel receive to read, only with --latency */
+  STAGE_CAN_READ,
+  /* Read to the end of the filters and rate limits */
+  STAGE_FILTER,
+  /* Requesting a frame from the pool, frames read from the bus only once they passed the filters */
+  STAGE_POOL,
+  /* Queued to the start of its packet, i.e. FrameBuffer, flush timer and pacing */
+  STAGE_QUEUE,
+  /* Encoding the packet */
+  STAGE_ENCODE,
+  /* Sending the packet */
+  STAGE_SEND,
+  /* Decoding the received packet until the frame is queued for the bus */
+  STAGE_DECODE,
+  /* Queued for the bus to the first write */
+  STAGE_CAN_QUEUE,
+  /* First write to written, including retries */
+  STAGE_CAN_WRITE,
+  STAGE_COUNT
+};
+
+const char* stageName(LatencyStage stage);
+
+/* A LatencyHistogram with a single writer that can be read concurrently */
+class AtomicHistogram {
+  public:
+    AtomicHistogram();
+
+    /* Only to be called by the writer */
+    void add(uint64_t delay);
+    /* Adds the delays recorded so far to histogram */
+    void mergeInto(LatencyHistogram &histogram) const;
+
+  private:
+    std::array<std::atomic<uint64_t>, LATENCY_BUCKETS> m_buckets;
+    std::atomic<uint64_t> m_max;
+};
+
+/* The stage histograms of one thread */
+class StageRecorder {
+  public:
+    StageRecorder();
+
+    void setEnabled(bool enabled);
+    bool isEnabled() const;
+    /* Records now - since in ns, frames that were never stamped (0) are left out */
+    void add(LatencyStage stage, uint64_t since, uint64_t now);
+    void mergeInto(LatencyStage stage, LatencyHistogram &histogram) const;
+
+  private:
+    bool m_enabled;
+    std::array<AtomicHistogram, STAGE_COUNT> m_stages;
+};
+
+/* The summary of each stage that recorded frames, merged over recorders */
+std::vector<std::string> stageSummaries(const std::vector<const StageRecorder*> &recorders);
+
+}
@@ -0,0 +1,557 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "logging.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <sstream>
+#include <string_view>
+#include <thread>
+
+#include <time.h>
+
+using namespace cannelloni;
+
+enum LogArgument : uint8_t {
+  LOG_ARG_STRING,
+  LOG_ARG_CHAR,
+  LOG_ARG_BOOL,
+  LOG_ARG_INT,
+  LOG_ARG_UINT,
+  LOG_ARG_DOUBLE,
+  LOG_ARG_STREAM_MANIPULATOR,
+  LOG_ARG_IOS_MANIPULATOR,
+  LOG_ARG_WIDTH,
+  LOG_ARG_PRECISION,
+  LOG_ARG_FILL,
+  LOG_ARG_FLAGS
+};
+
+static_assert(sizeof(canfd_frame) <= LOG_RECORD_DATA, "frames must fit into a record");
+
+/* A ring with one producer, the owning thread, and the log thread as consumer */
+class cannelloni::LogRing {
+  public:
+    LogRing()
+      : m_head(0)
+      , m_tail(0)
+      , m_closed(false)
+    {}
+
+    bool push(const LogRecord &record) {
+      uint64_t tail = m_tail.load(std::memory_order_relaxed);
+      if (tail - m_head.load(std::memory_order_acquire) == LOG_RING_SIZE)
+        return false;
+      /* Only the used part of the data */
+      memcpy(&m_records[tail % LOG_RING_SIZE], &record, offsetof(LogRecord, data) + record.length);
+      m_tail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    void popAll(std::vector<LogRecord> &records) {
+      uint64_t head = m_head.load(std::memory_order_relaxed);
+      uint64_t tail = m_tail.load(std::memory_order_acquire);
+      for (; head != tail; head++)
+        records.push_back(m_records[head % LOG_RING_SIZE]);
+      m_head.store(head, std::memory_order_release);
+    }
+
+    /* Called by the owning thread when it exits */
+    void close() {
+      m_closed.store(true, std::memory_order_release);
+    }
+    bool isClosed() const {
+      return m_closed.load(std::memory_order_acquire);
+    }
+
+  private:
+    std::array<LogRecord, LOG_RING_SIZE> m_records;
+    std::atomic<uint64_t> m_head;
+    std::atomic<uint64_t> m_tail;
+    std::atomic<bool> m_closed;
+};
+
+namespace {
+
+/* Closes the ring of a thread once it exits, the log thread frees it */
+struct RingHolder {
+  std::shared_ptr<LogRing> ring;
+
+  ~RingHolder() {
+    if (ring)
+      ring->close();
+  }
+};
+
+thread_local RingHolder t_ring;
+
+const char* baseName(const char *path) {
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+}
+
+LogSite::LogSite(LogLevel level, const char *file, int line, const char *function)
+  : level(level)
+  , file(baseName(file))
+  , line(line)
+  , function(function)
+  , m_second(0)
+  , m_count(0)
+  , m_suppressed(0)
+{
+}
+
+bool LogSite::admit(uint32_t &suppressed) {
+  uint32_t rate = Logger::instance().getRate();
+  /* Sites like the ones of the frame buffer are shared by threads */
+  if (rate != 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t second = ts.tv_sec;
+    if (m_second.load(std::memory_order_relaxed) != second &&
+        m_second.exchange(second, std::memory_order_relaxed) != second)
+      m_count.store(0, std::memory_order_relaxed);
+    if (m_count.fetch_add(1, std::memory_order_relaxed) >= rate) {
+      m_suppressed.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  }
+  suppressed = m_suppressed.exchange(0, std::memory_order_relaxed);
+  return true;
+}
+
+LogLine::LogLine(LogSite &site) {
+  m_record.site = &site;
+  m_record.length = 0;
+  m_record.overflow = NULL;
+  m_record.suppressed = 0;
+  m_active = site.admit(m_record.suppressed);
+}
+
+LogLine::~LogLine() {
+  if (m_active)
+    Logger::instance().write(m_record);
+}
+
+uint8_t* LogLine::reserve(size_t size) {
+  if (!m_record.overflow) {
+    if (m_record.length + size <= LOG_RECORD_DATA) {
+      uint8_t *data = m_record.data + m_record.length;
+      m_record.length += size;
+      return data;
+    }
+    m_record.overflow = new std::vector<uint8_t>(m_record.data, m_record.data + m_record.length);
+    /* The ring copies only the head of the record from now on */
+    m_record.length = 0;
+  }
+  size_t offset = m_record.overflow->size();
+  m_record.overflow->resize(offset + size);
+  return m_record.overflow->data() + offset;
+}
+
+void LogLine::append(uint8_t tag, const void *value, size_t size) {
+  if (!m_active)
+    return;
+  uint8_t *data = reserve(1 + size);
+  data[0] = tag;
+  memcpy(data + 1, value, size);
+}
+
+void LogLine::appendString(const char *value, size_t size) {
+  if (!m_active)
+    return;
+  /* Longer strings are split, they are formatted back to back */
+  do {
+    uint16_t length = std::min<size_t>(size, UINT16_MAX);
+    uint8_t *data = reserve(1 + sizeof(length) + length);
+    data[0] = LOG_ARG_STRING;
+    memcpy(data + 1, &length, sizeof(length));
+    memcpy(data + 1 + sizeof(length), value, length);
+    value += length;
+    size -= length;
+  } while (size > 0);
+}
+
+void LogLine::appendInteger(uint64_t value, bool isSigned) {
+  append(isSigned ? LOG_ARG_INT : LOG_ARG_UINT, &value, sizeof(value));
+}
+
+LogLine& LogLine::operator<<(const char *value) {
+  if (m_active)
+    appendString(value, strlen(value));
+  return *this;
+}
+
+LogLine& LogLine::operator<<(const std::string &value) {
+  appendString(value.data(), value.size());
+  return *this;
+}
+
+LogLine& LogLine::operator<<(char value) {
+  append(LOG_ARG_CHAR, &value, sizeof(value));
+  return *this;
+}
+
+LogLine& LogLine::operator<<(signed char value) {
+  return *this << static_cast<char>(value);
+}
+
+LogLine& LogLine::operator<<(unsigned char value) {
+  return *this << static_cast<char>(value);
+}
+
+LogLine& LogLine::operator<<(bool value) {
+  append(LOG_ARG_BOOL, &value, sizeof(value));
+  return *this;
+}
+
+LogLine& LogLine::operator<<(double value) {
+  append(LOG_ARG_DOUBLE, &value, sizeof(value));
+  return *this;
+}
+
+LogLine& LogLine::operator<<(std::ostream& (*manipulator)(std::ostream&)) {
+  append(LOG_ARG_STREAM_MANIPULATOR, &manipulator, sizeof(manipulator));
+  return *this;
+}
+
+LogLine& LogLine::operator<<(std::ios_base& (*manipulator)(std::ios_base&)) {
+  append(LOG_ARG_IOS_MANIPULATOR, &manipulator, sizeof(manipulator));
+  return *this;
+}
+
+static const std::ios_base::fmtflags defaultFlags = std::ios_base::skipws | std::ios_base::dec;
+
+static std::ostringstream& probe() {
+  thread_local std::ostringstream stream;
+  return stream;
+}
+
+std::ostream& LogLine::probeStream() {
+  std::ostringstream &stream = probe();
+  stream.str("");
+  stream.clear();
+  stream.flags(defaultFlags);
+  stream.width(0);
+  stream.precision(6);
+  stream.fill(' ');
+  return stream;
+}
+
+void LogLine::appendProbe() {
+  std::ostringstream &stream = probe();
+  std::string text = stream.str();
+  if (!text.empty())
+    appendString(text.data(), text.size());
+  /* Manipulators like std::setw change the state of the stream instead */
+  int64_t width = stream.width();
+  if (width != 0)
+    append(LOG_ARG_WIDTH, &width, sizeof(width));
+  int64_t precision = stream.precision();
+  if (precision != 6)
+    append(LOG_ARG_PRECISION, &precision, sizeof(precision));
+  char fill = stream.fill();
+  if (fill != ' ')
+    append(LOG_ARG_FILL, &fill, sizeof(fill));
+  uint64_t flags[2] = { static_cast<uint64_t>(stream.flags()),
+                        static_cast<uint64_t>(stream.flags() ^ defaultFlags) };
+  if (flags[1] != 0)
+    append(LOG_ARG_FLAGS, flags, sizeof(flags));
+}
+
+/* Applies the arguments of a record to out */
+static void formatArguments(std::ostream &out, const uint8_t *data, size_t length) {
+  const uint8_t *end = data + length;
+  while (data < end) {
+    uint8_t tag = *data++;
+    switch (tag) {
+      case LOG_ARG_STRING: {
+        uint16_t size;
+        memcpy(&size, data, sizeof(size));
+        out << std::string_view(reinterpret_cast<const char*>(data + sizeof(size)), size);
+        data += sizeof(size) + size;
+        break;
+      }
+      case LOG_ARG_CHAR:
+        out << static_cast<char>(*data);
+        data += 1;
+        break;
+      case LOG_ARG_BOOL:
+        out << static_cast<bool>(*data);
+        data += sizeof(bool);
+        break;
+      case LOG_ARG_INT:
+      case LOG_ARG_UINT: {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        if (tag == LOG_ARG_INT)
+          out << static_cast<int64_t>(value);
+        else
+          out << value;
+        data += sizeof(value);
+        break;
+      }
+      case LOG_ARG_DOUBLE: {
+        double value;
+        memcpy(&value, data, sizeof(value));
+        out << value;
+        data += sizeof(value);
+        break;
+      }
+      case LOG_ARG_STREAM_MANIPULATOR: {
+        std::ostream& (*manipulator)(std::ostream&);
+        memcpy(&manipulator, data, sizeof(manipulator));
+        out << manipulator;
+        data += sizeof(manipulator);
+        break;
+      }
+      case LOG_ARG_IOS_MANIPULATOR: {
+        std::ios_base& (*manipulator)(std::ios_base&);
+        memcpy(&manipulator, data, sizeof(manipulator));
+        out << manipulator;
+        data += sizeof(manipulator);
+        break;
+      }
+      case LOG_ARG_WIDTH:
+      case LOG_ARG_PRECISION: {
+        int64_t value;
+        memcpy(&value, data, sizeof(value));
+        if (tag == LOG_ARG_WIDTH)
+          out.width(value);
+        else
+          out.precision(value);
+        data += sizeof(value);
+        break;
+      }
+      case LOG_ARG_FILL:
+        out.fill(static_cast<char>(*data));
+        data += 1;
+        break;
+      case LOG_ARG_FLAGS: {
+        uint64_t flags[2];
+        memcpy(flags, data, sizeof(flags));
+        out.setf(static_cast<std::ios_base::fmtflags>(flags[0]),
+                 static_cast<std::ios_base::fmtflags>(flags[1]));
+        data += sizeof(flags);
+        break;
+      }
+      default:
+        return;
+    }
+  }
+}
+
+Logger& Logger::instance() {
+  static Logger logger;
+  return logger;
+}
+
+Logger::Logger()
+  : m_async(false)
+  , m_rate(LOG_RATE_DEFAULT)
+  , m_sequence(0)
+  , m_droppedCount(0)
+  , m_reportedDropCount(0)
+{
+}
+
+Logger::~Logger() {
+  if (isRunning()) {
+    stop();
+    join();
+  }
+}
+
+int Logger::start() {
+  m_async.store(true, std::memory_order_release);
+  return Thread::start();
+}
+
+void Logger::stop() {
+  Thread::stop();
+}
+
+void Logger::run() {
+  while (m_started) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(LOG_FLUSH_INTERVAL));
+    drain();
+  }
+  /* Everything from now on is written directly */
+  m_async.store(false, std::memory_order_release);
+  drain();
+}
+
+void Logger::setRate(uint32_t rate) {
+  m_rate.store(rate, std::memory_order_relaxed);
+}
+
+uint32_t Logger::getRate() const {
+  return m_rate.load(std::memory_order_relaxed);
+}
+
+uint64_t Logger::getDroppedCount() const {
+  return m_droppedCount.load(std::memory_order_relaxed);
+}
+
+LogRing* Logger::ring() {
+  if (!t_ring.ring) {
+    t_ring.ring = std::make_shared<LogRing>();
+    std::lock_guard<std::mutex> lock(m_ringsMutex);
+    m_rings.push_back(t_ring.ring);
+  }
+  return t_ring.ring.get();
+}
+
+void Logger::write(LogRecord &record) {
+  record.sequence = m_sequence.fetch_add(1, std::memory_order_relaxed);
+  if (m_async.load(std::memory_order_acquire)) {
+    if (!ring()->push(record)) {
+      delete record.overflow;
+      m_droppedCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    return;
+  }
+  std::lock_guard<std::mutex> lock(m_writeMutex);
+  format(record);
+  delete record.overflow;
+  std::cout.flush();
+}
+
+size_t Logger::drain() {
+  std::vector<std::shared_ptr<LogRing>> rings;
+  {
+    std::lock_guard<std::mutex> lock(m_ringsMutex);
+    rings = m_rings;
+  }
+  std::vector<LogRecord> records;
+  std::vector<LogRing*> closed;
+  for (const auto &ring : rings) {
+    /* A closed ring gets no more records, so it is empty after this */
+    if (ring->isClosed())
+      closed.push_back(ring.get());
+    ring->popAll(records);
+  }
+  if (!closed.empty()) {
+    std::lock_guard<std::mutex> lock(m_ringsMutex);
+    std::erase_if(m_rings, [&closed](const auto &ring) {
+      return std::find(closed.begin(), closed.end(), ring.get()) != closed.end();
+    });
+  }
+  std::sort(records.begin(), records.end(),
+            [](const LogRecord &a, const LogRecord &b) { return a.sequence < b.sequence; });
+
+  std::lock_guard<std::mutex> lock(m_writeMutex);
+  for (const LogRecord &record : records) {
+    format(record);
+    delete record.overflow;
+  }
+  uint64_t dropped = getDroppedCount();
+  if (dropped != m_reportedDropCount) {
+    std::cerr << "WARNING:logging.cpp:drain:" << dropped - m_reportedDropCount
+              << " log messages dropped, the log thread could not keep up" << std::endl;
+    m_reportedDropCount = dropped;
+  }
+  if (!records.empty())
+    std::cout.flush();
+  return records.size();
+}
+
+void Logger::format(const LogRecord &record) {
+  std::ostringstream out;
+  if (!record.site) {
+    canfd_frame frame;
+    memcpy(&frame, record.data, sizeof(frame));
+    formatCANInfo(out, &frame);
+    std::cout << out.str();
+    return;
+  }
+  const LogSite &site = *record.site;
+  switch (site.level) {
+    case LOG_INFO: out << "INFO:"; break;
+    case LOG_WARNING: out << "WARNING:"; break;
+    case LOG_ERROR: out << "ERROR:"; break;
+  }
+  out << site.file << "[" << site.line << "]:" << site.function << ":";
+  if (record.suppressed)
+    out << "(" << record.suppressed << " suppressed) ";
+  if (record.overflow)
+    formatArguments(out, record.overflow->data(), record.overflow->size());
+  else
+    formatArguments(out, record.data, record.length);
+  (site.level == LOG_INFO ? std::cout : std::cerr) << out.str();
+}
+
+FrameDebugger::FrameDebugger()
+  : m_config({ /* sample */ 1, /* ids */ IdSet() })
+  , m_skipped(0)
+{
+}
+
+void FrameDebugger::setup(const FrameDebugConfig &config) {
+  m_config = config;
+  m_skipped = 0;
+}
+
+void FrameDebugger::log(const canfd_frame *frame) {
+  if (!m_config.ids.empty() && !m_config.ids.contains(frame->can_id))
+    return;
+  if (++m_skipped < m_config.sample)
+    return;
+  m_skipped = 0;
+  LogRecord record;
+  record.site = NULL;
+  record.suppressed = 0;
+  record.length = sizeof(canfd_frame);
+  record.overflow = NULL;
+  memcpy(record.data, frame, sizeof(canfd_frame));
+  Logger::instance().write(record);
+}
+
+void cannelloni::formatCANInfo(std::ostream &out, const canfd_frame *frame) {
+  if (frame->len & CANFD_FRAME) {
+    out << "FD|";
+  } else {
+    out << "LC|";
+  }
+  if (frame->can_id & CAN_EFF_FLAG) {
+    out << "EFF Frame ID[" << std::setw(5) << std::hex << (frame->can_id & CAN_EFF_MASK) << "]";
+  } else {
+    out << "SFF Frame ID[" << std::setw(5) << std::hex << (frame->can_id & CAN_SFF_MASK) << "]";
+  }
+  if (frame->can_id & CAN_ERR_FLAG)
+    out << "  ERROR  ";
+  else
+    out << "  Length:" << std::dec << (int) canfd_len(frame) << "  ";
+
+  if (frame->can_id & CAN_RTR_FLAG)  {
+      out << "  REMOTE";
+  } else {
+    /* This will also contain the error information */
+    for (uint8_t i=0; i < canfd_len(frame); i++)
+      out << std::setbase(16) << " " << int(frame->data[i]);
+  }
+  out << std::endl;
+}
@@ -19,53 +19,228 @@
  */
 
 #pragma once
+#include <atomic>
+#include <concepts>
 #include <iostream>
 #include <iomanip>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <type_traits>
+#include <vector>
 
 #include "cannelloni.h"
+#include "idset.h"
+#include "thread.h"
 
-using namespace cannelloni;
+namespace cannelloni {
 
-inline std::string splitFilename(const std::string &path) {
-  size_t pos = path.find_last_of("/\\");
-  if (pos == std::string::npos)
-    return path;
-  else
-    return path.substr(pos+1);
-}
+/* Messages per second a call site may log by default, 0 is unlimited */
+#define LOG_RATE_DEFAULT 100
+/* Records a thread can queue before further ones are dropped */
+#define LOG_RING_SIZE 512
+/* Bytes of a record for the arguments, longer messages go to the heap */
+#define LOG_RECORD_DATA 232
+/* Time in ms between two passes of the log thread */
+#define LOG_FLUSH_INTERVAL 10
+
+/* Design Notes:
+ *
+ * linfo, lwarn and lerror are used on the forwarding path, e.g. for
+ * every packet of an unknown peer or, with -d c, for every frame. They
+ * must neither format nor block there.
+ *
+ * Each call site has a static LogSite with its file, line and function
+ * and a rate limit of messages per second. The arguments of a message
+ * are stored in a LogRecord as tagged binary values (integers, copies of
+ * strings, manipulators), frames of the frame debugging are stored as
+ * they are. Once the Logger runs, a record is pushed into a ring that
+ * belongs to the calling thread: one producer and one consumer, so a
+ * push is a copy and a release store. If the ring is full the record is
+ * dropped and counted, the thread is never held up.
+ *
+ * Arguments that do not fit into the LOG_RECORD_DATA bytes of a record,
+ * like the summaries printed on exit, are moved into a buffer on the
+ * heap that the record owns. Such messages are rare and none is printed
+ * per frame, so the forwarding path does not allocate.
+ *
+ * The log thread drains the rings every LOG_FLUSH_INTERVAL ms, orders
+ * the records by their sequence number and formats them. Before the
+ * Logger is started and after it is stopped records are formatted by the
+ * calling thread, like tools and early errors need it.
+ */
+
+enum LogLevel {
+  LOG_INFO,
+  LOG_WARNING,
+  LOG_ERROR
+};
+
+class LogSite {
+  public:
+    LogSite(LogLevel level, const char *file, int line, const char *function);
+
+    /*
+     * false if the site used up its rate in the current second, otherwise
+     * suppressed is set to the messages dropped since the last one
+     */
+    bool admit(uint32_t &suppressed);
+
+    const LogLevel level;
+    /* Without the directory */
+    const char * const file;
+    const int line;
+    const char * const function;
+
+  private:
+    std::atomic<uint64_t> m_second;
+    std::atomic<uint32_t> m_count;
+    std::atomic<uint32_t> m_suppressed;
+};
+
+struct LogRecord {
+  /* NULL for frames */
+  const LogSite *site;
+  uint64_t sequence;
+  uint32_t suppressed;
+  /* Bytes used in data */
+  uint16_t length;
+  uint16_t reserved;
+  /* All arguments if they did not fit into data, NULL otherwise */
+  std::vector<uint8_t> *overflow;
+  uint8_t data[LOG_RECORD_DATA];
+};
+
+class LogRing;
+
+/* A message, it is written once the statement that created it ends */
+class LogLine {
+  public:
+    explicit LogLine(LogSite &site);
+    LogLine(const LogLine&) = delete;
+    LogLine& operator=(const LogLine&) = delete;
+    ~LogLine();
+
+    LogLine& operator<<(const char *value);
+    LogLine& operator<<(const std::string &value);
+    LogLine& operator<<(char value);
+    LogLine& operator<<(signed char value);
+    LogLine& operator<<(unsigned char value);
+    LogLine& operator<<(bool value);
+    LogLine& operator<<(double value);
+    LogLine& operator<<(std::ostream& (*manipulator)(std::ostream&));
+    LogLine& operator<<(std::ios_base& (*manipulator)(std::ios_base&));
+
+    template <std::signed_integral T>
+    LogLine& operator<<(T value) {
+      appendInteger(value, true);
+      return *this;
+    }
+    template <std::unsigned_integral T>
+    LogLine& operator<<(T value) {
+      appendInteger(value, false);
+      return *this;
+    }
+    /* Anything else, e.g. std::setw, is formatted right away */
+    template <typename T>
+      requires (!std::is_arithmetic_v<T> && !std::is_convertible_v<const T&, const char*>)
+    LogLine& operator<<(const T &value) {
+      if (m_active) {
+        std::ostream &probe = probeStream();
+        probe << value;
+        appendProbe();
+      }
+      return *this;
+    }
 
-#define FUNCTION_STRING splitFilename(__FILE__) << "[" << std::dec <<  __LINE__ << "]:" << __FUNCTION__ << ":"
-#define INFO_STRING "INFO:"
-#define ERROR_STRING "ERROR:"
-#define WARNING_STRING "WARNING:"
-
-#define linfo std::cout << INFO_STRING << FUNCTION_STRING
-#define lwarn std::cerr << WARNING_STRING << FUNCTION_STRING
-#define lerror std::cerr << ERROR_STRING << FUNCTION_STRING
-
-inline void printCANInfo(const canfd_frame *frame) {
-  if (frame->len & CANFD_FRAME) {
-    std::cout << "FD|";
-  } else {
-    std::cout << "LC|";
-  }
-  if (frame->can_id & CAN_EFF_FLAG) {
-    std::cout << "EFF Frame ID[" << std::setw(5) << std::hex << (frame->can_id & CAN_EFF_MASK) << "]";
-  } else {
-    std::cout << "SFF Frame ID[" << std::setw(5) << std::hex << (frame->can_id & CAN_SFF_MASK) << "]";
-  }
-  if (frame->can_id & CAN_ERR_FLAG)
-    std::cout << "  ERROR  ";
-  else
-    std::cout << "  Length:" << std::dec << (int) canfd_len(frame) << "  ";
-
-  if (frame->can_id & CAN_RTR_FLAG)  {
-      std::cout << "  REMOTE";
-  } else {
-    /* This will also contain the error information */
-    for (uint8_t i=0; i < canfd_len(frame); i++)
-      std::cout << std::setbase(16) << " " << int(frame->data[i]);
-  }
-  std::cout << std::endl;
+  private:
+    /* Space for size more bytes of arguments, in data or the overflow */
+    uint8_t* reserve(size_t size);
+    void append(uint8_t tag, const void *value, size_t size);
+    void appendString(const char *value, size_t size);
+    void appendInteger(uint64_t value, bool isSigned);
+    /* A stream in the default state to format the fallback with */
+    static std::ostream& probeStream();
+    void appendProbe();
+
+  private:
+    bool m_active;
+    LogRecord m_record;
 };
+
+class Logger : public Thread {
+  public:
+    static Logger& instance();
+    virtual ~Logger();
+
+    /* Formats records in a thread of its own from now on */
+    virtual int start();
+    virtual void stop();
+    virtual void run();
+
+    /* Messages per second of each call site, 0 is unlimited */
+    void setRate(uint32_t rate);
+    uint32_t getRate() const;
+
+    /* Queues record or, if the log thread does not run, formats it */
+    void write(LogRecord &record);
+    /* Records that were dropped because a ring was full */
+    uint64_t getDroppedCount() const;
+
+  private:
+    Logger();
+    /* The ring of the calling thread */
+    LogRing* ring();
+    /* Formats all queued records, returns the number of records */
+    size_t drain();
+    void format(const LogRecord &record);
+
+  private:
+    std::atomic<bool> m_async;
+    std::atomic<uint32_t> m_rate;
+    std::atomic<uint64_t> m_sequence;
+    std::atomic<uint64_t> m_droppedCount;
+    uint64_t m_reportedDropCount;
+    std::mutex m_ringsMutex;
+    std::vector<std::shared_ptr<LogRing>> m_rings;
+    /* Held while records are formatted */
+    std::mutex m_writeMutex;
+};
+
+struct FrameDebugConfig {
+  /* Log every nth frame, 1 logs all */
+  uint32_t sample;
+  /* Log only these IDs if not empty */
+  IdSet ids;
+};
+
+/* Logs the frames a thread handles with -d c */
+class FrameDebugger {
+  public:
+    FrameDebugger();
+
+    void setup(const FrameDebugConfig &config);
+    void log(const canfd_frame *frame);
+
+  private:
+    FrameDebugConfig m_config;
+    uint32_t m_skipped;
+};
+
+/* The site of the message, it is created once per call site */
+#define LOG_SITE(level) \
+  ([](const char *function) -> cannelloni::LogSite& { \
+    static cannelloni::LogSite site(level, __FILE__, __LINE__, function); \
+    return site; \
+  }(__FUNCTION__))
+
+#define linfo cannelloni::LogLine(LOG_SITE(cannelloni::LOG_INFO))
+#define lwarn cannelloni::LogLine(LOG_SITE(cannelloni::LOG_WARNING))
+#define lerror cannelloni::LogLine(LOG_SITE(cannelloni::LOG_ERROR))
+
+/* Formats frame like -d c prints it */
+void formatCANInfo(std::ostream &out, const canfd_frame *frame);
+
+}
+
+using namespace cannelloni;
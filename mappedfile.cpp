@@ -0,0 +1,124 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "mappedfile.h"
+#include "logging.h"
+
+using namespace cannelloni;
+
+MappedFile::MappedFile()
+  : m_fd(-1)
+  , m_data(NULL)
+  , m_size(0)
+{
+}
+
+MappedFile::~MappedFile() {
+  close();
+}
+
+bool MappedFile::open(const std::string &path, size_t size, bool create) {
+  close();
+  int flags = O_RDWR;
+  if (create)
+    flags |= O_CREAT;
+  m_fd = ::open(path.c_str(), flags, 0644);
+  if (m_fd < 0) {
+    lerror << "Could not open " << path << std::endl;
+    return false;
+  }
+  struct stat st;
+  if (fstat(m_fd, &st) < 0) {
+    lerror << "Could not stat " << path << std::endl;
+    close();
+    return false;
+  }
+  if (size == 0) {
+    size = st.st_size;
+  } else if (static_cast<size_t>(st.st_size) < size) {
+    if (!create || ftruncate(m_fd, size) < 0) {
+      lerror << "Could not resize " << path << std::endl;
+      close();
+      return false;
+    }
+  }
+  if (size == 0) {
+    lerror << "Can not map empty file " << path << std::endl;
+    close();
+    return false;
+  }
+  void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+  if (data == MAP_FAILED) {
+    lerror << "Could not map " << path << std::endl;
+    close();
+    return false;
+  }
+  m_data = static_cast<uint8_t*>(data);
+  m_size = size;
+  m_path = path;
+  return true;
+}
+
+void MappedFile::close() {
+  if (m_data) {
+    munmap(m_data, m_size);
+    m_data = NULL;
+  }
+  if (m_fd >= 0) {
+    ::close(m_fd);
+    m_fd = -1;
+  }
+  m_size = 0;
+}
+
+void MappedFile::remove() {
+  std::string path = m_path;
+  close();
+  if (!path.empty())
+    unlink(path.c_str());
+  m_path.clear();
+}
+
+bool MappedFile::isOpen() {
+  return m_data != NULL;
+}
+
+uint8_t* MappedFile::data() {
+  return m_data;
+}
+
+size_t MappedFile::size() {
+  return m_size;
+}
+
+const std::string& MappedFile::path() {
+  return m_path;
+}
+
+void MappedFile::sync(bool async) {
+  if (m_data)
+    msync(m_data, m_size, async ? MS_ASYNC : MS_SYNC);
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+namespace cannelloni {
+
+/*
+ * A file that is mapped into memory using mmap (MAP_SHARED).
+ * Changes are visible to other processes and are written back
+ * by the kernel, sync() can be used to start the write back early.
+ */
+
+class MappedFile {
+  public:
+    MappedFile();
+    ~MappedFile();
+
+    /*
+     * Opens and maps path. If create is true, the file is created
+     * if it does not exist and grown to size bytes.
+     * If size is 0, the current size of the file is mapped.
+     */
+    bool open(const std::string &path, size_t size, bool create);
+    void close();
+    /* closes the file and removes it from the filesystem */
+    void remove();
+
+    bool isOpen();
+    uint8_t* data();
+    size_t size();
+    const std::string& path();
+
+    /* Schedules (async) or waits for (sync) the write back */
+    void sync(bool async = true);
+
+  private:
+    int m_fd;
+    uint8_t *m_data;
+    size_t m_size;
+    std::string m_path;
+};
+
+}
@@ -0,0 +1,275 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "metrics.h"
+#include "logging.h"
+
+using namespace cannelloni;
+
+void MetricHistogram::observe(uint64_t value) {
+  size_t bucket = 0;
+  while (bucket < METRIC_HISTOGRAM_BUCKETS - 1 && value > (1ULL << bucket))
+    bucket++;
+  m_buckets[bucket].add();
+  m_count.add();
+  m_sum.add(value);
+}
+
+uint64_t MetricHistogram::getBucket(size_t bucket) const {
+  return m_buckets[bucket].get();
+}
+
+uint64_t MetricHistogram::getCount() const {
+  return m_count.get();
+}
+
+uint64_t MetricHistogram::getSum() const {
+  return m_sum.get();
+}
+
+MetricsRegistry::Family& MetricsRegistry::family(const std::string &name, const std::string &help,
+                                                 MetricType type) {
+  for (Family &existing : m_families) {
+    if (existing.name == name)
+      return existing;
+  }
+  m_families.push_back(Family{name, help, type, {}});
+  return m_families.back();
+}
+
+void MetricsRegistry::add(const std::string &name, const std::string &help, MetricType type,
+                          const std::string &labels, const Metric &metric) {
+  add(name, help, type, labels, [&metric]() { return metric.get(); });
+}
+
+void MetricsRegistry::add(const std::string &name, const std::string &help, MetricType type,
+                          const std::string &labels, std::function<uint64_t()> read) {
+  family(name, help, type).series.push_back(Series{labels, read, NULL, nullptr});
+}
+
+void MetricsRegistry::add(const std::string &name, const std::string &help,
+                          const std::string &labels, const MetricHistogram &histogram) {
+  family(name, help, METRIC_HISTOGRAM).series.push_back(Series{labels, nullptr, &histogram, nullptr});
+}
+
+void MetricsRegistry::add(const std::string &name, const std::string &help, const std::string &labels,
+                          std::function<void(LatencyHistogram&)> merge) {
+  family(name, help, METRIC_SUMMARY).series.push_back(Series{labels, nullptr, NULL, merge});
+}
+
+void MetricsRegistry::samples(const Family &family, const Series &series,
+                              const std::function<void(const std::string&, MetricType, uint64_t)> &visit) {
+  std::string labels = series.labels.empty() ? "" : "{" + series.labels + "}";
+  std::string separator = series.labels.empty() ? "" : ",";
+  if (family.type == METRIC_HISTOGRAM) {
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < METRIC_HISTOGRAM_BUCKETS; i++) {
+      cumulative += series.histogram->getBucket(i);
+      /* The last bucket takes all larger values, so it is +Inf */
+      std::string le = (i == METRIC_HISTOGRAM_BUCKETS - 1) ? "+Inf" : std::to_string(1ULL << i);
+      visit(family.name + "_bucket{" + series.labels + separator + "le=\"" + le + "\"}",
+            METRIC_COUNTER, cumulative);
+    }
+    visit(family.name + "_sum" + labels, METRIC_COUNTER, series.histogram->getSum());
+    visit(family.name + "_count" + labels, METRIC_COUNTER, series.histogram->getCount());
+  } else if (family.type == METRIC_SUMMARY) {
+    LatencyHistogram histogram;
+    series.merge(histogram);
+    for (const char *quantile : { "0.5", "0.99", "0.999" }) {
+      visit(family.name + "{" + series.labels + separator + "quantile=\"" + quantile + "\"}",
+            METRIC_GAUGE, histogram.percentile(atof(quantile)));
+    }
+    visit(family.name + "_count" + labels, METRIC_COUNTER, histogram.getCount());
+  } else {
+    visit(family.name + labels, family.type, series.read());
+  }
+}
+
+std::string MetricsRegistry::render() const {
+  static const char *types[] = { "counter", "gauge", "histogram", "summary" };
+  std::ostringstream out;
+  for (const Family &family : m_families) {
+    out << "# HELP " << family.name << " " << family.help << "\n"
+        << "# TYPE " << family.name << " " << types[family.type] << "\n";
+    for (const Series &series : family.series) {
+      samples(family, series, [&out](const std::string &name, MetricType, uint64_t value) {
+        out << name << " " << value << "\n";
+      });
+    }
+  }
+  return out.str();
+}
+
+void MetricsRegistry::forEach(const std::function<void(const std::string&, MetricType, uint64_t)> &visit) const {
+  for (const Family &family : m_families) {
+    for (const Series &series : family.series)
+      samples(family, series, visit);
+  }
+}
+
+MetricsServer::MetricsServer(const MetricsConfig &config, const MetricsRegistry &registry)
+  : Thread()
+  , m_config(config)
+  , m_registry(registry)
+  , m_socket(-1)
+  , m_requestCount(0)
+{}
+
+MetricsServer::~MetricsServer() {
+  if (m_socket >= 0) {
+    close(m_socket);
+    if (!m_config.path.empty())
+      unlink(m_config.path.c_str());
+  }
+}
+
+int MetricsServer::start() {
+  if (m_config.path.empty()) {
+    m_socket = socket(m_config.address.ss_family, SOCK_STREAM, 0);
+    if (m_socket < 0) {
+      lerror << "Could not create the metrics socket" << std::endl;
+      return -1;
+    }
+    int option = 1;
+    setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+    socklen_t length = m_config.address.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                                              : sizeof(struct sockaddr_in);
+    if (bind(m_socket, (struct sockaddr *) &m_config.address, length) < 0) {
+      lerror << "Could not bind the metrics socket: " << strerror(errno) << std::endl;
+      return -1;
+    }
+  } else {
+    struct sockaddr_un address;
+    if (m_config.path.size() >= sizeof(address.sun_path)) {
+      lerror << "The path of the metrics socket is too long" << std::endl;
+      return -1;
+    }
+    m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_socket < 0) {
+      lerror << "Could not create the metrics socket" << std::endl;
+      return -1;
+    }
+    /* A socket left behind by a previous run, other files are not touched */
+    struct stat st;
+    if (stat(m_config.path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+      unlink(m_config.path.c_str());
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, m_config.path.c_str(), sizeof(address.sun_path) - 1);
+    if (bind(m_socket, (struct sockaddr *) &address, sizeof(address)) < 0) {
+      lerror << "Could not bind the metrics socket: " << strerror(errno) << std::endl;
+      return -1;
+    }
+  }
+  if (listen(m_socket, 8) < 0) {
+    lerror << "Could not listen on the metrics socket" << std::endl;
+    return -1;
+  }
+  return Thread::start();
+}
+
+void MetricsServer::stop() {
+  Thread::stop();
+  /* m_started is now false, we need to wake up the thread */
+  m_stopTimer.fire();
+}
+
+void MetricsServer::run() {
+  fd_set readfds;
+  linfo << "MetricsServer up and running" << std::endl;
+  while (m_started) {
+    FD_ZERO(&readfds);
+    FD_SET(m_socket, &readfds);
+    FD_SET(m_stopTimer.getFd(), &readfds);
+    int ret = select(std::max(m_socket, m_stopTimer.getFd()) + 1, &readfds, NULL, NULL, NULL);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      lerror << "select error" << std::endl;
+      break;
+    }
+    if (FD_ISSET(m_stopTimer.getFd(), &readfds))
+      m_stopTimer.read();
+    if (FD_ISSET(m_socket, &readfds)) {
+      int client = accept(m_socket, NULL, NULL);
+      if (client < 0)
+        continue;
+      serve(client);
+      close(client);
+    }
+  }
+  linfo << "Metrics Summary: Requests: " << m_requestCount << std::endl;
+}
+
+void MetricsServer::serve(int client) {
+  std::string request;
+  char buffer[512];
+  struct timeval sendTimeout = { METRICS_REQUEST_TIMEOUT / 1000, (METRICS_REQUEST_TIMEOUT % 1000) * 1000 };
+  setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+  /* One client at a time, so a client that does not send its request is cut off */
+  while (request.size() < METRICS_REQUEST_SIZE && request.find("\r\n\r\n") == std::string::npos) {
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(client, &readfds);
+    struct timeval timeout = { METRICS_REQUEST_TIMEOUT / 1000, (METRICS_REQUEST_TIMEOUT % 1000) * 1000 };
+    if (select(client + 1, &readfds, NULL, NULL, &timeout) <= 0)
+      return;
+    ssize_t received = read(client, buffer, sizeof(buffer));
+    if (received <= 0)
+      return;
+    request.append(buffer, received);
+  }
+  m_requestCount++;
+  std::string status = "200 OK";
+  std::string body;
+  if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 13, "GET /metrics?") == 0 ||
+      request.compare(0, 6, "GET / ") == 0) {
+    body = m_registry.render();
+  } else {
+    status = "404 Not Found";
+    body = "Metrics are served at /metrics\n";
+  }
+  std::ostringstream response;
+  response << "HTTP/1.0 " << status << "\r\n"
+           << "Content-Type: text/plain; version=0.0.4\r\n"
+           << "Content-Length: " << body.size() << "\r\n"
+           << "Connection: close\r\n\r\n" << body;
+  std::string data = response.str();
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t res = send(client, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (res <= 0)
+      return;
+    sent += res;
+  }
+}
@@ -0,0 +1,181 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+
+#include "latency.h"
+#include "thread.h"
+#include "timer.h"
+
+namespace cannelloni {
+
+/* Buckets of a MetricHistogram are powers of two from 1 to 2^(n-1) */
+#define METRIC_HISTOGRAM_BUCKETS 8
+/* Requests larger than this are answered without being read completely */
+#define METRICS_REQUEST_SIZE 4096
+/* Time in ms a client gets to send its request */
+#define METRICS_REQUEST_TIMEOUT 1000
+
+/* Design Notes:
+ *
+ * Metrics are updated on the forwarding path, so they are plain
+ * std::atomic values that are only accessed with relaxed ordering. Each
+ * metric has one writer at a time (the owning thread or the holder of a
+ * mutex), which updates it with a load and a store instead of a locked
+ * read-modify-write. The metrics thread reads them at any time and may
+ * see a scrape that is a few frames behind.
+ *
+ * The owners register their metrics with the MetricsRegistry before the
+ * threads are started, after that the registry is only read. The
+ * MetricsServer thread answers each HTTP request with the registry in
+ * the Prometheus text format, so scraping never takes a lock of the
+ * forwarding path.
+ */
+
+/* A counter or gauge */
+class Metric {
+  public:
+    Metric() : m_value(0) {}
+
+    void add(uint64_t n = 1) {
+      m_value.store(m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    void set(uint64_t value) {
+      m_value.store(value, std::memory_order_relaxed);
+    }
+    /* Keeps the largest value, for high-water marks */
+    void raise(uint64_t value) {
+      if (value > m_value.load(std::memory_order_relaxed))
+        m_value.store(value, std::memory_order_relaxed);
+    }
+    uint64_t get() const {
+      return m_value.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint64_t> m_value;
+};
+
+/* A Prometheus histogram of small values like the number of packets per flush */
+class MetricHistogram {
+  public:
+    void observe(uint64_t value);
+    /* Values <= 2^bucket, the last bucket also takes all larger values */
+    uint64_t getBucket(size_t bucket) const;
+    uint64_t getCount() const;
+    uint64_t getSum() const;
+
+  private:
+    Metric m_buckets[METRIC_HISTOGRAM_BUCKETS];
+    Metric m_count;
+    Metric m_sum;
+};
+
+enum MetricType {
+  METRIC_COUNTER,
+  METRIC_GAUGE,
+  METRIC_HISTOGRAM,
+  /* p50, p99 and p99.9 of a LatencyHistogram */
+  METRIC_SUMMARY
+};
+
+class MetricsRegistry {
+  public:
+    /* labels are the Prometheus labels without braces, e.g. direction="rx" */
+    void add(const std::string &name, const std::string &help, MetricType type,
+             const std::string &labels, const Metric &metric);
+    /* For values that are derived from other ones */
+    void add(const std::string &name, const std::string &help, MetricType type,
+             const std::string &labels, std::function<uint64_t()> read);
+    void add(const std::string &name, const std::string &help,
+             const std::string &labels, const MetricHistogram &histogram);
+    /* merge adds the recorded delays to the histogram it is given */
+    void add(const std::string &name, const std::string &help, const std::string &labels,
+             std::function<void(LatencyHistogram&)> merge);
+
+    /* All metrics in the Prometheus text format */
+    std::string render() const;
+    /*
+     * Calls visit with each sample, the name includes the labels like in
+     * the text format. Buckets and counts are counters, quantiles gauges.
+     */
+    void forEach(const std::function<void(const std::string&, MetricType, uint64_t)> &visit) const;
+
+  private:
+    struct Series {
+      std::string labels;
+      std::function<uint64_t()> read;
+      const MetricHistogram *histogram;
+      std::function<void(LatencyHistogram&)> merge;
+    };
+    struct Family {
+      std::string name;
+      std::string help;
+      MetricType type;
+      std::vector<Series> series;
+    };
+
+    Family& family(const std::string &name, const std::string &help, MetricType type);
+    /* The samples of one series, a histogram or summary has several */
+    static void samples(const Family &family, const Series &series,
+                        const std::function<void(const std::string&, MetricType, uint64_t)> &visit);
+
+  private:
+    std::vector<Family> m_families;
+};
+
+struct MetricsConfig {
+  /* Listen on this Unix socket if not empty, otherwise on address */
+  std::string path;
+  struct sockaddr_storage address;
+};
+
+class MetricsServer : public Thread {
+  public:
+    MetricsServer(const MetricsConfig &config, const MetricsRegistry &registry);
+    virtual ~MetricsServer();
+
+    virtual int start();
+    virtual void stop();
+    virtual void run();
+
+  private:
+    /* Reads the request of client and answers it */
+    void serve(int client);
+
+  private:
+    MetricsConfig m_config;
+    const MetricsRegistry &m_registry;
+    int m_socket;
+    /* Wakes up the thread on stop() */
+    Timer m_stopTimer;
+    uint64_t m_requestCount;
+};
+
+}
@@ -110,7 +110,8 @@ size_t encodeFrame(uint8_t *data, canfd_frame *frame) {
 
 uint8_t* buildPacket(uint16_t len, uint8_t* packetBuffer,
         std::list<canfd_frame*>& frames, uint8_t seqNo,
-        std::function<void(std::list<canfd_frame*>&, std::list<canfd_frame*>::iterator)> handleOverflow)
+        std::function<void(std::list<canfd_frame*>&, std::list<canfd_frame*>::iterator)> handleOverflow,
+        uint16_t frameOverhead)
 {
     using namespace cannelloni;
 
@@ -121,7 +122,8 @@ uint8_t* buildPacket(uint16_t len, uint8_t* packetBuffer,
         canfd_frame* frame = *it;
         /* Check for packet overflow */
         if ((data - packetBuffer + CANNELLONI_FRAME_BASE_SIZE + canfd_len(frame)
-                + ((frame->len & CANFD_FRAME) ? sizeof(frame->flags) : 0))
+                + ((frame->len & CANFD_FRAME) ? sizeof(frame->flags) : 0)
+                + (frameCount + 1) * frameOverhead)
                 > len)
         {
             handleOverflow(frames, it);
@@ -298,7 +300,8 @@ size_t encodeFrame(uint8_t *data, canfd_frame *frame) {
 
 uint8_t* buildPacket(uint16_t len, uint8_t* packetBuffer,
         std::list<canfd_frame*>& frames, uint8_t seqNo,
-        std::function<void(std::list<canfd_frame*>&, std::list<canfd_frame*>::iterator)> handleOverflow)
+        std::function<void(std::list<canfd_frame*>&, std::list<canfd_frame*>::iterator)> handleOverflow,
+        uint16_t frameOverhead)
 {
     using namespace cannelloni;
 
@@ -312,7 +315,7 @@ uint8_t* buildPacket(uint16_t len, uint8_t* packetBuffer,
         /* Check for packet overflow */
         uint16_t writeable = len -(data - packetBuffer);
         uint8_t dlc = canfd_len(frame);
-        uint16_t writeto = (dlc > 8? dlc:8) + sizeof(DTUEthFrame);
+        uint16_t writeto = (dlc > 8? dlc:8) + sizeof(DTUEthFrame) + (frameCount + 1) * frameOverhead;
         if (writeable < writeto)
         {
             handleOverflow(frames, it);
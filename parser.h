@@ -51,12 +51,15 @@ size_t encodeFrame(uint8_t *data, canfd_frame *frame);
  * @param handleOverflow Callback responsible for handling CAN frames that
  * did't fit into Cannelloni package. First argument is a frames list
  * reference, second argument is iterator to the first not handled frame.
+ * @param frameOverhead Bytes the caller appends for each frame after the
+ * packet, which have to fit into len as well
  * @return
  */
 uint8_t *buildPacket(uint16_t len, uint8_t *packetBuffer,
                          std::list<canfd_frame *> &frames, uint8_t seqNo,
                          std::function<void(std::list<canfd_frame *> &,
                                             std::list<canfd_frame *>::iterator)>
-                             handleOverflow);
+                             handleOverflow,
+                         uint16_t frameOverhead = 0);
 
 #endif /* PARSER_H_ */
@@ -0,0 +1,183 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "pathmtu.h"
+
+#include <algorithm>
+
+using namespace cannelloni;
+
+PathMtuDiscovery::PathMtuDiscovery()
+  : m_maxMtu(0)
+  , m_probeCount(0)
+  , m_loweredCount(0)
+{
+  reset();
+}
+
+void PathMtuDiscovery::setup(uint32_t maxMtu) {
+  m_maxMtu = std::min<uint32_t>(maxMtu, PMTU_MAX_MTU);
+  reset();
+}
+
+bool PathMtuDiscovery::isEnabled() {
+  return m_maxMtu > 0;
+}
+
+void PathMtuDiscovery::reset() {
+  m_limit = m_maxMtu;
+  m_mtu = std::min<uint32_t>(PMTU_BASE_MTU, m_maxMtu);
+  m_searching = false;
+  m_confirming = false;
+  m_low = m_mtu;
+  m_high = m_mtu;
+  m_probeSize = 0;
+  m_probeAttempts = 0;
+  m_inFlight = false;
+  m_nextSearch = std::chrono::steady_clock::time_point::min();
+}
+
+uint32_t PathMtuDiscovery::nextProbe(std::chrono::steady_clock::time_point now) {
+  if (!isEnabled())
+    return 0;
+  if (m_inFlight) {
+    if (now - m_probeSent < std::chrono::microseconds(PMTU_PROBE_TIMEOUT))
+      return 0;
+    m_inFlight = false;
+    if (++m_probeAttempts >= PMTU_MAX_PROBES)
+      probeFailed(now);
+  }
+  if (!m_searching) {
+    if (now < m_nextSearch)
+      return 0;
+    startSearch(now);
+    if (!m_searching)
+      return 0;
+  }
+  m_inFlight = true;
+  m_probeSent = now;
+  m_probeCount++;
+  return m_probeSize;
+}
+
+bool PathMtuDiscovery::onProbeAck(uint32_t mtu, std::chrono::steady_clock::time_point now) {
+  /* Answers to probes of an earlier search are ignored */
+  if (!m_inFlight || mtu != m_probeSize)
+    return false;
+  m_inFlight = false;
+  if (m_confirming) {
+    nextSize(true, now);
+    return false;
+  }
+  bool raised = mtu > m_mtu;
+  m_low = mtu;
+  m_mtu = std::max(m_mtu, mtu);
+  nextSize(false, now);
+  return raised;
+}
+
+bool PathMtuDiscovery::onKernelMtu(uint32_t mtu, std::chrono::steady_clock::time_point now) {
+  if (!isEnabled() || mtu == 0)
+    return false;
+  /* The kernel forgets learned path MTUs after a while, so the limit may go up again */
+  m_limit = std::clamp<uint32_t>(mtu, PMTU_MIN_MTU, m_maxMtu);
+  bool lowered = false;
+  if (m_mtu > m_limit) {
+    m_mtu = m_limit;
+    m_loweredCount++;
+    lowered = true;
+  }
+  if (m_searching) {
+    m_low = std::min(m_low, m_mtu);
+    m_high = std::min(m_high, m_limit);
+    if (m_probeSize > m_limit) {
+      /* The probe can't be sent at all, the new limit is the most likely MTU */
+      m_inFlight = false;
+      nextSize(true, now);
+    }
+  }
+  return lowered;
+}
+
+uint64_t PathMtuDiscovery::nextTimeout(std::chrono::steady_clock::time_point now) {
+  if (!isEnabled())
+    return 0;
+  std::chrono::steady_clock::time_point due;
+  if (m_inFlight) {
+    due = m_probeSent + std::chrono::microseconds(PMTU_PROBE_TIMEOUT);
+  } else if (m_searching) {
+    return 1;
+  } else {
+    due = m_nextSearch;
+  }
+  if (due <= now)
+    return 1;
+  return std::chrono::duration_cast<std::chrono::microseconds>(due - now).count() + 1;
+}
+
+void PathMtuDiscovery::startSearch(std::chrono::steady_clock::time_point now) {
+  m_searching = true;
+  m_low = m_mtu;
+  m_high = m_limit;
+  if (m_mtu > PMTU_BASE_MTU) {
+    /* Make sure the current MTU still works before going further */
+    m_confirming = true;
+    m_probeSize = m_mtu;
+    m_probeAttempts = 0;
+  } else {
+    nextSize(true, now);
+  }
+}
+
+void PathMtuDiscovery::nextSize(bool top, std::chrono::steady_clock::time_point now) {
+  m_probeAttempts = 0;
+  m_confirming = false;
+  if (m_high <= m_low || (!top && m_high - m_low < PMTU_SEARCH_PRECISION)) {
+    m_searching = false;
+    m_nextSearch = now + std::chrono::microseconds(PMTU_SEARCH_INTERVAL);
+    return;
+  }
+  m_probeSize = top ? m_high : m_low + (m_high - m_low + 1) / 2;
+}
+
+void PathMtuDiscovery::probeFailed(std::chrono::steady_clock::time_point now) {
+  if (m_confirming) {
+    /* Packets of the current MTU get lost without an ICMP error */
+    m_mtu = std::min<uint32_t>(PMTU_BASE_MTU, m_limit);
+    m_low = m_mtu;
+    m_loweredCount++;
+    nextSize(true, now);
+  } else {
+    m_high = m_probeSize - 1;
+    nextSize(false, now);
+  }
+}
+
+uint32_t PathMtuDiscovery::getMtu() {
+  return m_mtu;
+}
+
+uint64_t PathMtuDiscovery::getProbeCount() {
+  return m_probeCount;
+}
+
+uint64_t PathMtuDiscovery::getLoweredCount() {
+  return m_loweredCount;
+}
@@ -0,0 +1,108 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace cannelloni {
+
+/* MTU used until a larger one has been confirmed, the minimum of IPv6 */
+#define PMTU_BASE_MTU 1280
+/* The MTU reported by the kernel is never taken below this */
+#define PMTU_MIN_MTU 256
+/* Largest MTU, limited by the 16 bit length of IP packets */
+#define PMTU_MAX_MTU 65535
+/* Time until a probe counts as lost in us */
+#define PMTU_PROBE_TIMEOUT 200000
+/* Lost probes after which a size counts as too large */
+#define PMTU_MAX_PROBES 3
+/* The search stops once the remaining range is smaller */
+#define PMTU_SEARCH_PRECISION 16
+/* Interval between two searches in us */
+#define PMTU_SEARCH_INTERVAL 60000000
+
+/* Design Notes:
+ *
+ * PathMtuDiscovery finds the path MTU by probing (RFC 8899): Packets are
+ * sent with PMTU_BASE_MTU until a probe of a larger size got answered by
+ * the remote. A search first probes the limit, which is the MTU of the
+ * interface or the smaller path MTU the kernel learned from ICMP. If that
+ * fails, it continues with a binary search between the confirmed MTU and
+ * the limit. The search is repeated every PMTU_SEARCH_INTERVAL, starting
+ * with a probe of the current MTU. If that fails as well, the path
+ * changed without an ICMP error (a black hole) and the MTU falls back to
+ * PMTU_BASE_MTU. A smaller MTU reported by the kernel is taken right away.
+ */
+
+class PathMtuDiscovery {
+  public:
+    PathMtuDiscovery();
+
+    /* maxMtu = 0 disables the discovery */
+    void setup(uint32_t maxMtu);
+    bool isEnabled();
+    /* Starts over with PMTU_BASE_MTU, e.g. after a restart of the remote */
+    void reset();
+
+    /* MTU of the next probe, 0 if no probe is due */
+    uint32_t nextProbe(std::chrono::steady_clock::time_point now);
+    /* Returns true if the MTU changed */
+    bool onProbeAck(uint32_t mtu, std::chrono::steady_clock::time_point now);
+    /* Path MTU known to the kernel, returns true if the MTU was lowered */
+    bool onKernelMtu(uint32_t mtu, std::chrono::steady_clock::time_point now);
+    /* Time in us until nextProbe has to be called again, 0 if disabled */
+    uint64_t nextTimeout(std::chrono::steady_clock::time_point now);
+
+    uint32_t getMtu();
+    uint64_t getProbeCount();
+    uint64_t getLoweredCount();
+
+  private:
+    void startSearch(std::chrono::steady_clock::time_point now);
+    /* Picks the next probe size, the limit itself if top is set */
+    void nextSize(bool top, std::chrono::steady_clock::time_point now);
+    void probeFailed(std::chrono::steady_clock::time_point now);
+
+  private:
+    uint32_t m_maxMtu;
+    /* Upper bound reported by the kernel */
+    uint32_t m_limit;
+    /* Confirmed MTU */
+    uint32_t m_mtu;
+    bool m_searching;
+    /* The current probe checks m_mtu */
+    bool m_confirming;
+    /* Search range, m_low is known to work */
+    uint32_t m_low;
+    uint32_t m_high;
+    uint32_t m_probeSize;
+    uint32_t m_probeAttempts;
+    bool m_inFlight;
+    std::chrono::steady_clock::time_point m_probeSent;
+    std::chrono::steady_clock::time_point m_nextSearch;
+
+    /* Performance Counters */
+    uint64_t m_probeCount;
+    uint64_t m_loweredCount;
+};
+
+}
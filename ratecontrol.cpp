@@ -0,0 +1,167 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "ratecontrol.h"
+
+#include <algorithm>
+
+using namespace cannelloni;
+
+RateController::RateController()
+  : m_minRate(0)
+  , m_maxRate(0)
+  , m_delayTarget(0)
+  , m_rate(0)
+  , m_tokens(0)
+  , m_sentSinceFeedback(0)
+  , m_decreaseCount(0)
+  , m_pacedCount(0)
+  , m_lastDelay(0)
+{
+}
+
+void RateController::setup(uint64_t minRate, uint64_t maxRate, uint64_t delayTarget) {
+  m_minRate = std::clamp<uint64_t>(minRate, 1, std::max<uint64_t>(maxRate, 1));
+  m_maxRate = maxRate;
+  m_delayTarget = delayTarget;
+  m_rate = maxRate;
+  m_tokens = 0;
+  m_lastRefill = std::chrono::steady_clock::now();
+  m_lastDecrease = m_lastRefill;
+  m_lastFeedback = m_lastRefill;
+}
+
+bool RateController::isEnabled() {
+  return m_maxRate > 0;
+}
+
+uint64_t RateController::pacingDelay(std::chrono::steady_clock::time_point now) {
+  refill(now);
+  if (m_tokens >= 0)
+    return 0;
+  m_pacedCount++;
+  return (-m_tokens * 1000000) / m_rate + 1;
+}
+
+void RateController::onSent(uint32_t bytes, std::chrono::steady_clock::time_point now) {
+  refill(now);
+  m_tokens -= bytes;
+  m_sentSinceFeedback += bytes;
+}
+
+bool RateController::onFeedback(uint32_t received, uint32_t lost, uint32_t delay,
+                                std::chrono::steady_clock::time_point now) {
+  uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - m_lastFeedback).count();
+  elapsed = std::min<uint64_t>(elapsed, 1000000);
+  uint64_t sent = m_sentSinceFeedback;
+  m_lastFeedback = now;
+  m_sentSinceFeedback = 0;
+  m_lastDelay = delay;
+
+  bool congested = (received + lost > 0 && lost * 100 > (received + lost) * RATE_LOSS_THRESHOLD) ||
+                   delay > m_delayTarget;
+  if (congested) {
+    if (now - m_lastDecrease < std::chrono::microseconds(RATE_FEEDBACK_INTERVAL))
+      return false;
+    m_lastDecrease = now;
+    m_rate = std::max(m_rate * RATE_DECREASE_FACTOR / 100, m_minRate);
+    m_decreaseCount++;
+    return true;
+  }
+  /* Don't grow a rate that is not used anyway */
+  if (sent * 1000000 >= m_rate * elapsed / 2)
+    m_rate = std::min(m_rate + RATE_ADDITIVE_INCREASE, m_maxRate);
+  return false;
+}
+
+void RateController::refill(std::chrono::steady_clock::time_point now) {
+  uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - m_lastRefill).count();
+  /* The bucket is full after RATE_BURST_TIME anyway */
+  elapsed = std::min<uint64_t>(elapsed, 1000000);
+  m_lastRefill = now;
+  int64_t burst = m_rate * RATE_BURST_TIME / 1000000;
+  m_tokens = std::min<int64_t>(m_tokens + m_rate * elapsed / 1000000, burst);
+}
+
+uint64_t RateController::getRate() {
+  return m_rate;
+}
+
+uint64_t RateController::getMinRate() {
+  return m_minRate;
+}
+
+uint64_t RateController::getDecreaseCount() {
+  return m_decreaseCount;
+}
+
+uint64_t RateController::getPacedCount() {
+  return m_pacedCount;
+}
+
+uint32_t RateController::getLastDelay() {
+  return m_lastDelay;
+}
+
+DelayTracker::DelayTracker() {
+  reset();
+}
+
+void DelayTracker::reset() {
+  m_hasBase = false;
+  m_base = 0;
+  m_windowBase = 0;
+  m_windowStart = std::chrono::steady_clock::now();
+  m_delaySum = 0;
+  m_delayCount = 0;
+}
+
+void DelayTracker::add(uint32_t sendTime, uint32_t arrivalTime) {
+  uint32_t offset = arrivalTime - sendTime;
+  auto now = std::chrono::steady_clock::now();
+  if (!m_hasBase) {
+    m_hasBase = true;
+    m_base = offset;
+    m_windowBase = offset;
+    m_windowStart = now;
+  }
+  /* Offsets are compared in serial number arithmetic */
+  if (static_cast<int32_t>(offset - m_windowBase) < 0)
+    m_windowBase = offset;
+  if (static_cast<int32_t>(offset - m_base) < 0)
+    m_base = offset;
+  if (now - m_windowStart >= std::chrono::microseconds(DELAY_BASE_WINDOW)) {
+    /* Start over with the minimum of the last window */
+    m_base = m_windowBase;
+    m_windowBase = offset;
+    m_windowStart = now;
+  }
+  m_delaySum += static_cast<uint32_t>(offset - m_base);
+  m_delayCount++;
+}
+
+uint32_t DelayTracker::takeQueuingDelay() {
+  if (m_delayCount == 0)
+    return 0;
+  uint32_t delay = m_delaySum / m_delayCount;
+  m_delaySum = 0;
+  m_delayCount = 0;
+  return delay;
+}
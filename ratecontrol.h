@@ -0,0 +1,127 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace cannelloni {
+
+/* Interval of FEEDBACK packets in us */
+#define RATE_FEEDBACK_INTERVAL 50000
+/* Rate added after a report without congestion in bytes/s */
+#define RATE_ADDITIVE_INCREASE 4000
+/* The rate is multiplied by RATE_DECREASE_FACTOR/100 on congestion */
+#define RATE_DECREASE_FACTOR 85
+/* Loss in percent of the packets in one report that counts as congestion */
+#define RATE_LOSS_THRESHOLD 2
+/* Time the pacer may send at once after being idle in us */
+#define RATE_BURST_TIME 10000
+/* Window after which the base delay is measured again in us */
+#define DELAY_BASE_WINDOW 10000000
+
+/* Design Notes:
+ *
+ * RateController paces the packets of the sender with a token bucket
+ * that is filled at the current rate. A packet may be sent once the
+ * bucket is not in debt, the size of the packet is taken afterwards.
+ *
+ * The rate follows AIMD, driven by the reports of the receiver: Every
+ * report without congestion adds RATE_ADDITIVE_INCREASE, as long as the
+ * sender actually used most of the rate. Loss above RATE_LOSS_THRESHOLD
+ * or a queuing delay above the target reduces the rate multiplicatively,
+ * at most once per RATE_FEEDBACK_INTERVAL, since the next report may still
+ * show the same congestion. Reacting to the delay reduces the rate
+ * before the queues along the path overflow.
+ */
+
+class RateController {
+  public:
+    RateController();
+
+    /* Rates in bytes/s, delayTarget in us. maxRate = 0 disables the controller */
+    void setup(uint64_t minRate, uint64_t maxRate, uint64_t delayTarget);
+    bool isEnabled();
+
+    /* Time in us until the next packet may be sent, 0 if it may be sent now */
+    uint64_t pacingDelay(std::chrono::steady_clock::time_point now);
+    void onSent(uint32_t bytes, std::chrono::steady_clock::time_point now);
+    /* Adjusts the rate to a report of the receiver, returns true if the rate was reduced */
+    bool onFeedback(uint32_t received, uint32_t lost, uint32_t delay,
+                    std::chrono::steady_clock::time_point now);
+
+    uint64_t getRate();
+    uint64_t getMinRate();
+    uint64_t getDecreaseCount();
+    uint64_t getPacedCount();
+    uint32_t getLastDelay();
+
+  private:
+    void refill(std::chrono::steady_clock::time_point now);
+
+  private:
+    uint64_t m_minRate;
+    uint64_t m_maxRate;
+    uint64_t m_delayTarget;
+    uint64_t m_rate;
+    /* Bytes that may be sent, negative while in debt */
+    int64_t m_tokens;
+    std::chrono::steady_clock::time_point m_lastRefill;
+    std::chrono::steady_clock::time_point m_lastDecrease;
+    std::chrono::steady_clock::time_point m_lastFeedback;
+    uint64_t m_sentSinceFeedback;
+
+    /* Performance Counters */
+    uint64_t m_decreaseCount;
+    uint64_t m_pacedCount;
+    uint32_t m_lastDelay;
+};
+
+/* Design Notes:
+ *
+ * DelayTracker estimates the queuing delay on the path without
+ * synchronized clocks. The difference between the arrival time and the
+ * send timestamp of a packet is the one-way delay plus the unknown clock
+ * offset. Its minimum is taken as base (the path with empty queues),
+ * anything above it is queuing delay. The base is measured again after
+ * DELAY_BASE_WINDOW, so clock drift and route changes don't add up.
+ */
+
+class DelayTracker {
+  public:
+    DelayTracker();
+
+    void reset();
+    /* Both times in us, taken from different clocks, may wrap */
+    void add(uint32_t sendTime, uint32_t arrivalTime);
+    /* Average queuing delay in us of the packets since the last call */
+    uint32_t takeQueuingDelay();
+
+  private:
+    bool m_hasBase;
+    uint32_t m_base;
+    uint32_t m_windowBase;
+    std::chrono::steady_clock::time_point m_windowStart;
+    uint64_t m_delaySum;
+    uint32_t m_delayCount;
+};
+
+}
@@ -0,0 +1,228 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "ratelimit.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+using namespace cannelloni;
+
+static bool parseNumber(const std::string &str, uint64_t max, uint64_t &value) {
+  std::size_t first = str.find_first_not_of(" \t");
+  std::size_t last = str.find_last_not_of(" \t\r");
+  if (first == std::string::npos)
+    return false;
+  std::string trimmed = str.substr(first, last - first + 1);
+  char *end;
+  value = strtoull(trimmed.c_str(), &end, 0);
+  return *end == '\0' && value <= max;
+}
+
+static bool parseRule(const std::string &line, RateLimitRule &rule) {
+  std::vector<std::string> fields;
+  std::istringstream ss(line);
+  std::string field;
+  while (getline(ss, field, ','))
+    fields.push_back(field);
+  if (fields.size() < 2 || fields.size() > 4)
+    return false;
+  uint64_t low, high;
+  std::size_t dash = fields[0].find('-');
+  if (dash == std::string::npos) {
+    if (!parseNumber(fields[0], CAN_EFF_MASK, low))
+      return false;
+    high = low;
+  } else if (!parseNumber(fields[0].substr(0, dash), CAN_EFF_MASK, low) ||
+             !parseNumber(fields[0].substr(dash + 1), CAN_EFF_MASK, high) || low > high) {
+    return false;
+  }
+  rule.low = low;
+  rule.high = high;
+  if (!parseNumber(fields[1], 1000000, rule.rate) || rule.rate == 0)
+    return false;
+  rule.burst = std::max<uint64_t>(rule.rate / 10, 1);
+  if (fields.size() > 2 && (!parseNumber(fields[2], 1000000, rule.burst) || rule.burst == 0))
+    return false;
+  rule.action = RATE_LIMIT_DROP;
+  if (fields.size() > 3) {
+    std::string action = fields[3];
+    action.erase(std::remove_if(action.begin(), action.end(), ::isspace), action.end());
+    if (action == "coalesce")
+      rule.action = RATE_LIMIT_COALESCE;
+    else if (action != "drop")
+      return false;
+  }
+  return true;
+}
+
+bool cannelloni::loadRateLimits(const std::string &filename, std::vector<RateLimitRule> &rules) {
+  std::ifstream file(filename.c_str(), std::ios::in);
+  if (file.fail())
+    return false;
+  std::vector<RateLimitRule> result;
+  std::string line;
+  while (getline(file, line)) {
+    std::size_t first = line.find_first_not_of(" \t\r");
+    /* Empty lines and comments */
+    if (first == std::string::npos || line[first] == '#')
+      continue;
+    RateLimitRule rule;
+    if (!parseRule(line, rule))
+      return false;
+    result.push_back(rule);
+  }
+  if (result.empty() || result.size() >= UINT16_MAX)
+    return false;
+  rules.swap(result);
+  return true;
+}
+
+RateLimiter::RateLimiter() {
+  m_table.fill(0);
+}
+
+void RateLimiter::setup(const std::vector<RateLimitRule> &rules, std::chrono::steady_clock::time_point now) {
+  m_buckets.clear();
+  m_extended.clear();
+  m_table.fill(0);
+  m_start = now;
+  for (const RateLimitRule &rule : rules) {
+    m_buckets.push_back(Bucket{rule, rule.burst * RATE_LIMIT_TOKEN, now, {}, 0, 0, 0});
+    if (rule.high >= RATE_LIMIT_TABLE_SIZE)
+      m_extended.push_back(m_buckets.size() - 1);
+  }
+  /* The first rule wins, so it is written last */
+  for (size_t i = m_buckets.size(); i-- > 0;) {
+    const RateLimitRule &rule = m_buckets[i].rule;
+    for (uint32_t id = rule.low; id <= rule.high && id < RATE_LIMIT_TABLE_SIZE; id++)
+      m_table[id] = i + 1;
+  }
+}
+
+bool RateLimiter::isEnabled() {
+  return !m_buckets.empty();
+}
+
+RateLimiter::Bucket* RateLimiter::lookup(canid_t can_id) {
+  uint32_t id = (can_id & CAN_EFF_FLAG) ? (can_id & CAN_EFF_MASK) : (can_id & CAN_SFF_MASK);
+  if (id < RATE_LIMIT_TABLE_SIZE)
+    return m_table[id] ? &m_buckets[m_table[id] - 1] : NULL;
+  for (size_t i : m_extended) {
+    if (id >= m_buckets[i].rule.low && id <= m_buckets[i].rule.high)
+      return &m_buckets[i];
+  }
+  return NULL;
+}
+
+void RateLimiter::refill(Bucket &bucket, std::chrono::steady_clock::time_point now) {
+  uint64_t capacity = bucket.rule.burst * RATE_LIMIT_TOKEN;
+  if (bucket.tokens >= capacity || now <= bucket.refilled) {
+    bucket.refilled = now;
+    return;
+  }
+  uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - bucket.refilled).count();
+  /* Enough to fill any bucket, keeps the product in range */
+  elapsed = std::min<uint64_t>(elapsed, capacity);
+  bucket.tokens = std::min(capacity, bucket.tokens + elapsed * bucket.rule.rate);
+  bucket.refilled = now;
+}
+
+RateLimiter::Result RateLimiter::admit(const canfd_frame *frame, std::chrono::steady_clock::time_point now) {
+  if (frame->can_id & CAN_ERR_FLAG)
+    return RATE_PASS;
+  Bucket *bucket = lookup(frame->can_id);
+  if (bucket == NULL)
+    return RATE_PASS;
+  if (!bucket->held.empty()) {
+    auto it = bucket->held.find(canfd_id(frame));
+    if (it != bucket->held.end()) {
+      it->second = *frame;
+      bucket->coalesced++;
+      return RATE_HOLD;
+    }
+  }
+  refill(*bucket, now);
+  if (bucket->tokens >= RATE_LIMIT_TOKEN) {
+    bucket->tokens -= RATE_LIMIT_TOKEN;
+    bucket->passed++;
+    return RATE_PASS;
+  }
+  if (bucket->rule.action == RATE_LIMIT_DROP) {
+    bucket->dropped++;
+    return RATE_DROP;
+  }
+  bucket->held.emplace(canfd_id(frame), *frame);
+  return RATE_HOLD;
+}
+
+void RateLimiter::due(std::chrono::steady_clock::time_point now, std::vector<canfd_frame> &frames) {
+  for (Bucket &bucket : m_buckets) {
+    if (bucket.held.empty())
+      continue;
+    refill(bucket, now);
+    /* Lower IDs first, like on the bus */
+    while (!bucket.held.empty() && bucket.tokens >= RATE_LIMIT_TOKEN) {
+      frames.push_back(bucket.held.begin()->second);
+      bucket.held.erase(bucket.held.begin());
+      bucket.tokens -= RATE_LIMIT_TOKEN;
+      bucket.passed++;
+    }
+  }
+}
+
+uint64_t RateLimiter::nextTimeout(std::chrono::steady_clock::time_point now) {
+  uint64_t timeout = 0;
+  for (Bucket &bucket : m_buckets) {
+    if (bucket.held.empty())
+      continue;
+    refill(bucket, now);
+    uint64_t missing = bucket.tokens >= RATE_LIMIT_TOKEN ? 0 : RATE_LIMIT_TOKEN - bucket.tokens;
+    /* Round up, so the token is there once the timer expires */
+    uint64_t wait = (missing + bucket.rule.rate - 1) / bucket.rule.rate + 1;
+    if (timeout == 0 || wait < timeout)
+      timeout = wait;
+  }
+  return timeout;
+}
+
+std::string RateLimiter::summary(std::chrono::steady_clock::time_point now) {
+  double seconds = std::chrono::duration<double>(now - m_start).count();
+  std::ostringstream out;
+  for (size_t i = 0; i < m_buckets.size(); i++) {
+    const Bucket &bucket = m_buckets[i];
+    out << (i > 0 ? " " : "") << "0x" << std::hex << bucket.rule.low;
+    if (bucket.rule.high != bucket.rule.low)
+      out << "-0x" << bucket.rule.high;
+    out << std::dec << ": Passed: " << bucket.passed;
+    if (seconds > 0) {
+      out << " (" << std::fixed << std::setprecision(1)
+          << 100.0 * bucket.passed / (bucket.rule.rate * seconds) << "%)";
+    }
+    out << " Dropped: " << bucket.dropped;
+    if (bucket.rule.action == RATE_LIMIT_COALESCE)
+      out << " Coalesced: " << bucket.coalesced;
+  }
+  return out.str();
+}
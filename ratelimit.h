@@ -0,0 +1,126 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cannelloni.h"
+
+namespace cannelloni {
+
+/* A frame takes this many tokens from a bucket */
+#define RATE_LIMIT_TOKEN 1000000
+/* IDs below this limit are looked up in a table */
+#define RATE_LIMIT_TABLE_SIZE (CAN_SFF_MASK + 1)
+
+enum RateLimitAction {
+  /* Frames above the rate are dropped */
+  RATE_LIMIT_DROP,
+  /* The latest frame of each ID above the rate is sent once the rate allows it */
+  RATE_LIMIT_COALESCE
+};
+
+struct RateLimitRule {
+  /* IDs without flags, like IdSet */
+  uint32_t low;
+  uint32_t high;
+  /* Frames per second */
+  uint64_t rate;
+  /* Frames that may be sent at once */
+  uint64_t burst;
+  RateLimitAction action;
+};
+
+/*
+ * Reads the rules from a CSV file with lines ID[-ID],RATE[,BURST[,ACTION]],
+ * where ACTION is drop (default) or coalesce and BURST defaults to a tenth
+ * of RATE. Returns false if the file can't be read or has a syntax error.
+ */
+bool loadRateLimits(const std::string &filename, std::vector<RateLimitRule> &rules);
+
+/* Design Notes:
+ *
+ * RateLimiter sits between CANThread and the network thread, next to the
+ * ChangeFilter, so a babbling ID loses its frames before they take
+ * space in the FrameBuffer of the network thread. Each rule is a token
+ * bucket shared by its IDs, the first rule that contains an ID applies.
+ *
+ * The lookup runs for every frame read from the bus and is only done by
+ * the CAN thread, so it needs no lock: standard IDs index a table of
+ * bucket numbers, the few rules above that range are searched linearly.
+ *
+ * A coalescing bucket keeps the latest frame of each ID that exceeded
+ * the rate and releases them in the order of their IDs once it has
+ * tokens again. A newer frame of an ID that is held replaces the held
+ * one, so the order of the frames of an ID is kept.
+ */
+
+class RateLimiter {
+  public:
+    enum Result {
+      RATE_PASS,
+      RATE_DROP,
+      /* The frame was copied and is released later, see due */
+      RATE_HOLD
+    };
+
+    RateLimiter();
+
+    void setup(const std::vector<RateLimitRule> &rules, std::chrono::steady_clock::time_point now);
+    bool isEnabled();
+    Result admit(const canfd_frame *frame, std::chrono::steady_clock::time_point now);
+    /* Appends the held frames that may be sent now to frames */
+    void due(std::chrono::steady_clock::time_point now, std::vector<canfd_frame> &frames);
+    /* Time in us until due has to be called again, 0 if no frame is held */
+    uint64_t nextTimeout(std::chrono::steady_clock::time_point now);
+
+    /* Usage, drop and coalesce counters of each bucket */
+    std::string summary(std::chrono::steady_clock::time_point now);
+
+  private:
+    struct Bucket {
+      RateLimitRule rule;
+      uint64_t tokens;
+      std::chrono::steady_clock::time_point refilled;
+      std::map<canid_t, canfd_frame> held;
+      uint64_t passed;
+      uint64_t dropped;
+      uint64_t coalesced;
+    };
+
+    Bucket* lookup(canid_t can_id);
+    void refill(Bucket &bucket, std::chrono::steady_clock::time_point now);
+
+  private:
+    std::vector<Bucket> m_buckets;
+    /* Bucket number + 1 of the standard IDs, 0 if there is none */
+    std::array<uint16_t, RATE_LIMIT_TABLE_SIZE> m_table;
+    /* Buckets of rules that reach beyond the table */
+    std::vector<size_t> m_extended;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+}
@@ -0,0 +1,397 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "recorder.h"
+#include "latency.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace cannelloni;
+
+const char* cannelloni::recordSourceName(uint8_t source) {
+  switch (source) {
+    case RECORD_CAN_TO_NETWORK: return "can_to_network";
+    case RECORD_NETWORK_TO_CAN: return "network_to_can";
+    default: return "unknown";
+  }
+}
+
+RecordQueue::RecordQueue()
+  : m_head(0)
+  , m_tail(0)
+{
+}
+
+void RecordQueue::push(const canfd_frame *frame, RecordSource source) {
+  uint64_t tail = m_tail.load(std::memory_order_relaxed);
+  if (tail - m_head.load(std::memory_order_acquire) == RECORD_QUEUE_SIZE) {
+    m_dropped.add();
+    return;
+  }
+  RecordedFrame &record = m_frames[tail % RECORD_QUEUE_SIZE];
+  record.time = realtimeNow();
+  record.can_id = frame->can_id;
+  record.len = frame->len;
+  record.flags = frame->flags;
+  record.source = source;
+  record.reserved = 0;
+  memcpy(record.data, frame->data, CANFD_MAX_DLEN);
+  m_tail.store(tail + 1, std::memory_order_release);
+}
+
+void RecordQueue::popAll(std::vector<RecordedFrame> &frames) {
+  uint64_t head = m_head.load(std::memory_order_relaxed);
+  uint64_t tail = m_tail.load(std::memory_order_acquire);
+  for (; head != tail; head++)
+    frames.push_back(m_frames[head % RECORD_QUEUE_SIZE]);
+  m_head.store(head, std::memory_order_release);
+}
+
+uint64_t RecordQueue::getDroppedCount() const {
+  return m_dropped.get();
+}
+
+/* Number of a segment file of instance, -1 if it is none */
+static long segmentNumber(const std::string &name, const std::string &instance) {
+  std::string prefix = "cannelloni-" + instance + "-";
+  const std::string suffix = ".rec";
+  if (name.size() <= prefix.size() + suffix.size() || name.compare(0, prefix.size(), prefix) != 0 ||
+      name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+    return -1;
+  std::string number = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+  if (number.empty() || !std::all_of(number.begin(), number.end(), ::isdigit))
+    return -1;
+  return strtol(number.c_str(), NULL, 10);
+}
+
+Recorder::Recorder(const RecorderConfig &config, const std::string &instance)
+  : m_config(config)
+  , m_instance(instance)
+  , m_header(NULL)
+  , m_count(0)
+  , m_segmentNumber(0)
+{
+}
+
+Recorder::~Recorder() {
+  closeSegment();
+}
+
+RecordQueue* Recorder::addQueue() {
+  m_queues.push_back(std::make_unique<RecordQueue>());
+  return m_queues.back().get();
+}
+
+int Recorder::start() {
+  /* Continue after the segments of an earlier run */
+  DIR *dir = opendir(m_config.directory.c_str());
+  if (!dir) {
+    lerror << "Could not open recording directory " << m_config.directory << std::endl;
+    return -1;
+  }
+  while (struct dirent *entry = readdir(dir)) {
+    long number = segmentNumber(entry->d_name, m_instance);
+    if (number >= 0 && static_cast<uint32_t>(number) >= m_segmentNumber)
+      m_segmentNumber = number + 1;
+  }
+  closedir(dir);
+  if (!openSegment())
+    return -1;
+  return Thread::start();
+}
+
+void Recorder::stop() {
+  Thread::stop();
+}
+
+void Recorder::run() {
+  while (m_started) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(RECORD_FLUSH_INTERVAL));
+    drain();
+  }
+  drain();
+  closeSegment();
+}
+
+uint64_t Recorder::getRecordedCount() const {
+  return m_recordedCount.get();
+}
+
+uint64_t Recorder::getDroppedCount() const {
+  uint64_t dropped = 0;
+  for (const auto &queue : m_queues)
+    dropped += queue->getDroppedCount();
+  return dropped;
+}
+
+uint64_t Recorder::getSegmentCount() const {
+  return m_segmentCount.get();
+}
+
+void Recorder::drain() {
+  m_batch.clear();
+  for (const auto &queue : m_queues)
+    queue->popAll(m_batch);
+  if (m_batch.empty())
+    return;
+  /* The queues are in order, merge them */
+  std::stable_sort(m_batch.begin(), m_batch.end(),
+                   [](const RecordedFrame &a, const RecordedFrame &b) { return a.time < b.time; });
+  uint64_t recorded = 0;
+  for (const RecordedFrame &frame : m_batch) {
+    if (!append(frame))
+      break;
+    recorded++;
+  }
+  if (m_header)
+    m_header->count.store(m_count, std::memory_order_release);
+  m_recordedCount.add(recorded);
+}
+
+bool Recorder::openSegment() {
+  char number[16];
+  snprintf(number, sizeof(number), "%06u", m_segmentNumber++);
+  std::string path = m_config.directory + "/cannelloni-" + m_instance + "-" + number + ".rec";
+  if (!m_file.open(path, m_config.segmentSize, true)) {
+    lerror << "Could not create recording segment " << path << std::endl;
+    return false;
+  }
+  m_header = reinterpret_cast<RecordingHeader*>(m_file.data());
+  m_header->magic = RECORD_MAGIC;
+  m_header->version = RECORD_VERSION;
+  m_header->recordSize = sizeof(RecordedFrame);
+  m_header->blockSize = RECORD_BLOCK_SIZE;
+  m_header->firstTime = 0;
+  m_header->lastTime = 0;
+  strncpy(m_header->instance, m_instance.c_str(), RECORD_INSTANCE_SIZE - 1);
+  m_header->count.store(0, std::memory_order_relaxed);
+  m_header->complete.store(0, std::memory_order_release);
+  m_count = 0;
+  m_timeIndex.clear();
+  m_idIndex.clear();
+  m_blockIds.clear();
+  m_segmentCount.add();
+  return true;
+}
+
+void Recorder::finishBlock() {
+  if (m_blockIds.empty())
+    return;
+  m_timeIndex.push_back(m_block);
+  for (uint32_t id : m_blockIds)
+    m_idIndex.push_back({ id, static_cast<uint32_t>(m_timeIndex.size() - 1) });
+  m_blockIds.clear();
+}
+
+void Recorder::closeSegment() {
+  if (!m_header)
+    return;
+  finishBlock();
+  std::sort(m_idIndex.begin(), m_idIndex.end(), [](const RecordingIdIndex &a, const RecordingIdIndex &b) {
+    return a.can_id != b.can_id ? a.can_id < b.can_id : a.block < b.block;
+  });
+  uint64_t offset = RECORD_HEADER_SIZE + m_count * sizeof(RecordedFrame);
+  m_header->timeIndexOffset = offset;
+  m_header->timeIndexCount = m_timeIndex.size();
+  memcpy(m_file.data() + offset, m_timeIndex.data(), m_timeIndex.size() * sizeof(RecordingTimeIndex));
+  offset += m_timeIndex.size() * sizeof(RecordingTimeIndex);
+  m_header->idIndexOffset = offset;
+  m_header->idIndexCount = m_idIndex.size();
+  memcpy(m_file.data() + offset, m_idIndex.data(), m_idIndex.size() * sizeof(RecordingIdIndex));
+  offset += m_idIndex.size() * sizeof(RecordingIdIndex);
+  m_header->count.store(m_count, std::memory_order_relaxed);
+  m_header->complete.store(1, std::memory_order_release);
+  std::string path = m_file.path();
+  m_file.sync(false);
+  m_file.close();
+  m_header = NULL;
+  /* The segment was created with its full size */
+  if (truncate(path.c_str(), offset) < 0)
+    lwarn << "Could not truncate recording segment " << path << std::endl;
+}
+
+bool Recorder::fits() {
+  uint64_t records = m_count + 1;
+  uint64_t blocks = (records + RECORD_BLOCK_SIZE - 1) / RECORD_BLOCK_SIZE;
+  /* Worst case: the frame has an ID the current block does not have yet */
+  uint64_t ids = m_idIndex.size() + m_blockIds.size() + 1;
+  return RECORD_HEADER_SIZE + records * sizeof(RecordedFrame) + blocks * sizeof(RecordingTimeIndex) +
+         ids * sizeof(RecordingIdIndex) <= m_file.size();
+}
+
+bool Recorder::append(const RecordedFrame &frame) {
+  if (!m_header)
+    return false;
+  if (!fits()) {
+    closeSegment();
+    if (!openSegment())
+      return false;
+  }
+  memcpy(m_file.data() + RECORD_HEADER_SIZE + m_count * sizeof(RecordedFrame), &frame, sizeof(frame));
+  if (m_count == 0)
+    m_header->firstTime = frame.time;
+  m_header->lastTime = std::max(m_header->lastTime, frame.time);
+
+  uint32_t id = frame.can_id & CAN_EFF_FLAG ? frame.can_id & (CAN_EFF_FLAG | CAN_EFF_MASK)
+                                            : frame.can_id & CAN_SFF_MASK;
+  if (m_blockIds.empty()) {
+    m_block.first = frame.time;
+    m_block.last = frame.time;
+  } else {
+    m_block.first = std::min(m_block.first, frame.time);
+    m_block.last = std::max(m_block.last, frame.time);
+  }
+  if (std::find(m_blockIds.begin(), m_blockIds.end(), id) == m_blockIds.end())
+    m_blockIds.push_back(id);
+  m_count++;
+  if (m_count % RECORD_BLOCK_SIZE == 0)
+    finishBlock();
+  return true;
+}
+
+RecordingReader::RecordingReader()
+  : m_data(NULL)
+  , m_size(0)
+{
+}
+
+RecordingReader::~RecordingReader() {
+  close();
+}
+
+bool RecordingReader::open(const std::string &path) {
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < RECORD_HEADER_SIZE) {
+    ::close(fd);
+    return false;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED)
+    return false;
+  m_data = static_cast<const uint8_t*>(data);
+  m_size = st.st_size;
+  const RecordingHeader &h = header();
+  if (h.magic != RECORD_MAGIC || h.version != RECORD_VERSION || h.recordSize != sizeof(RecordedFrame) ||
+      h.blockSize != RECORD_BLOCK_SIZE) {
+    close();
+    return false;
+  }
+  if (h.complete.load(std::memory_order_acquire) &&
+      (h.timeIndexOffset + h.timeIndexCount * sizeof(RecordingTimeIndex) > m_size ||
+       h.idIndexOffset + h.idIndexCount * sizeof(RecordingIdIndex) > m_size)) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void RecordingReader::close() {
+  if (m_data) {
+    munmap(const_cast<uint8_t*>(m_data), m_size);
+    m_data = NULL;
+  }
+  m_size = 0;
+}
+
+const RecordingHeader& RecordingReader::header() const {
+  return *reinterpret_cast<const RecordingHeader*>(m_data);
+}
+
+const RecordedFrame* RecordingReader::record(uint64_t index) const {
+  uint64_t offset = RECORD_HEADER_SIZE + index * sizeof(RecordedFrame);
+  if (offset + sizeof(RecordedFrame) > m_size)
+    return NULL;
+  return reinterpret_cast<const RecordedFrame*>(m_data + offset);
+}
+
+uint64_t RecordingReader::query(uint64_t from, uint64_t to, const IdSet &ids,
+                                const std::function<void(const RecordedFrame&)> &visit) const {
+  const RecordingHeader &h = header();
+  bool complete = h.complete.load(std::memory_order_acquire);
+  uint64_t count = h.count.load(std::memory_order_acquire);
+  uint64_t blocks = (count + RECORD_BLOCK_SIZE - 1) / RECORD_BLOCK_SIZE;
+  std::vector<bool> candidates(blocks, true);
+  if (complete && h.timeIndexCount == blocks) {
+    const RecordingTimeIndex *timeIndex = reinterpret_cast<const RecordingTimeIndex*>(m_data + h.timeIndexOffset);
+    for (uint64_t block = 0; block < blocks; block++)
+      candidates[block] = timeIndex[block].last >= from && timeIndex[block].first <= to;
+    if (!ids.empty()) {
+      const RecordingIdIndex *idIndex = reinterpret_cast<const RecordingIdIndex*>(m_data + h.idIndexOffset);
+      std::vector<bool> withId(blocks, false);
+      for (uint64_t i = 0; i < h.idIndexCount; i++) {
+        if (idIndex[i].block < blocks && ids.contains(idIndex[i].can_id))
+          withId[idIndex[i].block] = true;
+      }
+      for (uint64_t block = 0; block < blocks; block++)
+        candidates[block] = candidates[block] && withId[block];
+    }
+  }
+  uint64_t matches = 0;
+  for (uint64_t block = 0; block < blocks; block++) {
+    if (!candidates[block])
+      continue;
+    uint64_t end = std::min(count, (block + 1) * RECORD_BLOCK_SIZE);
+    for (uint64_t i = block * RECORD_BLOCK_SIZE; i < end; i++) {
+      const RecordedFrame *frame = record(i);
+      if (!frame)
+        return matches;
+      if (frame->time < from || frame->time > to)
+        continue;
+      if (!ids.empty() && !ids.contains(frame->can_id))
+        continue;
+      visit(*frame);
+      matches++;
+    }
+  }
+  return matches;
+}
+
+std::vector<std::string> cannelloni::listRecordings(const std::string &directory) {
+  std::vector<std::string> paths;
+  DIR *dir = opendir(directory.c_str());
+  if (!dir)
+    return paths;
+  while (struct dirent *entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name.size() > 4 && name.compare(0, 11, "cannelloni-") == 0 &&
+        name.compare(name.size() - 4, 4, ".rec") == 0)
+      paths.push_back(directory + "/" + name);
+  }
+  closedir(dir);
+  std::sort(paths.begin(), paths.end());
+  return paths;
+}
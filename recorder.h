@@ -0,0 +1,230 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "cannelloni.h"
+#include "idset.h"
+#include "mappedfile.h"
+#include "metrics.h"
+#include "thread.h"
+
+namespace cannelloni {
+
+#define RECORD_MAGIC 0x43414e52
+/* Changes whenever the layout of a segment changes */
+#define RECORD_VERSION 1
+/* The records start at this offset of a segment */
+#define RECORD_HEADER_SIZE 4096
+/* Records of a block, the index has an entry per block */
+#define RECORD_BLOCK_SIZE 1024
+/* Frames a thread can queue before further ones are dropped */
+#define RECORD_QUEUE_SIZE 65536
+/* Time in ms between two batches of the writer */
+#define RECORD_FLUSH_INTERVAL 10
+#define RECORD_DEFAULT_SEGMENT_SIZE (64 << 20)
+#define RECORD_INSTANCE_SIZE 32
+
+/* Design Notes:
+ *
+ * The recorder keeps every frame cannelloni tunnels, so there is no
+ * need for a candump next to it. The CAN thread sees both directions
+ * and pushes the frames into a RecordQueue with one producer and one
+ * consumer, a full queue drops frames instead of blocking the thread.
+ * The Recorder thread drains the queues every RECORD_FLUSH_INTERVAL ms
+ * and appends the batch to a memory mapped segment file.
+ *
+ * A segment is a header, fixed size records and, once the segment is
+ * full, its index:
+ *
+ *   | header | record 0 | record 1 | ... | time index | ID index |
+ *
+ * The records are split into blocks of RECORD_BLOCK_SIZE. The time
+ * index has the first and last time of each block, the ID index a sorted
+ * entry for every ID and block it occurs in. A query reads the index
+ * and only the blocks that can contain matching frames. Segments that
+ * are still written have no index yet and are scanned, the header's
+ * count tells how many records are complete.
+ */
+
+enum RecordSource : uint8_t {
+  /* Read from the bus and sent to the remote */
+  RECORD_CAN_TO_NETWORK,
+  /* Received from the remote and written to the bus */
+  RECORD_NETWORK_TO_CAN
+};
+
+const char* recordSourceName(uint8_t source);
+
+struct RecordedFrame {
+  /* CLOCK_REALTIME in ns */
+  uint64_t time;
+  uint32_t can_id;
+  /* With CANFD_FRAME like in the frame buffer */
+  uint8_t len;
+  uint8_t flags;
+  uint8_t source;
+  uint8_t reserved;
+  uint8_t data[CANFD_MAX_DLEN];
+};
+
+static_assert(sizeof(RecordedFrame) == 80, "records are written to segments as they are");
+
+struct RecordingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t recordSize;
+  uint32_t blockSize;
+  /* Set once the index is written */
+  std::atomic<uint32_t> complete;
+  uint32_t reserved;
+  /* Records that are written completely */
+  std::atomic<uint64_t> count;
+  uint64_t firstTime;
+  uint64_t lastTime;
+  uint64_t timeIndexOffset;
+  uint64_t timeIndexCount;
+  uint64_t idIndexOffset;
+  uint64_t idIndexCount;
+  char instance[RECORD_INSTANCE_SIZE];
+};
+
+static_assert(sizeof(RecordingHeader) <= RECORD_HEADER_SIZE, "the header must fit");
+
+struct RecordingTimeIndex {
+  uint64_t first;
+  uint64_t last;
+};
+
+struct RecordingIdIndex {
+  /* canfd_id() of the frames */
+  uint32_t can_id;
+  uint32_t block;
+};
+
+class RecordQueue {
+  public:
+    RecordQueue();
+
+    /* Only called by the producer */
+    void push(const canfd_frame *frame, RecordSource source);
+    /* Only called by the recorder thread */
+    void popAll(std::vector<RecordedFrame> &frames);
+
+    uint64_t getDroppedCount() const;
+
+  private:
+    std::array<RecordedFrame, RECORD_QUEUE_SIZE> m_frames;
+    std::atomic<uint64_t> m_head;
+    std::atomic<uint64_t> m_tail;
+    Metric m_dropped;
+};
+
+struct RecorderConfig {
+  /* The recorder is off if this is empty */
+  std::string directory;
+  size_t segmentSize;
+};
+
+class Recorder : public Thread {
+  public:
+    Recorder(const RecorderConfig &config, const std::string &instance);
+    virtual ~Recorder();
+
+    /* A queue for a producer, must be called before start() */
+    RecordQueue* addQueue();
+
+    virtual int start();
+    virtual void stop();
+    virtual void run();
+
+    uint64_t getRecordedCount() const;
+    uint64_t getDroppedCount() const;
+    uint64_t getSegmentCount() const;
+
+  private:
+    /* Appends the frames of all queues to the segments */
+    void drain();
+    bool openSegment();
+    /* Writes the index of the current segment and closes it */
+    void closeSegment();
+    bool fits();
+    /* false if there is no segment to write to */
+    bool append(const RecordedFrame &frame);
+    /* Adds the current block to the index */
+    void finishBlock();
+
+  private:
+    RecorderConfig m_config;
+    std::string m_instance;
+    std::vector<std::unique_ptr<RecordQueue>> m_queues;
+    std::vector<RecordedFrame> m_batch;
+
+    MappedFile m_file;
+    RecordingHeader *m_header;
+    uint64_t m_count;
+    uint32_t m_segmentNumber;
+    std::vector<RecordingTimeIndex> m_timeIndex;
+    std::vector<RecordingIdIndex> m_idIndex;
+    RecordingTimeIndex m_block;
+    /* IDs of the current block */
+    std::vector<uint32_t> m_blockIds;
+
+    Metric m_recordedCount;
+    Metric m_segmentCount;
+};
+
+/* Reads a segment, also one that is still written */
+class RecordingReader {
+  public:
+    RecordingReader();
+    ~RecordingReader();
+
+    bool open(const std::string &path);
+    void close();
+
+    const RecordingHeader& header() const;
+    /*
+     * Calls visit with the frames taken from from to to (ns) whose IDs
+     * are in ids, all IDs if ids is empty. Returns the number of frames.
+     */
+    uint64_t query(uint64_t from, uint64_t to, const IdSet &ids,
+                   const std::function<void(const RecordedFrame&)> &visit) const;
+    /* NULL past the end of the file, header().count tells the complete ones */
+    const RecordedFrame* record(uint64_t index) const;
+
+  private:
+    const uint8_t *m_data;
+    size_t m_size;
+};
+
+/* The segments in directory, ordered by their number */
+std::vector<std::string> listRecordings(const std::string &directory);
+
+}
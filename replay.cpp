@@ -0,0 +1,338 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "replay.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+using namespace cannelloni;
+
+ReplayReader::ReplayReader()
+  : m_source(RECORD_CAN_TO_NETWORK)
+  , m_segment(0)
+  , m_index(0)
+  , m_invalidCount(0)
+{}
+
+bool ReplayReader::open(const std::string &path, RecordSource source) {
+  m_source = source;
+  m_path = path;
+  m_segments.clear();
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0)
+    return false;
+  if (S_ISDIR(st.st_mode)) {
+    m_segments = listRecordings(path);
+    if (m_segments.empty())
+      return false;
+  } else {
+    /* Segments start with the magic, anything else is read as a candump log */
+    uint32_t magic = 0;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    ssize_t readBytes = read(fd, &magic, sizeof(magic));
+    ::close(fd);
+    if (readBytes == sizeof(magic) && magic == RECORD_MAGIC)
+      m_segments.push_back(path);
+  }
+  return rewind();
+}
+
+bool ReplayReader::rewind() {
+  if (m_segments.empty()) {
+    /* Counted once per pass */
+    m_invalidCount = 0;
+    m_log.close();
+    m_log.clear();
+    m_log.open(m_path);
+    return m_log.is_open();
+  }
+  m_segment = 0;
+  m_index = 0;
+  if (m_reader.open(m_segments[0]))
+    return true;
+  lerror << "Could not read recording segment " << m_segments[0] << std::endl;
+  m_segment = m_segments.size();
+  return false;
+}
+
+bool ReplayReader::nextSegment() {
+  while (++m_segment < m_segments.size()) {
+    m_index = 0;
+    if (m_reader.open(m_segments[m_segment]))
+      return true;
+    lerror << "Could not read recording segment " << m_segments[m_segment] << std::endl;
+  }
+  m_reader.close();
+  return false;
+}
+
+bool ReplayReader::next(RecordedFrame &frame) {
+  if (m_segments.empty()) {
+    std::string line;
+    while (std::getline(m_log, line)) {
+      if (parseCandump(line, frame))
+        return true;
+      if (!line.empty() && line[0] != '#')
+        m_invalidCount++;
+    }
+    return false;
+  }
+  while (m_segment < m_segments.size()) {
+    if (m_index < m_reader.header().count.load(std::memory_order_acquire)) {
+      const RecordedFrame *record = m_reader.record(m_index++);
+      if (!record)
+        continue;
+      if (record->source != m_source)
+        continue;
+      frame = *record;
+      return true;
+    }
+    if (!nextSegment())
+      break;
+  }
+  return false;
+}
+
+uint64_t ReplayReader::getInvalidCount() const {
+  return m_invalidCount;
+}
+
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+bool ReplayReader::parseCandump(const std::string &line, RecordedFrame &frame) {
+  std::istringstream in(line);
+  std::string time, interface, data;
+  if (!(in >> time >> interface >> data))
+    return false;
+  /* (seconds.microseconds) */
+  if (time.size() < 3 || time.front() != '(' || time.back() != ')')
+    return false;
+  size_t dot = time.find('.');
+  if (dot == std::string::npos)
+    return false;
+  char *end;
+  uint64_t seconds = strtoull(time.c_str() + 1, &end, 10);
+  if (end != time.c_str() + dot)
+    return false;
+  uint64_t fraction = strtoull(time.c_str() + dot + 1, &end, 10);
+  size_t digits = end - (time.c_str() + dot + 1);
+  if (*end != ')' || digits == 0 || digits > 9)
+    return false;
+  for (size_t i = digits; i < 9; i++)
+    fraction *= 10;
+
+  memset(&frame, 0, sizeof(frame));
+  frame.time = seconds * 1000000000 + fraction;
+  frame.source = RECORD_CAN_TO_NETWORK;
+
+  size_t hash = data.find('#');
+  if (hash == 3) {
+    frame.can_id = strtoul(data.substr(0, 3).c_str(), &end, 16);
+    if (*end != '\0')
+      return false;
+  } else if (hash == 8) {
+    frame.can_id = strtoul(data.substr(0, 8).c_str(), &end, 16);
+    if (*end != '\0')
+      return false;
+    /* Like canplayer: 8 digits are an extended ID unless it is an error frame */
+    if (!(frame.can_id & CAN_ERR_FLAG))
+      frame.can_id |= CAN_EFF_FLAG;
+  } else {
+    return false;
+  }
+
+  size_t pos = hash + 1;
+  size_t maxLen = CAN_MAX_DLEN;
+  if (pos < data.size() && data[pos] == '#') {
+    /* ID##<flags><data> */
+    if (pos + 1 >= data.size() || hexValue(data[pos + 1]) < 0)
+      return false;
+    frame.flags = hexValue(data[pos + 1]);
+    frame.len = CANFD_FRAME;
+    maxLen = CANFD_MAX_DLEN;
+    pos += 2;
+  } else if (pos < data.size() && (data[pos] == 'R' || data[pos] == 'r')) {
+    /* ID#R with an optional DLC */
+    frame.can_id |= CAN_RTR_FLAG;
+    if (pos + 1 < data.size()) {
+      int dlc = hexValue(data[pos + 1]);
+      if (dlc < 0 || dlc > CAN_MAX_DLEN)
+        return false;
+      frame.len = dlc;
+    }
+    return true;
+  }
+
+  uint8_t len = 0;
+  while (pos < data.size()) {
+    /* Bytes may be separated by dots */
+    if (data[pos] == '.') {
+      pos++;
+      continue;
+    }
+    if (pos + 1 >= data.size() || len >= maxLen)
+      return false;
+    int high = hexValue(data[pos]);
+    int low = hexValue(data[pos + 1]);
+    if (high < 0 || low < 0)
+      return false;
+    frame.data[len++] = (high << 4) | low;
+    pos += 2;
+  }
+  frame.len |= len;
+  return true;
+}
+
+Replayer::Replayer()
+  : m_hasPending(false)
+  , m_done(false)
+  , m_passes(0)
+  , m_start(0)
+  , m_first(0)
+  , m_due(0)
+  , m_firstInjected(0)
+  , m_lastInjected(0)
+  , m_injectedCount(0)
+  , m_stallCount(0)
+{
+  m_config.target = REPLAY_NETWORK;
+  m_config.speed = 1.0;
+  m_config.repeat = 1;
+  memset(&m_pending, 0, sizeof(m_pending));
+}
+
+void Replayer::setup(const ReplayConfig &config) {
+  m_config = config;
+}
+
+bool Replayer::isEnabled() const {
+  return !m_config.path.empty();
+}
+
+ReplayTarget Replayer::getTarget() const {
+  return m_config.target;
+}
+
+bool Replayer::open() {
+  RecordSource source = m_config.target == REPLAY_NETWORK ? RECORD_CAN_TO_NETWORK : RECORD_NETWORK_TO_CAN;
+  return m_reader.open(m_config.path, source);
+}
+
+bool Replayer::load() {
+  if (m_reader.next(m_pending))
+    return true;
+  m_passes++;
+  if (m_config.repeat && m_passes >= m_config.repeat)
+    return false;
+  if (!m_reader.rewind() || !m_reader.next(m_pending))
+    return false;
+  /* The next pass starts where the last one ended */
+  m_start = m_due;
+  m_first = m_pending.time;
+  return true;
+}
+
+Replayer::Result Replayer::poll(uint64_t now, uint64_t &wait) {
+  wait = 0;
+  if (m_done)
+    return REPLAY_DONE;
+  if (!m_hasPending) {
+    if (!load()) {
+      m_done = true;
+      return REPLAY_DONE;
+    }
+    m_hasPending = true;
+    if (m_start == 0) {
+      m_start = now;
+      m_first = m_pending.time;
+    }
+    if (m_config.speed > 0) {
+      /* Frames that go back in time are due at once */
+      uint64_t offset = m_pending.time > m_first ? m_pending.time - m_first : 0;
+      m_due = std::max(m_due, m_start + static_cast<uint64_t>(offset / m_config.speed));
+    } else {
+      m_due = now;
+    }
+  }
+  if (m_due <= now)
+    return REPLAY_DUE;
+  /* Rounded up, the timer must not fire before the frame is due */
+  wait = (m_due - now + 999) / 1000;
+  return REPLAY_WAIT;
+}
+
+const RecordedFrame& Replayer::pending() const {
+  return m_pending;
+}
+
+void Replayer::injected(uint64_t now) {
+  m_hasPending = false;
+  if (m_injectedCount++ == 0)
+    m_firstInjected = now;
+  m_lastInjected = now;
+  if (m_config.speed > 0)
+    m_deviation.add(now > m_due ? (now - m_due) / 1000 : 0);
+}
+
+void Replayer::stalled() {
+  m_stallCount++;
+}
+
+bool Replayer::isDone() const {
+  return m_done;
+}
+
+uint64_t Replayer::getInjectedCount() const {
+  return m_injectedCount;
+}
+
+std::string Replayer::summary(uint64_t now) const {
+  std::ostringstream out;
+  uint64_t end = m_done ? m_lastInjected : now;
+  double seconds = m_injectedCount ? (end - m_firstInjected) / 1e9 : 0;
+  out << "Injected: " << m_injectedCount << " Passes: " << m_passes
+      << " Duration: " << seconds << " s"
+      << " FPS: " << (seconds > 0 ? static_cast<uint64_t>(m_injectedCount / seconds) : 0)
+      << " Stalls: " << m_stallCount;
+  if (m_reader.getInvalidCount())
+    out << " Invalid lines: " << m_reader.getInvalidCount();
+  if (m_config.speed > 0)
+    out << " Deviation: " << m_deviation.summary("us");
+  return out.str();
+}
@@ -0,0 +1,170 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "latency.h"
+#include "recorder.h"
+
+namespace cannelloni {
+
+/* Frames injected at most per wakeup, so the bus is still read in between */
+#define REPLAY_BATCH 256
+/* Time in us until frames are requested again once a frame buffer is exhausted */
+#define REPLAY_RETRY_INTERVAL 1000
+
+/* Design Notes:
+ *
+ * A replay reads a candump log or the segments written with --record and
+ * injects the frames into the tunnel from within the CAN thread, so they
+ * take the same path as frames read from the bus (towards the network)
+ * or received from the remote (towards the bus). There is no canplayer
+ * process and no vcan in between.
+ *
+ * The Replayer only decides which frame is due. Frame i is due at
+ *
+ *   start + (time(i) - time(0)) / speed
+ *
+ * on the monotonic clock, so a late wakeup does not shift the frames
+ * after it. The CAN thread arms a timer for the next due frame and
+ * injects up to REPLAY_BATCH frames per wakeup. A speed of 0 injects the
+ * frames as fast as the frame buffers take them. The difference between
+ * the due time and the time a frame is injected is kept in a histogram.
+ *
+ * Frames of recordings keep their direction: towards the network only
+ * the frames read from the bus are replayed, towards the bus only the
+ * ones received from the remote. A candump log has no direction and
+ * all its frames are replayed.
+ */
+
+enum ReplayTarget {
+  /* Sent to the remote like frames read from the bus */
+  REPLAY_NETWORK,
+  /* Written to the bus like frames received from the remote */
+  REPLAY_CAN
+};
+
+struct ReplayConfig {
+  /* A candump log, a segment or a directory with segments, off if empty */
+  std::string path;
+  ReplayTarget target;
+  /* Factor of the recorded timing, 0 is as fast as possible */
+  double speed;
+  /* Number of times the recording is replayed, 0 repeats it forever */
+  uint64_t repeat;
+};
+
+/* Reads the frames of a candump log or of recording segments in order */
+class ReplayReader {
+  public:
+    ReplayReader();
+
+    /* Only frames of source are read from segments */
+    bool open(const std::string &path, RecordSource source);
+    /* false at the end of the recording */
+    bool next(RecordedFrame &frame);
+    /* Starts over with the first frame */
+    bool rewind();
+
+    /* Lines of a candump log that are no frames */
+    uint64_t getInvalidCount() const;
+
+    /* Parses a line like "(1700000000.123456) can0 123#DEADBEEF" */
+    static bool parseCandump(const std::string &line, RecordedFrame &frame);
+
+  private:
+    bool nextSegment();
+
+  private:
+    RecordSource m_source;
+    /* Empty for a candump log */
+    std::vector<std::string> m_segments;
+    size_t m_segment;
+    RecordingReader m_reader;
+    uint64_t m_index;
+    std::string m_path;
+    std::ifstream m_log;
+    uint64_t m_invalidCount;
+};
+
+class Replayer {
+  public:
+    enum Result {
+      /* pending() is due and can be injected */
+      REPLAY_DUE,
+      /* The next frame is due later */
+      REPLAY_WAIT,
+      REPLAY_DONE
+    };
+
+    Replayer();
+
+    /* Must be called before open() */
+    void setup(const ReplayConfig &config);
+    bool isEnabled() const;
+    ReplayTarget getTarget() const;
+    /* Opens the recording */
+    bool open();
+
+    /*
+     * Checks the next frame at now (monotonic ns), wait is set to the
+     * time in us until it is due
+     */
+    Result poll(uint64_t now, uint64_t &wait);
+    const RecordedFrame& pending() const;
+    /* pending() was injected at now */
+    void injected(uint64_t now);
+    /* No frame could be injected because the frame buffer is exhausted */
+    void stalled();
+
+    bool isDone() const;
+    uint64_t getInjectedCount() const;
+    std::string summary(uint64_t now) const;
+
+  private:
+    /* Reads the next frame into m_pending, starts a new pass at the end */
+    bool load();
+
+  private:
+    ReplayConfig m_config;
+    ReplayReader m_reader;
+    RecordedFrame m_pending;
+    bool m_hasPending;
+    bool m_done;
+    uint64_t m_passes;
+    /* Monotonic time of the first frame of the pass */
+    uint64_t m_start;
+    /* Recorded time of the first frame of the pass */
+    uint64_t m_first;
+    uint64_t m_due;
+    uint64_t m_firstInjected;
+    uint64_t m_lastInjected;
+    uint64_t m_injectedCount;
+    uint64_t m_stallCount;
+    /* Injection time minus due time in us */
+    LatencyHistogram m_deviation;
+};
+
+}
@@ -0,0 +1,188 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "retransmitbuffer.h"
+
+#include <algorithm>
+
+using namespace cannelloni;
+
+RetransmitBuffer::RetransmitBuffer()
+  : m_minTimeout(20000)
+  , m_srtt(0)
+  , m_rttvar(0)
+  , m_timeout(20000)
+  , m_sentCount(0)
+  , m_retransmitCount(0)
+  , m_ackedCount(0)
+  , m_recoveredCount(0)
+  , m_failedCount(0)
+  , m_recoveryLatencySum(0)
+  , m_recoveryLatencyMax(0)
+{
+}
+
+void RetransmitBuffer::setMinTimeout(uint64_t timeout) {
+  m_minTimeout = timeout;
+  if (m_srtt == 0)
+    m_timeout = timeout;
+  else
+    m_timeout = std::max(m_timeout, timeout);
+}
+
+void RetransmitBuffer::reset() {
+  m_entries.clear();
+}
+
+void RetransmitBuffer::store(uint32_t seq, const uint8_t *data, uint16_t len,
+                             std::chrono::steady_clock::time_point now) {
+  if (m_entries.size() >= RETRANSMIT_BUFFER_MAX_PACKETS) {
+    m_entries.pop_front();
+    m_failedCount++;
+  }
+  m_entries.push_back(Entry{seq, 0, now, now, std::vector<uint8_t>(data, data + len)});
+  m_sentCount++;
+}
+
+void RetransmitBuffer::acknowledge(uint32_t seq, std::chrono::steady_clock::time_point now) {
+  auto it = find(seq);
+  if (it == m_entries.end())
+    return;
+  uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - it->firstSent).count();
+  if (it->retries == 0) {
+    sampleRoundTrip(elapsed);
+  } else {
+    m_recoveredCount++;
+    m_recoveryLatencySum += elapsed;
+    m_recoveryLatencyMax = std::max(m_recoveryLatencyMax, elapsed);
+  }
+  m_ackedCount++;
+  m_entries.erase(it);
+}
+
+const std::vector<uint8_t>* RetransmitBuffer::nack(uint32_t seq, std::chrono::steady_clock::time_point now) {
+  auto it = find(seq);
+  if (it == m_entries.end())
+    return NULL;
+  /* The receiver may report the same gap again before the retransmission arrived */
+  if (it->retries > 0 && now - it->lastSent < std::chrono::microseconds(m_srtt))
+    return NULL;
+  /* The same limit as for timeouts, a peer can't keep a packet alive by NACKing it */
+  if (it->retries >= RETRANSMIT_MAX_RETRIES) {
+    m_failedCount++;
+    m_entries.erase(it);
+    return NULL;
+  }
+  return retransmit(*it, now);
+}
+
+const std::vector<uint8_t>* RetransmitBuffer::nextExpired(std::chrono::steady_clock::time_point now) {
+  auto it = m_entries.begin();
+  while (it != m_entries.end()) {
+    if (deadline(*it) > now) {
+      it++;
+    } else if (it->retries >= RETRANSMIT_MAX_RETRIES) {
+      m_failedCount++;
+      it = m_entries.erase(it);
+    } else {
+      return retransmit(*it, now);
+    }
+  }
+  return NULL;
+}
+
+uint64_t RetransmitBuffer::nextTimeout(std::chrono::steady_clock::time_point now) {
+  if (m_entries.empty())
+    return 0;
+  auto due = deadline(m_entries.front());
+  for (const Entry &entry : m_entries) {
+    due = std::min(due, deadline(entry));
+  }
+  if (due <= now)
+    return 1;
+  return std::chrono::duration_cast<std::chrono::microseconds>(due - now).count() + 1;
+}
+
+std::deque<RetransmitBuffer::Entry>::iterator RetransmitBuffer::find(uint32_t seq) {
+  return std::find_if(m_entries.begin(), m_entries.end(),
+                      [seq](const Entry &entry) { return entry.seq == seq; });
+}
+
+std::chrono::steady_clock::time_point RetransmitBuffer::deadline(const Entry &entry) {
+  uint64_t timeout = std::min<uint64_t>(m_timeout << entry.retries, RETRANSMIT_MAX_TIMEOUT);
+  return entry.lastSent + std::chrono::microseconds(timeout);
+}
+
+const std::vector<uint8_t>* RetransmitBuffer::retransmit(Entry &entry, std::chrono::steady_clock::time_point now) {
+  entry.retries++;
+  entry.lastSent = now;
+  m_retransmitCount++;
+  return &entry.data;
+}
+
+void RetransmitBuffer::sampleRoundTrip(uint64_t rtt) {
+  if (m_srtt == 0) {
+    m_srtt = std::max<uint64_t>(rtt, 1);
+    m_rttvar = rtt / 2;
+  } else {
+    uint64_t delta = rtt > m_srtt ? rtt - m_srtt : m_srtt - rtt;
+    m_rttvar = (3 * m_rttvar + delta) / 4;
+    m_srtt = std::max<uint64_t>((7 * m_srtt + rtt) / 8, 1);
+  }
+  m_timeout = std::clamp<uint64_t>(m_srtt + 4 * m_rttvar, m_minTimeout, RETRANSMIT_MAX_TIMEOUT);
+}
+
+size_t RetransmitBuffer::size() {
+  return m_entries.size();
+}
+
+uint64_t RetransmitBuffer::getTimeout() {
+  return m_timeout;
+}
+
+uint64_t RetransmitBuffer::getSentCount() {
+  return m_sentCount;
+}
+
+uint64_t RetransmitBuffer::getRetransmitCount() {
+  return m_retransmitCount;
+}
+
+uint64_t RetransmitBuffer::getAckedCount() {
+  return m_ackedCount;
+}
+
+uint64_t RetransmitBuffer::getRecoveredCount() {
+  return m_recoveredCount;
+}
+
+uint64_t RetransmitBuffer::getFailedCount() {
+  return m_failedCount;
+}
+
+uint64_t RetransmitBuffer::getAverageRecoveryLatency() {
+  if (m_recoveredCount == 0)
+    return 0;
+  return m_recoveryLatencySum / m_recoveredCount;
+}
+
+uint64_t RetransmitBuffer::getMaxRecoveryLatency() {
+  return m_recoveryLatencyMax;
+}
@@ -0,0 +1,118 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+namespace cannelloni {
+
+/* Maximum number of unacknowledged packets, the oldest one is given up */
+#define RETRANSMIT_BUFFER_MAX_PACKETS 256
+/* Number of retransmissions before a packet is given up */
+#define RETRANSMIT_MAX_RETRIES 8
+/* Upper bound of the retransmission timeout in us */
+#define RETRANSMIT_MAX_TIMEOUT 1000000
+
+/* Design Notes:
+ *
+ * RetransmitBuffer keeps a copy of every reliable packet until the
+ * receiver acknowledges it. A packet is sent again when the receiver
+ * reports it missing (NACK) or when it has not been acknowledged within
+ * the retransmission timeout. The timeout follows the measured round
+ * trip time like in TCP (RFC 6298), never goes below the configured
+ * minimum and doubles with every retransmission of a packet.
+ * Round trip times are only sampled from packets that were sent once.
+ */
+
+class RetransmitBuffer {
+  public:
+    RetransmitBuffer();
+
+    /* Lower bound of the retransmission timeout in us */
+    void setMinTimeout(uint64_t timeout);
+    /* Drops all packets, e.g. after the remote stopped using extension headers */
+    void reset();
+
+    void store(uint32_t seq, const uint8_t *data, uint16_t len,
+               std::chrono::steady_clock::time_point now);
+    void acknowledge(uint32_t seq, std::chrono::steady_clock::time_point now);
+    /*
+     * Returns the packet the receiver is missing if it has to be sent
+     * again, NULL if it is not held or has just been sent. A packet that
+     * ran out of retries is dropped.
+     */
+    const std::vector<uint8_t>* nack(uint32_t seq, std::chrono::steady_clock::time_point now);
+    /*
+     * Returns the next packet whose timeout expired, NULL if there is none.
+     * Packets that ran out of retries are dropped.
+     */
+    const std::vector<uint8_t>* nextExpired(std::chrono::steady_clock::time_point now);
+    /* Time in us until the next timeout, 0 if the buffer is empty */
+    uint64_t nextTimeout(std::chrono::steady_clock::time_point now);
+
+    size_t size();
+    uint64_t getTimeout();
+    uint64_t getSentCount();
+    uint64_t getRetransmitCount();
+    uint64_t getAckedCount();
+    uint64_t getRecoveredCount();
+    uint64_t getFailedCount();
+    /* Time from the first transmission to the ACK of recovered packets in us */
+    uint64_t getAverageRecoveryLatency();
+    uint64_t getMaxRecoveryLatency();
+
+  private:
+    struct Entry {
+      uint32_t seq;
+      uint32_t retries;
+      std::chrono::steady_clock::time_point firstSent;
+      std::chrono::steady_clock::time_point lastSent;
+      std::vector<uint8_t> data;
+    };
+
+    std::deque<Entry>::iterator find(uint32_t seq);
+    std::chrono::steady_clock::time_point deadline(const Entry &entry);
+    const std::vector<uint8_t>* retransmit(Entry &entry, std::chrono::steady_clock::time_point now);
+    void sampleRoundTrip(uint64_t rtt);
+
+  private:
+    uint64_t m_minTimeout;
+    /* Smoothed round trip time and its variation in us, 0 until sampled */
+    uint64_t m_srtt;
+    uint64_t m_rttvar;
+    uint64_t m_timeout;
+    /* Ordered by sequence number */
+    std::deque<Entry> m_entries;
+
+    /* Performance Counters */
+    uint64_t m_sentCount;
+    uint64_t m_retransmitCount;
+    uint64_t m_ackedCount;
+    uint64_t m_recoveredCount;
+    uint64_t m_failedCount;
+    uint64_t m_recoveryLatencySum;
+    uint64_t m_recoveryLatencyMax;
+};
+
+}
@@ -45,6 +45,7 @@
 #include "inet_address.h"
 #include "logging.h"
 #include "sctpthread.h"
+#include "spillqueue.h"
 
 
 
@@ -99,6 +100,16 @@ void SCTPThread::run() {
   /* Set interval to m_timeout */
   m_transmitTimer.adjust(m_timeout, m_timeout);
   m_blockTimer.adjust(SELECT_TIMEOUT, SELECT_TIMEOUT);
+  if (m_frameBuffer->getSpillQueue()) {
+    m_drainTimer.adjust(SPILL_DRAIN_INTERVAL, SPILL_DRAIN_INTERVAL);
+  } else {
+    m_drainTimer.disable();
+  }
+  if (m_clockSync.isEnabled()) {
+    m_clockTimer.adjust(CLOCK_SYNC_FAST_INTERVAL, CLOCK_SYNC_FAST_INTERVAL);
+  } else {
+    m_clockTimer.disable();
+  }
 
   while (m_started) {
     if (!m_connected) {
@@ -150,6 +161,7 @@ void SCTPThread::run() {
         linfo << "Got a connection from " << formatSocketAddress(getSocketAddress(&connAddr)) << std::endl;
         /* At this point we have a valid connection */
         m_connected = true;
+        m_clockSync.reset();
         /* Clear the old entries in frameBuffer */
         m_frameBuffer->reset();
         /* Disable Nagle for this connection */
@@ -177,6 +189,7 @@ void SCTPThread::run() {
         } else {
           linfo << "Connected!" << std::endl;
           m_connected = true;
+          m_clockSync.reset();
         }
       }
     } else { /* m_connected == true */
@@ -185,7 +198,10 @@ void SCTPThread::run() {
       FD_SET(m_socket, &readfds);
       FD_SET(m_transmitTimer.getFd(), &readfds);
       FD_SET(m_blockTimer.getFd(), &readfds);
-      int ret = select(std::max({m_socket, m_transmitTimer.getFd(), m_blockTimer.getFd()})+1,
+      FD_SET(m_drainTimer.getFd(), &readfds);
+      FD_SET(m_clockTimer.getFd(), &readfds);
+      int ret = select(std::max({m_socket, m_transmitTimer.getFd(), m_blockTimer.getFd(),
+                                 m_drainTimer.getFd(), m_clockTimer.getFd()})+1,
         &readfds, NULL, NULL, NULL);
       if (ret < 0) {
         if (errno == EOF) {
@@ -207,6 +223,14 @@ void SCTPThread::run() {
       if (FD_ISSET(m_blockTimer.getFd(), &readfds)) {
         m_blockTimer.read();
       }
+      if (FD_ISSET(m_drainTimer.getFd(), &readfds)) {
+        m_drainTimer.read();
+        drainSpill();
+      }
+      if (FD_ISSET(m_clockTimer.getFd(), &readfds)) {
+        m_clockTimer.read();
+        requestClock();
+      }
       if (FD_ISSET(m_socket, &readfds)) {
         struct sctp_sndrcvinfo sinfo;
         int flags = 0;
@@ -216,12 +240,14 @@ void SCTPThread::run() {
         receivedBytes = sctp_recvmsg(m_socket, buffer, m_linkMtuSize,
                         (struct sockaddr *) &clientAddr, &clientAddrLen, &sinfo, &flags);
         if (receivedBytes < 0) {
+          m_receiveErrors.add();
           lerror << "recvfrom error." << std::endl;
           /* close connection */
           m_connected = false;
           close(m_socket);
           continue;
         } else if (receivedBytes > 0) {
+          m_rxBytes.add(receivedBytes);
           parsePacket(buffer, receivedBytes, &clientAddr);
         } else {
           m_connected  = false;
@@ -234,7 +260,13 @@ void SCTPThread::run() {
   if (m_debugOptions.buffer) {
     m_frameBuffer->debug();
   }
-  linfo << "Shutting down. SCTP Transmission Summary: TX: " << m_txCount << " RX: " << m_rxCount << std::endl;
+  linfo << "Shutting down. SCTP Transmission Summary: TX: " << m_txCount.get() << " RX: " << m_rxCount.get() << std::endl;
+  if (m_clockSync.isEnabled()) {
+    linfo << "Clock Summary: Offset: " << m_clockSync.getOffset() / 1000
+          << " us RTT: " << m_clockSync.getRtt() / 1000
+          << " us Requests: " << m_clockSync.getRequestCount()
+          << " Samples: " << m_clockSync.getSampleCount() << std::endl;
+  }
   m_connected = false;
   close(m_socket);
   if (m_role == SCTP_SERVER) {
@@ -259,5 +291,7 @@ ssize_t SCTPThread::sendBuffer(uint8_t *buffer, uint16_t len) {
   memset(&sinfo, 0, sizeof(sinfo));
   sinfo.sinfo_stream = 0;
   sinfo.sinfo_assoc_id = m_assoc_id;
-  return sctp_send(m_socket, buffer, len, &sinfo, 0);
+  ssize_t ret = sctp_send(m_socket, buffer, len, &sinfo, 0);
+  countSent(ret);
+  return ret;
 }
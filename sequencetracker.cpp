@@ -0,0 +1,199 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "sequencetracker.h"
+
+using namespace cannelloni;
+
+SequenceTracker::SequenceTracker()
+  : m_receivedCount(0)
+  , m_lostCount(0)
+  , m_duplicateCount(0)
+  , m_reorderedCount(0)
+  , m_lateCount(0)
+{
+  reset();
+}
+
+void SequenceTracker::reset() {
+  m_synced = false;
+  m_highest = 0;
+  m_history = 0;
+  m_lastGap = 0;
+}
+
+SequenceResult SequenceTracker::track(uint32_t seq) {
+  m_lastGap = 0;
+  if (!m_synced) {
+    m_synced = true;
+    m_highest = seq;
+    m_history = 0;
+    m_receivedCount++;
+    return SEQ_IN_ORDER;
+  }
+  int32_t diff = static_cast<int32_t>(seq - m_highest);
+  if (diff > 0) {
+    /* Everything between m_highest and seq is missing for now */
+    m_lostCount += diff - 1;
+    m_lastGap = diff - 1;
+    if (diff > SEQUENCE_HISTORY_SIZE) {
+      m_history = 0;
+    } else {
+      m_history = (m_history << 1 | 1) << (diff - 1);
+    }
+    m_highest = seq;
+    m_receivedCount++;
+    return SEQ_IN_ORDER;
+  } else if (diff == 0) {
+    m_duplicateCount++;
+    return SEQ_DUPLICATE;
+  } else if (-diff > SEQUENCE_HISTORY_SIZE) {
+    m_receivedCount++;
+    m_lateCount++;
+    return SEQ_LATE;
+  }
+  uint64_t bit = 1ULL << (-diff - 1);
+  if (m_history & bit) {
+    m_duplicateCount++;
+    return SEQ_DUPLICATE;
+  }
+  m_history |= bit;
+  m_receivedCount++;
+  m_reorderedCount++;
+  if (m_lostCount > 0)
+    m_lostCount--;
+  return SEQ_REORDERED;
+}
+
+uint32_t SequenceTracker::getLastGap() {
+  return m_lastGap;
+}
+
+uint64_t SequenceTracker::getReceivedCount() {
+  return m_receivedCount;
+}
+
+uint64_t SequenceTracker::getLostCount() {
+  return m_lostCount;
+}
+
+uint64_t SequenceTracker::getDuplicateCount() {
+  return m_duplicateCount;
+}
+
+uint64_t SequenceTracker::getReorderedCount() {
+  return m_reorderedCount;
+}
+
+uint64_t SequenceTracker::getLateCount() {
+  return m_lateCount;
+}
+
+ReorderBuffer::ReorderBuffer()
+  : m_window(0)
+  , m_heldCount(0)
+  , m_skippedCount(0)
+{
+  reset();
+}
+
+void ReorderBuffer::setWindow(uint64_t window) {
+  m_window = window;
+}
+
+bool ReorderBuffer::isEnabled() {
+  return m_window > 0;
+}
+
+void ReorderBuffer::reset() {
+  m_synced = false;
+  m_next = 0;
+  m_entries.clear();
+}
+
+bool ReorderBuffer::push(uint32_t seq, uint8_t flags, const uint8_t *data, uint16_t len,
+                         std::chrono::steady_clock::time_point now) {
+  if (!m_synced) {
+    m_synced = true;
+    m_next = seq;
+  }
+  int32_t offset = static_cast<int32_t>(seq - m_next);
+  if (offset < 0)
+    return false;
+  auto it = m_entries.begin();
+  while (it != m_entries.end() && static_cast<int32_t>(it->seq - m_next) < offset)
+    it++;
+  if (it != m_entries.end() && it->seq == seq)
+    return true;
+  if (offset > 0)
+    m_heldCount++;
+  m_entries.insert(it, Entry{seq, flags, now, std::vector<uint8_t>(data, data + len)});
+  return true;
+}
+
+bool ReorderBuffer::pop(std::vector<uint8_t> &packet, uint8_t &flags, std::chrono::steady_clock::time_point now) {
+  if (m_entries.empty())
+    return false;
+  Entry &front = m_entries.front();
+  if (front.seq != m_next) {
+    /* Give up on the gap once a held packet has waited long enough */
+    bool expired = now - oldestArrival() >= std::chrono::microseconds(m_window);
+    if (!expired && m_entries.size() <= REORDER_BUFFER_MAX_PACKETS)
+      return false;
+    m_skippedCount += front.seq - m_next;
+    m_next = front.seq;
+  }
+  packet.swap(front.data);
+  flags = front.flags;
+  m_entries.pop_front();
+  m_next++;
+  return true;
+}
+
+uint64_t ReorderBuffer::nextTimeout(std::chrono::steady_clock::time_point now) {
+  if (m_entries.empty())
+    return 0;
+  auto due = oldestArrival() + std::chrono::microseconds(m_window);
+  if (due <= now)
+    return 1;
+  return std::chrono::duration_cast<std::chrono::microseconds>(due - now).count() + 1;
+}
+
+std::chrono::steady_clock::time_point ReorderBuffer::oldestArrival() {
+  /* A packet that filled a gap is not the oldest one */
+  auto oldest = m_entries.front().arrival;
+  for (const Entry &entry : m_entries) {
+    if (entry.arrival < oldest)
+      oldest = entry.arrival;
+  }
+  return oldest;
+}
+
+size_t ReorderBuffer::size() {
+  return m_entries.size();
+}
+
+uint64_t ReorderBuffer::getHeldCount() {
+  return m_heldCount;
+}
+
+uint64_t ReorderBuffer::getSkippedCount() {
+  return m_skippedCount;
+}
@@ -0,0 +1,144 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+namespace cannelloni {
+
+/* Number of sequence numbers behind the highest one that are remembered */
+#define SEQUENCE_HISTORY_SIZE 64
+/* Maximum number of packets held by a ReorderBuffer */
+#define REORDER_BUFFER_MAX_PACKETS 64
+
+enum SequenceResult {
+  /* Next or newer than the highest sequence number so far */
+  SEQ_IN_ORDER,
+  /* Older than the highest sequence number, fills a gap */
+  SEQ_REORDERED,
+  /* Already received */
+  SEQ_DUPLICATE,
+  /* Too old to tell whether it is a duplicate */
+  SEQ_LATE
+};
+
+/* Design Notes:
+ *
+ * SequenceTracker keeps the highest sequence number received so far and
+ * a bitmap of the SEQUENCE_HISTORY_SIZE sequence numbers before it.
+ * A jump ahead counts the skipped packets as lost. Once one of them
+ * arrives, it is counted as reordered and no longer as lost. Sequence
+ * numbers are compared in serial number arithmetic, so wrapping is fine.
+ */
+
+class SequenceTracker {
+  public:
+    SequenceTracker();
+
+    /* Forget everything about the previous sequence, e.g. after a restart of the peer */
+    void reset();
+    SequenceResult track(uint32_t seq);
+    /* Number of packets the last tracked packet skipped ahead, 0 if it was in order */
+    uint32_t getLastGap();
+
+    uint64_t getReceivedCount();
+    uint64_t getLostCount();
+    uint64_t getDuplicateCount();
+    uint64_t getReorderedCount();
+    uint64_t getLateCount();
+
+  private:
+    bool m_synced;
+    uint32_t m_highest;
+    /* Bit n is set if m_highest - n - 1 has been received */
+    uint64_t m_history;
+    uint32_t m_lastGap;
+
+    /* Performance Counters */
+    uint64_t m_receivedCount;
+    uint64_t m_lostCount;
+    uint64_t m_duplicateCount;
+    uint64_t m_reorderedCount;
+    uint64_t m_lateCount;
+};
+
+/* Design Notes:
+ *
+ * ReorderBuffer holds packets that arrive ahead of a gap until the
+ * missing packets arrive or the oldest held packet has waited for
+ * the configured window. Then the gap is skipped. Late packets (behind
+ * the next expected sequence number) are never held.
+ * The buffer only orders, duplicates have to be filtered before.
+ */
+
+class ReorderBuffer {
+  public:
+    ReorderBuffer();
+
+    /* Time a packet may be held in us, 0 disables the buffer */
+    void setWindow(uint64_t window);
+    bool isEnabled();
+    void reset();
+
+    /*
+     * Queues the packet. Returns false if the packet is late and
+     * has to be delivered right away.
+     */
+    bool push(uint32_t seq, uint8_t flags, const uint8_t *data, uint16_t len,
+              std::chrono::steady_clock::time_point now);
+    /*
+     * Moves the next packet that may be delivered and the flags of its
+     * extension header into packet and flags. Returns false if there is none.
+     */
+    bool pop(std::vector<uint8_t> &packet, uint8_t &flags, std::chrono::steady_clock::time_point now);
+    /* Time in us until the oldest held packet is due, 0 if the buffer is empty */
+    uint64_t nextTimeout(std::chrono::steady_clock::time_point now);
+
+    size_t size();
+    uint64_t getHeldCount();
+    uint64_t getSkippedCount();
+
+  private:
+    struct Entry {
+      uint32_t seq;
+      uint8_t flags;
+      std::chrono::steady_clock::time_point arrival;
+      std::vector<uint8_t> data;
+    };
+
+    std::chrono::steady_clock::time_point oldestArrival();
+
+  private:
+    uint64_t m_window;
+    bool m_synced;
+    uint32_t m_next;
+    /* Ordered by sequence number */
+    std::deque<Entry> m_entries;
+
+    /* Performance Counters */
+    uint64_t m_heldCount;
+    uint64_t m_skippedCount;
+};
+
+}
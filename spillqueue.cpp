@@ -0,0 +1,386 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <vector>
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "spillqueue.h"
+#include "logging.h"
+
+using namespace cannelloni;
+
+static uint32_t headerChecksum(const SpillSegmentHeader *header) {
+  /* FNV-1a over everything but the checksum itself */
+  const uint8_t *data = reinterpret_cast<const uint8_t*>(header);
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < offsetof(SpillSegmentHeader, checksum); i++) {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint8_t recordCheck(const SpillRecordHeader *record, const uint8_t *data) {
+  uint8_t check = record->len ^ record->flags;
+  for (size_t i = 0; i < sizeof(record->can_id); i++)
+    check ^= reinterpret_cast<const uint8_t*>(&record->can_id)[i];
+  for (uint8_t i = 0; i < (record->len & ~(CANFD_FRAME)); i++)
+    check ^= data[i];
+  return check;
+}
+
+static size_t recordSize(uint8_t len) {
+  return sizeof(SpillRecordHeader) + (len & ~(CANFD_FRAME));
+}
+
+SpillQueue::SpillQueue()
+  : m_nextSequence(0)
+  , m_depth(0)
+  , m_drainTokens(0)
+  , m_rateCount(0)
+  , m_measuredRate(0)
+  , m_spilledCount(0)
+  , m_drainedCount(0)
+  , m_droppedCount(0)
+{
+}
+
+SpillQueue::~SpillQueue() {
+  close();
+}
+
+bool SpillQueue::open(const SpillConfig &config) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_config = config;
+  if (m_config.segmentSize < sizeof(SpillSegmentHeader) + recordSize(CANFD_MAX_DLEN)) {
+    lerror << "Spill segment size is too small" << std::endl;
+    return false;
+  }
+  if (m_config.diskBudget < 2 * m_config.segmentSize) {
+    lerror << "Spill disk budget must hold at least two segments" << std::endl;
+    return false;
+  }
+  if (mkdir(m_config.directory.c_str(), 0755) < 0 && errno != EEXIST) {
+    lerror << "Could not create spill directory " << m_config.directory << std::endl;
+    return false;
+  }
+  /* We might be daemonized later, so we need an absolute path */
+  char absolutePath[PATH_MAX];
+  if (realpath(m_config.directory.c_str(), absolutePath) == NULL) {
+    lerror << "Could not resolve spill directory " << m_config.directory << std::endl;
+    return false;
+  }
+  m_config.directory = absolutePath;
+
+  DIR *dir = opendir(m_config.directory.c_str());
+  if (dir == NULL) {
+    lerror << "Could not open spill directory " << m_config.directory << std::endl;
+    return false;
+  }
+  std::vector<uint64_t> sequences;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    unsigned long long sequence;
+    char suffix[8];
+    if (sscanf(entry->d_name, "spill-%16llx.%4s", &sequence, suffix) == 2 &&
+        strcmp(suffix, "seg") == 0) {
+      sequences.push_back(sequence);
+    }
+  }
+  closedir(dir);
+  std::sort(sequences.begin(), sequences.end());
+
+  for (uint64_t sequence : sequences) {
+    recoverSegment(segmentPath(sequence), sequence);
+    m_nextSequence = sequence + 1;
+  }
+  uint64_t usage = 0;
+  for (const Segment &segment : m_segments)
+    usage += segment.file->size();
+  while (usage > m_config.diskBudget && !m_segments.empty()) {
+    usage -= m_segments.front().file->size();
+    dropOldestSegment();
+  }
+  if (m_depth > 0) {
+    linfo << "Recovered " << m_depth << " spilled frames from "
+          << m_segments.size() << " segments" << std::endl;
+  }
+  m_lastDrain = std::chrono::steady_clock::now();
+  m_rateStart = m_lastDrain;
+  return true;
+}
+
+void SpillQueue::close() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (Segment &segment : m_segments) {
+    segment.file->sync(false);
+    segment.file->close();
+  }
+  m_segments.clear();
+}
+
+bool SpillQueue::isOpen() {
+  return !m_config.directory.empty();
+}
+
+bool SpillQueue::append(const canfd_frame *frame) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  size_t size = recordSize(frame->len);
+  if (m_segments.empty() ||
+      m_segments.back().writeOffset + size > m_segments.back().file->size()) {
+    if (!addSegment())
+      return false;
+  }
+  Segment &segment = m_segments.back();
+  uint8_t *data = segment.file->data() + segment.writeOffset;
+  SpillRecordHeader *record = reinterpret_cast<SpillRecordHeader*>(data);
+  record->can_id = frame->can_id;
+  record->len = frame->len;
+  record->flags = frame->flags;
+  memcpy(data + sizeof(SpillRecordHeader), frame->data, canfd_len(frame));
+  record->check = recordCheck(record, data + sizeof(SpillRecordHeader));
+  /* The marker completes the record, write it last */
+  std::atomic_thread_fence(std::memory_order_release);
+  record->marker = SPILL_RECORD_MARKER;
+  segment.writeOffset += size;
+  segment.records++;
+  updateHeader(segment);
+
+  if (m_depth == 0) {
+    linfo << "Spilling frames to " << m_config.directory << std::endl;
+  }
+  m_depth++;
+  m_spilledCount++;
+  return true;
+}
+
+bool SpillQueue::pop(canfd_frame *frame) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_segments.empty() || m_segments.front().records == 0)
+    return false;
+  Segment &segment = m_segments.front();
+  const uint8_t *data = segment.file->data() + segment.readOffset;
+  const SpillRecordHeader *record = reinterpret_cast<const SpillRecordHeader*>(data);
+  frame->can_id = record->can_id;
+  frame->len = record->len;
+  frame->flags = record->flags;
+  memcpy(frame->data, data + sizeof(SpillRecordHeader), canfd_len(frame));
+  segment.readOffset += recordSize(record->len);
+  segment.records--;
+
+  if (segment.records == 0) {
+    /*
+     * Drained segments are removed, also the one we are writing to.
+     * A new segment starts zeroed, so no stale record can ever be
+     * recovered from it.
+     */
+    segment.file->remove();
+    m_segments.pop_front();
+  } else {
+    updateHeader(segment);
+  }
+
+  m_depth--;
+  m_drainedCount++;
+  m_rateCount++;
+  auto now = std::chrono::steady_clock::now();
+  auto elapsed = std::chrono::duration<double>(now - m_rateStart).count();
+  if (elapsed >= 1.0) {
+    m_measuredRate = m_rateCount / elapsed;
+    m_rateCount = 0;
+    m_rateStart = now;
+  }
+  if (m_depth == 0) {
+    linfo << "Spill queue drained" << std::endl;
+  }
+  return true;
+}
+
+size_t SpillQueue::drainBudget() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto now = std::chrono::steady_clock::now();
+  if (m_config.drainRate == 0) {
+    m_lastDrain = now;
+    return m_depth;
+  }
+  double elapsed = std::chrono::duration<double>(now - m_lastDrain).count();
+  m_lastDrain = now;
+  /* Allow bursts of up to 100ms worth of frames */
+  double maxTokens = std::max(1.0, m_config.drainRate / 10.0);
+  m_drainTokens = std::min(maxTokens, m_drainTokens + elapsed * m_config.drainRate);
+  size_t budget = std::min<uint64_t>(static_cast<uint64_t>(m_drainTokens), m_depth);
+  m_drainTokens -= budget;
+  return budget;
+}
+
+uint64_t SpillQueue::depth() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_depth;
+}
+
+uint64_t SpillQueue::diskUsage() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  uint64_t usage = 0;
+  for (const Segment &segment : m_segments)
+    usage += segment.file->size();
+  return usage;
+}
+
+uint64_t SpillQueue::getSpilledCount() {
+  return m_spilledCount;
+}
+
+uint64_t SpillQueue::getDrainedCount() {
+  return m_drainedCount;
+}
+
+uint64_t SpillQueue::getDroppedCount() {
+  return m_droppedCount;
+}
+
+double SpillQueue::getDrainRate() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  /* The last measurement is outdated if nothing has been drained since */
+  if (std::chrono::steady_clock::now() - m_rateStart > std::chrono::seconds(2))
+    return 0;
+  return m_measuredRate;
+}
+
+void SpillQueue::debug() {
+  linfo << "SpillQueue: " << depth() << " (frames) " << m_segments.size() << " (segments) "
+        << diskUsage() << " (bytes)" << std::endl;
+  linfo << "Spilled: " << m_spilledCount << " Drained: " << m_drainedCount
+        << " Dropped: " << m_droppedCount << " Drain rate: " << getDrainRate()
+        << " frames/s" << std::endl;
+}
+
+bool SpillQueue::recoverSegment(const std::string &path, uint64_t sequence) {
+  auto file = std::make_unique<MappedFile>();
+  if (!file->open(path, 0, false))
+    return false;
+  if (file->size() < sizeof(SpillSegmentHeader)) {
+    file->remove();
+    return false;
+  }
+  const SpillSegmentHeader *header = reinterpret_cast<const SpillSegmentHeader*>(file->data());
+  uint64_t offset = sizeof(SpillSegmentHeader);
+  if (header->magic == SPILL_SEGMENT_MAGIC && header->version == SPILL_SEGMENT_VERSION &&
+      header->checksum == headerChecksum(header) &&
+      header->readOffset >= offset && header->readOffset <= file->size()) {
+    offset = header->readOffset;
+  } else {
+    lwarn << "Spill segment " << path << " has an invalid header, scanning all records" << std::endl;
+  }
+  /*
+   * Do not trust writeOffset, the header may have been written back
+   * before the records. Scan until the first incomplete record.
+   */
+  Segment segment;
+  segment.sequence = sequence;
+  segment.readOffset = offset;
+  segment.records = 0;
+  while (offset + sizeof(SpillRecordHeader) <= file->size()) {
+    const uint8_t *data = file->data() + offset;
+    const SpillRecordHeader *record = reinterpret_cast<const SpillRecordHeader*>(data);
+    if (record->marker != SPILL_RECORD_MARKER)
+      break;
+    if ((record->len & ~(CANFD_FRAME)) > CANFD_MAX_DLEN)
+      break;
+    if (offset + recordSize(record->len) > file->size())
+      break;
+    if (record->check != recordCheck(record, data + sizeof(SpillRecordHeader)))
+      break;
+    offset += recordSize(record->len);
+    segment.records++;
+  }
+  segment.writeOffset = offset;
+  if (segment.records == 0) {
+    file->remove();
+    return false;
+  }
+  segment.file = std::move(file);
+  updateHeader(segment);
+  m_depth += segment.records;
+  m_segments.push_back(std::move(segment));
+  return true;
+}
+
+bool SpillQueue::addSegment() {
+  while (!m_segments.empty() &&
+         (m_segments.size() + 1) * m_config.segmentSize > m_config.diskBudget) {
+    dropOldestSegment();
+  }
+  if (!m_segments.empty()) {
+    /* Start write back of the full segment */
+    m_segments.back().file->sync(true);
+  }
+  Segment segment;
+  segment.sequence = m_nextSequence++;
+  segment.readOffset = sizeof(SpillSegmentHeader);
+  segment.writeOffset = sizeof(SpillSegmentHeader);
+  segment.records = 0;
+  segment.file = std::make_unique<MappedFile>();
+  if (!segment.file->open(segmentPath(segment.sequence), m_config.segmentSize, true)) {
+    return false;
+  }
+  updateHeader(segment);
+  m_segments.push_back(std::move(segment));
+  return true;
+}
+
+void SpillQueue::dropOldestSegment() {
+  Segment &segment = m_segments.front();
+  lwarn << "Spill disk budget exhausted, dropping " << segment.records
+        << " frames" << std::endl;
+  m_droppedCount += segment.records;
+  m_depth -= segment.records;
+  segment.file->remove();
+  m_segments.pop_front();
+}
+
+void SpillQueue::updateHeader(Segment &segment) {
+  SpillSegmentHeader *header = reinterpret_cast<SpillSegmentHeader*>(segment.file->data());
+  header->magic = SPILL_SEGMENT_MAGIC;
+  header->version = SPILL_SEGMENT_VERSION;
+  header->headerSize = sizeof(SpillSegmentHeader);
+  header->sequence = segment.sequence;
+  header->capacity = segment.file->size();
+  header->readOffset = segment.readOffset;
+  header->writeOffset = segment.writeOffset;
+  header->reserved = 0;
+  header->checksum = headerChecksum(header);
+}
+
+std::string SpillQueue::segmentPath(uint64_t sequence) {
+  char name[32];
+  snprintf(name, sizeof(name), "spill-%016llx.seg", static_cast<unsigned long long>(sequence));
+  return m_config.directory + "/" + name;
+}
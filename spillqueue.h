@@ -0,0 +1,169 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "cannelloni.h"
+#include "mappedfile.h"
+
+namespace cannelloni {
+
+#define SPILL_SEGMENT_MAGIC   0x4c505343 /* "CSPL" */
+#define SPILL_SEGMENT_VERSION 1
+#define SPILL_RECORD_MARKER   0xA5
+
+/* Interval in which the network threads move spilled frames back (us) */
+#define SPILL_DRAIN_INTERVAL 10000
+
+struct SpillConfig {
+  /* Directory for the segment files, empty disables spilling */
+  std::string directory;
+  /* Size of one segment file in bytes */
+  uint64_t segmentSize;
+  /* Maximum size of all segment files in bytes */
+  uint64_t diskBudget;
+  /* Frames per second that are moved back when draining, 0 is unlimited */
+  uint32_t drainRate;
+};
+
+/*
+ * Every segment file starts with this header. It is updated in place
+ * whenever a record is appended or drained. The checksum covers all
+ * preceding fields, an invalid header is ignored on recovery and
+ * the records are scanned from the start of the segment.
+ */
+struct __attribute__((__packed__)) SpillSegmentHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t headerSize;
+  uint64_t sequence;
+  uint64_t capacity;
+  /* First record that has not been drained yet */
+  uint64_t readOffset;
+  /* End of the last complete record */
+  uint64_t writeOffset;
+  uint32_t reserved;
+  uint32_t checksum;
+};
+
+/*
+ * Each record is followed by canfd_len(frame) bytes of data.
+ * marker and check are used to find the last complete record
+ * after a crash.
+ */
+struct __attribute__((__packed__)) SpillRecordHeader {
+  uint32_t can_id;
+  uint8_t len;
+  uint8_t flags;
+  uint8_t check;
+  uint8_t marker;
+};
+
+/* Design Notes:
+ *
+ * SpillQueue is an optional second tier behind a FrameBuffer. Once the
+ * pool of the FrameBuffer is exhausted, frames are appended to a log of
+ * memory mapped segment files instead of overwriting buffered frames.
+ * As long as the log is not empty, all further frames are appended as
+ * well, so frames leave the tunnel in the order they arrived.
+ *
+ * The network thread moves frames back into the FrameBuffer once its
+ * path works again, limited to drainRate frames per second, so that the
+ * backlog does not saturate the link (see FrameBuffer::drainSpill).
+ *
+ * When diskBudget is reached, the oldest segment is dropped.
+ */
+
+class SpillQueue {
+  public:
+    SpillQueue();
+    ~SpillQueue();
+
+    /* Creates the directory if needed and recovers existing segments */
+    bool open(const SpillConfig &config);
+    void close();
+    bool isOpen();
+
+    /* Appends a copy of frame, returns false if the frame could not be stored */
+    bool append(const canfd_frame *frame);
+    /* Copies the oldest frame into frame, returns false if empty */
+    bool pop(canfd_frame *frame);
+
+    /*
+     * Returns the number of frames that may be drained now
+     * according to drainRate
+     */
+    size_t drainBudget();
+
+    /* Number of frames on disk that still need to be drained */
+    uint64_t depth();
+    uint64_t diskUsage();
+
+    uint64_t getSpilledCount();
+    uint64_t getDrainedCount();
+    uint64_t getDroppedCount();
+    /* Measured drain rate in frames per second */
+    double getDrainRate();
+
+    void debug();
+
+  private:
+    struct Segment {
+      uint64_t sequence;
+      uint64_t readOffset;
+      uint64_t writeOffset;
+      uint64_t records;
+      std::unique_ptr<MappedFile> file;
+    };
+
+    bool recoverSegment(const std::string &path, uint64_t sequence);
+    bool addSegment();
+    void dropOldestSegment();
+    void updateHeader(Segment &segment);
+    std::string segmentPath(uint64_t sequence);
+
+  private:
+    SpillConfig m_config;
+    std::deque<Segment> m_segments;
+    std::mutex m_mutex;
+    uint64_t m_nextSequence;
+    uint64_t m_depth;
+
+    /* drain rate limiting */
+    std::chrono::steady_clock::time_point m_lastDrain;
+    double m_drainTokens;
+    /* drain rate measurement */
+    std::chrono::steady_clock::time_point m_rateStart;
+    uint64_t m_rateCount;
+    double m_measuredRate;
+
+    /* Performance Counters */
+    uint64_t m_spilledCount;
+    uint64_t m_drainedCount;
+    uint64_t m_droppedCount;
+};
+
+}
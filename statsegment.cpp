@@ -0,0 +1,145 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "statsegment.h"
+#include "logging.h"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace cannelloni;
+
+/* Attempts of a reader before it gives up on a busy segment */
+#define STATS_READ_RETRIES 100
+
+StatsSegment::StatsSegment()
+  : m_header(NULL)
+{
+}
+
+StatsSegment::~StatsSegment() {
+  close();
+}
+
+bool StatsSegment::isValidInstance(const std::string &instance) {
+  if (instance.empty() || instance.size() >= STATS_INSTANCE_SIZE)
+    return false;
+  if (instance == "." || instance == "..")
+    return false;
+  return instance.find('/') == std::string::npos;
+}
+
+bool StatsSegment::open(const std::string &instance) {
+  close();
+  if (!isValidInstance(instance)) {
+    lerror << "Invalid statistics instance name " << instance << std::endl;
+    return false;
+  }
+  std::string path = STATS_PATH_PREFIX + instance;
+  StatsHeader *existing = new StatsHeader;
+  if (read(path, *existing) && existing->pid != static_cast<uint32_t>(getpid())
+      && kill(existing->pid, 0) == 0) {
+    lerror << "Statistics segment " << path << " is used by process "
+           << existing->pid << std::endl;
+    delete existing;
+    return false;
+  }
+  delete existing;
+  /* Start from an empty segment, readers of the old one keep their mapping */
+  unlink(path.c_str());
+  if (!m_file.open(path, sizeof(StatsHeader), true))
+    return false;
+  m_header = reinterpret_cast<StatsHeader*>(m_file.data());
+  m_header->sequence.store(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  m_header->magic = STATS_MAGIC;
+  m_header->version = STATS_VERSION;
+  m_header->size = sizeof(StatsHeader);
+  m_header->pid = getpid();
+  m_header->started = monotonicNow();
+  m_header->updated = m_header->started;
+  m_header->count = 0;
+  strncpy(m_header->instance, instance.c_str(), STATS_INSTANCE_SIZE - 1);
+  m_header->sequence.store(2, std::memory_order_release);
+  return true;
+}
+
+void StatsSegment::close() {
+  if (m_header) {
+    m_header = NULL;
+    m_file.remove();
+  }
+}
+
+void StatsSegment::publish(const MetricsRegistry &registry) {
+  if (!m_header)
+    return;
+  uint64_t sequence = m_header->sequence.load(std::memory_order_relaxed);
+  m_header->sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  uint32_t count = 0;
+  registry.forEach([this, &count](const std::string &name, MetricType type, uint64_t value) {
+    if (count == STATS_MAX_ENTRIES)
+      return;
+    StatsEntry &entry = m_header->entries[count++];
+    strncpy(entry.name, name.c_str(), STATS_NAME_SIZE - 1);
+    entry.name[STATS_NAME_SIZE - 1] = '\0';
+    entry.type = type;
+    entry.value = value;
+  });
+  m_header->count = count;
+  m_header->updated = monotonicNow();
+  m_header->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+bool StatsSegment::read(const std::string &path, StatsHeader &snapshot) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(StatsHeader)) {
+    ::close(fd);
+    return false;
+  }
+  void *data = mmap(NULL, sizeof(StatsHeader), PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED)
+    return false;
+  const StatsHeader *header = static_cast<const StatsHeader*>(data);
+  bool consistent = false;
+  for (int i = 0; i < STATS_READ_RETRIES && !consistent; i++) {
+    uint64_t before = header->sequence.load(std::memory_order_acquire);
+    if (before & 1) {
+      usleep(100);
+      continue;
+    }
+    memcpy(static_cast<void*>(&snapshot), header, sizeof(StatsHeader));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    consistent = header->sequence.load(std::memory_order_relaxed) == before;
+  }
+  munmap(data, sizeof(StatsHeader));
+  return consistent && snapshot.magic == STATS_MAGIC && snapshot.version == STATS_VERSION
+         && snapshot.count <= STATS_MAX_ENTRIES;
+}
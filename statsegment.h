@@ -0,0 +1,105 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "mappedfile.h"
+#include "metrics.h"
+
+namespace cannelloni {
+
+/* Segments are /dev/shm/cannelloni-<instance> */
+#define STATS_PATH_PREFIX "/dev/shm/cannelloni-"
+#define STATS_MAGIC 0x43414e53
+/* Changes whenever the layout changes, readers refuse other versions */
+#define STATS_VERSION 1
+/* Name of a sample including its labels */
+#define STATS_NAME_SIZE 120
+#define STATS_INSTANCE_SIZE 64
+/* Samples that do not fit are left out */
+#define STATS_MAX_ENTRIES 512
+
+/* Design Notes:
+ *
+ * The main thread copies the samples of the MetricsRegistry into a
+ * shared memory segment once a second, the forwarding threads are not
+ * involved at all. Readers like cannelloni-stat map the segment read-only
+ * and never block the writer.
+ *
+ * The segment is protected by a seqlock: the writer makes the sequence
+ * odd, updates the entries and makes it even again. A reader copies the
+ * segment and retries if the sequence was odd or changed meanwhile. The
+ * names are rewritten along with the values, so a reader never has to
+ * deal with a partial layout.
+ */
+
+struct StatsEntry {
+  char name[STATS_NAME_SIZE];
+  /* MetricType, readers only compute rates of counters */
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t value;
+};
+
+struct StatsHeader {
+  uint32_t magic;
+  uint32_t version;
+  /* Size of the segment in bytes */
+  uint32_t size;
+  uint32_t pid;
+  /* Odd while the writer updates the segment */
+  std::atomic<uint64_t> sequence;
+  /* CLOCK_MONOTONIC in ns of the start and the last update */
+  uint64_t started;
+  uint64_t updated;
+  uint32_t count;
+  uint32_t reserved;
+  char instance[STATS_INSTANCE_SIZE];
+  StatsEntry entries[STATS_MAX_ENTRIES];
+};
+
+class StatsSegment {
+  public:
+    StatsSegment();
+    ~StatsSegment();
+
+    /* Creates the segment of instance, fails if a running process uses it */
+    bool open(const std::string &instance);
+    /* Removes the segment */
+    void close();
+    /* Copies all samples of registry into the segment */
+    void publish(const MetricsRegistry &registry);
+
+    /* Instance names must be usable as a file name */
+    static bool isValidInstance(const std::string &instance);
+    /* A consistent copy of the segment at path, false if there is none */
+    static bool read(const std::string &path, StatsHeader &snapshot);
+
+  private:
+    MappedFile m_file;
+    StatsHeader *m_header;
+};
+
+}
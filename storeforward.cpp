@@ -0,0 +1,185 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <algorithm>
+
+#include "storeforward.h"
+#include "logging.h"
+#include "spillqueue.h"
+
+using namespace cannelloni;
+
+StoreForwardQueue::StoreForwardQueue()
+  : m_config{0, 0, SF_DROP_OLDEST}
+  , m_online(false)
+  , m_storedCount(0)
+  , m_forwardedCount(0)
+  , m_droppedCount(0)
+  , m_expiredCount(0)
+{
+}
+
+StoreForwardQueue::~StoreForwardQueue() {}
+
+void StoreForwardQueue::setConfig(const StoreForwardConfig &config) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_config = config;
+}
+
+bool StoreForwardQueue::isEnabled() {
+  return m_config.maxFrames > 0;
+}
+
+bool StoreForwardQueue::insertFrame(canfd_frame *frame, FrameBuffer *buffer) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_online) {
+    buffer->insertFrame(frame);
+    return true;
+  }
+  auto now = std::chrono::steady_clock::now();
+  expire(buffer, now);
+  /*
+   * If a SpillQueue is attached, frames that do not fit go to disk.
+   * Once it contains frames, all newer frames have to go there as well.
+   */
+  SpillQueue *spillQueue = buffer->getSpillQueue();
+  if (spillQueue && (spillQueue->depth() > 0 || m_queue.size() >= m_config.maxFrames)) {
+    if (buffer->spillFrame(frame))
+      return false;
+  }
+  if (m_queue.size() >= m_config.maxFrames) {
+    m_droppedCount++;
+    if (m_config.dropPolicy == SF_DROP_NEWEST) {
+      buffer->insertFramePool(frame);
+      return false;
+    }
+    buffer->insertFramePool(m_queue.front().frame);
+    m_queue.pop_front();
+  }
+  m_queue.push_back(Entry{frame, now});
+  m_storedCount++;
+  return false;
+}
+
+void StoreForwardQueue::goOffline(FrameBuffer *buffer) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_online = false;
+  /* Frames from the back of the buffer go in front of the queue first */
+  canfd_frame *frame;
+  while ((frame = buffer->requestBufferBack()) != NULL) {
+    m_queue.push_front(Entry{frame, frontTime()});
+    m_storedCount++;
+  }
+  enforceLimit(buffer);
+}
+
+size_t StoreForwardQueue::goOnline(FrameBuffer *buffer) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  expire(buffer, std::chrono::steady_clock::now());
+  size_t forwarded = m_queue.size();
+  /* Stored frames are older than anything that has been spilled */
+  for (const Entry &entry : m_queue) {
+    buffer->insertFrame(entry.frame, false);
+  }
+  m_queue.clear();
+  m_forwardedCount += forwarded;
+  m_online = true;
+  return forwarded;
+}
+
+void StoreForwardQueue::returnFrames(std::list<canfd_frame*> &frames,
+                                     std::list<canfd_frame*>::iterator start,
+                                     FrameBuffer *buffer) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  /* Walk backwards so that the original order is kept */
+  auto it = frames.end();
+  while (it != start) {
+    it--;
+    m_queue.push_front(Entry{*it, frontTime()});
+    m_storedCount++;
+  }
+  frames.erase(start, frames.end());
+  enforceLimit(buffer);
+}
+
+size_t StoreForwardQueue::size() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_queue.size();
+}
+
+uint64_t StoreForwardQueue::getStoredCount() {
+  return m_storedCount;
+}
+
+uint64_t StoreForwardQueue::getForwardedCount() {
+  return m_forwardedCount;
+}
+
+uint64_t StoreForwardQueue::getDroppedCount() {
+  return m_droppedCount;
+}
+
+uint64_t StoreForwardQueue::getExpiredCount() {
+  return m_expiredCount;
+}
+
+void StoreForwardQueue::debug() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  linfo << "StoreForwardQueue: " << m_queue.size() << " (elements) "
+        << (m_online ? "online" : "offline") << std::endl;
+  linfo << "Stored: " << m_storedCount << " Forwarded: " << m_forwardedCount
+        << " Dropped: " << m_droppedCount << " Expired: " << m_expiredCount << std::endl;
+}
+
+std::chrono::steady_clock::time_point StoreForwardQueue::frontTime() {
+  /*
+   * Frames that are put back in front are older than everything in the
+   * queue, keep the queue ordered by time so that expire() works
+   */
+  auto now = std::chrono::steady_clock::now();
+  if (m_queue.empty())
+    return now;
+  return std::min(now, m_queue.front().time);
+}
+
+void StoreForwardQueue::expire(FrameBuffer *buffer, std::chrono::steady_clock::time_point now) {
+  if (m_config.maxAge == 0)
+    return;
+  const auto maxAge = std::chrono::microseconds(m_config.maxAge);
+  /* Entries are ordered by time, so we only need to look at the front */
+  while (!m_queue.empty() && now - m_queue.front().time > maxAge) {
+    buffer->insertFramePool(m_queue.front().frame);
+    m_queue.pop_front();
+    m_expiredCount++;
+  }
+}
+
+void StoreForwardQueue::enforceLimit(FrameBuffer *buffer) {
+  while (m_queue.size() > m_config.maxFrames) {
+    if (m_config.dropPolicy == SF_DROP_NEWEST) {
+      buffer->insertFramePool(m_queue.back().frame);
+      m_queue.pop_back();
+    } else {
+      buffer->insertFramePool(m_queue.front().frame);
+      m_queue.pop_front();
+    }
+    m_droppedCount++;
+  }
+}
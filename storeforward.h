@@ -0,0 +1,125 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <list>
+#include <mutex>
+
+#include "framebuffer.h"
+
+namespace cannelloni {
+
+enum StoreForwardDropPolicy { SF_DROP_OLDEST, SF_DROP_NEWEST };
+
+struct StoreForwardConfig {
+  /* Maximum number of frames kept while offline, 0 disables the queue */
+  size_t maxFrames;
+  /* Maximum age of a stored frame in us, 0 keeps frames forever */
+  uint64_t maxAge;
+  StoreForwardDropPolicy dropPolicy;
+};
+
+/* Design Notes:
+ *
+ * A connection oriented transport (TCP) cannot transmit frames while
+ * it is not connected. Instead of putting these frames back into the
+ * pool, StoreForwardQueue keeps them (bounded in size and age) until the
+ * connection has been negotiated again and then hands them over to the
+ * FrameBuffer of the transport in one burst.
+ *
+ * The queue is either online or offline. While online, insertFrame
+ * passes frames straight into the FrameBuffer. Both decisions are made
+ * under the same mutex, so a frame can never slip into the FrameBuffer
+ * after the queue went offline and get lost or overtaken.
+ *
+ * All frames are owned by the pool of the FrameBuffer that is passed
+ * in, dropped frames are returned there.
+ */
+
+class StoreForwardQueue {
+  public:
+    StoreForwardQueue();
+    ~StoreForwardQueue();
+
+    void setConfig(const StoreForwardConfig &config);
+    bool isEnabled();
+
+    /*
+     * Inserts frame into buffer when online, stores it otherwise.
+     * Returns true if the frame went into buffer.
+     */
+    bool insertFrame(canfd_frame *frame, FrameBuffer *buffer);
+
+    /*
+     * Moves all frames that are still in buffer in front of the queue
+     * and stores all further frames until goOnline is called.
+     */
+    void goOffline(FrameBuffer *buffer);
+
+    /*
+     * Drops expired frames, moves all stored frames into buffer
+     * and passes all further frames into buffer.
+     * Returns the number of forwarded frames.
+     */
+    size_t goOnline(FrameBuffer *buffer);
+
+    /*
+     * Puts frames [start, end) that could not be transmitted back in
+     * front of the queue. The frames are removed from frames.
+     */
+    void returnFrames(std::list<canfd_frame*> &frames,
+                      std::list<canfd_frame*>::iterator start,
+                      FrameBuffer *buffer);
+
+    size_t size();
+    uint64_t getStoredCount();
+    uint64_t getForwardedCount();
+    uint64_t getDroppedCount();
+    uint64_t getExpiredCount();
+
+    void debug();
+
+  private:
+    struct Entry {
+      canfd_frame *frame;
+      std::chrono::steady_clock::time_point time;
+    };
+
+    std::chrono::steady_clock::time_point frontTime();
+    void expire(FrameBuffer *buffer, std::chrono::steady_clock::time_point now);
+    void enforceLimit(FrameBuffer *buffer);
+
+  private:
+    StoreForwardConfig m_config;
+    std::deque<Entry> m_queue;
+    std::mutex m_mutex;
+    bool m_online;
+
+    /* Performance Counters */
+    uint64_t m_storedCount;
+    uint64_t m_forwardedCount;
+    uint64_t m_droppedCount;
+    uint64_t m_expiredCount;
+};
+
+}
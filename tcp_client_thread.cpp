@@ -42,7 +42,7 @@ bool TCPClientThread::attempt_connect() {
     lerror << "socket error" << std::endl;
     return false;
   }
-  if (!setupSocket()) {
+  if (!setupSocket(m_socket)) {
     return false;
   }
   if (!setupPipe()) {
@@ -0,0 +1,350 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "inet_address.h"
+#include "logging.h"
+#include "spillqueue.h"
+#include "tcpthread.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace cannelloni;
+
+TCPFailoverClientThread::TCPFailoverClientThread(const struct debugOptions_t &debugOptions,
+                                                 const struct TCPThreadParams &params,
+                                                 const std::vector<struct sockaddr_storage> &standbyAddrs)
+  : TCPThread(debugOptions, params)
+  , m_active(NULL)
+  , m_hasActive(false)
+  , m_failoverCount(0)
+  , m_failbackCount(0)
+{
+  /* The remote comes first, standby servers follow in the given order */
+  m_servers.emplace_back(-1, m_remoteAddr);
+  for (const struct sockaddr_storage &addr : standbyAddrs) {
+    m_servers.emplace_back(-1, addr);
+  }
+  for (TCPPeer &server : m_servers) {
+    server.state = DISCONNECTED;
+  }
+  m_retryAt.resize(m_servers.size(), std::chrono::steady_clock::now());
+  m_negotiatedAt.resize(m_servers.size());
+}
+
+void TCPFailoverClientThread::run() {
+  fd_set readfds;
+  fd_set writefds;
+
+  if (!setupPipe()) {
+    return;
+  }
+  m_blockTimer.adjust(SELECT_TIMEOUT, SELECT_TIMEOUT);
+  if (m_frameBuffer->getSpillQueue()) {
+    m_drainTimer.adjust(SPILL_DRAIN_INTERVAL, SPILL_DRAIN_INTERVAL);
+  } else {
+    m_drainTimer.disable();
+  }
+  if (m_liveness.heartbeatInterval) {
+    m_heartbeatTimer.adjust(m_liveness.heartbeatInterval * 1000, m_liveness.heartbeatInterval * 1000);
+  } else {
+    m_heartbeatTimer.disable();
+  }
+  if (m_clockSync.isEnabled()) {
+    m_clockTimer.adjust(CLOCK_SYNC_FAST_INTERVAL, CLOCK_SYNC_FAST_INTERVAL);
+  } else {
+    m_clockTimer.disable();
+  }
+
+  while (m_started) {
+    auto now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < m_servers.size(); i++) {
+      if (m_servers[i].state == DISCONNECTED && now >= m_retryAt[i])
+        startConnect(m_servers[i]);
+    }
+
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    FD_SET(m_blockTimer.getFd(), &readfds);
+    FD_SET(m_framebufferHasDataPipe[SIGNAL_PIPE_READ], &readfds);
+    FD_SET(m_drainTimer.getFd(), &readfds);
+    FD_SET(m_heartbeatTimer.getFd(), &readfds);
+    FD_SET(m_clockTimer.getFd(), &readfds);
+    int maxFd = std::max({m_blockTimer.getFd(), m_framebufferHasDataPipe[SIGNAL_PIPE_READ],
+                          m_drainTimer.getFd(), m_heartbeatTimer.getFd(), m_clockTimer.getFd()});
+    for (TCPPeer &server : m_servers) {
+      if (server.state == DISCONNECTED)
+        continue;
+      if (server.state == CONNECTING || !server.sendQueue.empty())
+        FD_SET(server.socket, &writefds);
+      if (server.state != CONNECTING)
+        FD_SET(server.socket, &readfds);
+      maxFd = std::max(maxFd, server.socket);
+    }
+    int ret = select(maxFd+1, &readfds, &writefds, NULL, NULL);
+    if (ret < 0) {
+      lerror << "select error" << std::endl;
+      continue;
+    }
+    for (TCPPeer &server : m_servers) {
+      if (server.state == DISCONNECTED)
+        continue;
+      if (server.state == CONNECTING) {
+        if (FD_ISSET(server.socket, &writefds))
+          finishConnect(server);
+        continue;
+      }
+      if (FD_ISSET(server.socket, &writefds) && !writePeer(server)) {
+        failPeer(server);
+        continue;
+      }
+      if (FD_ISSET(server.socket, &readfds)) {
+        bool negotiated = server.state == NEGOTIATED;
+        /* Frames received from standby servers are not written to the bus */
+        if (!readPeer(server, &server == m_active)) {
+          failPeer(server);
+          continue;
+        }
+        if (server.state == NEGOTIATED && !negotiated)
+          m_negotiatedAt[&server - m_servers.data()] = std::chrono::steady_clock::now();
+        if (server.state == NEGOTIATED && m_active == NULL) {
+          activate(&server);
+        }
+      }
+    }
+    failBack();
+    if (FD_ISSET(m_heartbeatTimer.getFd(), &readfds)) {
+      m_heartbeatTimer.read();
+      for (TCPPeer &server : m_servers) {
+        if (server.state != CONNECTED && server.state != NEGOTIATED)
+          continue;
+        if (heartbeatExpired(server.lastRx)) {
+          lwarn << "Server " << formatSocketAddress(getSocketAddress(&server.addr))
+                << " missed " << TCP_HEARTBEAT_TIMEOUT_INTERVALS << " heartbeats" << std::endl;
+          failPeer(server);
+        } else if (server.state == NEGOTIATED) {
+          queueControlFrame(server, TCP_CONTROL_HEARTBEAT, m_heartbeatSeq++);
+          if (!writePeer(server))
+            failPeer(server);
+        }
+      }
+    }
+    if (FD_ISSET(m_clockTimer.getFd(), &readfds)) {
+      m_clockTimer.read();
+      /* Only the clock of the active server matters */
+      if (m_active && m_active->state == NEGOTIATED) {
+        uint64_t times[3] = {m_clockSync.request(), 0, 0};
+        queueControlFrame(*m_active, TCP_CONTROL_CLOCK, 0, times);
+        uint64_t interval = m_clockSync.nextInterval();
+        m_clockTimer.adjust(interval, interval);
+        if (!writePeer(*m_active))
+          failPeer(*m_active);
+      }
+    }
+    if (FD_ISSET(m_blockTimer.getFd(), &readfds)) {
+      m_blockTimer.read();
+      sendFrameBuffer();
+    }
+    if (FD_ISSET(m_drainTimer.getFd(), &readfds)) {
+      m_drainTimer.read();
+      SpillQueue *spillQueue = m_frameBuffer->getSpillQueue();
+      if (m_active && spillQueue->depth() > 0 &&
+          m_frameBuffer->drainSpill(spillQueue->drainBudget()) > 0) {
+        sendFrameBuffer();
+      }
+    }
+    if (FD_ISSET(m_framebufferHasDataPipe[SIGNAL_PIPE_READ], &readfds)) {
+      int signal;
+      ssize_t res = read(m_framebufferHasDataPipe[SIGNAL_PIPE_READ], &signal, sizeof(signal));
+      if (res == sizeof(signal)) {
+        sendFrameBuffer();
+      }
+    }
+  }
+  if (m_debugOptions.buffer) {
+    m_frameBuffer->debug();
+  }
+  for (TCPPeer &server : m_servers) {
+    if (server.state != DISCONNECTED)
+      close(server.socket);
+    linfo << "Server " << formatSocketAddress(getSocketAddress(&server.addr))
+          << " TX: " << server.txCount << " RX: " << server.rxCount
+          << " Dropped: " << server.droppedCount << std::endl;
+  }
+  linfo << "Shutting down. TCP Transmission Summary: TX: " << m_txCount.get() << " RX: " << m_rxCount.get()
+        << " Failovers: " << m_failoverCount << " Failbacks: " << m_failbackCount << std::endl;
+  printClockSummary();
+  close(m_framebufferHasDataPipe[SIGNAL_PIPE_READ]);
+  close(m_framebufferHasDataPipe[SIGNAL_PIPE_WRITE]);
+  cleanup();
+}
+
+void TCPFailoverClientThread::transmitFrame(canfd_frame *frame) {
+  if (!m_hasActive) {
+    m_frameBuffer->insertFramePool(frame);
+    return;
+  }
+  m_frameBuffer->insertFrame(frame);
+  int signal = 1;
+  ssize_t res = write(m_framebufferHasDataPipe[SIGNAL_PIPE_WRITE], &signal, sizeof(signal));
+  if (res != sizeof(signal) && errno != EWOULDBLOCK) {
+    lwarn << "could not write to pipe " << res << std::endl;
+  }
+}
+
+bool TCPFailoverClientThread::attempt_connect() {
+  /* Connections are established by run() */
+  return false;
+}
+
+void TCPFailoverClientThread::cleanup() {}
+
+void TCPFailoverClientThread::startConnect(TCPPeer &server) {
+  size_t index = &server - m_servers.data();
+  m_retryAt[index] = std::chrono::steady_clock::now() + std::chrono::seconds(TCP_RECONNECT_INTERVAL);
+
+  server.socket = socket(m_addressFamily, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (server.socket < 0) {
+    lerror << "socket error" << std::endl;
+    return;
+  }
+  if (!setupSocket(server.socket)) {
+    close(server.socket);
+    return;
+  }
+  if (connect(server.socket, (struct sockaddr *)&server.addr, sizeof(server.addr)) < 0 &&
+      errno != EINPROGRESS) {
+    close(server.socket);
+    return;
+  }
+  server.state = CONNECTING;
+}
+
+void TCPFailoverClientThread::finishConnect(TCPPeer &server) {
+  uint8_t protocolVersionBuffer[] = CANNELLONI_CONNECT_V1_STRING;
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(server.socket, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+    close(server.socket);
+    server.state = DISCONNECTED;
+    return;
+  }
+  if (write(server.socket, protocolVersionBuffer, sizeof(protocolVersionBuffer)-1) != sizeof(protocolVersionBuffer)-1) {
+    lerror << "write error could not announce protocol" << std::endl;
+    close(server.socket);
+    server.state = DISCONNECTED;
+    return;
+  }
+  linfo << "Connected to " << formatSocketAddress(getSocketAddress(&server.addr)) << std::endl;
+  server.state = CONNECTED;
+  server.lastRx = std::chrono::steady_clock::now();
+  server.decoder.reset();
+  server.rxBuffer.clear();
+}
+
+void TCPFailoverClientThread::failPeer(TCPPeer &server) {
+  linfo << "Connection to " << formatSocketAddress(getSocketAddress(&server.addr)) << " lost" << std::endl;
+  close(server.socket);
+  server.state = DISCONNECTED;
+  if (&server != m_active) {
+    server.sendQueue.clear();
+    server.queuedBytes = 0;
+    server.sendOffset = 0;
+    return;
+  }
+  /* Take over the first negotiated standby, it already passed the handshake */
+  TCPPeer *standby = NULL;
+  for (TCPPeer &candidate : m_servers) {
+    if (candidate.state == NEGOTIATED) {
+      standby = &candidate;
+      break;
+    }
+  }
+  if (standby) {
+    /*
+     * Batches that have not been written completely move to the standby.
+     * A partially written batch is sent again as a whole.
+     */
+    for (auto &batch : server.sendQueue) {
+      if (batch->frameCount > 0) {
+        standby->sendQueue.push_back(batch);
+        standby->queuedBytes += batch->data.size();
+      }
+    }
+    m_failoverCount++;
+  }
+  server.sendQueue.clear();
+  server.queuedBytes = 0;
+  server.sendOffset = 0;
+  activate(standby);
+  if (standby && !writePeer(*standby))
+    failPeer(*standby);
+}
+
+void TCPFailoverClientThread::activate(TCPPeer *server) {
+  m_active = server;
+  m_hasActive = server != NULL;
+  m_clockSync.reset();
+  if (server) {
+    linfo << "Using " << formatSocketAddress(getSocketAddress(&server->addr)) << std::endl;
+  } else {
+    lwarn << "No server available" << std::endl;
+  }
+}
+
+void TCPFailoverClientThread::failBack() {
+  if (m_active == NULL)
+    return;
+  auto now = std::chrono::steady_clock::now();
+  /* Only servers in front of the active one have a higher priority */
+  for (size_t i = 0; &m_servers[i] != m_active; i++) {
+    if (m_servers[i].state == NEGOTIATED &&
+        now - m_negotiatedAt[i] >= std::chrono::seconds(TCP_FAILBACK_DELAY)) {
+      /* Batches queued for the previous server are still written to it */
+      m_failbackCount++;
+      activate(&m_servers[i]);
+      return;
+    }
+  }
+}
+
+void TCPFailoverClientThread::sendFrameBuffer() {
+  if (m_active == NULL) {
+    m_frameBuffer->reset();
+    return;
+  }
+  std::shared_ptr<const TCPBatch> batch = encodeFrameBuffer();
+  if (!batch)
+    return;
+  if (m_active->queuedBytes + batch->data.size() > TCP_FAILOVER_QUEUE_SIZE) {
+    m_active->droppedCount += batch->frameCount;
+    return;
+  }
+  m_active->sendQueue.push_back(batch);
+  m_active->queuedBytes += batch->data.size();
+  if (!writePeer(*m_active))
+    failPeer(*m_active);
+}
@@ -0,0 +1,271 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "inet_address.h"
+#include "logging.h"
+#include "parser.h"
+#include "spillqueue.h"
+#include "tcpthread.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace cannelloni;
+
+TCPMultiServerThread::TCPMultiServerThread(const struct debugOptions_t &debugOptions,
+                                           const struct TCPServerThreadParams &params,
+                                           const struct TCPMultiServerConfig &config)
+  : TCPServerThread(debugOptions, params)
+  , m_config(config)
+  , m_negotiatedPeers(0)
+  , m_rejectedCount(0)
+{
+}
+
+void TCPMultiServerThread::run() {
+  fd_set readfds;
+  fd_set writefds;
+
+  if (listen(m_serverSocket, m_config.maxClients) < 0) {
+    lerror << "listen error" << std::endl;
+    cleanup();
+    return;
+  }
+  if (!setupPipe()) {
+    cleanup();
+    return;
+  }
+  m_blockTimer.adjust(SELECT_TIMEOUT, SELECT_TIMEOUT);
+  if (m_frameBuffer->getSpillQueue()) {
+    m_drainTimer.adjust(SPILL_DRAIN_INTERVAL, SPILL_DRAIN_INTERVAL);
+  } else {
+    m_drainTimer.disable();
+  }
+  if (m_liveness.heartbeatInterval) {
+    m_heartbeatTimer.adjust(m_liveness.heartbeatInterval * 1000, m_liveness.heartbeatInterval * 1000);
+  } else {
+    m_heartbeatTimer.disable();
+  }
+  linfo << "Waiting for up to " << m_config.maxClients << " clients to connect." << std::endl;
+
+  while (m_started) {
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    FD_SET(m_serverSocket, &readfds);
+    FD_SET(m_blockTimer.getFd(), &readfds);
+    FD_SET(m_framebufferHasDataPipe[SIGNAL_PIPE_READ], &readfds);
+    FD_SET(m_drainTimer.getFd(), &readfds);
+    FD_SET(m_heartbeatTimer.getFd(), &readfds);
+    int maxFd = std::max({m_serverSocket, m_blockTimer.getFd(), m_framebufferHasDataPipe[SIGNAL_PIPE_READ],
+                          m_drainTimer.getFd(), m_heartbeatTimer.getFd()});
+    for (TCPPeer &peer : m_peers) {
+      FD_SET(peer.socket, &readfds);
+      if (!peer.sendQueue.empty())
+        FD_SET(peer.socket, &writefds);
+      maxFd = std::max(maxFd, peer.socket);
+    }
+    int ret = select(maxFd+1, &readfds, &writefds, NULL, NULL);
+    if (ret < 0) {
+      lerror << "select error" << std::endl;
+      continue;
+    }
+    if (FD_ISSET(m_blockTimer.getFd(), &readfds)) {
+      m_blockTimer.read();
+      /* Frames that have not been signaled through the pipe */
+      broadcastFrameBuffer();
+    }
+    if (FD_ISSET(m_drainTimer.getFd(), &readfds)) {
+      m_drainTimer.read();
+      SpillQueue *spillQueue = m_frameBuffer->getSpillQueue();
+      if (m_negotiatedPeers > 0 && spillQueue->depth() > 0 &&
+          m_frameBuffer->drainSpill(spillQueue->drainBudget()) > 0) {
+        broadcastFrameBuffer();
+      }
+    }
+    if (FD_ISSET(m_heartbeatTimer.getFd(), &readfds)) {
+      m_heartbeatTimer.read();
+      for (TCPPeer &peer : m_peers) {
+        if (heartbeatExpired(peer.lastRx)) {
+          lwarn << "Client " << formatSocketAddress(getSocketAddress(&peer.addr))
+                << " missed " << TCP_HEARTBEAT_TIMEOUT_INTERVALS << " heartbeats" << std::endl;
+          disconnectPeer(peer);
+        } else if (peer.state == NEGOTIATED) {
+          queueControlFrame(peer, TCP_CONTROL_HEARTBEAT, m_heartbeatSeq++);
+          if (!writePeer(peer))
+            disconnectPeer(peer);
+        }
+      }
+    }
+    if (FD_ISSET(m_framebufferHasDataPipe[SIGNAL_PIPE_READ], &readfds)) {
+      int signal;
+      ssize_t res = read(m_framebufferHasDataPipe[SIGNAL_PIPE_READ], &signal, sizeof(signal));
+      if (res == sizeof(signal)) {
+        broadcastFrameBuffer();
+      }
+    }
+    for (TCPPeer &peer : m_peers) {
+      if (peer.state != DISCONNECTED && FD_ISSET(peer.socket, &writefds) && !writePeer(peer))
+        disconnectPeer(peer);
+      if (peer.state != DISCONNECTED && FD_ISSET(peer.socket, &readfds)) {
+        bool negotiated = peer.state == NEGOTIATED;
+        if (!readPeer(peer, true)) {
+          disconnectPeer(peer);
+        } else if (!negotiated && peer.state == NEGOTIATED) {
+          m_negotiatedPeers++;
+        }
+      }
+    }
+    m_peers.remove_if([](const TCPPeer &peer) { return peer.state == DISCONNECTED; });
+    if (FD_ISSET(m_serverSocket, &readfds)) {
+      acceptClient();
+    }
+  }
+  if (m_debugOptions.buffer) {
+    m_frameBuffer->debug();
+  }
+  for (TCPPeer &peer : m_peers) {
+    disconnectPeer(peer);
+  }
+  m_peers.clear();
+  linfo << "Shutting down. TCP Transmission Summary: TX: " << m_txCount.get() << " RX: " << m_rxCount.get()
+        << " Rejected clients: " << m_rejectedCount << std::endl;
+  close(m_framebufferHasDataPipe[SIGNAL_PIPE_READ]);
+  close(m_framebufferHasDataPipe[SIGNAL_PIPE_WRITE]);
+  cleanup();
+}
+
+void TCPMultiServerThread::transmitFrame(canfd_frame *frame) {
+  if (m_negotiatedPeers == 0) {
+    m_frameBuffer->insertFramePool(frame);
+    return;
+  }
+  m_frameBuffer->insertFrame(frame);
+  int signal = 1;
+  ssize_t res = write(m_framebufferHasDataPipe[SIGNAL_PIPE_WRITE], &signal, sizeof(signal));
+  if (res != sizeof(signal) && errno != EWOULDBLOCK) {
+    lwarn << "could not write to pipe " << res << std::endl;
+  }
+}
+
+void TCPMultiServerThread::acceptClient() {
+  struct sockaddr_storage connAddr;
+  socklen_t connAddrLen = sizeof(connAddr);
+  uint8_t protocolVersionBuffer[] = CANNELLONI_CONNECT_V1_STRING;
+
+  int socket = accept(m_serverSocket, (struct sockaddr *) &connAddr, &connAddrLen);
+  if (socket == -1) {
+    lerror << "Error while accepting." << std::endl;
+    return;
+  }
+  if (m_peers.size() >= m_config.maxClients) {
+    lwarn << "Rejecting " << formatSocketAddress(getSocketAddress(&connAddr))
+          << ", " << m_config.maxClients << " clients are already connected." << std::endl;
+    m_rejectedCount++;
+    close(socket);
+    return;
+  }
+  if (m_checkPeerConnect) {
+    if ((m_addressFamily == AF_INET && (memcmp(&((struct sockaddr_in *) &connAddr)->sin_addr, &((struct sockaddr_in *) &m_remoteAddr)->sin_addr, sizeof(struct in_addr)) != 0)) ||
+        (m_addressFamily == AF_INET6 && (memcmp(&((struct sockaddr_in6 *) &connAddr)->sin6_addr, &((struct sockaddr_in6 *) &m_remoteAddr)->sin6_addr, sizeof(struct in6_addr)) != 0))) {
+      lwarn << "Got a connection attempt from " << formatSocketAddress(getSocketAddress(&connAddr))
+            << ", which is not set as a remote. Restart with -p argument to override." << std::endl;
+      m_rejectedCount++;
+      close(socket);
+      return;
+    }
+  }
+  if (!setupSocket(socket)) {
+    close(socket);
+    return;
+  }
+  /* The socket buffer of a fresh connection always has room for the announcement */
+  if (write(socket, protocolVersionBuffer, sizeof(protocolVersionBuffer)-1) != sizeof(protocolVersionBuffer)-1) {
+    lerror << "write error could not announce protocol" << std::endl;
+    close(socket);
+    return;
+  }
+  if (fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK) < 0) {
+    lerror << "Could not make client socket non-blocking" << std::endl;
+    close(socket);
+    return;
+  }
+  linfo << "Got a connection from " << formatSocketAddress(getSocketAddress(&connAddr))
+        << " (" << m_peers.size()+1 << "/" << m_config.maxClients << ")" << std::endl;
+  m_peers.emplace_back(socket, connAddr);
+}
+
+void TCPMultiServerThread::broadcastFrameBuffer() {
+  if (m_negotiatedPeers == 0) {
+    /* Nobody to send to, return the frames to the pool */
+    m_frameBuffer->reset();
+    return;
+  }
+  /* Every frame is encoded once, the batch is shared by all send queues */
+  std::shared_ptr<const TCPBatch> batch = encodeFrameBuffer();
+  if (!batch)
+    return;
+  for (TCPPeer &peer : m_peers) {
+    if (peer.state == NEGOTIATED) {
+      enqueueBatch(peer, batch);
+    }
+  }
+}
+
+void TCPMultiServerThread::enqueueBatch(TCPPeer &peer, const std::shared_ptr<const TCPBatch> &batch) {
+  if (peer.queuedBytes + batch->data.size() > m_config.maxQueueBytes) {
+    if (m_config.slowClientPolicy == SLOW_CLIENT_DISCONNECT) {
+      lwarn << "Send queue of " << formatSocketAddress(getSocketAddress(&peer.addr))
+            << " is full, disconnecting." << std::endl;
+      disconnectPeer(peer);
+      return;
+    }
+    /* Only whole batches are dropped, so the stream stays decodable */
+    if (peer.droppedCount == 0) {
+      lwarn << "Send queue of " << formatSocketAddress(getSocketAddress(&peer.addr))
+            << " is full, dropping frames for this client." << std::endl;
+    }
+    peer.droppedCount += batch->frameCount;
+    return;
+  }
+  peer.sendQueue.push_back(batch);
+  peer.queuedBytes += batch->data.size();
+  if (!writePeer(peer))
+    disconnectPeer(peer);
+}
+
+void TCPMultiServerThread::disconnectPeer(TCPPeer &peer) {
+  if (peer.state == DISCONNECTED)
+    return;
+  if (peer.state == NEGOTIATED)
+    m_negotiatedPeers--;
+  peer.state = DISCONNECTED;
+  close(peer.socket);
+  linfo << "Client " << formatSocketAddress(getSocketAddress(&peer.addr))
+        << " disconnected. TX: " << peer.txCount << " RX: " << peer.rxCount
+        << " Dropped: " << peer.droppedCount << std::endl;
+  peer.sendQueue.clear();
+  peer.queuedBytes = 0;
+}
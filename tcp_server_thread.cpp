@@ -108,7 +108,7 @@ bool TCPServerThread::attempt_connect() {
   m_frameBuffer->reset();
   m_decoder.reset();
   /* At this point we have a valid connection */
-  if (!setupSocket()) {
+  if (!setupSocket(m_socket)) {
     return false;
   }
   if (!setupPipe()) {
@@ -34,6 +34,7 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <endian.h>
 #include <errno.h>
 
 #include <sys/types.h>
@@ -50,8 +51,11 @@
 
 #include "cannelloni.h"
 #include "connection.h"
+#include "inet_address.h"
+#include "latency.h"
 #include "logging.h"
 #include "parser.h"
+#include "spillqueue.h"
 #include "tcpthread.h"
 
 using namespace cannelloni;
@@ -63,15 +67,30 @@ TCPThread::TCPThread(const struct debugOptions_t &debugOptions,
   , m_serverSocket(0)
   , m_socket(0)
   , m_connect_state(DISCONNECTED)
-  , m_rxCount(0)
-  , m_txCount(0)
   , m_addressFamily(params.addressFamily)
+  , m_liveness{ /* userTimeout */ 0, /* keepalive */ 0, /* heartbeatInterval */ 0 }
+  , m_heartbeatSeq(0)
+  , m_controlTimes{0, 0, 0}
 {
 
   memcpy(&m_remoteAddr, &params.remoteAddr, sizeof(struct sockaddr_storage));
   memcpy(&m_localAddr, &params.localAddr, sizeof(struct sockaddr_storage));
 }
 
+TCPPeer::TCPPeer(int socket, const struct sockaddr_storage &addr)
+  : socket(socket)
+  , state(CONNECTED)
+  , controlTimes{0, 0, 0}
+  , sendOffset(0)
+  , queuedBytes(0)
+  , rxCount(0)
+  , txCount(0)
+  , droppedCount(0)
+  , lastRx(std::chrono::steady_clock::now())
+{
+  memcpy(&this->addr, &addr, sizeof(struct sockaddr_storage));
+}
+
 int TCPThread::start() {
   return Thread::start();
 }
@@ -85,6 +104,21 @@ void TCPThread::run() {
 
   /* Set interval to m_timeout */
   m_blockTimer.adjust(SELECT_TIMEOUT, SELECT_TIMEOUT);
+  if (m_frameBuffer->getSpillQueue()) {
+    m_drainTimer.adjust(SPILL_DRAIN_INTERVAL, SPILL_DRAIN_INTERVAL);
+  } else {
+    m_drainTimer.disable();
+  }
+  if (m_liveness.heartbeatInterval) {
+    m_heartbeatTimer.adjust(m_liveness.heartbeatInterval * 1000, m_liveness.heartbeatInterval * 1000);
+  } else {
+    m_heartbeatTimer.disable();
+  }
+  if (m_clockSync.isEnabled()) {
+    m_clockTimer.adjust(CLOCK_SYNC_FAST_INTERVAL, CLOCK_SYNC_FAST_INTERVAL);
+  } else {
+    m_clockTimer.disable();
+  }
 
   while (m_started) {
     if (m_connect_state == DISCONNECTED) {
@@ -99,7 +133,7 @@ void TCPThread::run() {
         }
       } else {
         /* Wait here for some time until the next attempt */
-        std::this_thread::sleep_for(std::chrono::seconds(2));
+        std::this_thread::sleep_for(std::chrono::seconds(TCP_RECONNECT_INTERVAL));
       }
     } else {
       /* Prepare readfds */
@@ -107,7 +141,12 @@ void TCPThread::run() {
       FD_SET(m_socket, &readfds);
       FD_SET(m_blockTimer.getFd(), &readfds);
       FD_SET(m_framebufferHasDataPipe[SIGNAL_PIPE_READ], &readfds);
-      int ret = select(std::max({m_socket, m_blockTimer.getFd(), m_framebufferHasDataPipe[SIGNAL_PIPE_READ]})+1, &readfds, NULL, NULL, NULL);
+      FD_SET(m_drainTimer.getFd(), &readfds);
+      FD_SET(m_heartbeatTimer.getFd(), &readfds);
+      FD_SET(m_clockTimer.getFd(), &readfds);
+      int ret = select(std::max({m_socket, m_blockTimer.getFd(), m_framebufferHasDataPipe[SIGNAL_PIPE_READ],
+                                 m_drainTimer.getFd(), m_heartbeatTimer.getFd(),
+                                 m_clockTimer.getFd()})+1, &readfds, NULL, NULL, NULL);
       if (ret < 0) {
         if (errno == EOF) {
           disconnect();
@@ -124,6 +163,34 @@ void TCPThread::run() {
         */
         flushFrameBuffer();
       }
+      if (FD_ISSET(m_drainTimer.getFd(), &readfds)) {
+        m_drainTimer.read();
+        SpillQueue *spillQueue = m_frameBuffer->getSpillQueue();
+        if (m_connect_state == NEGOTIATED && spillQueue->depth() > 0 &&
+            m_frameBuffer->drainSpill(spillQueue->drainBudget()) > 0) {
+          flushFrameBuffer();
+        }
+      }
+      if (FD_ISSET(m_heartbeatTimer.getFd(), &readfds)) {
+        m_heartbeatTimer.read();
+        if (m_connect_state == NEGOTIATED) {
+          if (heartbeatExpired(m_lastRx)) {
+            lwarn << "Remote missed " << TCP_HEARTBEAT_TIMEOUT_INTERVALS << " heartbeats, disconnecting" << std::endl;
+            disconnect();
+            continue;
+          }
+          sendControlFrame(m_socket, TCP_CONTROL_HEARTBEAT, m_heartbeatSeq++);
+        }
+      }
+      if (FD_ISSET(m_clockTimer.getFd(), &readfds)) {
+        m_clockTimer.read();
+        if (m_connect_state == NEGOTIATED) {
+          uint64_t times[3] = {m_clockSync.request(), 0, 0};
+          sendControlFrame(m_socket, TCP_CONTROL_CLOCK, 0, times);
+          uint64_t interval = m_clockSync.nextInterval();
+          m_clockTimer.adjust(interval, interval);
+        }
+      }
       if (FD_ISSET(m_framebufferHasDataPipe[SIGNAL_PIPE_READ], &readfds)) {
         int signal;
         ssize_t res = read(m_framebufferHasDataPipe[SIGNAL_PIPE_READ], &signal, sizeof(signal));
@@ -154,6 +221,7 @@ void TCPThread::run() {
 
           receivedBytes = read(m_socket, buffer, expectedBytes);
           if (receivedBytes < 0) {
+            m_receiveErrors.add();
             lerror << "recvfrom error." << std::endl;
             /* close connection */
             disconnect();
@@ -162,10 +230,21 @@ void TCPThread::run() {
             disconnect();
             continue;
           }
+          m_rxBytes.add(receivedBytes);
+          m_lastRx = std::chrono::steady_clock::now();
         }
         if (m_connect_state == CONNECTED) {
           if (memcmp(buffer, protocolVersionBuffer, sizeof(CANNELLONI_CONNECT_V1_STRING)-1) == 0) {
             m_connect_state = NEGOTIATED;
+            m_lastRx = std::chrono::steady_clock::now();
+            if (m_storeForward.isEnabled()) {
+              /* Send everything that has been stored while we were offline */
+              size_t forwarded = m_storeForward.goOnline(m_frameBuffer);
+              if (m_debugOptions.buffer) {
+                linfo << "Forwarding " << forwarded << " stored frames" << std::endl;
+              }
+              flushFrameBuffer();
+            }
             continue;
           } else {
             lwarn << "Invalid protocol detected" << std::endl;
@@ -175,14 +254,10 @@ void TCPThread::run() {
         } else {
           m_decoder.expectedBytes = decodeFrame(buffer, receivedBytes, &m_decoder.tempFrame, &m_decoder.state);
           if (m_decoder.expectedBytes == 0) {
-            canfd_frame *frameBufferFrame = m_peerThread->getFrameBuffer()->requestFrame(true, m_debugOptions.buffer);
-            if (frameBufferFrame != NULL) {
-              memcpy(frameBufferFrame, &m_decoder.tempFrame, sizeof(m_decoder.tempFrame));
-              m_peerThread->transmitFrame(frameBufferFrame);
-            } else {
-              lerror << "Dropping frame due to framebuffer issue." << std::endl;
-            }
-            m_rxCount++;
+            if (handleControlFrame(m_socket, &m_decoder.tempFrame))
+              continue;
+            forwardFrame(&m_decoder.tempFrame);
+            m_rxCount.add();
             continue;
           } else if (m_decoder.expectedBytes == -1) {
             lerror << "Decoder Error" << std::endl;
@@ -195,8 +270,17 @@ void TCPThread::run() {
   }
   if (m_debugOptions.buffer) {
     m_frameBuffer->debug();
+    if (m_storeForward.isEnabled())
+      m_storeForward.debug();
   }
-  linfo << "Shutting down. TCP Transmission Summary: TX: " << m_txCount << " RX: " << m_rxCount << std::endl;
+  linfo << "Shutting down. TCP Transmission Summary: TX: " << m_txCount.get() << " RX: " << m_rxCount.get() << std::endl;
+  if (m_storeForward.isEnabled()) {
+    linfo << "Store and forward: Stored: " << m_storeForward.getStoredCount()
+          << " Forwarded: " << m_storeForward.getForwardedCount()
+          << " Dropped: " << m_storeForward.getDroppedCount()
+          << " Expired: " << m_storeForward.getExpiredCount() << std::endl;
+  }
+  printClockSummary();
   m_connect_state = DISCONNECTED;
   close(m_socket);
   cleanup();
@@ -204,17 +288,29 @@ void TCPThread::run() {
 
 void TCPThread::disconnect() {
   m_connect_state = DISCONNECTED;
+  /* The next connection may go to another host */
+  m_clockSync.reset();
+  if (m_storeForward.isEnabled()) {
+    /* Frames that are still waiting in m_frameBuffer are kept as well */
+    m_storeForward.goOffline(m_frameBuffer);
+  }
   close(m_socket);
   close(m_framebufferHasDataPipe[SIGNAL_PIPE_READ]);
   close(m_framebufferHasDataPipe[SIGNAL_PIPE_WRITE]);
 }
 
 void TCPThread::transmitFrame(canfd_frame *frame) {
-  if (m_connect_state != NEGOTIATED) {
+  if (m_storeForward.isEnabled()) {
+    /* Stores the frame unless we are negotiated */
+    if (!m_storeForward.insertFrame(frame, m_frameBuffer))
+      return;
+  } else if (m_connect_state != NEGOTIATED) {
     m_frameBuffer->insertFramePool(frame);
+    m_notConnectedDropCount.add();
     return;
+  } else {
+    m_frameBuffer->insertFrame(frame);
   }
-  m_frameBuffer->insertFrame(frame);
   int signal = 1;
   ssize_t res = write(m_framebufferHasDataPipe[SIGNAL_PIPE_WRITE], &signal, sizeof(signal));
   if (res != sizeof(signal)) {
@@ -236,32 +332,357 @@ void TCPThread::flushFrameBuffer() {
   uint8_t transmitBuffer[MAX_TRANSMIT_BUFFER_SIZE_BYTES];
   m_frameBuffer->swapBuffers();
   std::list<canfd_frame*> *frames = m_frameBuffer->getIntermediateBuffer();
+  uint64_t sent = m_txCount.get();
   for (auto it = frames->begin(); it != frames->end(); it++) {
     canfd_frame* frame = *it;
+    uint64_t start = m_stages.isEnabled() ? monotonicNow() : 0;
     ssize_t encodedBytes = encodeFrame(transmitBuffer, frame);
+    uint64_t encoded = start ? monotonicNow() : 0;
     ssize_t bytesWritten = send(m_socket, transmitBuffer, encodedBytes, 0);
     if (encodedBytes != bytesWritten) {
+      m_sendErrors.add();
       disconnect();
+      if (m_storeForward.isEnabled()) {
+        /* This frame and all following ones have not been transmitted */
+        m_storeForward.returnFrames(*frames, it, m_frameBuffer);
+      }
       break;
     }
-    m_txCount++;
+    if (start) {
+      m_stages.add(STAGE_QUEUE, frameStageTime(frame), start);
+      m_stages.add(STAGE_ENCODE, start, encoded);
+      m_stages.add(STAGE_SEND, encoded, monotonicNow());
+    }
+    if (m_flight.isEnabled())
+      m_flight.record(FLIGHT_NET_TX, frame, m_txCount.get());
+    m_txCount.add();
+    m_txBytes.add(bytesWritten);
+  }
+  m_frameBuffer->unlockIntermediateBuffer();
+  m_frameBuffer->mergeIntermediateBuffer();
+  m_flushPackets.observe(m_txCount.get() - sent);
+}
+
+void TCPThread::forwardFrame(const canfd_frame *decoded) {
+  uint64_t requested = m_stages.isEnabled() ? monotonicNow() : 0;
+  canfd_frame *frameBufferFrame = m_peerThread->getFrameBuffer()->requestFrame(true, m_debugOptions.buffer);
+  if (frameBufferFrame == NULL) {
+    lerror << "Dropping frame due to framebuffer issue." << std::endl;
+    return;
+  }
+  memcpy(frameBufferFrame, decoded, sizeof(canfd_frame));
+  if (requested) {
+    /* The frame is decoded byte by byte as the stream arrives, so only the pool is a stage of its own */
+    uint64_t now = monotonicNow();
+    m_stages.add(STAGE_POOL, requested, now);
+    frameStageTime(frameBufferFrame) = now;
+  }
+  if (m_flight.isEnabled())
+    m_flight.record(FLIGHT_NET_RX, frameBufferFrame, m_rxCount.get());
+  m_peerThread->transmitFrame(frameBufferFrame);
+}
+
+void TCPThread::registerMetrics(MetricsRegistry &registry) {
+  registry.add("cannelloni_network_frames_total", "Frames sent to and received from the remote",
+               METRIC_COUNTER, "direction=\"rx\"", m_rxCount);
+  registry.add("cannelloni_network_frames_total", "Frames sent to and received from the remote",
+               METRIC_COUNTER, "direction=\"tx\"", m_txCount);
+  registry.add("cannelloni_network_bytes_total", "Bytes sent to and received from the remote",
+               METRIC_COUNTER, "direction=\"rx\"", m_rxBytes);
+  registry.add("cannelloni_network_bytes_total", "Bytes sent to and received from the remote",
+               METRIC_COUNTER, "direction=\"tx\"", m_txBytes);
+  registry.add("cannelloni_socket_errors_total", "Failed socket operations", METRIC_COUNTER,
+               "socket=\"network\",op=\"read\"", m_receiveErrors);
+  registry.add("cannelloni_socket_errors_total", "Failed socket operations", METRIC_COUNTER,
+               "socket=\"network\",op=\"write\"", m_sendErrors);
+  registry.add("cannelloni_dropped_frames_total", "Frames that were dropped", METRIC_COUNTER,
+               "buffer=\"can_to_network\",reason=\"not_connected\"", m_notConnectedDropCount);
+  registry.add("cannelloni_flush_packets", "Packets sent by one flush, each frame is a packet with TCP",
+               "", m_flushPackets);
+}
+
+void TCPThread::setStoreForward(const StoreForwardConfig &config) {
+  m_storeForward.setConfig(config);
+}
+
+void TCPThread::setLiveness(const TCPLivenessConfig &config) {
+  m_liveness = config;
+}
+
+void TCPThread::setClockSync(bool enabled) {
+  m_clockSync.setEnabled(enabled);
+}
+
+/* Keeps the time of a time frame for the clock frame that follows, false for other frames */
+static bool receiveControlTime(const canfd_frame *frame, uint64_t times[3]) {
+  if (frame->can_id < TCP_CONTROL_TIME_CAN_ID || frame->can_id >= TCP_CONTROL_TIME_CAN_ID + 3)
+    return false;
+  if (canfd_len(frame) >= sizeof(uint64_t)) {
+    uint64_t time;
+    memcpy(&time, frame->data, sizeof(time));
+    times[frame->can_id - TCP_CONTROL_TIME_CAN_ID] = be64toh(time);
+  }
+  return true;
+}
+
+bool TCPThread::handleControlFrame(int socket, const canfd_frame *frame) {
+  /* Always consumed, an error frame with EFF must never reach the bus */
+  if (receiveControlTime(frame, m_controlTimes))
+    return true;
+  if (frame->can_id != TCP_CONTROL_CAN_ID)
+    return false;
+  if (canfd_len(frame) >= TCP_CONTROL_LEN && frame->data[0] == TCP_CONTROL_HEARTBEAT) {
+    uint32_t seq;
+    memcpy(&seq, &frame->data[4], sizeof(seq));
+    sendControlFrame(socket, TCP_CONTROL_HEARTBEAT_ACK, ntohl(seq));
+  }
+  uint64_t answer[3];
+  if (receiveClock(frame, m_controlTimes, answer))
+    sendControlFrame(socket, TCP_CONTROL_CLOCK_ACK, 0, answer);
+  return true;
+}
+
+bool TCPThread::handlePeerControlFrame(TCPPeer &peer, const canfd_frame *frame) {
+  if (receiveControlTime(frame, peer.controlTimes))
+    return true;
+  if (frame->can_id != TCP_CONTROL_CAN_ID)
+    return false;
+  if (canfd_len(frame) >= TCP_CONTROL_LEN && frame->data[0] == TCP_CONTROL_HEARTBEAT) {
+    uint32_t seq;
+    memcpy(&seq, &frame->data[4], sizeof(seq));
+    queueControlFrame(peer, TCP_CONTROL_HEARTBEAT_ACK, ntohl(seq));
+  }
+  uint64_t answer[3];
+  if (receiveClock(frame, peer.controlTimes, answer))
+    queueControlFrame(peer, TCP_CONTROL_CLOCK_ACK, 0, answer);
+  return true;
+}
+
+bool TCPThread::receiveClock(const canfd_frame *frame, const uint64_t times[3], uint64_t answer[3]) {
+  uint64_t now = realtimeNow();
+  if (canfd_len(frame) < TCP_CONTROL_LEN ||
+      (frame->data[0] != TCP_CONTROL_CLOCK && frame->data[0] != TCP_CONTROL_CLOCK_ACK))
+    return false;
+  /* Requests are answered even if this end does not measure the offset itself */
+  if (frame->data[0] == TCP_CONTROL_CLOCK) {
+    answer[0] = times[0];
+    answer[1] = now;
+    answer[2] = realtimeNow();
+    return true;
+  }
+  if (m_clockSync.isEnabled() && m_clockSync.answer(times[0], times[1], times[2], now) &&
+      m_clockSync.getSampleCount() == 1) {
+    linfo << "Clock offset of the remote: " << m_clockSync.getOffset() / 1000 << " us RTT: "
+          << m_clockSync.getRtt() / 1000 << " us" << std::endl;
+  }
+  return false;
+}
+
+void TCPThread::printClockSummary() {
+  if (m_clockSync.isEnabled()) {
+    linfo << "Clock Summary: Offset: " << m_clockSync.getOffset() / 1000
+          << " us RTT: " << m_clockSync.getRtt() / 1000
+          << " us Requests: " << m_clockSync.getRequestCount()
+          << " Samples: " << m_clockSync.getSampleCount() << std::endl;
+  }
+}
+
+/* Encodes a control frame, and the times ahead of it, with encodeFrame like data frames */
+static size_t encodeControlFrame(uint8_t *data, uint8_t type, uint32_t seq, const uint64_t *times) {
+  uint8_t *start = data;
+  canfd_frame frame;
+  memset(&frame, 0, sizeof(frame));
+  frame.len = TCP_CONTROL_LEN;
+  if (times) {
+    for (size_t i = 0; i < 3; i++) {
+      uint64_t time = htobe64(times[i]);
+      frame.can_id = TCP_CONTROL_TIME_CAN_ID + i;
+      memcpy(frame.data, &time, sizeof(time));
+      data += encodeFrame(data, &frame);
+    }
+  }
+  uint32_t netSeq = htonl(seq);
+  frame.can_id = TCP_CONTROL_CAN_ID;
+  memset(frame.data, 0, TCP_CONTROL_LEN);
+  frame.data[0] = type;
+  memcpy(&frame.data[4], &netSeq, sizeof(netSeq));
+  data += encodeFrame(data, &frame);
+  return data - start;
+}
+
+bool TCPThread::sendControlFrame(int socket, uint8_t type, uint32_t seq, const uint64_t *times) {
+  uint8_t buffer[TCP_CONTROL_MAX_SIZE];
+  size_t len = encodeControlFrame(buffer, type, seq, times);
+  ssize_t res = send(socket, buffer, len, MSG_NOSIGNAL);
+  if (res > 0)
+    m_txBytes.add(res);
+  return res == static_cast<ssize_t>(len);
+}
+
+bool TCPThread::heartbeatExpired(std::chrono::steady_clock::time_point lastRx) {
+  if (m_liveness.heartbeatInterval == 0)
+    return false;
+  auto silence = std::chrono::steady_clock::now() - lastRx;
+  return silence > std::chrono::milliseconds(m_liveness.heartbeatInterval * TCP_HEARTBEAT_TIMEOUT_INTERVALS);
+}
+
+std::shared_ptr<TCPBatch> TCPThread::encodeFrameBuffer() {
+  std::shared_ptr<TCPBatch> batch;
+  m_frameBuffer->swapBuffers();
+  std::list<canfd_frame*> *frames = m_frameBuffer->getIntermediateBuffer();
+  if (!frames->empty()) {
+    batch = std::make_shared<TCPBatch>();
+    batch->data.resize(frames->size() * (MAX_TRANSMIT_BUFFER_SIZE_BYTES));
+    size_t offset = 0;
+    uint64_t start = m_stages.isEnabled() ? monotonicNow() : 0;
+    for (canfd_frame *frame : *frames) {
+      offset += encodeFrame(batch->data.data() + offset, frame);
+    }
+    /* The batch is written to the peers later on, so there is no send stage */
+    if (start) {
+      uint64_t encoded = monotonicNow();
+      for (canfd_frame *frame : *frames) {
+        m_stages.add(STAGE_QUEUE, frameStageTime(frame), start);
+        m_stages.add(STAGE_ENCODE, start, encoded);
+      }
+    }
+    /* The frames are recorded once they are encoded, not once a peer got them */
+    if (m_flight.isEnabled()) {
+      uint64_t seq = m_txCount.get();
+      for (canfd_frame *frame : *frames)
+        m_flight.record(FLIGHT_NET_TX, frame, seq++);
+    }
+    batch->data.resize(offset);
+    batch->frameCount = frames->size();
+    m_txCount.add(batch->frameCount);
   }
   m_frameBuffer->unlockIntermediateBuffer();
   m_frameBuffer->mergeIntermediateBuffer();
+  return batch;
 }
 
-bool TCPThread::setupSocket() {
+void TCPThread::queueControlFrame(TCPPeer &peer, uint8_t type, uint32_t seq, const uint64_t *times) {
+  /* Control frames are queued as well, so they never end up inside a partially written batch */
+  auto batch = std::make_shared<TCPBatch>();
+  batch->data.resize(TCP_CONTROL_MAX_SIZE);
+  batch->data.resize(encodeControlFrame(batch->data.data(), type, seq, times));
+  batch->frameCount = 0;
+  peer.sendQueue.push_back(batch);
+  peer.queuedBytes += batch->data.size();
+}
+
+bool TCPThread::writePeer(TCPPeer &peer) {
+  while (!peer.sendQueue.empty()) {
+    const TCPBatch &batch = *peer.sendQueue.front();
+    ssize_t res = send(peer.socket, batch.data.data() + peer.sendOffset,
+                       batch.data.size() - peer.sendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (res < 0) {
+      /* Continue once select reports the socket as writable */
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      m_sendErrors.add();
+      return false;
+    }
+    m_txBytes.add(res);
+    peer.sendOffset += res;
+    if (peer.sendOffset < batch.data.size()) {
+      continue;
+    }
+    peer.txCount += batch.frameCount;
+    peer.queuedBytes -= batch.data.size();
+    peer.sendOffset = 0;
+    peer.sendQueue.pop_front();
+  }
+  return true;
+}
+
+bool TCPThread::readPeer(TCPPeer &peer, bool forward) {
+  uint8_t buffer[TCP_PEER_READ_SIZE];
+  ssize_t receivedBytes = read(peer.socket, buffer, sizeof(buffer));
+  if (receivedBytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return true;
+  } else if (receivedBytes < 0) {
+    m_receiveErrors.add();
+    return false;
+  } else if (receivedBytes == 0) {
+    return false;
+  }
+  m_rxBytes.add(receivedBytes);
+  peer.lastRx = std::chrono::steady_clock::now();
+  peer.rxBuffer.insert(peer.rxBuffer.end(), buffer, buffer + receivedBytes);
+
+  size_t offset = 0;
+  if (peer.state == CONNECTED) {
+    const size_t protocolLength = sizeof(CANNELLONI_CONNECT_V1_STRING)-1;
+    if (peer.rxBuffer.size() < protocolLength)
+      return true;
+    if (memcmp(peer.rxBuffer.data(), CANNELLONI_CONNECT_V1_STRING, protocolLength) != 0) {
+      lwarn << "Invalid protocol detected from "
+            << formatSocketAddress(getSocketAddress(&peer.addr)) << std::endl;
+      return false;
+    }
+    peer.state = NEGOTIATED;
+    offset = protocolLength;
+  }
+
+  Decoder &decoder = peer.decoder;
+  while (true) {
+    if (decoder.expectedBytes == 0) {
+      decoder.expectedBytes = decodeFrame(NULL, 0, &decoder.tempFrame, &decoder.state);
+    }
+    if (peer.rxBuffer.size() - offset < static_cast<size_t>(decoder.expectedBytes))
+      break;
+    ssize_t consumed = decoder.expectedBytes;
+    decoder.expectedBytes = decodeFrame(peer.rxBuffer.data() + offset, consumed,
+                                        &decoder.tempFrame, &decoder.state);
+    offset += consumed;
+    if (decoder.expectedBytes == -1) {
+      lerror << "Decoder Error" << std::endl;
+      return false;
+    } else if (decoder.expectedBytes == 0) {
+      if (handlePeerControlFrame(peer, &decoder.tempFrame))
+        continue;
+      peer.rxCount++;
+      if (!forward)
+        continue;
+      forwardFrame(&decoder.tempFrame);
+      m_rxCount.add();
+    }
+  }
+  peer.rxBuffer.erase(peer.rxBuffer.begin(), peer.rxBuffer.begin() + offset);
+  return writePeer(peer);
+}
+
+bool TCPThread::setupSocket(int socket) {
   const int nagle = 0;
   const int min_window_size = 1;
-  if (setsockopt(m_socket, IPPROTO_TCP, TCP_WINDOW_CLAMP, &min_window_size, sizeof(min_window_size))) {
+  if (setsockopt(socket, IPPROTO_TCP, TCP_WINDOW_CLAMP, &min_window_size, sizeof(min_window_size))) {
     lerror << "Could not set window size to " << min_window_size << std::endl;
     return false;
   }
   /* Disable Nagle for this connection */
-  if (setsockopt(m_socket, IPPROTO_TCP, TCP_NODELAY, &nagle, sizeof(nagle))) {
+  if (setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &nagle, sizeof(nagle))) {
     lerror << "Could not disable Nagle." << std::endl;
     return false;
   }
+  /* Fail the connection once sent data stays unacknowledged for too long */
+  if (m_liveness.userTimeout &&
+      setsockopt(socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &m_liveness.userTimeout, sizeof(m_liveness.userTimeout))) {
+    lerror << "Could not set TCP user timeout." << std::endl;
+    return false;
+  }
+  if (m_liveness.keepalive) {
+    const int keepalive = 1;
+    const int keepaliveTime = m_liveness.keepalive;
+    const int keepaliveProbes = TCP_HEARTBEAT_TIMEOUT_INTERVALS;
+    if (setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive)) ||
+        setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &keepaliveTime, sizeof(keepaliveTime)) ||
+        setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &keepaliveTime, sizeof(keepaliveTime)) ||
+        setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &keepaliveProbes, sizeof(keepaliveProbes))) {
+      lerror << "Could not enable keepalive." << std::endl;
+      return false;
+    }
+  }
   return true;
 }
 
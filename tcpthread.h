@@ -20,10 +20,18 @@
 
 #pragma once
 
+#include "clocksync.h"
 #include "connection.h"
 #include "timer.h"
 #include "decoder.h"
+#include "storeforward.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <memory>
 #include <mutex>
+#include <vector>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
@@ -35,13 +43,50 @@
 enum TCPThreadRole { TCP_SERVER, TCP_CLIENT };
 /*
   DISCONNECTED: Waiting for a connection
+  CONNECTING: Non-blocking connect in progress
   CONNECTED: TCP Connection established
   NEGOTIATED: A cannelloni peer has been found
  */
-enum ConnectState { DISCONNECTED, CONNECTED, NEGOTIATED };
+enum ConnectState { DISCONNECTED, CONNECTING, CONNECTED, NEGOTIATED };
 
 #define CANNELLONI_CONNECT_V1_STRING "CANNELLONIv1"
 
+/* Bytes read from a client socket in one go */
+#define TCP_PEER_READ_SIZE 4096
+/* Seconds between two connection attempts */
+#define TCP_RECONNECT_INTERVAL 2
+/*
+ * Seconds a server with a higher priority than the active one has to
+ * stay negotiated before a failover client switches back to it
+ */
+#define TCP_FAILBACK_DELAY 5
+/* Bytes that may be queued for the active server of a failover client */
+#define TCP_FAILOVER_QUEUE_SIZE (1024 << 10)
+
+/*
+ * Control frames are exchanged between cannelloni peers once heartbeats
+ * or the clock synchronization are enabled. They use an error frame ID
+ * with the EFF flag set which SocketCAN never generates, so they can't
+ * collide with bus traffic. They are consumed on receive whatever the
+ * local options are, heartbeats and clock requests are always answered.
+ * Control frames are classic frames encoded like the data frames, so
+ * every wire format can carry them.
+ * Layout: | type | 3 bytes reserved | 32 bit sequence number |
+ * A clock frame follows the three 64 bit times of a CannelloniExtClock,
+ * one per frame with the IDs TCP_CONTROL_TIME_CAN_ID to
+ * TCP_CONTROL_TIME_CAN_ID + 2: | originate | receive | transmit |
+ */
+#define TCP_CONTROL_CAN_ID (CAN_ERR_FLAG | CAN_EFF_FLAG | 0x1CA77E11)
+#define TCP_CONTROL_TIME_CAN_ID (TCP_CONTROL_CAN_ID + 1)
+#define TCP_CONTROL_LEN 8
+/* Bytes of an encoded clock frame and its times */
+#define TCP_CONTROL_MAX_SIZE (4 * (MAX_TRANSMIT_BUFFER_SIZE_BYTES))
+/* Missed heartbeats after which a connection is considered dead */
+#define TCP_HEARTBEAT_TIMEOUT_INTERVALS 3
+
+enum TCPControlType { TCP_CONTROL_HEARTBEAT = 1, TCP_CONTROL_HEARTBEAT_ACK = 2,
+                      TCP_CONTROL_CLOCK = 3, TCP_CONTROL_CLOCK_ACK = 4 };
+
 namespace cannelloni {
   
   struct TCPThreadParams {
@@ -50,6 +95,46 @@ namespace cannelloni {
     int addressFamily;
   };
 
+  struct TCPLivenessConfig {
+    /* TCP_USER_TIMEOUT in ms, 0 keeps the kernel default */
+    uint32_t userTimeout;
+    /* Keepalive idle time and probe interval in s, 0 disables keepalive */
+    uint32_t keepalive;
+    /* Interval of application heartbeats in ms, 0 disables heartbeats */
+    uint32_t heartbeatInterval;
+  };
+
+  /*
+   * Frames encoded once and shared by the send queues of all
+   * connections they are written to
+   */
+  struct TCPBatch {
+    std::vector<uint8_t> data;
+    size_t frameCount;
+  };
+
+  /* A single connection and its state */
+  struct TCPPeer {
+    int socket;
+    ConnectState state;
+    struct sockaddr_storage addr;
+    Decoder decoder;
+    /* Times received for the next clock frame */
+    uint64_t controlTimes[3];
+    /* Received bytes that have not been decoded yet */
+    std::vector<uint8_t> rxBuffer;
+    std::deque<std::shared_ptr<const TCPBatch>> sendQueue;
+    /* Bytes of sendQueue.front() that have already been written */
+    size_t sendOffset;
+    size_t queuedBytes;
+    uint64_t rxCount;
+    uint64_t txCount;
+    uint64_t droppedCount;
+    std::chrono::steady_clock::time_point lastRx;
+
+    TCPPeer(int socket, const struct sockaddr_storage &addr);
+  };
+
   class TCPThread : public ConnectionThread {
     public:
       TCPThread(const struct debugOptions_t &debugOptions,
@@ -61,22 +146,66 @@ namespace cannelloni {
 
       virtual void transmitFrame(canfd_frame *frame);
 
+      /* Keep frames while the connection is down, see StoreForwardQueue */
+      void setStoreForward(const StoreForwardConfig &config);
+      /* Detection of dead connections */
+      void setLiveness(const TCPLivenessConfig &config);
+      /* Estimates the offset of the clock of the remote, needed on both ends, see clocksync.h */
+      void setClockSync(bool enabled);
+      virtual void registerMetrics(MetricsRegistry &registry);
+
     protected:
       bool isConnected();
       void flushFrameBuffer();
+      /* Hands a copy of decoded to the peer thread */
+      void forwardFrame(const canfd_frame *decoded);
       void disconnect();
-      bool setupSocket();
+      bool setupSocket(int socket);
       bool setupPipe();
       virtual bool attempt_connect() = 0;
 
+      /* Returns true if frame is a control frame and has been handled */
+      bool handleControlFrame(int socket, const canfd_frame *frame);
+      /* times are the three times of a clock frame, NULL for other types */
+      bool sendControlFrame(int socket, uint8_t type, uint32_t seq, const uint64_t *times = NULL);
+      /*
+       * Answers a TCP_CONTROL_CLOCK or takes the sample of a TCP_CONTROL_CLOCK_ACK
+       * with the times received ahead of it, returns true if answer has to be
+       * sent back as a TCP_CONTROL_CLOCK_ACK
+       */
+      bool receiveClock(const canfd_frame *frame, const uint64_t times[3], uint64_t answer[3]);
+      void printClockSummary();
+      bool heartbeatExpired(std::chrono::steady_clock::time_point lastRx);
+
+      /* Helpers for threads that handle several non-blocking TCPPeers */
+      std::shared_ptr<TCPBatch> encodeFrameBuffer();
+      void queueControlFrame(TCPPeer &peer, uint8_t type, uint32_t seq, const uint64_t *times = NULL);
+      /* Handles a control frame of peer, returns false if frame is none */
+      bool handlePeerControlFrame(TCPPeer &peer, const canfd_frame *frame);
+      /* Both return false if the connection has to be closed */
+      bool writePeer(TCPPeer &peer);
+      bool readPeer(TCPPeer &peer, bool forward);
+
     protected:
       struct debugOptions_t m_debugOptions;
       int m_serverSocket;
       int m_socket;
       ConnectState m_connect_state;
       Timer m_blockTimer;
-      uint64_t m_rxCount;
-      uint64_t m_txCount;
+      Timer m_drainTimer;
+      Timer m_heartbeatTimer;
+      Timer m_clockTimer;
+      /* Performance Counters, frames */
+      Metric m_rxCount;
+      Metric m_txCount;
+      Metric m_rxBytes;
+      Metric m_txBytes;
+      Metric m_sendErrors;
+      Metric m_receiveErrors;
+      /* Frames that arrived while no remote was connected */
+      Metric m_notConnectedDropCount;
+      /* Frames sent by one flushFrameBuffer */
+      MetricHistogram m_flushPackets;
       std::recursive_mutex m_socketWriteMutex;
 
       struct sockaddr_storage m_localAddr;
@@ -85,6 +214,13 @@ namespace cannelloni {
 
       int m_framebufferHasDataPipe[2];
       Decoder m_decoder;
+      StoreForwardQueue m_storeForward;
+      TCPLivenessConfig m_liveness;
+      std::chrono::steady_clock::time_point m_lastRx;
+      uint32_t m_heartbeatSeq;
+      /* Times received for the next clock frame */
+      uint64_t m_controlTimes[3];
+      ClockSync m_clockSync;
   };
 
   struct TCPServerThreadParams {
@@ -113,10 +249,51 @@ namespace cannelloni {
       virtual bool attempt_connect();
       virtual void cleanup();
 
-    private:
+    protected:
       bool m_checkPeerConnect;
   };
 
+  enum SlowClientPolicy { SLOW_CLIENT_DROP, SLOW_CLIENT_DISCONNECT };
+
+  struct TCPMultiServerConfig {
+    /* Number of clients that may be connected at the same time */
+    size_t maxClients;
+    /* Bytes that may be queued for a single client */
+    size_t maxQueueBytes;
+    /* What happens to a client whose queue is full */
+    SlowClientPolicy slowClientPolicy;
+  };
+
+  /*
+   * Server that accepts up to maxClients clients. Frames from the
+   * CAN bus are written to all negotiated clients, frames from any
+   * client are written to the CAN bus.
+   * Sockets are non-blocking and every client has its own send queue,
+   * so a slow client never stalls the others.
+   */
+  class TCPMultiServerThread : public TCPServerThread {
+    public:
+      TCPMultiServerThread(const struct debugOptions_t &debugOptions,
+                           const struct TCPServerThreadParams &params,
+                           const struct TCPMultiServerConfig &config);
+
+      virtual void run();
+      virtual void transmitFrame(canfd_frame *frame);
+
+    private:
+      void acceptClient();
+      void broadcastFrameBuffer();
+      void enqueueBatch(TCPPeer &peer, const std::shared_ptr<const TCPBatch> &batch);
+      void disconnectPeer(TCPPeer &peer);
+
+    private:
+      TCPMultiServerConfig m_config;
+      std::list<TCPPeer> m_peers;
+      /* Read by transmitFrame which runs in the CAN thread */
+      std::atomic<size_t> m_negotiatedPeers;
+      uint64_t m_rejectedCount;
+  };
+
   class TCPClientThread : public TCPThread {
   public:
     TCPClientThread(const struct debugOptions_t &debugOptions,
@@ -124,4 +301,43 @@ namespace cannelloni {
     virtual bool attempt_connect();
     virtual void cleanup();
   };
+
+  /*
+   * Client that keeps negotiated connections to the remote and to all
+   * standby servers. Frames are only exchanged with the active server,
+   * the others just exchange heartbeats. The order of the servers is
+   * their priority, the remote comes first. Once the active server
+   * fails, the first negotiated standby takes over without a new
+   * handshake. A server with a higher priority takes over again once it
+   * stayed negotiated for TCP_FAILBACK_DELAY seconds.
+   */
+  class TCPFailoverClientThread : public TCPThread {
+  public:
+    TCPFailoverClientThread(const struct debugOptions_t &debugOptions,
+                            const struct TCPThreadParams &params,
+                            const std::vector<struct sockaddr_storage> &standbyAddrs);
+    virtual void run();
+    virtual void transmitFrame(canfd_frame *frame);
+    virtual bool attempt_connect();
+    virtual void cleanup();
+
+  private:
+    void startConnect(TCPPeer &peer);
+    void finishConnect(TCPPeer &peer);
+    void failPeer(TCPPeer &peer);
+    void activate(TCPPeer *peer);
+    /* Switches to the healthy server with the highest priority */
+    void failBack();
+    void sendFrameBuffer();
+
+  private:
+    std::vector<TCPPeer> m_servers;
+    std::vector<std::chrono::steady_clock::time_point> m_retryAt;
+    std::vector<std::chrono::steady_clock::time_point> m_negotiatedAt;
+    TCPPeer *m_active;
+    /* Read by transmitFrame which runs in the CAN thread */
+    std::atomic<bool> m_hasActive;
+    uint64_t m_failoverCount;
+    uint64_t m_failbackCount;
+  };
 }
@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+#
+# This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+#
+# Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License, version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+#
+
+import csv
+import statistics
+import sys
+
+# Usage:
+#
+# ./cycle_jitter.py candump.log
+# candump.log is a log file produced by
+#
+# # candump -l vcan0 vcan1
+#
+# Prints the mean cycle time and the jitter (standard deviation and
+# largest deviation of the intervals) of every ID on every interface,
+# e.g. to compare a cyclic ID sent with --udp-bcm-offload to the
+# original one.
+#
+
+def parse_candump(path):
+    arrivals = {}
+    with open(path, newline='') as f:
+        reader = csv.reader(f, delimiter=' ')
+        for row in reader:
+            if len(row) < 3:
+                continue
+            canId = int(row[2].split('#')[0], 16)
+            key = (row[1], canId)
+            if not key in arrivals:
+                arrivals[key] = []
+            arrivals[key].append(float(row[0][1:][:-1]))
+    return arrivals
+
+
+def main():
+    dump = parse_candump(sys.argv[1])
+    for (bus, canId), times in sorted(dump.items()):
+        if len(times) < 3:
+            continue
+        intervals = [b - a for a, b in zip(times, times[1:])]
+        mean = statistics.mean(intervals)
+        stdev = statistics.stdev(intervals)
+        worst = max(abs(i - mean) for i in intervals)
+        print("{} 0x{:x}: Frames: {} Cycle: {:.3f} Jitter: {:.3f} stdev {:.3f} max [ms]".format(
+            bus, canId, len(times), mean * 1000, stdev * 1000, worst * 1000))
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+#
+# This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+#
+# Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License, version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+#
+
+import argparse
+import random
+import select
+import socket
+
+# Usage:
+#
+# ./lossy_link.py --loss 0.05
+#
+# Forwards UDP packets between two cannelloni instances on one host and
+# drops packets at random. Instance A sends to port 20001 and listens
+# on port 20000, instance B sends to port 20003 and listens on port
+# 20002:
+#
+# # cannelloni -I vcan0 -l 20000 -r 20001 -R 127.0.0.1 -p --udp-fec 8,2
+# # cannelloni -I vcan1 -l 20002 -r 20003 -R 127.0.0.1 -p --udp-fec 8,2
+# # candump -l vcan0 vcan1
+# # cangen -I i -g 1 -n 10000 vcan0
+#
+# Then compare the delivery ratio and latency reported by
+#
+# # ./candump_compare.py candump-*.log
+#
+# with a run without --udp-fec (or with --udp-reliable-ids). Loss,
+# reordering and the ports are configurable, see --help.
+#
+
+def main():
+    parser = argparse.ArgumentParser(description="lossy UDP link between two cannelloni instances")
+    parser.add_argument("--loss", type=float, default=0.05, help="probability a packet is dropped")
+    parser.add_argument("--reorder", type=float, default=0.0,
+                        help="probability a packet is held back behind the next one")
+    parser.add_argument("--a", type=int, nargs=2, default=[20000, 20001], metavar=("LISTEN", "REMOTE"),
+                        help="ports of instance A")
+    parser.add_argument("--b", type=int, nargs=2, default=[20002, 20003], metavar=("LISTEN", "REMOTE"),
+                        help="ports of instance B")
+    parser.add_argument("--seed", type=int, default=None)
+    args = parser.parse_args()
+
+    random.seed(args.seed)
+    # Packets of A arrive on A's remote port and leave towards B and vice versa
+    fromA = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    fromA.bind(("127.0.0.1", args.a[1]))
+    fromB = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    fromB.bind(("127.0.0.1", args.b[1]))
+    routes = {fromA: (fromB, ("127.0.0.1", args.b[0])),
+              fromB: (fromA, ("127.0.0.1", args.a[0]))}
+    held = {fromA: None, fromB: None}
+    forwarded = 0
+    dropped = 0
+
+    try:
+        while True:
+            readable, _, _ = select.select(list(routes), [], [])
+            for sock in readable:
+                data, _ = sock.recvfrom(65535)
+                out, dst = routes[sock]
+                if random.random() < args.loss:
+                    dropped += 1
+                    continue
+                if held[sock] is None and random.random() < args.reorder:
+                    held[sock] = data
+                    continue
+                out.sendto(data, dst)
+                forwarded += 1
+                if held[sock] is not None:
+                    out.sendto(held[sock], dst)
+                    held[sock] = None
+                    forwarded += 1
+    except KeyboardInterrupt:
+        pass
+    print("Forwarded: {} Dropped: {} ({:.2f}%)".format(
+        forwarded, dropped, 100.0 * dropped / max(forwarded + dropped, 1)))
+
+if __name__ == "__main__":
+    main()
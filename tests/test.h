@@ -0,0 +1,80 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+ * A minimal test harness without dependencies. TEST(suite, name) registers
+ * a test, CHECK and CHECK_EQUAL record a failure and continue. The runner
+ * runs all tests or those of the suites given on the command line.
+ */
+
+namespace cannelloni {
+namespace test {
+
+struct TestCase {
+  std::string suite;
+  std::string name;
+  std::function<void()> run;
+};
+
+std::vector<TestCase>& registry();
+/* Failures of the running test */
+int& failures();
+
+struct Registrar {
+  Registrar(const char *suite, const char *name, std::function<void()> run) {
+    registry().push_back(TestCase{suite, name, run});
+  }
+};
+
+template <typename A, typename B>
+void checkEqual(const A &actual, const B &expected, const char *actualText, const char *expectedText,
+                const char *file, int line) {
+  if (actual == expected)
+    return;
+  failures()++;
+  std::cout << file << ":" << line << ": CHECK_EQUAL(" << actualText << ", " << expectedText
+            << ") failed: " << actual << " != " << expected << std::endl;
+}
+
+}
+}
+
+#define TEST(suite, name) \
+  static void test_##suite##_##name(); \
+  static cannelloni::test::Registrar registrar_##suite##_##name(#suite, #name, test_##suite##_##name); \
+  static void test_##suite##_##name()
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      cannelloni::test::failures()++; \
+      std::cout << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed" << std::endl; \
+    } \
+  } while (0)
+
+#define CHECK_EQUAL(actual, expected) \
+  cannelloni::test::checkEqual((actual), (expected), #actual, #expected, __FILE__, __LINE__)
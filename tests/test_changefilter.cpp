@@ -0,0 +1,183 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "changefilter.h"
+#include "ratelimit.h"
+#include "test.h"
+
+using namespace cannelloni;
+using std::chrono::microseconds;
+
+static canfd_frame makeFrame(canid_t can_id, uint8_t value) {
+  canfd_frame frame = {};
+  frame.can_id = can_id;
+  frame.len = 8;
+  frame.data[0] = value;
+  return frame;
+}
+
+static ChangeFilterConfig changeConfig(const char *ids, uint64_t refreshInterval) {
+  ChangeFilterConfig config = { /* ids */ IdSet(), /* refreshInterval */ refreshInterval, /* masks */ {} };
+  config.ids.parse(ids);
+  return config;
+}
+
+/* The order of CANThread: a frame is committed once the rate limiter let it through */
+static bool forward(ChangeFilter &filter, RateLimiter &limiter, const canfd_frame &frame,
+                    std::chrono::steady_clock::time_point now) {
+  if (!filter.pass(&frame, now))
+    return false;
+  if (limiter.admit(&frame, now) == RateLimiter::RATE_DROP)
+    return false;
+  filter.commit(&frame, now);
+  return true;
+}
+
+TEST(changefilter, suppresses_unchanged) {
+  ChangeFilter filter;
+  ChangeFilterConfig config = changeConfig("0x100", 100000);
+  std::array<uint8_t, CANFD_MAX_DLEN> mask;
+  mask.fill(0xff);
+  /* The last byte is a counter */
+  mask[7] = 0;
+  config.masks[0x100] = mask;
+  filter.setup(config);
+  auto now = std::chrono::steady_clock::now();
+  canfd_frame frame = makeFrame(0x100, 1);
+  canfd_frame other = makeFrame(0x101, 1);
+  CHECK(filter.pass(&frame, now));
+  filter.commit(&frame, now);
+  CHECK(!filter.pass(&frame, now));
+  frame.data[7] = 1;
+  CHECK(!filter.pass(&frame, now));
+  /* Other IDs, other payloads and other lengths pass */
+  CHECK(filter.pass(&other, now));
+  CHECK(filter.pass(&other, now));
+  frame.data[0] = 2;
+  CHECK(filter.pass(&frame, now));
+  frame.data[0] = 1;
+  frame.len = 7;
+  CHECK(filter.pass(&frame, now));
+  frame.len = 8;
+  /* Unchanged frames are sent again after the refresh interval */
+  CHECK(filter.pass(&frame, now + microseconds(100000)));
+  CHECK_EQUAL(filter.getPassedCount(), 1u);
+  CHECK_EQUAL(filter.getSuppressedCount(), 2u);
+}
+
+TEST(changefilter, uncommitted_frames_are_not_remembered) {
+  ChangeFilter filter;
+  filter.setup(changeConfig("0x100", 0));
+  auto now = std::chrono::steady_clock::now();
+  canfd_frame first = makeFrame(0x100, 1);
+  canfd_frame second = makeFrame(0x100, 2);
+  CHECK(filter.pass(&first, now));
+  /* The first frame never reached the network */
+  CHECK(filter.pass(&first, now));
+  filter.commit(&first, now);
+  CHECK(filter.pass(&second, now));
+  /* Still compared against the first one */
+  CHECK(!filter.pass(&first, now));
+}
+
+TEST(changefilter, change_dropped_by_rate_limit_is_sent_later) {
+  ChangeFilter filter;
+  /* Without refresh, a lost change would never be sent */
+  filter.setup(changeConfig("0x100", 0));
+  RateLimiter limiter;
+  auto now = std::chrono::steady_clock::now();
+  limiter.setup({RateLimitRule{0x100, 0x100, 10, 1, RATE_LIMIT_DROP}}, now);
+  canfd_frame first = makeFrame(0x100, 1);
+  canfd_frame second = makeFrame(0x100, 2);
+  CHECK(forward(filter, limiter, first, now));
+  /* The bucket is empty, the change is dropped */
+  CHECK(!forward(filter, limiter, second, now + microseconds(1000)));
+  /* and passes the change filter again once there is a token */
+  CHECK(forward(filter, limiter, second, now + microseconds(100000)));
+  CHECK(!forward(filter, limiter, second, now + microseconds(200000)));
+}
+
+static std::vector<RegenerateConfig> regenerateConfig(const char *ids, uint64_t period, uint64_t timeout) {
+  RegenerateConfig config = { /* ids */ IdSet(), /* period */ period, /* timeout */ timeout };
+  config.ids.parse(ids);
+  return {config};
+}
+
+TEST(regenerate, repeats_last_frame) {
+  CyclicRegenerator regenerator;
+  regenerator.setup(regenerateConfig("0x100", 10000, 1000000));
+  auto now = std::chrono::steady_clock::now();
+  canfd_frame frame = makeFrame(0x100, 1);
+  regenerator.update(&frame, now);
+  /* Other IDs are not regenerated */
+  canfd_frame other = makeFrame(0x101, 1);
+  regenerator.update(&other, now);
+  std::vector<canfd_frame> frames;
+  regenerator.due(now + microseconds(9999), frames);
+  CHECK(frames.empty());
+  CHECK_EQUAL(regenerator.nextTimeout(now + microseconds(9999)), 2u);
+  regenerator.due(now + microseconds(10000), frames);
+  CHECK_EQUAL(frames.size(), 1u);
+  /* A new frame replaces the payload and starts a new period */
+  frame = makeFrame(0x100, 2);
+  regenerator.update(&frame, now + microseconds(15000));
+  frames.clear();
+  regenerator.due(now + microseconds(20000), frames);
+  CHECK(frames.empty());
+  regenerator.due(now + microseconds(25000), frames);
+  CHECK_EQUAL(frames.size(), 1u);
+  if (frames.size() == 1)
+    CHECK_EQUAL(frames[0].data[0], 2);
+  CHECK_EQUAL(regenerator.getRegeneratedCount(), 2u);
+}
+
+TEST(regenerate, stops_without_new_frames) {
+  CyclicRegenerator regenerator;
+  regenerator.setup(regenerateConfig("0x100-0x1ff", 10000, 35000));
+  auto now = std::chrono::steady_clock::now();
+  canfd_frame first = makeFrame(0x100, 1);
+  canfd_frame second = makeFrame(0x101, 1);
+  regenerator.update(&first, now);
+  regenerator.update(&second, now);
+  std::vector<canfd_frame> frames;
+  /* Only one of the IDs is still sent */
+  for (int i = 1; i <= 10; i++) {
+    if (i % 2 == 0)
+      regenerator.update(&second, now + microseconds(i * 10000 - 5000));
+    regenerator.due(now + microseconds(i * 10000), frames);
+  }
+  size_t firstCount = 0;
+  for (const canfd_frame &frame : frames) {
+    if (frame.can_id == 0x100)
+      firstCount++;
+  }
+  /* Repeated within the timeout, then dropped */
+  CHECK_EQUAL(firstCount, 3u);
+  CHECK_EQUAL(regenerator.getExpiredCount(), 1u);
+  /* Nothing is scheduled once the last ID timed out */
+  regenerator.due(now + microseconds(200000), frames);
+  CHECK_EQUAL(regenerator.getExpiredCount(), 2u);
+  CHECK_EQUAL(regenerator.nextTimeout(now + microseconds(200000)), 0u);
+  /* A new frame arms it again */
+  regenerator.update(&first, now + microseconds(300000));
+  frames.clear();
+  regenerator.due(now + microseconds(310000), frames);
+  CHECK_EQUAL(frames.size(), 1u);
+}
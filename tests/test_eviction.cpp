@@ -0,0 +1,141 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "framebuffer.h"
+#include "test.h"
+
+using namespace cannelloni;
+
+namespace {
+
+/* A frame is told apart from frames with the same ID by data[0] */
+struct Tagged {
+  canid_t can_id;
+  uint8_t tag;
+
+  bool operator==(const Tagged &other) const {
+    return can_id == other.can_id && tag == other.tag;
+  }
+};
+
+std::ostream& operator<<(std::ostream &out, const Tagged &frame) {
+  return out << std::hex << frame.can_id << std::dec << "/" << static_cast<int>(frame.tag);
+}
+
+/*
+ * Fills a FrameBuffer that has exactly as many frames as ids and
+ * returns the frames in the order the policy evicts them
+ */
+std::vector<Tagged> evictionOrder(const EvictionConfig &config, const std::vector<canid_t> &ids,
+                                  const std::vector<canid_t> &returned = {}) {
+  size_t size = ids.size() + returned.size();
+  FrameBuffer buffer(size, size);
+  buffer.setEvictionPolicy(config);
+  uint8_t tag = 0;
+  for (canid_t id : ids) {
+    canfd_frame *frame = buffer.requestFrame(false);
+    frame->can_id = id;
+    frame->len = 1;
+    frame->data[0] = tag++;
+    buffer.insertFrame(frame, false);
+  }
+  /* Frames put back in front, e.g. after a failed write */
+  for (canid_t id : returned) {
+    canfd_frame *frame = buffer.requestFrame(false);
+    frame->can_id = id;
+    frame->len = 1;
+    frame->data[0] = tag++;
+    buffer.returnFrame(frame);
+  }
+  std::vector<Tagged> order;
+  std::vector<canfd_frame*> evicted;
+  for (size_t i = 0; i < size; i++) {
+    canfd_frame *frame = buffer.requestFrame(true);
+    if (frame == NULL)
+      break;
+    /* The metadata is cleared, the frame itself is untouched */
+    order.push_back(Tagged{frame->can_id, frame->data[0]});
+    evicted.push_back(frame);
+  }
+  for (canfd_frame *frame : evicted)
+    buffer.insertFramePool(frame);
+  return order;
+}
+
+void checkOrder(const std::vector<Tagged> &actual, const std::vector<Tagged> &expected) {
+  CHECK_EQUAL(actual.size(), expected.size());
+  for (size_t i = 0; i < std::min(actual.size(), expected.size()); i++)
+    CHECK_EQUAL(actual[i], expected[i]);
+}
+
+}
+
+TEST(eviction, oldest) {
+  checkOrder(evictionOrder({EVICT_OLDEST, 0}, {0x300, 0x100, 0x200}),
+             {{0x300, 0}, {0x100, 1}, {0x200, 2}});
+  /* A returned frame is the oldest one */
+  checkOrder(evictionOrder({EVICT_OLDEST, 0}, {0x300, 0x100}, {0x200}),
+             {{0x200, 2}, {0x300, 0}, {0x100, 1}});
+}
+
+TEST(eviction, newest) {
+  checkOrder(evictionOrder({EVICT_NEWEST, 0}, {0x300, 0x100, 0x200}),
+             {{0x200, 2}, {0x100, 1}, {0x300, 0}});
+}
+
+TEST(eviction, priority) {
+  canid_t extended = CAN_EFF_FLAG | (0x100 << 18);
+  canid_t lowest = CAN_EFF_FLAG | CAN_EFF_MASK;
+  /*
+   * The ID that loses the arbitration goes first, the oldest frame of it
+   * first. An extended frame loses against a standard frame with its base ID.
+   */
+  checkOrder(evictionOrder({EVICT_PRIORITY, 0}, {0x100, 0x200, extended, 0x7ff, 0x200, lowest, 0x101}),
+             {{lowest, 5}, {0x7ff, 3}, {0x200, 1}, {0x200, 4}, {0x101, 6}, {extended, 2}, {0x100, 0}});
+  /* A returned frame is older than the buffered frames of its ID */
+  checkOrder(evictionOrder({EVICT_PRIORITY, 0}, {0x200, 0x100, 0x200}, {0x200}),
+             {{0x200, 3}, {0x200, 0}, {0x200, 2}, {0x100, 1}});
+}
+
+TEST(eviction, quota) {
+  /* 0x10 is above the quota of 2, then 0x20 ties it and the oldest frame goes */
+  checkOrder(evictionOrder({EVICT_QUOTA, 2}, {0x10, 0x20, 0x10, 0x10, 0x20, 0x30, 0x10}),
+             {{0x10, 0}, {0x10, 2}, {0x20, 1}, {0x10, 3}, {0x20, 4}, {0x30, 5}, {0x10, 6}});
+  /* Within the quota it behaves like EVICT_OLDEST */
+  checkOrder(evictionOrder({EVICT_QUOTA, 4}, {0x30, 0x10, 0x20}),
+             {{0x30, 0}, {0x10, 1}, {0x20, 2}});
+}
+
+TEST(eviction, drop_counts) {
+  FrameBuffer buffer(2, 2);
+  buffer.setEvictionPolicy({EVICT_NEWEST, 0});
+  for (canid_t id : {0x100u, 0x200u}) {
+    canfd_frame *frame = buffer.requestFrame(false);
+    frame->can_id = id;
+    frame->len = 0;
+    buffer.insertFrame(frame, false);
+  }
+  canfd_frame *frame = buffer.requestFrame(true);
+  CHECK(frame != NULL);
+  CHECK(buffer.requestFrame(false) == NULL);
+  buffer.insertFramePool(frame);
+  CHECK_EQUAL(buffer.getDropCounts()[0x200], 1u);
+  CHECK_EQUAL(buffer.getDropCounts().size(), 1u);
+}
@@ -0,0 +1,191 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <algorithm>
+#include <random>
+
+#include "fec.h"
+#include "test.h"
+
+using namespace cannelloni;
+
+namespace {
+
+struct Packet {
+  uint32_t seq;
+  uint8_t flags;
+  std::vector<uint8_t> data;
+};
+
+/* Packets of different lengths, so padding is covered */
+std::vector<Packet> makePackets(uint32_t base, uint8_t k, std::mt19937 &random) {
+  std::vector<Packet> packets;
+  for (uint8_t i = 0; i < k; i++) {
+    Packet packet{base + i, static_cast<uint8_t>(random() & 0xff), std::vector<uint8_t>(random() % 200)};
+    for (uint8_t &byte : packet.data)
+      byte = random() & 0xff;
+    packets.push_back(packet);
+  }
+  return packets;
+}
+
+/*
+ * Sends the group through an encoder and a decoder, lost has a bit for each
+ * of the k data and m parity packets. Returns false if the recovered packets
+ * differ from the lost data packets.
+ */
+bool transfer(const std::vector<Packet> &packets, uint8_t m, uint64_t lost, FecDecoder &decoder) {
+  uint8_t k = packets.size();
+  FecEncoder encoder;
+  encoder.setup(k, m);
+  bool complete = false;
+  for (const Packet &packet : packets)
+    complete = encoder.add(packet.seq, packet.flags, packet.data.data(), packet.data.size());
+  if (!complete || encoder.groupBase() != packets[0].seq)
+    return false;
+  std::vector<std::vector<uint8_t>> parity;
+  encoder.finish(parity);
+  if (parity.size() != m)
+    return false;
+
+  for (uint8_t i = 0; i < k; i++) {
+    if (!(lost & 1ULL << i))
+      decoder.addData(packets[i].seq, packets[i].flags, packets[i].data.data(), packets[i].data.size());
+  }
+  std::vector<FecRecoveredPacket> recovered;
+  for (uint8_t j = 0; j < m; j++) {
+    if (!(lost & 1ULL << (k + j)))
+      decoder.addParity(packets[0].seq, k, m, j, parity[j].data(), parity[j].size(), recovered);
+  }
+
+  size_t lostData = 0;
+  for (uint8_t i = 0; i < k; i++) {
+    if (!(lost & 1ULL << i))
+      continue;
+    lostData++;
+    bool found = false;
+    for (const FecRecoveredPacket &packet : recovered) {
+      if (packet.seq == packets[i].seq)
+        found = packet.flags == packets[i].flags && packet.data == packets[i].data;
+    }
+    if (!found)
+      return false;
+  }
+  return recovered.size() == lostData;
+}
+
+}
+
+TEST(fec, every_loss_pattern_up_to_parity_count) {
+  std::mt19937 random(1);
+  const std::pair<uint8_t, uint8_t> setups[] = {{1, 1}, {2, 1}, {4, 2}, {5, 3}, {8, 4}, {6, 6}};
+  for (const auto &setup : setups) {
+    uint8_t k = setup.first;
+    uint8_t m = setup.second;
+    uint64_t patterns = 0;
+    uint64_t failed = 0;
+    for (uint64_t lost = 0; lost < 1ULL << (k + m); lost++) {
+      if (__builtin_popcountll(lost) > m)
+        continue;
+      FecDecoder decoder;
+      std::vector<Packet> packets = makePackets(1000, k, random);
+      patterns++;
+      if (!transfer(packets, m, lost, decoder))
+        failed++;
+    }
+    CHECK(patterns > 0);
+    CHECK_EQUAL(failed, 0u);
+  }
+}
+
+TEST(fec, largest_group) {
+  std::mt19937 random(2);
+  uint8_t k = FEC_MAX_DATA_PACKETS;
+  uint8_t m = FEC_MAX_PARITY_PACKETS;
+  for (int round = 0; round < 50; round++) {
+    /* m losses spread over data and parity packets */
+    std::vector<uint8_t> order(k + m);
+    for (size_t i = 0; i < order.size(); i++)
+      order[i] = i;
+    std::shuffle(order.begin(), order.end(), random);
+    uint64_t lostData = 0;
+    uint64_t lostParity = 0;
+    for (uint8_t i = 0; i < m; i++) {
+      if (order[i] < k)
+        lostData |= 1ULL << order[i];
+      else
+        lostParity |= 1ULL << (order[i] - k);
+    }
+    /* The pattern does not fit into one mask, so parity losses are handled here */
+    std::vector<Packet> packets = makePackets(5000, k, random);
+    FecEncoder encoder;
+    encoder.setup(k, m);
+    for (const Packet &packet : packets)
+      encoder.add(packet.seq, packet.flags, packet.data.data(), packet.data.size());
+    std::vector<std::vector<uint8_t>> parity;
+    encoder.finish(parity);
+    FecDecoder decoder;
+    for (uint8_t i = 0; i < k; i++) {
+      if (!(lostData & 1ULL << i))
+        decoder.addData(packets[i].seq, packets[i].flags, packets[i].data.data(), packets[i].data.size());
+    }
+    std::vector<FecRecoveredPacket> recovered;
+    for (uint8_t j = 0; j < m; j++) {
+      if (!(lostParity & 1ULL << j))
+        decoder.addParity(5000, k, m, j, parity[j].data(), parity[j].size(), recovered);
+    }
+    CHECK_EQUAL(recovered.size(), static_cast<size_t>(__builtin_popcountll(lostData)));
+    for (const FecRecoveredPacket &packet : recovered)
+      CHECK(packet.data == packets[packet.seq - 5000].data);
+    CHECK_EQUAL(decoder.getUnrecoverableCount(), 0u);
+  }
+}
+
+TEST(fec, sequence_wraparound) {
+  std::mt19937 random(3);
+  /* The group spans the wrap of the sequence numbers */
+  std::vector<Packet> packets = makePackets(0xfffffffe, 4, random);
+  CHECK_EQUAL(packets[2].seq, 0u);
+  FecDecoder decoder;
+  CHECK(transfer(packets, 2, 0b0101, decoder));
+  CHECK_EQUAL(decoder.getRecoveredCount(), 2u);
+}
+
+TEST(fec, more_losses_than_parity) {
+  std::mt19937 random(4);
+  std::vector<Packet> packets = makePackets(1, 6, random);
+  FecDecoder decoder;
+  /* Three data packets lost, two parity packets received */
+  CHECK(!transfer(packets, 2, 0b100101, decoder));
+  CHECK_EQUAL(decoder.getRecoveredCount(), 0u);
+  CHECK_EQUAL(decoder.getUnrecoverableCount(), 3u);
+}
+
+TEST(fec, group_restarts_on_gap) {
+  FecEncoder encoder;
+  encoder.setup(4, 1);
+  uint8_t data[4] = {1, 2, 3, 4};
+  encoder.add(10, 0, data, sizeof(data));
+  encoder.add(11, 0, data, sizeof(data));
+  /* Groups only consist of consecutive packets */
+  CHECK(!encoder.add(13, 0, data, sizeof(data)));
+  CHECK_EQUAL(encoder.groupBase(), 13u);
+  CHECK_EQUAL(static_cast<int>(encoder.pending()), 1);
+}
@@ -0,0 +1,57 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <algorithm>
+
+#include "test.h"
+
+using namespace cannelloni::test;
+
+std::vector<TestCase>& cannelloni::test::registry() {
+  static std::vector<TestCase> tests;
+  return tests;
+}
+
+int& cannelloni::test::failures() {
+  static int count = 0;
+  return count;
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> suites(argv + 1, argv + argc);
+  size_t run = 0;
+  size_t failed = 0;
+  for (const TestCase &test : registry()) {
+    if (!suites.empty() && std::find(suites.begin(), suites.end(), test.suite) == suites.end())
+      continue;
+    failures() = 0;
+    test.run();
+    run++;
+    if (failures()) {
+      failed++;
+      std::cout << "FAIL " << test.suite << "." << test.name << std::endl;
+    } else {
+      std::cout << "ok   " << test.suite << "." << test.name << std::endl;
+    }
+  }
+  std::cout << run - failed << "/" << run << " tests passed" << std::endl;
+  /* A suite without tests is a typo on the command line */
+  return failed || run == 0 ? 1 : 0;
+}
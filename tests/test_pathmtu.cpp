@@ -0,0 +1,149 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "pathmtu.h"
+#include "test.h"
+
+using namespace cannelloni;
+using std::chrono::microseconds;
+
+/*
+ * Runs a search over a path that drops packets above pathMtu, lossy also
+ * drops the first probe of each size. Returns the time the search ended.
+ */
+static std::chrono::steady_clock::time_point search(PathMtuDiscovery &pmtu, uint32_t pathMtu,
+                                                    std::chrono::steady_clock::time_point now,
+                                                    bool lossy = false) {
+  uint32_t lastSize = 0;
+  for (int i = 0; i < 1000; i++) {
+    uint32_t size = pmtu.nextProbe(now);
+    if (size == 0) {
+      /* Idle until the next search */
+      if (pmtu.nextTimeout(now) > PMTU_PROBE_TIMEOUT + 1)
+        break;
+      now += microseconds(pmtu.nextTimeout(now));
+      continue;
+    }
+    bool retry = size == lastSize;
+    lastSize = size;
+    if (size <= pathMtu && (!lossy || retry))
+      pmtu.onProbeAck(size, now + microseconds(1000));
+    now += microseconds(PMTU_PROBE_TIMEOUT);
+  }
+  return now;
+}
+
+TEST(pathmtu, disabled) {
+  PathMtuDiscovery pmtu;
+  pmtu.setup(0);
+  auto now = std::chrono::steady_clock::now();
+  CHECK(!pmtu.isEnabled());
+  CHECK_EQUAL(pmtu.nextProbe(now), 0u);
+  CHECK_EQUAL(pmtu.nextTimeout(now), 0u);
+}
+
+TEST(pathmtu, converges) {
+  for (bool lossy : {false, true}) {
+    for (uint32_t path = PMTU_BASE_MTU; path <= 9100; path += 37) {
+      PathMtuDiscovery pmtu;
+      pmtu.setup(9000);
+      CHECK_EQUAL(pmtu.getMtu(), static_cast<uint32_t>(PMTU_BASE_MTU));
+      search(pmtu, path, std::chrono::steady_clock::now(), lossy);
+      uint32_t mtu = pmtu.getMtu();
+      if (path >= 9000) {
+        CHECK_EQUAL(mtu, 9000u);
+      } else {
+        CHECK(mtu <= path);
+        CHECK(path - mtu < PMTU_SEARCH_PRECISION);
+      }
+      CHECK_EQUAL(pmtu.getLoweredCount(), 0u);
+    }
+  }
+}
+
+TEST(pathmtu, limit_first) {
+  PathMtuDiscovery pmtu;
+  pmtu.setup(1500);
+  auto now = std::chrono::steady_clock::now();
+  CHECK_EQUAL(pmtu.nextProbe(now), 1500u);
+  /* Nothing is sent while the probe is in flight */
+  CHECK_EQUAL(pmtu.nextProbe(now + microseconds(1000)), 0u);
+  /* Answers to other sizes are ignored */
+  CHECK(!pmtu.onProbeAck(1400, now + microseconds(1000)));
+  CHECK(pmtu.onProbeAck(1500, now + microseconds(1000)));
+  CHECK_EQUAL(pmtu.getMtu(), 1500u);
+  CHECK_EQUAL(pmtu.getProbeCount(), 1u);
+  CHECK_EQUAL(pmtu.nextProbe(now + microseconds(2000)), 0u);
+  CHECK(pmtu.nextTimeout(now + microseconds(2000)) > PMTU_SEARCH_INTERVAL - 2000);
+}
+
+TEST(pathmtu, black_hole) {
+  PathMtuDiscovery pmtu;
+  pmtu.setup(9000);
+  auto now = search(pmtu, 9000, std::chrono::steady_clock::now());
+  CHECK_EQUAL(pmtu.getMtu(), 9000u);
+  /* The next search confirms the MTU first, its failure falls back to the base */
+  now += microseconds(PMTU_SEARCH_INTERVAL);
+  CHECK_EQUAL(pmtu.nextProbe(now), 9000u);
+  for (int i = 1; i < PMTU_MAX_PROBES; i++) {
+    now += microseconds(PMTU_PROBE_TIMEOUT);
+    CHECK_EQUAL(pmtu.nextProbe(now), 9000u);
+  }
+  now += microseconds(PMTU_PROBE_TIMEOUT);
+  uint32_t size = pmtu.nextProbe(now);
+  CHECK_EQUAL(pmtu.getMtu(), static_cast<uint32_t>(PMTU_BASE_MTU));
+  CHECK_EQUAL(pmtu.getLoweredCount(), 1u);
+  CHECK_EQUAL(size, 9000u);
+  /* The search continues right away */
+  search(pmtu, 1400, now + microseconds(PMTU_PROBE_TIMEOUT));
+  CHECK(pmtu.getMtu() <= 1400u && 1400u - pmtu.getMtu() < PMTU_SEARCH_PRECISION);
+  CHECK_EQUAL(pmtu.getLoweredCount(), 1u);
+}
+
+TEST(pathmtu, kernel_mtu) {
+  PathMtuDiscovery pmtu;
+  pmtu.setup(9000);
+  auto now = search(pmtu, 9000, std::chrono::steady_clock::now());
+  CHECK(pmtu.onKernelMtu(1500, now));
+  CHECK_EQUAL(pmtu.getMtu(), 1500u);
+  CHECK(!pmtu.onKernelMtu(1500, now));
+  /* Never below the minimum */
+  CHECK(pmtu.onKernelMtu(100, now));
+  CHECK_EQUAL(pmtu.getMtu(), static_cast<uint32_t>(PMTU_MIN_MTU));
+  CHECK_EQUAL(pmtu.getLoweredCount(), 2u);
+  /* A higher limit is only taken after a probe */
+  CHECK(!pmtu.onKernelMtu(9000, now));
+  CHECK_EQUAL(pmtu.getMtu(), static_cast<uint32_t>(PMTU_MIN_MTU));
+  search(pmtu, 9000, now + microseconds(PMTU_SEARCH_INTERVAL));
+  CHECK_EQUAL(pmtu.getMtu(), 9000u);
+}
+
+TEST(pathmtu, kernel_mtu_during_search) {
+  PathMtuDiscovery pmtu;
+  pmtu.setup(9000);
+  auto now = std::chrono::steady_clock::now();
+  CHECK_EQUAL(pmtu.nextProbe(now), 9000u);
+  /* The probe in flight can't be sent, the limit is probed instead */
+  CHECK(!pmtu.onKernelMtu(1500, now));
+  CHECK_EQUAL(pmtu.nextProbe(now), 1500u);
+  CHECK(!pmtu.onProbeAck(9000, now));
+  CHECK(pmtu.onProbeAck(1500, now));
+  CHECK_EQUAL(pmtu.getMtu(), 1500u);
+}
@@ -0,0 +1,179 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <unistd.h>
+
+#include "ratelimit.h"
+#include "test.h"
+
+using namespace cannelloni;
+using std::chrono::microseconds;
+
+static canfd_frame makeFrame(canid_t can_id, uint8_t tag) {
+  canfd_frame frame = {};
+  frame.can_id = can_id;
+  frame.len = 1;
+  frame.data[0] = tag;
+  return frame;
+}
+
+static RateLimitRule makeRule(uint32_t low, uint32_t high, uint64_t rate, uint64_t burst,
+                              RateLimitAction action) {
+  return RateLimitRule{low, high, rate, burst, action};
+}
+
+TEST(ratelimit, burst_then_drop) {
+  RateLimiter limiter;
+  auto now = std::chrono::steady_clock::now();
+  limiter.setup({makeRule(0x100, 0x100, 100, 3, RATE_LIMIT_DROP)}, now);
+  CHECK(limiter.isEnabled());
+  canfd_frame frame = makeFrame(0x100, 0);
+  /* The bucket starts full */
+  for (int i = 0; i < 3; i++)
+    CHECK_EQUAL(limiter.admit(&frame, now), RateLimiter::RATE_PASS);
+  CHECK_EQUAL(limiter.admit(&frame, now), RateLimiter::RATE_DROP);
+  /* One token every 10 ms at 100 frames per second */
+  CHECK_EQUAL(limiter.admit(&frame, now + microseconds(9999)), RateLimiter::RATE_DROP);
+  CHECK_EQUAL(limiter.admit(&frame, now + microseconds(10000)), RateLimiter::RATE_PASS);
+  CHECK_EQUAL(limiter.admit(&frame, now + microseconds(10000)), RateLimiter::RATE_DROP);
+  /* Never more than the burst after a long pause */
+  now += std::chrono::seconds(10);
+  for (int i = 0; i < 3; i++)
+    CHECK_EQUAL(limiter.admit(&frame, now), RateLimiter::RATE_PASS);
+  CHECK_EQUAL(limiter.admit(&frame, now), RateLimiter::RATE_DROP);
+  /* IDs without a rule and error frames always pass */
+  canfd_frame other = makeFrame(0x101, 0);
+  canfd_frame error = makeFrame(CAN_ERR_FLAG | 0x100, 0);
+  CHECK_EQUAL(limiter.admit(&other, now), RateLimiter::RATE_PASS);
+  CHECK_EQUAL(limiter.admit(&error, now), RateLimiter::RATE_PASS);
+}
+
+TEST(ratelimit, first_rule_wins) {
+  RateLimiter limiter;
+  auto now = std::chrono::steady_clock::now();
+  limiter.setup({makeRule(0x10, 0x10, 1, 1, RATE_LIMIT_DROP),
+                 makeRule(0x0, 0x7ff, 1, 2, RATE_LIMIT_DROP)}, now);
+  canfd_frame first = makeFrame(0x10, 0);
+  canfd_frame second = makeFrame(0x11, 0);
+  CHECK_EQUAL(limiter.admit(&first, now), RateLimiter::RATE_PASS);
+  CHECK_EQUAL(limiter.admit(&first, now), RateLimiter::RATE_DROP);
+  /* The IDs of a rule share its bucket */
+  canfd_frame third = makeFrame(0x7ff, 0);
+  CHECK_EQUAL(limiter.admit(&second, now), RateLimiter::RATE_PASS);
+  CHECK_EQUAL(limiter.admit(&third, now), RateLimiter::RATE_PASS);
+  CHECK_EQUAL(limiter.admit(&second, now), RateLimiter::RATE_DROP);
+}
+
+TEST(ratelimit, extended_ids) {
+  RateLimiter limiter;
+  auto now = std::chrono::steady_clock::now();
+  limiter.setup({makeRule(0x100, 0x100, 1, 1, RATE_LIMIT_DROP),
+                 makeRule(0x700, 0x1000, 1, 1, RATE_LIMIT_DROP),
+                 makeRule(0x18000000, 0x18ffffff, 1, 1, RATE_LIMIT_DROP)}, now);
+  /* Rules match the ID without flags, in and beyond the table */
+  canfd_frame low = makeFrame(CAN_EFF_FLAG | 0x100, 0);
+  canfd_frame across = makeFrame(CAN_EFF_FLAG | 0x900, 0);
+  canfd_frame high = makeFrame(CAN_EFF_FLAG | 0x18fe0001, 0);
+  canfd_frame outside = makeFrame(CAN_EFF_FLAG | 0x19000000, 0);
+  for (canfd_frame *frame : {&low, &across, &high}) {
+    CHECK_EQUAL(limiter.admit(frame, now), RateLimiter::RATE_PASS);
+    CHECK_EQUAL(limiter.admit(frame, now), RateLimiter::RATE_DROP);
+  }
+  canfd_frame standard = makeFrame(0x701, 0);
+  CHECK_EQUAL(limiter.admit(&standard, now), RateLimiter::RATE_DROP);
+  CHECK_EQUAL(limiter.admit(&outside, now), RateLimiter::RATE_PASS);
+  CHECK_EQUAL(limiter.admit(&outside, now), RateLimiter::RATE_PASS);
+}
+
+TEST(ratelimit, coalesce) {
+  RateLimiter limiter;
+  auto now = std::chrono::steady_clock::now();
+  limiter.setup({makeRule(0x100, 0x1ff, 1000, 1, RATE_LIMIT_COALESCE)}, now);
+  canfd_frame frame = makeFrame(0x180, 1);
+  CHECK_EQUAL(limiter.admit(&frame, now), RateLimiter::RATE_PASS);
+  CHECK_EQUAL(limiter.nextTimeout(now), 0u);
+  frame = makeFrame(0x180, 2);
+  CHECK_EQUAL(limiter.admit(&frame, now), RateLimiter::RATE_HOLD);
+  frame = makeFrame(0x120, 3);
+  CHECK_EQUAL(limiter.admit(&frame, now), RateLimiter::RATE_HOLD);
+  /* The newer frame replaces the held one, even with a token available */
+  frame = makeFrame(0x180, 4);
+  CHECK_EQUAL(limiter.admit(&frame, now + microseconds(1000)), RateLimiter::RATE_HOLD);
+  std::vector<canfd_frame> frames;
+  limiter.due(now + microseconds(500), frames);
+  CHECK(frames.empty());
+  /* One token per ms, rounded up by one us */
+  CHECK_EQUAL(limiter.nextTimeout(now + microseconds(500)), 501u);
+  /* Lower IDs first, one per token as the burst is a single frame */
+  limiter.due(now + microseconds(2000), frames);
+  CHECK_EQUAL(frames.size(), 1u);
+  CHECK_EQUAL(limiter.nextTimeout(now + microseconds(2000)), 1001u);
+  limiter.due(now + microseconds(3000), frames);
+  CHECK_EQUAL(frames.size(), 2u);
+  if (frames.size() == 2) {
+    CHECK_EQUAL(frames[0].can_id, 0x120u);
+    CHECK_EQUAL(frames[0].data[0], 3);
+    CHECK_EQUAL(frames[1].can_id, 0x180u);
+    CHECK_EQUAL(frames[1].data[0], 4);
+  }
+  CHECK_EQUAL(limiter.nextTimeout(now + microseconds(3000)), 0u);
+  CHECK(limiter.summary(now + std::chrono::seconds(1)).find("Coalesced: 1") != std::string::npos);
+}
+
+TEST(ratelimit, load_rules) {
+  char path[] = "/tmp/cannelloni-ratelimit-XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  if (fd < 0)
+    return;
+  close(fd);
+  {
+    std::ofstream file(path);
+    file << "# comment\n\n0x100,100\n0x200-0x2ff, 50, 5, coalesce\n0x18000000-0x18ffffff,10,1,drop\n";
+  }
+  std::vector<RateLimitRule> rules;
+  CHECK(loadRateLimits(path, rules));
+  CHECK_EQUAL(rules.size(), 3u);
+  if (rules.size() == 3) {
+    CHECK_EQUAL(rules[0].low, 0x100u);
+    CHECK_EQUAL(rules[0].high, 0x100u);
+    /* A tenth of the rate */
+    CHECK_EQUAL(rules[0].burst, 10u);
+    CHECK_EQUAL(rules[0].action, RATE_LIMIT_DROP);
+    CHECK_EQUAL(rules[1].high, 0x2ffu);
+    CHECK_EQUAL(rules[1].rate, 50u);
+    CHECK_EQUAL(rules[1].burst, 5u);
+    CHECK_EQUAL(rules[1].action, RATE_LIMIT_COALESCE);
+    CHECK_EQUAL(rules[2].low, 0x18000000u);
+  }
+  for (const char *invalid : {"0x100\n", "0x200-0x100,10\n", "0x100,0\n", "0x100,10,1,queue\n",
+                              "0x100,10,1,drop,1\n", "0x20000000,10\n", "# only comments\n"}) {
+    std::ofstream(path) << invalid;
+    std::vector<RateLimitRule> previous = rules;
+    CHECK(!loadRateLimits(path, rules));
+    /* The rules are only replaced on success */
+    CHECK_EQUAL(rules.size(), previous.size());
+  }
+  unlink(path);
+  CHECK(!loadRateLimits(path, rules));
+}
@@ -0,0 +1,152 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <unistd.h>
+
+#include "recorder.h"
+#include "test.h"
+
+using namespace cannelloni;
+
+#define TEST_FRAMES 40000
+
+static canfd_frame makeFrame(uint32_t i) {
+  canfd_frame frame = {};
+  if (i % 5000 == 0)
+    frame.can_id = 0x7ff;
+  else if (i % 3 == 0)
+    frame.can_id = CAN_EFF_FLAG | (0x18fe0000 + i % 5);
+  else
+    frame.can_id = 0x100 + i % 16;
+  frame.len = 8;
+  memcpy(frame.data, &i, sizeof(i));
+  return frame;
+}
+
+/* The frames of a segment that match, read one by one without the index */
+static std::vector<uint32_t> scan(const RecordingReader &reader, uint64_t from, uint64_t to, const IdSet &ids) {
+  std::vector<uint32_t> frames;
+  for (uint64_t i = 0; i < reader.header().count; i++) {
+    const RecordedFrame *frame = reader.record(i);
+    if (frame->time < from || frame->time > to || (!ids.empty() && !ids.contains(frame->can_id)))
+      continue;
+    uint32_t number;
+    memcpy(&number, frame->data, sizeof(number));
+    frames.push_back(number);
+  }
+  return frames;
+}
+
+static std::vector<uint32_t> query(const RecordingReader &reader, uint64_t from, uint64_t to, const IdSet &ids) {
+  std::vector<uint32_t> frames;
+  uint64_t count = reader.query(from, to, ids, [&frames](const RecordedFrame &frame) {
+    uint32_t number;
+    memcpy(&number, frame.data, sizeof(number));
+    frames.push_back(number);
+  });
+  CHECK_EQUAL(count, frames.size());
+  return frames;
+}
+
+/* Compares the indexed query to a scan for some time windows and ID lists */
+static void compareQueries(const RecordingReader &reader, const std::vector<uint64_t> &times) {
+  for (const char *list : {"", "0x7ff", "0x100-0x103", "0x18fe0001-0x18fe0003", "0x105,0x7ff"}) {
+    IdSet ids;
+    CHECK(ids.parse(list) || *list == '\0');
+    for (size_t i = 0; i + 1 < times.size(); i++) {
+      for (size_t j = i + 1; j < times.size(); j += 3) {
+        std::vector<uint32_t> expected = scan(reader, times[i], times[j], ids);
+        CHECK(query(reader, times[i], times[j], ids) == expected);
+      }
+    }
+  }
+}
+
+TEST(recorder, indexed_query) {
+  char directory[] = "/tmp/cannelloni-recorder-XXXXXX";
+  CHECK(mkdtemp(directory) != NULL);
+  RecorderConfig config;
+  config.directory = directory;
+  /* About ten blocks per segment */
+  config.segmentSize = RECORD_HEADER_SIZE + 10 * RECORD_BLOCK_SIZE * (sizeof(RecordedFrame) + 32);
+  Recorder recorder(config, "test");
+  RecordQueue *queue = recorder.addQueue();
+  CHECK_EQUAL(recorder.start(), 0);
+  /* Spread the frames over some time so the blocks have different times */
+  for (uint32_t i = 0; i < TEST_FRAMES; i++) {
+    canfd_frame frame = makeFrame(i);
+    queue->push(&frame, i % 2 ? RECORD_NETWORK_TO_CAN : RECORD_CAN_TO_NETWORK);
+    if (i % 500 == 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  recorder.stop();
+  recorder.join();
+  CHECK_EQUAL(recorder.getRecordedCount(), static_cast<uint64_t>(TEST_FRAMES));
+  CHECK_EQUAL(recorder.getDroppedCount(), 0u);
+  CHECK(recorder.getSegmentCount() > 2);
+
+  std::vector<std::string> paths = listRecordings(directory);
+  CHECK_EQUAL(paths.size(), recorder.getSegmentCount());
+  uint64_t total = 0;
+  uint32_t next = 0;
+  for (const std::string &path : paths) {
+    RecordingReader reader;
+    CHECK(reader.open(path));
+    CHECK(reader.header().complete);
+    uint64_t count = reader.header().count;
+    total += count;
+    /* The frames are recorded in order */
+    std::vector<uint32_t> all = query(reader, 0, UINT64_MAX, IdSet());
+    for (uint32_t number : all)
+      CHECK_EQUAL(number, next++);
+    /* Windows at the first record, inside blocks, at block edges and at the last record */
+    std::vector<uint64_t> times;
+    for (uint64_t i : {uint64_t(0), uint64_t(1), uint64_t(RECORD_BLOCK_SIZE - 1), uint64_t(RECORD_BLOCK_SIZE),
+                       count / 3, count / 2, count - RECORD_BLOCK_SIZE / 2, count - 1})
+      times.push_back(reader.record(std::min(i, count - 1))->time);
+    compareQueries(reader, times);
+
+    /* A segment that is still written is scanned */
+    std::string copy = std::string(directory) + "/open.rec";
+    {
+      std::ifstream in(path, std::ios::binary);
+      std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+      uint32_t complete = 0;
+      memcpy(data.data() + offsetof(RecordingHeader, complete), &complete, sizeof(complete));
+      std::ofstream(copy, std::ios::binary).write(data.data(), data.size());
+    }
+    RecordingReader open;
+    CHECK(open.open(copy));
+    CHECK(!open.header().complete);
+    compareQueries(open, times);
+    open.close();
+    unlink(copy.c_str());
+  }
+  CHECK_EQUAL(total, static_cast<uint64_t>(TEST_FRAMES));
+  for (const std::string &path : paths)
+    unlink(path.c_str());
+  rmdir(directory);
+}
@@ -0,0 +1,95 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "retransmitbuffer.h"
+#include "test.h"
+
+using namespace cannelloni;
+using std::chrono::microseconds;
+
+TEST(retransmit, ack_samples_round_trip) {
+  RetransmitBuffer buffer;
+  buffer.setMinTimeout(1000);
+  auto now = std::chrono::steady_clock::now();
+  uint8_t data[3] = {1, 2, 3};
+  buffer.store(7, data, sizeof(data), now);
+  buffer.acknowledge(7, now + microseconds(10000));
+  CHECK_EQUAL(buffer.size(), 0u);
+  CHECK_EQUAL(buffer.getAckedCount(), 1u);
+  CHECK_EQUAL(buffer.getRecoveredCount(), 0u);
+  /* RTO = SRTT + 4 * RTTVAR = 10 ms + 4 * 5 ms */
+  CHECK_EQUAL(buffer.getTimeout(), 30000u);
+}
+
+TEST(retransmit, nack_and_timeout) {
+  RetransmitBuffer buffer;
+  buffer.setMinTimeout(1000);
+  auto now = std::chrono::steady_clock::now();
+  uint8_t data[3] = {1, 2, 3};
+  buffer.store(0xffffffff, data, sizeof(data), now);
+  buffer.store(0, data, sizeof(data), now);
+  /* Nothing expired before the timeout */
+  CHECK(buffer.nextExpired(now + microseconds(999)) == NULL);
+  const std::vector<uint8_t> *packet = buffer.nack(0, now + microseconds(100));
+  CHECK(packet != NULL && packet->size() == 3);
+  CHECK(buffer.nextExpired(now + microseconds(1000)) != NULL);
+  CHECK_EQUAL(buffer.getRetransmitCount(), 2u);
+  /* Retransmitted packets are recovered, they don't sample the round trip */
+  buffer.acknowledge(0, now + microseconds(500));
+  buffer.acknowledge(0xffffffff, now + microseconds(1500));
+  CHECK_EQUAL(buffer.getRecoveredCount(), 2u);
+  CHECK_EQUAL(buffer.getMaxRecoveryLatency(), 1500u);
+  CHECK_EQUAL(buffer.getTimeout(), 1000u);
+}
+
+TEST(retransmit, gives_up_after_retries) {
+  RetransmitBuffer buffer;
+  buffer.setMinTimeout(1000);
+  auto now = std::chrono::steady_clock::now();
+  uint8_t data = 0;
+  buffer.store(1, &data, 1, now);
+  int retransmissions = 0;
+  /* The timeout doubles with every retry */
+  for (int i = 0; i < 100 && buffer.size() > 0; i++) {
+    now += microseconds(RETRANSMIT_MAX_TIMEOUT);
+    if (buffer.nextExpired(now))
+      retransmissions++;
+  }
+  CHECK_EQUAL(retransmissions, RETRANSMIT_MAX_RETRIES);
+  CHECK_EQUAL(buffer.getFailedCount(), 1u);
+}
+
+TEST(retransmit, nack_gives_up_after_retries) {
+  RetransmitBuffer buffer;
+  buffer.setMinTimeout(1000);
+  auto now = std::chrono::steady_clock::now();
+  uint8_t data = 0;
+  buffer.store(1, &data, 1, now);
+  int retransmissions = 0;
+  /* No round trip was sampled, so every NACK is answered */
+  for (int i = 0; i < 100; i++) {
+    now += microseconds(100);
+    if (buffer.nack(1, now))
+      retransmissions++;
+  }
+  CHECK_EQUAL(retransmissions, RETRANSMIT_MAX_RETRIES);
+  CHECK_EQUAL(buffer.size(), 0u);
+  CHECK_EQUAL(buffer.getFailedCount(), 1u);
+}
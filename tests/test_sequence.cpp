@@ -0,0 +1,133 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2023 Maximilian Güntner <code@mguentner.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "sequencetracker.h"
+#include "test.h"
+
+using namespace cannelloni;
+
+TEST(sequence, in_order_across_wraparound) {
+  SequenceTracker tracker;
+  uint32_t seq = 0xfffffff0;
+  for (int i = 0; i < 32; i++, seq++)
+    CHECK_EQUAL(tracker.track(seq), SEQ_IN_ORDER);
+  CHECK_EQUAL(seq, 0x10u);
+  CHECK_EQUAL(tracker.getReceivedCount(), 32u);
+  CHECK_EQUAL(tracker.getLostCount(), 0u);
+  CHECK_EQUAL(tracker.getReorderedCount(), 0u);
+}
+
+TEST(sequence, gap_across_wraparound) {
+  SequenceTracker tracker;
+  tracker.track(0xfffffffe);
+  /* 0xffffffff and 0 are missing */
+  CHECK_EQUAL(tracker.track(1), SEQ_IN_ORDER);
+  CHECK_EQUAL(tracker.getLastGap(), 2u);
+  CHECK_EQUAL(tracker.getLostCount(), 2u);
+  CHECK_EQUAL(tracker.track(0), SEQ_REORDERED);
+  CHECK_EQUAL(tracker.track(0xffffffff), SEQ_REORDERED);
+  CHECK_EQUAL(tracker.getLostCount(), 0u);
+  CHECK_EQUAL(tracker.getReorderedCount(), 2u);
+  CHECK_EQUAL(tracker.track(0xffffffff), SEQ_DUPLICATE);
+}
+
+TEST(sequence, duplicates) {
+  SequenceTracker tracker;
+  for (uint32_t seq = 100; seq < 110; seq++)
+    tracker.track(seq);
+  /* The highest one and older ones in the history */
+  CHECK_EQUAL(tracker.track(109), SEQ_DUPLICATE);
+  CHECK_EQUAL(tracker.track(105), SEQ_DUPLICATE);
+  CHECK_EQUAL(tracker.track(100), SEQ_DUPLICATE);
+  CHECK_EQUAL(tracker.getDuplicateCount(), 3u);
+  CHECK_EQUAL(tracker.getReceivedCount(), 10u);
+  CHECK_EQUAL(tracker.getLostCount(), 0u);
+}
+
+TEST(sequence, late_beyond_history) {
+  SequenceTracker tracker;
+  tracker.track(1000);
+  tracker.track(1000 + SEQUENCE_HISTORY_SIZE);
+  CHECK_EQUAL(tracker.getLostCount(), static_cast<uint64_t>(SEQUENCE_HISTORY_SIZE - 1));
+  /* The oldest ones still within the history */
+  CHECK_EQUAL(tracker.track(1001), SEQ_REORDERED);
+  CHECK_EQUAL(tracker.track(1000), SEQ_DUPLICATE);
+  CHECK_EQUAL(tracker.track(999), SEQ_LATE);
+  CHECK_EQUAL(tracker.getLateCount(), 1u);
+}
+
+TEST(sequence, jump_clears_history) {
+  SequenceTracker tracker;
+  tracker.track(5);
+  tracker.track(5 + 10 * SEQUENCE_HISTORY_SIZE);
+  /* 5 is out of the history, it can't be told apart from a late packet */
+  CHECK_EQUAL(tracker.track(5), SEQ_LATE);
+  CHECK_EQUAL(tracker.track(4 + 10 * SEQUENCE_HISTORY_SIZE), SEQ_REORDERED);
+}
+
+TEST(sequence, reset) {
+  SequenceTracker tracker;
+  tracker.track(50);
+  tracker.reset();
+  /* A restarted peer starts over without losses */
+  CHECK_EQUAL(tracker.track(0), SEQ_IN_ORDER);
+  CHECK_EQUAL(tracker.getLostCount(), 0u);
+}
+
+TEST(reorder, releases_in_order_across_wraparound) {
+  ReorderBuffer buffer;
+  buffer.setWindow(1000);
+  auto now = std::chrono::steady_clock::now();
+  uint8_t data = 0;
+  std::vector<uint8_t> packet;
+  uint8_t flags;
+  CHECK(buffer.push(0xffffffff, 1, &data, 1, now));
+  CHECK(buffer.pop(packet, flags, now));
+  CHECK_EQUAL(static_cast<int>(flags), 1);
+  /* 0 is missing, 1 and 2 are held */
+  CHECK(buffer.push(2, 3, &data, 1, now));
+  CHECK(buffer.push(1, 2, &data, 1, now));
+  CHECK(!buffer.pop(packet, flags, now));
+  CHECK_EQUAL(buffer.getHeldCount(), 2u);
+  CHECK(buffer.push(0, 0, &data, 1, now));
+  for (int expected : {0, 2, 3}) {
+    CHECK(buffer.pop(packet, flags, now));
+    CHECK_EQUAL(static_cast<int>(flags), expected);
+  }
+  CHECK_EQUAL(buffer.getSkippedCount(), 0u);
+  /* Behind the next expected one */
+  CHECK(!buffer.push(0xfffffffe, 0, &data, 1, now));
+}
+
+TEST(reorder, skips_gap_after_window) {
+  ReorderBuffer buffer;
+  buffer.setWindow(1000);
+  auto now = std::chrono::steady_clock::now();
+  uint8_t data = 0;
+  std::vector<uint8_t> packet;
+  uint8_t flags;
+  buffer.push(10, 0, &data, 1, now);
+  buffer.pop(packet, flags, now);
+  buffer.push(13, 0, &data, 1, now);
+  CHECK(!buffer.pop(packet, flags, now + std::chrono::microseconds(999)));
+  CHECK(buffer.nextTimeout(now) > 0);
+  CHECK(buffer.pop(packet, flags, now + std::chrono::microseconds(1000)));
+  CHECK_EQUAL(buffer.getSkippedCount(), 2u);
+}
@@ -25,6 +25,8 @@
 
 #include <algorithm>
 
+#include <endian.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -43,9 +45,16 @@
 #include "logging.h"
 #include "make_unique.h"
 #include "parser.h"
+#include "spillqueue.h"
 
 using namespace cannelloni;
 
+/* Local time in us for CannelloniExtTimestamp, wraps every 71 minutes */
+static uint32_t timestampNow() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 UDPThread::UDPThread(const struct debugOptions_t &debugOptions,
                      const struct UDPThreadParams &params)
   : ConnectionThread()
@@ -53,22 +62,37 @@ UDPThread::UDPThread(const struct debugOptions_t &debugOptions,
   , m_checkPeer(params.checkPeer)
   , m_socket(0)
   , m_addressFamily(params.addressFamily)
+  , m_linkDown(false)
   , m_sequenceNumber(0)
+  , m_sequenceConfig{ /* enabled */ false, /* reorderWindow */ 0 }
+  , m_peerExt(false)
+  , m_extSequenceNumber(0)
+  , m_reliabilityConfig{ /* ids */ IdSet(), /* minTimeout */ 20000 }
+  , m_peerReliable(false)
+  , m_peerFec(false)
+  , m_rateConfig{ /* minRate */ 0, /* maxRate */ 0, /* delayTarget */ 0 }
+  , m_peerFeedback(false)
+  , m_feedbackReceived(0)
+  , m_feedbackLost(0)
+  , m_pmtuDiscovery(false)
+  , m_peerCycles(false)
+  , m_latencyConfig{ /* enabled */ false, /* ids */ IdSet() }
   , m_timeout(100)
-  , m_rxCount(0)
-  , m_txCount(0)
+  , m_ackCount(0)
+  , m_nackCount(0)
+  , m_parityCount(0)
+  , m_feedbackCount(0)
+  , m_cycleCount(0)
+  , m_laneTxCount(1, 0)
 {
+  m_lanePipe[SIGNAL_PIPE_READ] = -1;
+  m_lanePipe[SIGNAL_PIPE_WRITE] = -1;
   memcpy(&m_debugOptions, &debugOptions, sizeof(struct debugOptions_t));
   memcpy(&m_remoteAddr, &params.remoteAddr, sizeof(struct sockaddr_storage));
   memcpy(&m_localAddr, &params.localAddr, sizeof(struct sockaddr_storage));
   
   m_linkMtuSize = params.linkMtuSize;
-  
-  if (params.addressFamily == AF_INET) {
-    m_payloadSize = m_linkMtuSize - IPv4_HEADER_SIZE - UDP_HEADER_SIZE;
-  } else {
-    m_payloadSize = m_linkMtuSize - IPv6_HEADER_SIZE - UDP_HEADER_SIZE;
-  }
+  m_payloadSize = m_linkMtuSize - ipOverhead();
 }
 
 int UDPThread::start() {
@@ -93,6 +117,46 @@ int UDPThread::start() {
     close(m_socket);
     return -1;
   }
+
+  if (m_pmtuDiscovery) {
+    /* The MTU of the route is the upper bound, packets must not get fragmented */
+    uint32_t routeMtu = queryPathMtu();
+    if (routeMtu == 0) {
+      lerror << "Could not determine the MTU of the route to the remote" << std::endl;
+      close(m_socket);
+      return -1;
+    }
+    int discover;
+    int ret;
+    if (m_addressFamily == AF_INET) {
+      discover = IP_PMTUDISC_DO;
+      ret = setsockopt(m_socket, IPPROTO_IP, IP_MTU_DISCOVER, &discover, sizeof(discover));
+    } else {
+      discover = IPV6_PMTUDISC_DO;
+      ret = setsockopt(m_socket, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &discover, sizeof(discover));
+    }
+    if (ret < 0) {
+      lerror << "Could not enable path MTU discovery" << std::endl;
+      close(m_socket);
+      return -1;
+    }
+    m_pathMtu.setup(routeMtu);
+    m_linkMtuSize = std::min<uint32_t>(routeMtu, PMTU_MAX_MTU);
+    updatePayloadSize();
+  }
+
+  if (!m_laneConfig.empty()) {
+    std::vector<IdSet> lanes;
+    for (const UDPLaneConfig &config : m_laneConfig)
+      lanes.push_back(config.ids);
+    m_frameBuffer->setLanes(lanes);
+    if (pipe(m_lanePipe) == -1 ||
+        fcntl(m_lanePipe[SIGNAL_PIPE_WRITE], F_SETFL, O_NONBLOCK) < 0) {
+      lerror << "could not inititalize signal pipe" << std::endl;
+      close(m_socket);
+      return -1;
+    }
+  }
   return Thread::start();
 }
 
@@ -112,28 +176,111 @@ bool UDPThread::parsePacket(uint8_t *buffer, uint16_t len, struct sockaddr_stora
   if (m_debugOptions.udp) {
     linfo << "Received " << std::dec << len << " Bytes from Host " << formatSocketAddress(getSocketAddress(clientAddr)) << std::endl;
   }
-  auto allocator = [this]()
+  /*
+   * The clock is synchronized apart from the data, also without sequence numbers.
+   * Requests are answered even if this end does not measure the offset itself.
+   */
+  if (len >= sizeof(struct CannelloniExtHeader) &&
+      buffer[0] == CANNELLONI_EXT_MAGIC && (buffer[1] == CLOCK || buffer[1] == CLOCK_ACK))
+    return receiveClock(buffer, len);
+  if (m_sequenceConfig.enabled) {
+    if (len >= sizeof(struct CannelloniExtHeader) && buffer[0] == CANNELLONI_EXT_MAGIC)
+      return parseExtPacket(buffer, len);
+    if (m_peerExt) {
+      /* The remote restarted without extension headers, negotiate again */
+      linfo << "Remote stopped sending extension headers" << std::endl;
+      m_peerExt = false;
+      m_peerReliable = false;
+      m_retransmitBuffer.reset();
+      m_retransmitTimer.disable();
+      m_fecEncoder.reset();
+      if (m_pathMtu.isEnabled()) {
+        /* Probes are not answered anymore */
+        m_pathMtu.reset();
+        updatePayloadSize();
+        m_pmtuTimer.disable();
+      }
+      if (m_peerCycles) {
+        /* Its cycles are gone, send all frames again */
+        m_peerCycles = false;
+        m_cycleDetector.reset();
+      }
+      /* It doesn't send CYCLE packets anymore */
+      m_peerThread->resetCycles();
+    }
+  }
+  return deliverPacket(buffer, len);
+}
+
+bool UDPThread::deliverPacket(const uint8_t *buffer, uint16_t len, uint8_t flags) {
+  /* The receive times of the frames follow the regular packet */
+  const uint8_t *frameTimes = nullptr;
+  uint16_t frameTimesCount = 0;
+  uint64_t frameTimesBase = 0;
+  if (flags & CANNELLONI_EXT_FLAG_FRAME_TIMES) {
+    struct CannelloniExtFrameTimes trailer;
+    if (len < sizeof(trailer)) {
+      lerror << "Received invalid frame times" << std::endl;
+      return true;
+    }
+    memcpy(&trailer, buffer + len - sizeof(trailer), sizeof(trailer));
+    frameTimesCount = ntohs(trailer.count);
+    frameTimesBase = be64toh(trailer.base);
+    uint32_t trailerLength = sizeof(trailer) + frameTimesCount * sizeof(uint32_t);
+    if (trailerLength > len) {
+      lerror << "Received invalid frame times" << std::endl;
+      return true;
+    }
+    len -= trailerLength;
+    frameTimes = buffer + len;
+  }
+  uint64_t decodeStart = m_stages.isEnabled() ? monotonicNow() : 0;
+  auto allocator = [this, decodeStart]()
   {
-      return m_peerThread->getFrameBuffer()->requestFrame(true, m_debugOptions.buffer);
+      if (!decodeStart)
+        return m_peerThread->getFrameBuffer()->requestFrame(true, m_debugOptions.buffer);
+      uint64_t requested = monotonicNow();
+      canfd_frame *frame = m_peerThread->getFrameBuffer()->requestFrame(true, m_debugOptions.buffer);
+      m_stages.add(STAGE_POOL, requested, monotonicNow());
+      return frame;
   };
-  auto receiver = [this](canfd_frame* f, bool success)
+  uint16_t frameIndex = 0;
+  auto receiver = [&](canfd_frame* f, bool success)
   {
+      if (frameIndex < frameTimesCount) {
+        uint32_t delta;
+        memcpy(&delta, frameTimes + frameIndex++ * sizeof(delta), sizeof(delta));
+        delta = ntohl(delta);
+        if (success && delta != CANNELLONI_FRAME_TIME_UNKNOWN) {
+          uint64_t received = frameTimesBase + static_cast<uint64_t>(delta) * 1000;
+          /* The times are taken with the clock of the remote */
+          frameTimestamp(f) = m_clockSync.isValid() ? m_clockSync.toLocal(received) : received;
+        }
+      }
       if (!success)
       {
           m_peerThread->getFrameBuffer()->insertFramePool(f);
           return;
       }
+      if (decodeStart) {
+        uint64_t now = monotonicNow();
+        m_stages.add(STAGE_DECODE, decodeStart, now);
+        frameStageTime(f) = now;
+      }
 
+      m_rxFrames.add();
+      if (m_flight.isEnabled())
+        m_flight.record(FLIGHT_NET_RX, f, m_rxCount.get());
       m_peerThread->transmitFrame(f);
       if (m_debugOptions.can)
       {
-          printCANInfo(f);
+          m_frameDebug.log(f);
       }
   };
   try
   {
       parseFrames(len, buffer, allocator, receiver);
-      m_rxCount++;
+      m_rxCount.add();
   }
   catch(std::exception& e)
   {
@@ -143,6 +290,489 @@ bool UDPThread::parsePacket(uint8_t *buffer, uint16_t len, struct sockaddr_stora
   return false;
 }
 
+bool UDPThread::parseExtPacket(const uint8_t *buffer, uint16_t len) {
+  const struct CannelloniExtHeader *header = reinterpret_cast<const struct CannelloniExtHeader*>(buffer);
+  if (header->length < sizeof(struct CannelloniExtHeader) || header->length > len) {
+    lerror << "Received invalid extension header" << std::endl;
+    return true;
+  }
+  if (!m_peerExt) {
+    linfo << "Remote uses extension headers" << std::endl;
+    m_peerExt = true;
+    if (m_pathMtu.isEnabled())
+      probePathMtu();
+  }
+  switch (header->type) {
+    case HELLO:
+      m_peerCycles = m_cycleDetector.isEnabled() && (header->flags & CANNELLONI_EXT_FLAG_CYCLES);
+      if ((header->flags & CANNELLONI_EXT_FLAG_PEER_SEEN) == 0) {
+        /* The remote (re)started, its sequence starts over */
+        std::vector<uint8_t> packet;
+        uint8_t flags;
+        while (m_reorderBuffer.pop(packet, flags, std::chrono::steady_clock::time_point::max()))
+          deliverPacket(packet.data(), packet.size(), flags);
+        m_reorderBuffer.reset();
+        m_sequenceTracker.reset();
+        m_reorderTimer.disable();
+        m_peerReliable = false;
+        m_peerFec = false;
+        m_fecDecoder.reset();
+        m_peerFeedback = false;
+        m_delayTracker.reset();
+        m_feedbackTimer.disable();
+        if (m_pathMtu.isEnabled()) {
+          /* The remote may accept packets of a different size now */
+          m_pathMtu.reset();
+          probePathMtu();
+        }
+        /* Announce the cycles again with the next check */
+        m_cycleDetector.reset();
+        /* and stop those of the previous run, they are announced again if they still run */
+        m_peerThread->resetCycles();
+        sendHello(true);
+      }
+      /* Data packets are kept from the start, so the first group can be recovered as well */
+      if (header->flags & CANNELLONI_EXT_FLAG_FEC)
+        m_peerFec = true;
+      return false;
+    case DATA: {
+      uint32_t arrival = timestampNow();
+      if (m_peerFec)
+        m_fecDecoder.addData(ntohl(header->seq), header->flags, buffer + header->length, len - header->length);
+      SequenceResult result = receiveData(ntohl(header->seq), header->flags,
+                                          buffer + header->length, len - header->length);
+      /* Retransmitted and reordered packets would distort the delay */
+      if ((header->flags & CANNELLONI_EXT_FLAG_TIMESTAMP) && result == SEQ_IN_ORDER &&
+          header->length >= sizeof(struct CannelloniExtTimestamp)) {
+        const struct CannelloniExtTimestamp *timestamp = reinterpret_cast<const struct CannelloniExtTimestamp*>(buffer);
+        m_delayTracker.add(ntohl(timestamp->timestamp), arrival);
+      }
+      if ((header->flags & CANNELLONI_EXT_FLAG_FEEDBACK) && !m_peerFeedback) {
+        m_peerFeedback = true;
+        m_feedbackReceived = m_sequenceTracker.getReceivedCount();
+        m_feedbackLost = m_sequenceTracker.getLostCount();
+        m_feedbackTimer.adjust(RATE_FEEDBACK_INTERVAL, RATE_FEEDBACK_INTERVAL);
+      }
+      return false;
+    }
+    case FEEDBACK: {
+      if (header->length < sizeof(struct CannelloniExtFeedback)) {
+        lerror << "Received invalid feedback packet" << std::endl;
+        return true;
+      }
+      const struct CannelloniExtFeedback *feedback = reinterpret_cast<const struct CannelloniExtFeedback*>(buffer);
+      if (m_rateController.isEnabled()) {
+        uint32_t delay = ntohl(feedback->delay);
+        bool reduced = m_rateController.onFeedback(ntohl(feedback->received), ntohl(feedback->lost),
+                                                   delay, std::chrono::steady_clock::now());
+        if (reduced && m_debugOptions.udp) {
+          linfo << "Congestion (Lost: " << ntohl(feedback->lost) << " Delay: " << delay
+                << " us), reducing rate to " << m_rateController.getRate() * 8 / 1000 << " kbit/s" << std::endl;
+        }
+        updateOverloadLimit();
+      }
+      return false;
+    }
+    case PARITY: {
+      if (header->length < sizeof(struct CannelloniExtParity)) {
+        lerror << "Received invalid parity packet" << std::endl;
+        return true;
+      }
+      const struct CannelloniExtParity *parity = reinterpret_cast<const struct CannelloniExtParity*>(buffer);
+      std::vector<FecRecoveredPacket> recovered;
+      m_peerFec = true;
+      m_fecDecoder.addParity(ntohl(header->seq), parity->count, parity->parityCount, parity->index,
+                             buffer + header->length, len - header->length, recovered);
+      for (const FecRecoveredPacket &packet : recovered) {
+        if (m_debugOptions.udp) {
+          linfo << "Recovered packet " << packet.seq << std::endl;
+        }
+        receiveData(packet.seq, packet.flags, packet.data.data(), packet.data.size());
+      }
+      return false;
+    }
+    case PROBE:
+    case PROBE_ACK: {
+      if (header->length < sizeof(struct CannelloniExtProbe)) {
+        lerror << "Received invalid probe" << std::endl;
+        return true;
+      }
+      uint16_t size = ntohs(reinterpret_cast<const struct CannelloniExtProbe*>(buffer)->size);
+      if (header->type == PROBE) {
+        /* Only a probe that arrived completely confirms the size */
+        if (size == len)
+          sendProbe(PROBE_ACK, size);
+      } else if (m_pathMtu.isEnabled()) {
+        m_pathMtu.onProbeAck(size + ipOverhead(), std::chrono::steady_clock::now());
+        /* Continue the search right away */
+        probePathMtu();
+      }
+      return false;
+    }
+    case CYCLE: {
+      if (header->length < sizeof(struct CannelloniExtCycle)) {
+        lerror << "Received invalid cycle packet" << std::endl;
+        return true;
+      }
+      /* Cycles are only sent to us if we accept them */
+      if (!m_cycleDetector.isEnabled())
+        return false;
+      const struct CannelloniExtCycle *cycle = reinterpret_cast<const struct CannelloniExtCycle*>(buffer);
+      canfd_frame frame;
+      memset(&frame, 0, sizeof(frame));
+      frame.can_id = ntohl(cycle->can_id);
+      frame.len = cycle->len;
+      frame.flags = cycle->flags;
+      memcpy(frame.data, cycle->data, std::min<uint8_t>(canfd_len(&frame), CANFD_MAX_DLEN));
+      uint32_t interval = ntohl(cycle->interval);
+      if (m_debugOptions.udp) {
+        linfo << "Remote " << (interval ? "announced" : "stopped") << " cycle of ID 0x" << std::hex
+              << (frame.can_id & CAN_EFF_MASK) << std::dec << " (" << interval << " us)" << std::endl;
+      }
+      m_peerThread->transmitCycle(frame, interval);
+      return false;
+    }
+    case ACK:
+      m_retransmitBuffer.acknowledge(ntohl(header->seq), std::chrono::steady_clock::now());
+      scheduleRetransmit();
+      return false;
+    case NACK: {
+      uint32_t seq = ntohl(header->seq);
+      uint16_t count = 1;
+      if (header->length >= sizeof(struct CannelloniExtNack))
+        count = ntohs(reinterpret_cast<const struct CannelloniExtNack*>(buffer)->count);
+      auto now = std::chrono::steady_clock::now();
+      for (uint16_t i = 0; i < count; i++) {
+        const std::vector<uint8_t> *packet = m_retransmitBuffer.nack(seq + i, now);
+        if (packet)
+          sendBuffer(const_cast<uint8_t*>(packet->data()), packet->size());
+      }
+      scheduleRetransmit();
+      return false;
+    }
+    default:
+      lwarn << "Received extension header with unknown type " << static_cast<int>(header->type) << std::endl;
+      return true;
+  }
+}
+
+SequenceResult UDPThread::receiveData(uint32_t seq, uint8_t flags, const uint8_t *buffer, uint16_t len) {
+  if (flags & CANNELLONI_EXT_FLAG_RELIABLE) {
+    /* Duplicates are acknowledged as well, the previous ACK might have been lost */
+    sendAck(ACK, seq, 1);
+    m_peerReliable = true;
+  }
+  return receiveSequenced(seq, flags, buffer, len);
+}
+
+SequenceResult UDPThread::receiveSequenced(uint32_t seq, uint8_t flags, const uint8_t *buffer, uint16_t len) {
+  SequenceResult result = m_sequenceTracker.track(seq);
+  uint32_t gap = m_sequenceTracker.getLastGap();
+  if (gap > 0 && m_peerReliable) {
+    /* Only the sender knows which of the missing packets were reliable */
+    uint16_t count = std::min<uint32_t>(gap, NACK_MAX_COUNT);
+    sendAck(NACK, seq - count, count);
+  }
+  if (m_debugOptions.udp && result != SEQ_IN_ORDER) {
+    linfo << "Packet " << seq << (result == SEQ_DUPLICATE ? " is a duplicate" :
+                                  result == SEQ_REORDERED ? " arrived out of order" : " arrived late")
+          << std::endl;
+  }
+  if (result == SEQ_DUPLICATE)
+    return result;
+  if (!m_reorderBuffer.isEnabled() ||
+      !m_reorderBuffer.push(seq, flags, buffer, len, std::chrono::steady_clock::now())) {
+    deliverPacket(buffer, len, flags);
+    return result;
+  }
+  releaseReordered();
+  return result;
+}
+
+void UDPThread::releaseReordered() {
+  auto now = std::chrono::steady_clock::now();
+  std::vector<uint8_t> packet;
+  uint8_t flags;
+  while (m_reorderBuffer.pop(packet, flags, now)) {
+    deliverPacket(packet.data(), packet.size(), flags);
+  }
+  uint64_t timeout = m_reorderBuffer.nextTimeout(now);
+  if (timeout) {
+    m_reorderTimer.adjust(timeout, timeout);
+  } else {
+    m_reorderTimer.disable();
+  }
+}
+
+void UDPThread::sendHello(bool peerSeen) {
+  struct CannelloniExtHeader header;
+  header.magic = CANNELLONI_EXT_MAGIC;
+  header.type = HELLO;
+  header.flags = peerSeen ? CANNELLONI_EXT_FLAG_PEER_SEEN : 0;
+  if (m_cycleDetector.isEnabled())
+    header.flags |= CANNELLONI_EXT_FLAG_CYCLES;
+  if (m_fecEncoder.isEnabled())
+    header.flags |= CANNELLONI_EXT_FLAG_FEC;
+  header.length = sizeof(header);
+  header.seq = htonl(m_extSequenceNumber);
+  sendBuffer(reinterpret_cast<uint8_t*>(&header), sizeof(header));
+}
+
+void UDPThread::sendAck(uint8_t type, uint32_t seq, uint16_t count) {
+  struct CannelloniExtNack nack;
+  nack.header.magic = CANNELLONI_EXT_MAGIC;
+  nack.header.type = type;
+  nack.header.flags = 0;
+  nack.header.seq = htonl(seq);
+  nack.count = htons(count);
+  if (type == NACK) {
+    nack.header.length = sizeof(nack);
+    m_nackCount++;
+  } else {
+    nack.header.length = sizeof(nack.header);
+    m_ackCount++;
+  }
+  sendBuffer(reinterpret_cast<uint8_t*>(&nack), nack.header.length);
+}
+
+void UDPThread::sendParity() {
+  uint32_t base = m_fecEncoder.groupBase();
+  uint8_t count = m_fecEncoder.pending();
+  std::vector<std::vector<uint8_t>> blocks;
+  m_fecEncoder.finish(blocks);
+  std::vector<uint8_t> packet;
+  for (size_t index = 0; index < blocks.size(); index++) {
+    packet.resize(sizeof(struct CannelloniExtParity) + blocks[index].size());
+    struct CannelloniExtParity *parity = reinterpret_cast<struct CannelloniExtParity*>(packet.data());
+    parity->header.magic = CANNELLONI_EXT_MAGIC;
+    parity->header.type = PARITY;
+    parity->header.flags = 0;
+    parity->header.length = sizeof(struct CannelloniExtParity);
+    parity->header.seq = htonl(base);
+    parity->count = count;
+    parity->parityCount = blocks.size();
+    parity->index = index;
+    parity->reserved = 0;
+    std::copy(blocks[index].begin(), blocks[index].end(), packet.begin() + sizeof(struct CannelloniExtParity));
+    if (sendBuffer(packet.data(), packet.size()) == static_cast<ssize_t>(packet.size()))
+      m_parityCount++;
+  }
+}
+
+void UDPThread::sendFeedback() {
+  uint64_t received = m_sequenceTracker.getReceivedCount() - m_feedbackReceived;
+  /* The lost count goes down when a missing packet arrives late */
+  uint64_t lost = std::max(m_sequenceTracker.getLostCount(), m_feedbackLost) - m_feedbackLost;
+  m_feedbackReceived = m_sequenceTracker.getReceivedCount();
+  m_feedbackLost = m_sequenceTracker.getLostCount();
+  if (received == 0 && lost == 0)
+    return;
+  struct CannelloniExtFeedback feedback;
+  feedback.header.magic = CANNELLONI_EXT_MAGIC;
+  feedback.header.type = FEEDBACK;
+  feedback.header.flags = 0;
+  feedback.header.length = sizeof(feedback);
+  feedback.header.seq = htonl(m_extSequenceNumber);
+  feedback.received = htonl(received);
+  feedback.lost = htonl(lost);
+  feedback.delay = htonl(m_delayTracker.takeQueuingDelay());
+  if (sendBuffer(reinterpret_cast<uint8_t*>(&feedback), sizeof(feedback)) == sizeof(feedback))
+    m_feedbackCount++;
+}
+
+void UDPThread::updateOverloadLimit() {
+  if (!m_rateController.isEnabled() || m_linkDown) {
+    m_frameBuffer->setOverloadLimit(0);
+    return;
+  }
+  size_t limit = m_rateController.getRate() * m_rateConfig.delayTarget / 1000000;
+  m_frameBuffer->setOverloadLimit(std::max<size_t>(limit, 2 * m_payloadSize));
+}
+
+void UDPThread::probePathMtu() {
+  auto now = std::chrono::steady_clock::now();
+  if (useExtHeader()) {
+    /* The kernel knows about smaller path MTUs from ICMP errors */
+    m_pathMtu.onKernelMtu(queryPathMtu(), now);
+    uint32_t mtu = m_pathMtu.nextProbe(now);
+    if (mtu) {
+      if (m_debugOptions.udp) {
+        linfo << "Probing path MTU " << mtu << std::endl;
+      }
+      sendProbe(PROBE, mtu - ipOverhead());
+    }
+  }
+  updatePayloadSize();
+  uint64_t timeout = useExtHeader() ? m_pathMtu.nextTimeout(now) : 0;
+  if (timeout) {
+    m_pmtuTimer.adjust(timeout, timeout);
+  } else {
+    m_pmtuTimer.disable();
+  }
+}
+
+void UDPThread::announceCycles() {
+  if (!useExtHeader() || !m_peerCycles)
+    return;
+  std::vector<CycleAnnouncement> cycles;
+  m_cycleDetector.announcements(std::chrono::steady_clock::now(), cycles);
+  for (const CycleAnnouncement &cycle : cycles)
+    sendCycle(cycle);
+}
+
+void UDPThread::sendCycle(const CycleAnnouncement &cycle) {
+  struct CannelloniExtCycle packet;
+  memset(&packet, 0, sizeof(packet));
+  packet.header.magic = CANNELLONI_EXT_MAGIC;
+  packet.header.type = CYCLE;
+  packet.header.flags = 0;
+  packet.header.length = sizeof(packet);
+  packet.header.seq = htonl(m_extSequenceNumber);
+  packet.interval = htonl(cycle.interval);
+  packet.can_id = htonl(cycle.frame.can_id);
+  packet.len = cycle.frame.len;
+  packet.flags = cycle.frame.flags;
+  memcpy(packet.data, cycle.frame.data, std::min<uint8_t>(canfd_len(&cycle.frame), CANFD_MAX_DLEN));
+  if (sendBuffer(reinterpret_cast<uint8_t*>(&packet), sizeof(packet)) == sizeof(packet))
+    m_cycleCount++;
+}
+
+void UDPThread::sendProbe(uint8_t type, uint16_t size) {
+  std::vector<uint8_t> packet(type == PROBE ? size : sizeof(struct CannelloniExtProbe));
+  struct CannelloniExtProbe *probe = reinterpret_cast<struct CannelloniExtProbe*>(packet.data());
+  probe->header.magic = CANNELLONI_EXT_MAGIC;
+  probe->header.type = type;
+  probe->header.flags = 0;
+  probe->header.length = sizeof(struct CannelloniExtProbe);
+  probe->header.seq = htonl(m_extSequenceNumber);
+  probe->size = htons(size);
+  sendBuffer(packet.data(), packet.size());
+}
+
+bool UDPThread::receiveClock(const uint8_t *buffer, uint16_t len) {
+  uint64_t now = realtimeNow();
+  if (len < sizeof(struct CannelloniExtClock)) {
+    lerror << "Received invalid clock packet" << std::endl;
+    return true;
+  }
+  const struct CannelloniExtClock *clock = reinterpret_cast<const struct CannelloniExtClock*>(buffer);
+  if (clock->header.type == CLOCK) {
+    sendClock(CLOCK_ACK, be64toh(clock->originate), now);
+  } else if (m_clockSync.answer(be64toh(clock->originate), be64toh(clock->receive),
+                                be64toh(clock->transmit), now) && m_clockSync.getSampleCount() == 1) {
+    linfo << "Clock offset of the remote: " << m_clockSync.getOffset() / 1000 << " us RTT: "
+          << m_clockSync.getRtt() / 1000 << " us" << std::endl;
+  }
+  return false;
+}
+
+void UDPThread::sendClock(uint8_t type, uint64_t originate, uint64_t receive) {
+  struct CannelloniExtClock clock;
+  clock.header.magic = CANNELLONI_EXT_MAGIC;
+  clock.header.type = type;
+  clock.header.flags = 0;
+  clock.header.length = sizeof(struct CannelloniExtClock);
+  clock.header.seq = htonl(m_extSequenceNumber);
+  clock.originate = htobe64(originate);
+  clock.receive = htobe64(receive);
+  /* As late as possible, the time it took to answer is not part of the RTT */
+  clock.transmit = htobe64(type == CLOCK_ACK ? realtimeNow() : 0);
+  sendBuffer(reinterpret_cast<uint8_t*>(&clock), sizeof(clock));
+}
+
+void UDPThread::requestClock() {
+  sendClock(CLOCK, m_clockSync.request(), 0);
+  uint64_t interval = m_clockSync.nextInterval();
+  m_clockTimer.adjust(interval, interval);
+}
+
+uint32_t UDPThread::queryPathMtu() {
+  /* IP_MTU needs a connected socket, m_socket receives from any address */
+  int querySocket = socket(m_addressFamily, SOCK_DGRAM, 0);
+  if (querySocket < 0)
+    return 0;
+  int mtu = 0;
+  socklen_t len = sizeof(mtu);
+  if (connect(querySocket, (struct sockaddr *)&m_remoteAddr, sizeof(m_remoteAddr)) < 0 ||
+      getsockopt(querySocket, m_addressFamily == AF_INET ? IPPROTO_IP : IPPROTO_IPV6,
+                 m_addressFamily == AF_INET ? IP_MTU : IPV6_MTU, &mtu, &len) < 0) {
+    mtu = 0;
+  }
+  close(querySocket);
+  return mtu > 0 ? mtu : 0;
+}
+
+void UDPThread::updatePayloadSize() {
+  if (!m_pathMtu.isEnabled())
+    return;
+  uint32_t payloadSize = m_pathMtu.getMtu() - ipOverhead();
+  if (payloadSize == m_payloadSize)
+    return;
+  m_payloadSize = payloadSize;
+  linfo << "Path MTU is " << m_pathMtu.getMtu() << " bytes, payload size is now "
+        << payloadSize << " bytes" << std::endl;
+  updateOverloadLimit();
+}
+
+uint32_t UDPThread::ipOverhead() {
+  if (m_addressFamily == AF_INET)
+    return IPv4_HEADER_SIZE + UDP_HEADER_SIZE;
+  return IPv6_HEADER_SIZE + UDP_HEADER_SIZE;
+}
+
+void UDPThread::retransmitExpired() {
+  auto now = std::chrono::steady_clock::now();
+  const std::vector<uint8_t> *packet;
+  while ((packet = m_retransmitBuffer.nextExpired(now)) != NULL) {
+    if (m_debugOptions.udp) {
+      linfo << "Retransmitting packet " << ntohl(reinterpret_cast<const struct CannelloniExtHeader*>(packet->data())->seq)
+            << std::endl;
+    }
+    sendBuffer(const_cast<uint8_t*>(packet->data()), packet->size());
+  }
+  scheduleRetransmit();
+}
+
+void UDPThread::scheduleRetransmit() {
+  uint64_t timeout = m_retransmitBuffer.nextTimeout(std::chrono::steady_clock::now());
+  if (timeout) {
+    m_retransmitTimer.adjust(timeout, timeout);
+  } else {
+    m_retransmitTimer.disable();
+  }
+}
+
+bool UDPThread::useExtHeader() {
+  return m_sequenceConfig.enabled && m_peerExt;
+}
+
+uint16_t UDPThread::extHeaderLength() {
+  if (m_rateController.isEnabled())
+    return sizeof(struct CannelloniExtTimestamp);
+  return sizeof(struct CannelloniExtHeader);
+}
+
+bool UDPThread::useReliability() {
+  return useExtHeader() && !m_reliabilityConfig.ids.empty();
+}
+
+uint32_t UDPThread::framePayloadSize() {
+  if (!useExtHeader())
+    return m_payloadSize;
+  if (m_fecEncoder.isEnabled()) {
+    /* A parity packet of a full sized packet has to fit as well */
+    return m_payloadSize - std::max<uint32_t>(extHeaderLength(),
+                                              sizeof(struct CannelloniExtParity) + FEC_BLOCK_HEADER_SIZE);
+  }
+  return m_payloadSize - extHeaderLength();
+}
+
+uint32_t UDPThread::lanePayloadSize(size_t lane) {
+  if (lane == 0 || m_laneConfig[lane-1].budget == 0)
+    return framePayloadSize();
+  return std::min(m_laneConfig[lane-1].budget, framePayloadSize());
+}
+
 void UDPThread::run() {
   fd_set readfds;
   ssize_t receivedBytes;
@@ -154,6 +784,37 @@ void UDPThread::run() {
   /* Set interval to m_timeout */
   m_transmitTimer.adjust(m_timeout, m_timeout);
   m_blockTimer.adjust(SELECT_TIMEOUT, SELECT_TIMEOUT);
+  if (m_frameBuffer->getSpillQueue()) {
+    m_drainTimer.adjust(SPILL_DRAIN_INTERVAL, SPILL_DRAIN_INTERVAL);
+  } else {
+    m_drainTimer.disable();
+  }
+  m_reorderTimer.disable();
+  m_retransmitTimer.disable();
+  m_paceTimer.disable();
+  m_feedbackTimer.disable();
+  m_pmtuTimer.disable();
+  if (m_cycleDetector.isEnabled()) {
+    m_cycleTimer.adjust(CYCLE_CHECK_INTERVAL, CYCLE_CHECK_INTERVAL);
+  } else {
+    m_cycleTimer.disable();
+  }
+  if (m_clockSync.isEnabled()) {
+    m_clockTimer.adjust(CLOCK_SYNC_FAST_INTERVAL, CLOCK_SYNC_FAST_INTERVAL);
+  } else {
+    m_clockTimer.disable();
+  }
+  for (size_t i = 0; i < m_laneConfig.size(); i++) {
+    if (m_laneConfig[i].timeout) {
+      m_laneTimers[i].adjust(m_laneConfig[i].timeout, m_laneConfig[i].timeout);
+    } else {
+      m_laneTimers[i].disable();
+    }
+  }
+  updateOverloadLimit();
+  if (m_sequenceConfig.enabled) {
+    sendHello(false);
+  }
 
   linfo << "UDPThread up and running" << std::endl;
   while (m_started) {
@@ -162,33 +823,135 @@ void UDPThread::run() {
     FD_SET(m_socket, &readfds);
     FD_SET(m_transmitTimer.getFd(), &readfds);
     FD_SET(m_blockTimer.getFd(), &readfds);
+    FD_SET(m_drainTimer.getFd(), &readfds);
+    FD_SET(m_reorderTimer.getFd(), &readfds);
+    FD_SET(m_retransmitTimer.getFd(), &readfds);
+    FD_SET(m_paceTimer.getFd(), &readfds);
+    FD_SET(m_feedbackTimer.getFd(), &readfds);
+    FD_SET(m_pmtuTimer.getFd(), &readfds);
+    FD_SET(m_cycleTimer.getFd(), &readfds);
+    FD_SET(m_clockTimer.getFd(), &readfds);
+    int maxFd = std::max({m_socket, m_transmitTimer.getFd(), m_blockTimer.getFd(),
+                          m_drainTimer.getFd(), m_reorderTimer.getFd(),
+                          m_retransmitTimer.getFd(), m_paceTimer.getFd(),
+                          m_feedbackTimer.getFd(), m_pmtuTimer.getFd(),
+                          m_cycleTimer.getFd(), m_clockTimer.getFd()});
+    for (Timer &timer : m_laneTimers) {
+      FD_SET(timer.getFd(), &readfds);
+      maxFd = std::max(maxFd, timer.getFd());
+    }
+    if (m_lanePipe[SIGNAL_PIPE_READ] >= 0) {
+      FD_SET(m_lanePipe[SIGNAL_PIPE_READ], &readfds);
+      maxFd = std::max(maxFd, m_lanePipe[SIGNAL_PIPE_READ]);
+    }
 
-    int ret = select(std::max({m_socket, m_transmitTimer.getFd(), m_blockTimer.getFd()})+1,
-                     &readfds, NULL, NULL, NULL);
+    int ret = select(maxFd+1, &readfds, NULL, NULL, NULL);
     if (ret < 0) {
       lerror << "select error" << std::endl;
       break;
     }
     if (FD_ISSET(m_transmitTimer.getFd(), &readfds)) {
       if (m_transmitTimer.read() > 0) {
-        if (m_frameBuffer->getFrameBufferSize())
-          prepareBuffer();
+        if (m_linkDown) {
+          /* Keep the frames, we retry with m_blockTimer */
+        } else if (m_frameBuffer->getFrameBufferSize())
+          transmitPaced();
         else {
           m_transmitTimer.disable();
+          /* Protect the packets of an incomplete group as well before going idle */
+          if (m_fecEncoder.pending() > 0 && useExtHeader())
+            sendParity();
+        }
+      }
+    }
+    for (size_t i = 0; i < m_laneTimers.size(); i++) {
+      if (FD_ISSET(m_laneTimers[i].getFd(), &readfds) && m_laneTimers[i].read() > 0) {
+        if (m_linkDown) {
+          /* Keep the frames, we retry with m_blockTimer */
+        } else if (m_frameBuffer->getFrameBufferSize(i+1)) {
+          flushLane(i+1);
+        } else {
+          m_laneTimers[i].disable();
         }
       }
     }
+    if (m_lanePipe[SIGNAL_PIPE_READ] >= 0 && FD_ISSET(m_lanePipe[SIGNAL_PIPE_READ], &readfds)) {
+      int lane;
+      ssize_t res = read(m_lanePipe[SIGNAL_PIPE_READ], &lane, sizeof(lane));
+      if (res == sizeof(lane) && !m_linkDown) {
+        flushLane(lane);
+      }
+    }
     if (FD_ISSET(m_blockTimer.getFd(), &readfds)) {
       m_blockTimer.read();
+      if (m_linkDown) {
+        /* Check whether the remote is reachable again */
+        for (size_t lane = 0; lane < m_frameBuffer->getLaneCount() && m_linkDown; lane++) {
+          if (m_frameBuffer->getFrameBufferSize(lane))
+            prepareBuffer(lane);
+        }
+        /* Lane 0 is sent by m_transmitTimer */
+        for (size_t lane = 1; lane < m_frameBuffer->getLaneCount() && !m_linkDown; lane++) {
+          flushLane(lane);
+        }
+      }
+      if (m_sequenceConfig.enabled && !m_peerExt) {
+        sendHello(false);
+      }
+    }
+    if (FD_ISSET(m_reorderTimer.getFd(), &readfds)) {
+      m_reorderTimer.read();
+      releaseReordered();
+    }
+    if (FD_ISSET(m_retransmitTimer.getFd(), &readfds)) {
+      m_retransmitTimer.read();
+      retransmitExpired();
+    }
+    if (FD_ISSET(m_paceTimer.getFd(), &readfds)) {
+      m_paceTimer.read();
+      m_paceTimer.disable();
+      if (!m_linkDown && m_frameBuffer->getFrameBufferSize())
+        transmitPaced();
+    }
+    if (FD_ISSET(m_feedbackTimer.getFd(), &readfds)) {
+      m_feedbackTimer.read();
+      sendFeedback();
+    }
+    if (FD_ISSET(m_pmtuTimer.getFd(), &readfds)) {
+      m_pmtuTimer.read();
+      probePathMtu();
+    }
+    if (FD_ISSET(m_cycleTimer.getFd(), &readfds)) {
+      m_cycleTimer.read();
+      announceCycles();
+    }
+    if (FD_ISSET(m_clockTimer.getFd(), &readfds)) {
+      m_clockTimer.read();
+      requestClock();
+    }
+    if (FD_ISSET(m_drainTimer.getFd(), &readfds)) {
+      m_drainTimer.read();
+      drainSpill();
     }
     if (FD_ISSET(m_socket, &readfds)) {
       /* Clear buffer */
       memset(buffer, 0, m_linkMtuSize);
+      /* With MSG_TRUNC the full size of larger packets is returned */
       receivedBytes = recvfrom(m_socket, buffer, m_linkMtuSize,
-          0, (struct sockaddr *)&clientAddr, &clientAddrLen);
+          MSG_TRUNC, (struct sockaddr *)&clientAddr, &clientAddrLen);
       if (receivedBytes < 0) {
+        m_receiveErrors.add();
         lerror << "recvfrom error." << std::endl;
         continue;
+      }
+      m_rxBytes.add(receivedBytes);
+      if (static_cast<size_t>(receivedBytes) > m_linkMtuSize) {
+        /* Probes of the remote are expected to exceed the local MTU at times */
+        const struct CannelloniExtHeader *header = reinterpret_cast<const struct CannelloniExtHeader*>(buffer);
+        if (header->magic != CANNELLONI_EXT_MAGIC || header->type != PROBE || m_debugOptions.udp) {
+          lwarn << "Dropped packet of " << receivedBytes << " bytes, which exceeds the MTU of "
+                << m_linkMtuSize << " bytes" << std::endl;
+        }
       } else if (receivedBytes > 0) {
         parsePacket(buffer, receivedBytes, &clientAddr);
       }
@@ -197,34 +960,110 @@ void UDPThread::run() {
   if (m_debugOptions.buffer) {
     m_frameBuffer->debug();
   }
-  linfo << "Shutting down. UDP Transmission Summary: TX: " << m_txCount << " RX: " << m_rxCount << std::endl;
+  linfo << "Shutting down. UDP Transmission Summary: TX: " << m_txCount.get() << " RX: " << m_rxCount.get() << std::endl;
+  if (m_sequenceConfig.enabled) {
+    linfo << "Sequence Summary: Received: " << m_sequenceTracker.getReceivedCount()
+          << " Lost: " << m_sequenceTracker.getLostCount()
+          << " Duplicate: " << m_sequenceTracker.getDuplicateCount()
+          << " Reordered: " << m_sequenceTracker.getReorderedCount()
+          << " Late: " << m_sequenceTracker.getLateCount() << std::endl;
+    if (m_reorderBuffer.isEnabled()) {
+      linfo << "Reorder Buffer: Held: " << m_reorderBuffer.getHeldCount()
+            << " Skipped: " << m_reorderBuffer.getSkippedCount() << std::endl;
+    }
+    if (!m_reliabilityConfig.ids.empty()) {
+      uint64_t sent = m_retransmitBuffer.getSentCount();
+      /* Retransmissions per reliable packet in 0.1% */
+      uint64_t rate = sent ? m_retransmitBuffer.getRetransmitCount() * 1000 / sent : 0;
+      linfo << "Reliability Summary: Sent: " << sent
+            << " Acked: " << m_retransmitBuffer.getAckedCount()
+            << " Retransmitted: " << m_retransmitBuffer.getRetransmitCount()
+            << " (" << rate / 10 << "." << rate % 10 << "%)"
+            << " Recovered: " << m_retransmitBuffer.getRecoveredCount()
+            << " Failed: " << m_retransmitBuffer.getFailedCount() << std::endl;
+      linfo << "Recovery Latency: Avg: " << m_retransmitBuffer.getAverageRecoveryLatency()
+            << " us Max: " << m_retransmitBuffer.getMaxRecoveryLatency()
+            << " us RTO: " << m_retransmitBuffer.getTimeout() << " us" << std::endl;
+    }
+    if (m_fecEncoder.isEnabled()) {
+      linfo << "FEC Summary: Parity packets sent: " << m_parityCount << std::endl;
+    }
+    if (m_peerFec || m_fecDecoder.getRecoveredCount() || m_fecDecoder.getUnrecoverableCount()) {
+      linfo << "FEC Summary: Recovered: " << m_fecDecoder.getRecoveredCount()
+            << " Unrecoverable: " << m_fecDecoder.getUnrecoverableCount() << std::endl;
+    }
+    if (m_feedbackCount) {
+      linfo << "Feedback packets sent: " << m_feedbackCount << std::endl;
+    }
+    if (m_ackCount || m_nackCount) {
+      linfo << "Acknowledgements: ACK: " << m_ackCount << " NACK: " << m_nackCount << std::endl;
+    }
+  }
+  if (!m_laneConfig.empty()) {
+    std::string lanes = "0: " + std::to_string(m_laneTxCount[0]);
+    for (size_t lane = 1; lane < m_laneTxCount.size(); lane++) {
+      lanes += " " + std::to_string(lane) + (m_laneConfig[lane-1].timeout ? "" : " (express)") +
+               ": " + std::to_string(m_laneTxCount[lane]);
+    }
+    linfo << "Lane Summary: TX: " << lanes << std::endl;
+  }
+  if (m_pathMtu.isEnabled()) {
+    linfo << "Path MTU: " << m_pathMtu.getMtu() << " bytes Payload: " << m_payloadSize
+          << " bytes Probes: " << m_pathMtu.getProbeCount()
+          << " Lowered: " << m_pathMtu.getLoweredCount() << std::endl;
+  }
+  if (m_cycleDetector.isEnabled()) {
+    linfo << "Cycle Offload Summary: Detected: " << m_cycleDetector.getDetectedCount()
+          << " Announcements: " << m_cycleCount
+          << " Suppressed: " << m_cycleDetector.getSuppressedCount() << std::endl;
+  }
+  if (m_clockSync.isEnabled()) {
+    linfo << "Clock Summary: Offset: " << m_clockSync.getOffset() / 1000
+          << " us RTT: " << m_clockSync.getRtt() / 1000
+          << " us Requests: " << m_clockSync.getRequestCount()
+          << " Samples: " << m_clockSync.getSampleCount() << std::endl;
+  }
+  if (m_outboundLatency.getTotal().getCount() > 0) {
+    linfo << "Latency Summary: CAN RX to UDP TX: " << m_outboundLatency.getTotal().summary() << std::endl;
+    for (const auto &line : m_outboundLatency.idSummaries())
+      linfo << "Latency Summary: " << line << std::endl;
+  }
+  if (m_rateController.isEnabled()) {
+    linfo << "Rate Control: Rate: " << m_rateController.getRate() * 8 / 1000 << " kbit/s"
+          << " Reductions: " << m_rateController.getDecreaseCount()
+          << " Paced: " << m_rateController.getPacedCount()
+          << " Queuing Delay: " << m_rateController.getLastDelay() << " us"
+          << " Overload Drops: " << m_frameBuffer->getOverloadDropCount() << std::endl;
+  }
   shutdown(m_socket, SHUT_RDWR);
   close(m_socket);
+  if (m_lanePipe[SIGNAL_PIPE_READ] >= 0) {
+    close(m_lanePipe[SIGNAL_PIPE_READ]);
+    close(m_lanePipe[SIGNAL_PIPE_WRITE]);
+  }
 }
 
 void UDPThread::transmitFrame(canfd_frame *frame) {
+  /* The remote sends unchanged frames of announced cycles on its own */
+  if (m_peerCycles && !m_cycleDetector.track(frame, std::chrono::steady_clock::now())) {
+    m_frameBuffer->insertFramePool(frame);
+    return;
+  }
+  uint32_t can_id;
+  if (frame->can_id & CAN_EFF_FLAG)
+    can_id = frame->can_id & CAN_EFF_MASK;
+  else
+    can_id = frame->can_id & CAN_SFF_MASK;
+  size_t lane = m_frameBuffer->laneOf(frame);
+  /* frame must not be accessed after this point, it might have been spilled */
   m_frameBuffer->insertFrame(frame);
-  /* If we have stopped the timer, enable it */
-  if (!m_transmitTimer.isEnabled()) {
-    m_transmitTimer.enable();
+  if (lane > 0) {
+    scheduleLane(lane);
+    return;
   }
-  /*
-   * We want that at least this frame and next frame fits into
-   * the packet. The minimum size is CANNELLONI_FRAME_BASE_SIZE,
-   * which is just the ID * plus the DLC
-   */
-  if (m_frameBuffer->getFrameBufferSize() +
-      CANNELLONI_DATA_PACKET_BASE_SIZE +
-      CANNELLONI_FRAME_BASE_SIZE >= m_payloadSize) {
-    m_transmitTimer.fire();
-  } else {
+  if (!scheduleTransmit()) {
     /* Check whether we have custom timeout for this frame */
     std::map<uint32_t,uint32_t>::iterator it;
-    uint32_t can_id;
-    if (frame->can_id & CAN_EFF_FLAG)
-      can_id = frame->can_id & CAN_EFF_MASK;
-    else
-      can_id = frame->can_id & CAN_SFF_MASK;
     it = m_timeoutTable.find(can_id);
     if (it != m_timeoutTable.end()) {
       uint32_t timeout = it->second;
@@ -243,6 +1082,68 @@ void UDPThread::transmitFrame(canfd_frame *frame) {
   }
 }
 
+bool UDPThread::scheduleTransmit() {
+  /* If we have stopped the timer, enable it */
+  if (!m_transmitTimer.isEnabled()) {
+    m_transmitTimer.enable();
+  }
+  /*
+   * We want that at least this frame and next frame fits into
+   * the packet. The minimum size is CANNELLONI_FRAME_BASE_SIZE,
+   * which is just the ID * plus the DLC
+   */
+  if (m_frameBuffer->getFrameBufferSize() +
+      CANNELLONI_DATA_PACKET_BASE_SIZE +
+      CANNELLONI_FRAME_BASE_SIZE >= framePayloadSize()) {
+    /* No need to wake up the thread if we can't send anyway */
+    if (!m_linkDown)
+      m_transmitTimer.fire();
+    return true;
+  }
+  return false;
+}
+
+void UDPThread::scheduleLane(size_t lane) {
+  if (m_laneConfig[lane-1].timeout == 0) {
+    int signal = lane;
+    ssize_t res = write(m_lanePipe[SIGNAL_PIPE_WRITE], &signal, sizeof(signal));
+    if (res != sizeof(signal) && errno != EWOULDBLOCK) {
+      lwarn << "could not write to pipe " << res << std::endl;
+    }
+    return;
+  }
+  Timer &timer = m_laneTimers[lane-1];
+  if (!timer.isEnabled()) {
+    timer.enable();
+  }
+  /* Same as scheduleTransmit, with the budget of the lane */
+  if (m_frameBuffer->getFrameBufferSize(lane) +
+      CANNELLONI_DATA_PACKET_BASE_SIZE +
+      CANNELLONI_FRAME_BASE_SIZE >= lanePayloadSize(lane)) {
+    if (!m_linkDown)
+      timer.fire();
+  }
+}
+
+void UDPThread::flushLane(size_t lane) {
+  size_t size;
+  while (!m_linkDown && (size = m_frameBuffer->getFrameBufferSize(lane)) > 0) {
+    prepareBuffer(lane);
+    /* Nothing could be sent, e.g. because the remote is not reachable */
+    if (m_frameBuffer->getFrameBufferSize(lane) >= size)
+      break;
+  }
+}
+
+void UDPThread::drainSpill() {
+  SpillQueue *spillQueue = m_frameBuffer->getSpillQueue();
+  if (m_linkDown || spillQueue == NULL || spillQueue->depth() == 0)
+    return;
+  if (m_frameBuffer->drainSpill(spillQueue->drainBudget()) > 0) {
+    scheduleTransmit();
+  }
+}
+
 void UDPThread::setTimeout(uint32_t timeout) {
   m_timeout = timeout;
 }
@@ -259,40 +1160,298 @@ std::map<uint32_t,uint32_t>& UDPThread::getTimeoutTable() {
   return m_timeoutTable;
 }
 
-void UDPThread::prepareBuffer() {
+void UDPThread::setSequencing(const UDPSequenceConfig &config) {
+  m_sequenceConfig = config;
+  m_reorderBuffer.setWindow(config.reorderWindow);
+}
+
+void UDPThread::setReliability(const UDPReliabilityConfig &config) {
+  m_reliabilityConfig = config;
+  m_retransmitBuffer.setMinTimeout(config.minTimeout);
+}
+
+void UDPThread::setFec(const UDPFecConfig &config) {
+  m_fecEncoder.setup(config.dataPackets, config.parityPackets);
+}
+
+void UDPThread::setRateControl(const UDPRateConfig &config) {
+  m_rateConfig = config;
+  m_rateController.setup(config.minRate, config.maxRate, config.delayTarget);
+}
+
+void UDPThread::setPathMtuDiscovery(bool enabled) {
+  m_pmtuDiscovery = enabled;
+}
+
+void UDPThread::setCycleOffload(const IdSet &ids) {
+  m_cycleDetector.setup(ids);
+}
+
+void UDPThread::setLatency(const LatencyConfig &config) {
+  m_latencyConfig = config;
+  m_outboundLatency.setIds(config.ids);
+}
+
+void UDPThread::setClockSync(bool enabled) {
+  m_clockSync.setEnabled(enabled);
+}
+
+void UDPThread::setLanes(const std::vector<UDPLaneConfig> &lanes) {
+  m_laneConfig = lanes;
+  m_laneTimers = std::vector<Timer>(lanes.size());
+  m_laneTxCount.assign(lanes.size() + 1, 0);
+}
+
+void UDPThread::transmitPaced() {
+  if (m_rateController.isEnabled()) {
+    uint64_t delay = m_rateController.pacingDelay(std::chrono::steady_clock::now());
+    if (delay) {
+      m_paceTimer.adjust(delay, delay);
+      return;
+    }
+  }
+  prepareBuffer();
+}
+
+void UDPThread::prepareBuffer(size_t lane) {
+  UDPFlushReason reason = FLUSH_TIMEOUT;
+  if (lane > 0)
+    reason = FLUSH_LANE;
+  else if (m_linkDown)
+    reason = FLUSH_RETRY;
+  else if (m_frameBuffer->getFrameBufferSize() + CANNELLONI_DATA_PACKET_BASE_SIZE +
+           CANNELLONI_FRAME_BASE_SIZE >= framePayloadSize())
+    reason = FLUSH_FULL;
+  m_flushCount[reason].add();
+  uint64_t packets = m_txCount.get();
+
+  m_frameBuffer->swapBuffers(lane);
+  if (m_sort)
+    m_frameBuffer->sortIntermediateBuffer(lane);
+
+  std::list<canfd_frame*> *buffer = m_frameBuffer->getIntermediateBuffer(lane);
+
+  if (useReliability()) {
+    /*
+     * Reliable frames go into packets of their own, so only those
+     * are kept for retransmission
+     */
+    std::list<canfd_frame*> bestEffort;
+    auto split = std::stable_partition(buffer->begin(), buffer->end(),
+        [this](const canfd_frame *frame) { return m_reliabilityConfig.ids.contains(frame->can_id); });
+    bestEffort.splice(bestEffort.end(), *buffer, split, buffer->end());
+    if (!buffer->empty()) {
+      auto unsent = sendPacket(*buffer, true, lane);
+      if (unsent != buffer->end()) {
+        /* Best-effort frames wait for the next packet as well */
+        buffer->splice(buffer->end(), bestEffort);
+        m_frameBuffer->returnIntermediateBuffer(unsent, lane);
+      }
+    }
+    if (!bestEffort.empty()) {
+      auto unsent = sendPacket(bestEffort, false, lane);
+      bool complete = (unsent == bestEffort.end());
+      /* The iterator stays valid and points into buffer after the splice */
+      buffer->splice(buffer->end(), bestEffort);
+      if (!complete)
+        m_frameBuffer->returnIntermediateBuffer(unsent, lane);
+    }
+  } else {
+    auto unsent = sendPacket(*buffer, false, lane);
+    if (unsent != buffer->end())
+      m_frameBuffer->returnIntermediateBuffer(unsent, lane);
+  }
+  m_frameBuffer->unlockIntermediateBuffer();
+  m_frameBuffer->mergeIntermediateBuffer(lane);
+  m_flushPackets.observe(m_txCount.get() - packets);
+}
+
+std::list<canfd_frame*>::iterator UDPThread::sendPacket(std::list<canfd_frame*> &frames, bool reliable,
+                                                        size_t lane) {
   // TODO : this should be a std::array, since payloadSize is really known at
   // compile time.
   auto bufWrap = std::make_unique<uint8_t[]>(m_payloadSize);
   auto packetBuffer = bufWrap.get();
 
   ssize_t transmittedBytes = 0;
+  std::list<canfd_frame*>::iterator unsent = frames.end();
+  uint64_t packetStart = m_stages.isEnabled() ? monotonicNow() : 0;
 
-  m_frameBuffer->swapBuffers();
-  if (m_sort)
-    m_frameBuffer->sortIntermediateBuffer();
-
-  std::list<canfd_frame*> *buffer = m_frameBuffer->getIntermediateBuffer();
-
-  auto overflowHandler = [this](std::list<canfd_frame*>&, std::list<canfd_frame*>::iterator it)
+  auto overflowHandler = [&unsent](std::list<canfd_frame*>&, std::list<canfd_frame*>::iterator it)
   {
-      /* Move all remaining frames back to m_buffer */
-      m_frameBuffer->returnIntermediateBuffer(it);
+      /* The remaining frames are moved back to m_buffer by the caller */
+      unsent = it;
   };
 
-  uint8_t* data = buildPacket(m_payloadSize, packetBuffer, *buffer,
-          m_sequenceNumber++, overflowHandler);
+  /* The extension header goes in front of the regular packet */
+  bool extHeader = useExtHeader();
+  uint16_t headerLength = extHeader ? extHeaderLength() : 0;
+  bool frameTimes = extHeader && m_latencyConfig.enabled;
+  /* Flags that describe the payload, which FEC has to restore as well */
+  uint8_t dataFlags = (reliable ? CANNELLONI_EXT_FLAG_RELIABLE : 0) |
+                      (frameTimes ? CANNELLONI_EXT_FLAG_FRAME_TIMES : 0);
+  if (extHeader) {
+    struct CannelloniExtHeader *header = reinterpret_cast<struct CannelloniExtHeader*>(packetBuffer);
+    header->magic = CANNELLONI_EXT_MAGIC;
+    header->type = DATA;
+    header->flags = dataFlags;
+    header->length = headerLength;
+    header->seq = htonl(m_extSequenceNumber);
+    if (m_rateController.isEnabled()) {
+      header->flags |= CANNELLONI_EXT_FLAG_TIMESTAMP | CANNELLONI_EXT_FLAG_FEEDBACK;
+      reinterpret_cast<struct CannelloniExtTimestamp*>(packetBuffer)->timestamp = htonl(timestampNow());
+    }
+  }
 
+  uint8_t* data;
+  if (frameTimes) {
+    data = buildPacket(lanePayloadSize(lane) - sizeof(struct CannelloniExtFrameTimes),
+                       packetBuffer + headerLength, frames, m_sequenceNumber++, overflowHandler,
+                       sizeof(uint32_t));
+    data = appendFrameTimes(data, frames.begin(), unsent);
+  } else {
+    data = buildPacket(lanePayloadSize(lane), packetBuffer + headerLength, frames,
+            m_sequenceNumber++, overflowHandler);
+  }
+
+  uint64_t encoded = packetStart ? monotonicNow() : 0;
   transmittedBytes = sendBuffer(packetBuffer, data-packetBuffer);
   if (transmittedBytes != data-packetBuffer) {
-    lerror << "UDP Socket error. Error while transmitting" << std::endl;
+    int error = errno;
+    if (error == EMSGSIZE &&
+        m_pathMtu.onKernelMtu(queryPathMtu(), std::chrono::steady_clock::now())) {
+      /* An ICMP error lowered the path MTU, send the frames again in smaller packets */
+      unsent = frames.begin();
+      updatePayloadSize();
+      m_transmitTimer.fire();
+    } else if (m_frameBuffer->getSpillQueue() &&
+        (error == ENETUNREACH || error == EHOSTUNREACH || error == ENETDOWN ||
+         error == EHOSTDOWN || error == ECONNREFUSED)) {
+      /* Keep the frames, they will be spilled once the pool is exhausted */
+      unsent = frames.begin();
+      if (!m_linkDown) {
+        lwarn << "Remote not reachable, keeping frames until it is back: "
+              << strerror(error) << std::endl;
+        m_linkDown = true;
+        updateOverloadLimit();
+      }
+    } else {
+      m_sendDropCount.add(std::distance(frames.begin(), unsent));
+      lerror << "UDP Socket error. Error while transmitting" << std::endl;
+    }
   } else {
-    m_txCount++;
+    if (m_linkDown) {
+      linfo << "Remote reachable again" << std::endl;
+      m_linkDown = false;
+      updateOverloadLimit();
+    }
+    if (reliable) {
+      m_retransmitBuffer.store(m_extSequenceNumber, packetBuffer, transmittedBytes,
+                               std::chrono::steady_clock::now());
+      if (!m_retransmitTimer.isEnabled())
+        scheduleRetransmit();
+    }
+    if (m_latencyConfig.enabled) {
+      uint64_t now = realtimeNow();
+      for (auto it = frames.begin(); it != unsent; it++) {
+        uint64_t received = frameTimestamp(*it);
+        if (received)
+          m_outboundLatency.add(*it, (static_cast<int64_t>(now - received)) / 1000);
+      }
+    }
+    if (packetStart) {
+      uint64_t sent = monotonicNow();
+      for (auto it = frames.begin(); it != unsent; it++) {
+        m_stages.add(STAGE_QUEUE, frameStageTime(*it), packetStart);
+        m_stages.add(STAGE_ENCODE, packetStart, encoded);
+        m_stages.add(STAGE_SEND, encoded, sent);
+      }
+    }
+    if (m_flight.isEnabled()) {
+      for (auto it = frames.begin(); it != unsent; it++)
+        m_flight.record(FLIGHT_NET_TX, *it, m_txCount.get());
+    }
+    bool groupComplete = false;
+    if (extHeader && m_fecEncoder.isEnabled()) {
+      groupComplete = m_fecEncoder.add(m_extSequenceNumber, dataFlags, packetBuffer + headerLength,
+                                       transmittedBytes - headerLength);
+    }
+    if (extHeader)
+      m_extSequenceNumber++;
+    m_txCount.add();
+    m_txFrames.add(std::distance(frames.begin(), unsent));
+    m_laneTxCount[lane]++;
+    if (groupComplete)
+      sendParity();
   }
-  m_frameBuffer->unlockIntermediateBuffer();
-  m_frameBuffer->mergeIntermediateBuffer();
+  return unsent;
+}
+
+uint8_t* UDPThread::appendFrameTimes(uint8_t *data, std::list<canfd_frame*>::iterator begin,
+                                     std::list<canfd_frame*>::iterator end) {
+  uint64_t base = 0;
+  uint16_t count = 0;
+  for (auto it = begin; it != end; it++, count++) {
+    uint64_t received = frameTimestamp(*it);
+    if (received && (base == 0 || received < base))
+      base = received;
+  }
+  for (auto it = begin; it != end; it++) {
+    uint64_t received = frameTimestamp(*it);
+    uint32_t delta = CANNELLONI_FRAME_TIME_UNKNOWN;
+    if (received)
+      delta = std::min<uint64_t>((received - base) / 1000, CANNELLONI_FRAME_TIME_UNKNOWN - 1);
+    delta = htonl(delta);
+    memcpy(data, &delta, sizeof(delta));
+    data += sizeof(delta);
+  }
+  struct CannelloniExtFrameTimes trailer;
+  trailer.base = htobe64(base);
+  trailer.count = htons(count);
+  memcpy(data, &trailer, sizeof(trailer));
+  return data + sizeof(trailer);
 }
 
 ssize_t UDPThread::sendBuffer(uint8_t *buffer, uint16_t len) {
-  return sendto(m_socket, buffer, len, 0,
-               (struct sockaddr *) &m_remoteAddr, sizeof(m_remoteAddr));
+  ssize_t ret = sendto(m_socket, buffer, len, 0,
+                       (struct sockaddr *) &m_remoteAddr, sizeof(m_remoteAddr));
+  countSent(ret);
+  /* Retransmissions and parity packets use up the rate as well */
+  if (ret > 0 && m_rateController.isEnabled())
+    m_rateController.onSent(ret, std::chrono::steady_clock::now());
+  return ret;
+}
+
+void UDPThread::countSent(ssize_t transmittedBytes) {
+  if (transmittedBytes > 0)
+    m_txBytes.add(transmittedBytes);
+  else
+    m_sendErrors.add();
+}
+
+void UDPThread::registerMetrics(MetricsRegistry &registry) {
+  static const char *flushReasons[FLUSH_REASONS] = { "timeout", "full", "lane", "retry" };
+  registry.add("cannelloni_network_packets_total", "Data packets sent to and received from the remote",
+               METRIC_COUNTER, "direction=\"rx\"", m_rxCount);
+  registry.add("cannelloni_network_packets_total", "Data packets sent to and received from the remote",
+               METRIC_COUNTER, "direction=\"tx\"", m_txCount);
+  registry.add("cannelloni_network_frames_total", "Frames sent to and received from the remote",
+               METRIC_COUNTER, "direction=\"rx\"", m_rxFrames);
+  registry.add("cannelloni_network_frames_total", "Frames sent to and received from the remote",
+               METRIC_COUNTER, "direction=\"tx\"", m_txFrames);
+  registry.add("cannelloni_network_bytes_total", "Bytes sent to and received from the remote",
+               METRIC_COUNTER, "direction=\"rx\"", m_rxBytes);
+  registry.add("cannelloni_network_bytes_total", "Bytes sent to and received from the remote",
+               METRIC_COUNTER, "direction=\"tx\"", m_txBytes);
+  registry.add("cannelloni_socket_errors_total", "Failed socket operations", METRIC_COUNTER,
+               "socket=\"network\",op=\"read\"", m_receiveErrors);
+  registry.add("cannelloni_socket_errors_total", "Failed socket operations", METRIC_COUNTER,
+               "socket=\"network\",op=\"write\"", m_sendErrors);
+  registry.add("cannelloni_dropped_frames_total", "Frames that were dropped", METRIC_COUNTER,
+               "buffer=\"can_to_network\",reason=\"send_error\"", m_sendDropCount);
+  for (int reason = 0; reason < FLUSH_REASONS; reason++) {
+    registry.add("cannelloni_flushes_total", "Times the frame buffer was flushed", METRIC_COUNTER,
+                 std::string("reason=\"") + flushReasons[reason] + "\"", m_flushCount[reason]);
+  }
+  registry.add("cannelloni_flush_packets", "Packets sent by one flush", "", m_flushPackets);
 }
@@ -20,13 +20,24 @@
 
 #pragma once
 
+#include <atomic>
 #include <map>
+#include <vector>
 
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 
+#include "bcmoffload.h"
+#include "clocksync.h"
 #include "connection.h"
+#include "fec.h"
+#include "idset.h"
+#include "latency.h"
+#include "pathmtu.h"
+#include "ratecontrol.h"
+#include "retransmitbuffer.h"
+#include "sequencetracker.h"
 #include "timer.h"
 
 
@@ -38,6 +49,70 @@ namespace cannelloni {
 
 /* Block select max. for 500ms */
 #define SELECT_TIMEOUT 500000
+#define SIGNAL_PIPE_READ 0
+#define SIGNAL_PIPE_WRITE 1
+
+/* Interval of HELLO packets until the remote announced extension headers */
+#define EXT_HELLO_INTERVAL SELECT_TIMEOUT
+
+struct UDPSequenceConfig {
+  /* Negotiate extension headers with extended sequence numbers */
+  bool enabled;
+  /* Time out-of-order packets may be held in us, 0 disables reordering */
+  uint64_t reorderWindow;
+};
+
+/* Maximum number of missing packets reported by a single NACK */
+#define NACK_MAX_COUNT 64
+
+struct UDPReliabilityConfig {
+  /* Frames with these IDs are sent in packets that are acknowledged */
+  IdSet ids;
+  /* Minimum retransmission timeout in us */
+  uint64_t minTimeout;
+};
+
+struct UDPFecConfig {
+  /* Data packets per group (K), 0 disables forward error correction */
+  uint8_t dataPackets;
+  /* Parity packets sent after each group (M) */
+  uint8_t parityPackets;
+};
+
+struct UDPRateConfig {
+  /* Rates in bytes/s, maxRate = 0 disables rate control */
+  uint64_t minRate;
+  uint64_t maxRate;
+  /* Queuing delay in us above which the rate is reduced */
+  uint64_t delayTarget;
+};
+
+/* Maximum number of lanes besides the default lane */
+#define UDP_MAX_LANES 8
+/* Smallest packet budget of a lane, a CAN FD frame has to fit in any format */
+#define UDP_MIN_LANE_BUDGET 128
+
+struct UDPLaneConfig {
+  /* Frames with these IDs use this lane instead of the default lane */
+  IdSet ids;
+  /* Time in us frames wait for more frames, 0 sends them right away (express lane) */
+  uint32_t timeout;
+  /* Maximum size of the frames in one packet of this lane in bytes, 0 is the payload size */
+  uint32_t budget;
+};
+
+/* What made prepareBuffer send, see the metrics */
+enum UDPFlushReason {
+  /* The timeout of the frames expired */
+  FLUSH_TIMEOUT,
+  /* The frames fill a packet */
+  FLUSH_FULL,
+  /* A lane other than the default one */
+  FLUSH_LANE,
+  /* The remote was not reachable */
+  FLUSH_RETRY,
+  FLUSH_REASONS
+};
 
 struct UDPThreadParams {
   struct sockaddr_storage &remoteAddr;
@@ -58,6 +133,7 @@ class UDPThread : public ConnectionThread {
     virtual void run();
     bool parsePacket(uint8_t *buf, uint16_t len, struct sockaddr_storage *clientAddr);
     virtual void transmitFrame(canfd_frame *frame);
+    virtual void registerMetrics(MetricsRegistry &registry);
 
     void setTimeout(uint32_t timeout);
     uint32_t getTimeout();
@@ -65,9 +141,104 @@ class UDPThread : public ConnectionThread {
     void setTimeoutTable(std::map<uint32_t,uint32_t> &timeoutTable);
     std::map<uint32_t,uint32_t>& getTimeoutTable();
 
+    void setSequencing(const UDPSequenceConfig &config);
+    /* Requires extension headers, see setSequencing */
+    void setReliability(const UDPReliabilityConfig &config);
+    /* Requires extension headers, see setSequencing */
+    void setFec(const UDPFecConfig &config);
+    /* Pacing works on its own, adapting the rate requires extension headers */
+    void setRateControl(const UDPRateConfig &config);
+    /*
+     * Replaces linkMtuSize by the path MTU to the remote,
+     * requires extension headers, see setSequencing
+     */
+    void setPathMtuDiscovery(bool enabled);
+    /* Lanes in the order of their priority, see FrameBuffer */
+    void setLanes(const std::vector<UDPLaneConfig> &lanes);
+    /*
+     * Offloads cyclic frames of ids to the CAN_BCM of the remote and accepts
+     * its cycles, requires extension headers, see bcmoffload.h
+     */
+    void setCycleOffload(const IdSet &ids);
+    /*
+     * Sends the receive times of the frames along and records the time they
+     * waited for a packet, requires extension headers, see latency.h
+     */
+    void setLatency(const LatencyConfig &config);
+    /* Estimates the offset of the clock of the remote, needed on both ends, see clocksync.h */
+    void setClockSync(bool enabled);
+
   protected:
-    void prepareBuffer();
+    /* Sends a packet with frames of lane, the remaining frames are put back */
+    void prepareBuffer(size_t lane = 0);
+    /* Calls prepareBuffer unless the pacer holds back packets, then m_paceTimer is armed */
+    void transmitPaced();
+    /*
+     * Sends one packet with frames from the front of frames and returns
+     * the first frame that has not been sent
+     */
+    std::list<canfd_frame*>::iterator sendPacket(std::list<canfd_frame*> &frames, bool reliable,
+                                                 size_t lane);
     virtual ssize_t sendBuffer(uint8_t *buffer, uint16_t len);
+    /* Counts the bytes or the error of each sendBuffer */
+    void countSent(ssize_t transmittedBytes);
+    /* Moves spilled frames back into the buffer while the link is up */
+    void drainSpill();
+    /*
+     * Makes sure the buffer gets transmitted in time, returns true
+     * if the buffer is full and has been scheduled for transmission
+     */
+    bool scheduleTransmit();
+    /* Bytes available for frames in a single packet */
+    uint32_t framePayloadSize();
+    /* framePayloadSize limited by the budget of lane */
+    uint32_t lanePayloadSize(size_t lane);
+    /* Wakes up the thread for a frame inserted into lane (> 0) */
+    void scheduleLane(size_t lane);
+    /* Sends all frames of lane */
+    void flushLane(size_t lane);
+    /* Writes the frames of a plain packet with the flags of its extension header to the CAN bus */
+    bool deliverPacket(const uint8_t *buffer, uint16_t len, uint8_t flags = 0);
+    bool parseExtPacket(const uint8_t *buffer, uint16_t len);
+    SequenceResult receiveData(uint32_t seq, uint8_t flags, const uint8_t *buffer, uint16_t len);
+    SequenceResult receiveSequenced(uint32_t seq, uint8_t flags, const uint8_t *buffer, uint16_t len);
+    /* Delivers held packets that are due and rearms m_reorderTimer */
+    void releaseReordered();
+    void sendHello(bool peerSeen);
+    /* Writes the receive times of the frames from begin to end after data */
+    uint8_t* appendFrameTimes(uint8_t *data, std::list<canfd_frame*>::iterator begin,
+                              std::list<canfd_frame*>::iterator end);
+    void sendAck(uint8_t type, uint32_t seq, uint16_t count);
+    /* Sends the parity packets of the current FEC group */
+    void sendParity();
+    void sendFeedback();
+    /* Lets the FrameBuffer drop frames that could not be sent within the delay target */
+    void updateOverloadLimit();
+    /* Sends the next probe of m_pathMtu if one is due and rearms m_pmtuTimer */
+    void probePathMtu();
+    /* Sends a PROBE padded to size bytes or a PROBE_ACK for it */
+    void sendProbe(uint8_t type, uint16_t size);
+    /* Path MTU to the remote known to the kernel, 0 if unknown */
+    uint32_t queryPathMtu();
+    /* Follows m_pathMtu with m_payloadSize */
+    void updatePayloadSize();
+    /* Size of the IP and UDP headers */
+    uint32_t ipOverhead();
+    /* Sends the CYCLE packets that are due */
+    void announceCycles();
+    void sendCycle(const CycleAnnouncement &cycle);
+    /* Answers a CLOCK or takes the sample of a CLOCK_ACK */
+    bool receiveClock(const uint8_t *buffer, uint16_t len);
+    /* Sends a CLOCK request or a CLOCK_ACK for originate, which arrived at receive */
+    void sendClock(uint8_t type, uint64_t originate, uint64_t receive);
+    /* Sends a CLOCK request and rearms m_clockTimer */
+    void requestClock();
+    /* Sends packets that have not been acknowledged in time and rearms m_retransmitTimer */
+    void retransmitExpired();
+    void scheduleRetransmit();
+    bool useExtHeader();
+    uint16_t extHeaderLength();
+    bool useReliability();
 
   protected:
     struct debugOptions_t m_debugOptions;
@@ -77,20 +248,91 @@ class UDPThread : public ConnectionThread {
     int m_addressFamily;
     Timer m_blockTimer;
     Timer m_transmitTimer;
+    Timer m_drainTimer;
+    Timer m_reorderTimer;
+    Timer m_retransmitTimer;
+    Timer m_paceTimer;
+    Timer m_feedbackTimer;
+    Timer m_pmtuTimer;
+    Timer m_cycleTimer;
+    Timer m_clockTimer;
+    /* Timers of the batched lanes, lane 0 uses m_transmitTimer */
+    std::vector<Timer> m_laneTimers;
+    /* Express lanes write their number into this pipe */
+    int m_lanePipe[2];
+    /*
+     * Set when the remote is not reachable and frames are kept
+     * in the buffer (only if a SpillQueue is attached)
+     */
+    std::atomic<bool> m_linkDown;
 
     struct sockaddr_storage m_localAddr;
     struct sockaddr_storage m_remoteAddr;
 
     uint8_t m_sequenceNumber;
+    /* Extension headers, see CannelloniExtHeader */
+    UDPSequenceConfig m_sequenceConfig;
+    /* The remote sends extension headers as well, read by transmitFrame which runs in the CAN thread */
+    std::atomic<bool> m_peerExt;
+    uint32_t m_extSequenceNumber;
+    SequenceTracker m_sequenceTracker;
+    ReorderBuffer m_reorderBuffer;
+    UDPReliabilityConfig m_reliabilityConfig;
+    /* The remote sends reliable packets, so gaps are reported with a NACK */
+    bool m_peerReliable;
+    RetransmitBuffer m_retransmitBuffer;
+    FecEncoder m_fecEncoder;
+    FecDecoder m_fecDecoder;
+    /* The remote sends parity packets, so received packets are kept for recovery */
+    bool m_peerFec;
+    UDPRateConfig m_rateConfig;
+    RateController m_rateController;
+    /* The remote wants FEEDBACK packets */
+    bool m_peerFeedback;
+    DelayTracker m_delayTracker;
+    /* Counters of m_sequenceTracker at the last FEEDBACK packet */
+    uint64_t m_feedbackReceived;
+    uint64_t m_feedbackLost;
+    bool m_pmtuDiscovery;
+    PathMtuDiscovery m_pathMtu;
+    CycleDetector m_cycleDetector;
+    /* The remote accepts CYCLE packets, read by the CAN thread */
+    std::atomic<bool> m_peerCycles;
+    /* Lane i+1 of the FrameBuffer */
+    std::vector<UDPLaneConfig> m_laneConfig;
+    LatencyConfig m_latencyConfig;
+    ClockSync m_clockSync;
+    /* Time from the CAN receive to the UDP send */
+    LatencyTracker m_outboundLatency;
     /* Timeout variables */
     uint32_t m_timeout;
     std::map<uint32_t,uint32_t> m_timeoutTable;
-    /* Performance Counters */
-    uint64_t m_rxCount;
-    uint64_t m_txCount;
+    /* Performance Counters, data packets */
+    Metric m_rxCount;
+    Metric m_txCount;
+    Metric m_rxFrames;
+    Metric m_txFrames;
+    /* Bytes of all packets */
+    Metric m_rxBytes;
+    Metric m_txBytes;
+    Metric m_sendErrors;
+    Metric m_receiveErrors;
+    /* Frames of packets that could not be sent */
+    Metric m_sendDropCount;
+    Metric m_flushCount[FLUSH_REASONS];
+    /* Packets sent by one prepareBuffer */
+    MetricHistogram m_flushPackets;
+    uint64_t m_ackCount;
+    uint64_t m_nackCount;
+    uint64_t m_parityCount;
+    uint64_t m_feedbackCount;
+    uint64_t m_cycleCount;
+    /* Packets sent per lane */
+    std::vector<uint64_t> m_laneTxCount;
 
     uint32_t m_linkMtuSize; // mtu of the network interface
-    uint32_t m_payloadSize; // payload usable by cannelloni
+    /* Changes with the path MTU and is read by the CAN thread */
+    std::atomic<uint32_t> m_payloadSize; // payload usable by cannelloni
 };
 
 }